@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file epistasis_bench.c
+ * @brief Throughput of the epistasis kernels and of the whole search, over synthetic datasets
+ *
+ * Each stage of the search (genotype masks, counts, high risk classification and confusion matrices) is timed 
+ * in isolation with every instruction set the CPU supports, over the same rows of random combinations. Then the 
+ * whole search is run over the dataset, written to the output directory. Results are written to the standard 
+ * output as tab-separated values, one line per stage, so they can be compared between builds.
+ *
+ * Bytes per second are estimated from the data each stage reads: the genotypes (or masks, or bitplanes) of the 
+ * SNPs in a combination, the masks of the folds and the counts, depending on the stage.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include "gwas/epistasis/dataset_format.h"
+#include "gwas/epistasis/epistasis_runner.h"
+#include "gwas/epistasis/kernels.h"
+#include "gwas/epistasis/mdr.h"
+#include "gwas/epistasis/model.h"
+
+typedef struct {
+    int order;
+    int num_folds;
+    int num_rows;                       /**< Rows of combinations each stage processes per iteration */
+    masks_info info;
+    uint8_t **genotype_permutations;
+    uint8_t *genotypes;                 /**< Genotypes of all SNPs, with the padding of info */
+    uint64_t *bitplanes;                /**< Bitplanes of all SNPs */
+    int *rows;                          /**< SNPs of each combination, order * num_combinations_in_a_row per row */
+    uint8_t *fold_masks;                /**< Masks of the folds, followed by a mask of all samples */
+    uint64_t *fold_bitmasks;
+    unsigned int *training_sizes;
+    unsigned int *testing_sizes;
+    uint8_t *masks;                     /**< Masks of the combinations of each row */
+    int *counts_aff;                    /**< Counts of each row, in all folds followed by all samples */
+    int *counts_unaff;
+    uint64_t *risk_masks;               /**< High risk cells of each row, in all folds */
+} bench_data;
+
+typedef void (*bench_stage_func)(bench_data *data, int row);
+
+static double min_stage_time = 0.5;
+
+
+/* **********************************************
+ *                    Stages                    *
+ * **********************************************/
+
+static void row_genotypes(bench_data *data, int row, uint8_t **genotypes) {
+    int *snps = data->rows + row * data->order * data->info.num_combinations_in_a_row;
+    for (int i = 0; i < data->order * data->info.num_combinations_in_a_row; i++) {
+        genotypes[i] = data->genotypes + (size_t) snps[i] * data->info.num_samples_with_padding;
+    }
+}
+
+/** Every row has buffers of its own, so repetitions of a stage don't find its input in cache. */
+static uint8_t *row_masks(bench_data *data, int row) {
+    return data->masks + (size_t) row * data->info.num_combinations_in_a_row * data->info.num_masks;
+}
+
+static size_t row_counts_offset(bench_data *data, int row) {
+    return (size_t) row * (data->num_folds + 1) * data->info.num_combinations_in_a_row * data->info.num_cell_counts_per_combination;
+}
+
+static uint64_t *row_risk_masks(bench_data *data, int row) {
+    return data->risk_masks + (size_t) row * data->num_folds * data->info.num_combinations_in_a_row * data->info.num_words_per_risk_mask;
+}
+
+static void stage_masks(bench_data *data, int row) {
+    uint8_t *genotypes[data->order * data->info.num_combinations_in_a_row];
+    row_genotypes(data, row, genotypes);
+    set_genotypes_masks(data->order, genotypes, data->info.num_combinations_in_a_row, row_masks(data, row), data->info);
+}
+
+static void stage_counts(bench_data *data, int row) {
+    size_t offset = row_counts_offset(data, row);
+    combination_counts_all_folds(data->order, data->fold_masks, data->num_folds + 1, data->genotype_permutations, 
+                                 row_masks(data, row), data->info, data->counts_aff + offset, data->counts_unaff + offset);
+}
+
+static void stage_counts_bitplanes(bench_data *data, int row) {
+    int *snps = data->rows + row * data->order * data->info.num_combinations_in_a_row;
+    uint64_t *bitplanes[data->order * data->info.num_combinations_in_a_row];
+    for (int i = 0; i < data->order * data->info.num_combinations_in_a_row; i++) {
+        bitplanes[i] = data->bitplanes + (size_t) snps[i] * data->info.num_words_per_snp;
+    }
+    size_t offset = row_counts_offset(data, row);
+    combination_counts_all_folds_bitplanes(data->order, data->info.num_combinations_in_a_row, data->fold_bitmasks, data->num_folds + 1, 
+                                           data->genotype_permutations, bitplanes, data->info, 
+                                           data->counts_aff + offset, data->counts_unaff + offset);
+}
+
+static void stage_high_risk(bench_data *data, int row) {
+    size_t offset = row_counts_offset(data, row);
+    mdr_high_risk_masks(data->counts_aff + offset, data->counts_unaff + offset, data->num_folds * data->info.num_combinations_in_a_row, 
+                        data->info.num_cell_counts_per_combination, data->info.num_affected, data->info.num_unaffected, 
+                        row_risk_masks(data, row));
+}
+
+static void stage_confusion(bench_data *data, int row) {
+    uint8_t *genotypes[data->order * data->info.num_combinations_in_a_row];
+    row_genotypes(data, row, genotypes);
+    for (int f = 0; f < data->num_folds; f++) {
+        for (int rc = 0; rc < data->info.num_combinations_in_a_row; rc++) {
+            unsigned int matrix[4];
+            uint64_t *risk_mask = row_risk_masks(data, row) + (f * data->info.num_combinations_in_a_row + rc) * data->info.num_words_per_risk_mask;
+            confusion_matrix(data->order, risk_mask, data->genotype_permutations, genotypes + rc * data->order, 
+                             data->fold_masks + f * data->info.num_samples_with_padding, TRAINING, 
+                             data->training_sizes + 3 * f + 1, data->testing_sizes + 3 * f + 1, data->info, matrix);
+        }
+    }
+}
+
+static void stage_confusion_counts(bench_data *data, int row) {
+    int num_cells = data->info.num_cell_counts_per_combination;
+    int num_combinations = data->info.num_combinations_in_a_row;
+    int *counts_aff = data->counts_aff + row_counts_offset(data, row);
+    int *counts_unaff = data->counts_unaff + row_counts_offset(data, row);
+    for (int f = 0; f < data->num_folds; f++) {
+        for (int rc = 0; rc < num_combinations; rc++) {
+            unsigned int matrix[4];
+            uint64_t *risk_mask = row_risk_masks(data, row) + (f * num_combinations + rc) * data->info.num_words_per_risk_mask;
+            size_t offset = (f * num_combinations + rc) * num_cells;
+            size_t all_offset = (data->num_folds * num_combinations + rc) * num_cells;
+            confusion_matrix_counts(risk_mask, counts_aff + offset, counts_unaff + offset, 
+                                    counts_aff + all_offset, counts_unaff + all_offset, TRAINING, 
+                                    data->training_sizes + 3 * f + 1, data->testing_sizes + 3 * f + 1, data->info, matrix);
+        }
+    }
+}
+
+
+/* **********************************************
+ *                 Measurements                 *
+ * **********************************************/
+
+/** Runs a stage over all rows until min_stage_time has elapsed, and writes its throughput. */
+static void run_stage(char *name, const char *isa, bench_stage_func stage, bench_data *data, double bytes_per_row) {
+    int iterations = 0;
+    double start = omp_get_wtime(), elapsed;
+    do {
+        for (int r = 0; r < data->num_rows; r++) {
+            stage(data, r);
+        }
+        iterations++;
+        elapsed = omp_get_wtime() - start;
+    } while (elapsed < min_stage_time);
+    
+    double num_rows = (double) iterations * data->num_rows;
+    printf("%s\t%s\t%d\t%.6f\t%.0f\t%.0f\n", name, isa, iterations, elapsed, 
+           num_rows * data->info.num_combinations_in_a_row / elapsed, num_rows * bytes_per_row / elapsed);
+}
+
+/** Times every stage with the kernels of an instruction set. */
+static void run_kernel_stages(enum kernel_isa isa, int order, int num_folds, int num_rows, 
+                              uint8_t *genotypes, size_t num_variants, int num_affected, int num_unaffected) {
+    const epistasis_kernels *kernels = epistasis_kernels_init(isa);
+    
+    // Padding depends on the kernels, so the data is laid out again for each of them
+    bench_data data;
+    data.order = order;
+    data.num_folds = num_folds;
+    data.num_rows = num_rows;
+    masks_info_init(order, COMBINATIONS_ROW_SSE, num_affected, num_unaffected, &data.info);
+    masks_info info = data.info;
+    int num_samples = num_affected + num_unaffected;
+    int num_combinations = info.num_combinations_in_a_row;
+    int num_cells = info.num_cell_counts_per_combination;
+    
+    int num_genotype_permutations;
+    data.genotype_permutations = get_genotype_combinations(order, &num_genotype_permutations);
+    
+    data.genotypes = _mm_malloc(num_variants * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    memset(data.genotypes, 0, num_variants * info.num_samples_with_padding * sizeof(uint8_t));
+    for (size_t i = 0; i < num_variants; i++) {
+        uint8_t *snp = data.genotypes + i * info.num_samples_with_padding;
+        memcpy(snp, genotypes + i * num_samples, num_affected * sizeof(uint8_t));
+        memcpy(snp + info.num_affected_with_padding, genotypes + i * num_samples + num_affected, num_unaffected * sizeof(uint8_t));
+    }
+    data.bitplanes = _mm_malloc(num_variants * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_bitplanes(num_variants, data.genotypes, info, data.bitplanes);
+    
+    // The same random combinations are used by all instruction sets
+    srand(num_variants);
+    data.rows = malloc(num_rows * num_combinations * order * sizeof(int));
+    for (int i = 0; i < num_rows * num_combinations * order; i++) {
+        data.rows[i] = rand() % num_variants;
+    }
+    
+    unsigned int *testing_sizes;
+    data.fold_masks = get_k_folds_masks_repetitions(1, num_affected, num_unaffected, num_folds, &testing_sizes);
+    data.fold_masks = add_all_samples_mask(num_folds, data.fold_masks, info);
+    data.fold_bitmasks = _mm_malloc((num_folds + 1) * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_fold_bitmasks(num_folds + 1, data.fold_masks, info, data.fold_bitmasks);
+    data.testing_sizes = testing_sizes;
+    data.training_sizes = malloc(3 * num_folds * sizeof(unsigned int));
+    for (int f = 0; f < num_folds; f++) {
+        data.training_sizes[3 * f] = num_samples - testing_sizes[3 * f];
+        data.training_sizes[3 * f + 1] = num_affected - testing_sizes[3 * f + 1];
+        data.training_sizes[3 * f + 2] = num_unaffected - testing_sizes[3 * f + 2];
+    }
+    
+    data.masks = _mm_malloc((size_t) num_rows * num_combinations * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    data.counts_aff = malloc((size_t) num_rows * (num_folds + 1) * num_combinations * num_cells * sizeof(int));
+    data.counts_unaff = malloc((size_t) num_rows * (num_folds + 1) * num_combinations * num_cells * sizeof(int));
+    data.risk_masks = malloc((size_t) num_rows * num_folds * num_combinations * info.num_words_per_risk_mask * sizeof(uint64_t));
+    
+    // Stages that depend on the results of others start from the ones of each row
+    for (int r = 0; r < num_rows; r++) {
+        stage_masks(&data, r);
+        stage_counts(&data, r);
+        stage_high_risk(&data, r);
+    }
+    
+    double snp_bytes = (double) num_combinations * order * info.num_samples_with_padding;
+    double mask_bytes = (double) num_combinations * num_cells * (order + num_folds + 1) * info.num_samples_with_padding;
+    double bitplane_bytes = (double) num_combinations * num_cells * (order + num_folds + 1) * info.num_words_per_bitplane * sizeof(uint64_t);
+    double count_bytes = (double) num_combinations * num_folds * num_cells * 2 * sizeof(int);
+    double confusion_bytes = (double) num_combinations * num_folds * (order + 1) * info.num_samples_with_padding;
+    
+    run_stage("set_genotypes_masks", kernels->name, stage_masks, &data, snp_bytes);
+    run_stage("combination_counts_all_folds", kernels->name, stage_counts, &data, mask_bytes);
+    run_stage("combination_counts_all_folds_bitplanes", kernels->name, stage_counts_bitplanes, &data, bitplane_bytes);
+    run_stage("mdr_high_risk_masks", kernels->name, stage_high_risk, &data, count_bytes);
+    run_stage("confusion_matrix", kernels->name, stage_confusion, &data, confusion_bytes);
+    run_stage("confusion_matrix_counts", kernels->name, stage_confusion_counts, &data, 2 * count_bytes);
+    
+    for (int i = 0; i < num_genotype_permutations; i++) {
+        free(data.genotype_permutations[i]);
+    }
+    free(data.genotype_permutations);
+    _mm_free(data.genotypes);
+    _mm_free(data.bitplanes);
+    free(data.rows);
+    _mm_free(data.fold_masks);
+    _mm_free(data.fold_bitmasks);
+    free(data.training_sizes);
+    free(data.testing_sizes);
+    _mm_free(data.masks);
+    free(data.counts_aff);
+    free(data.counts_unaff);
+    free(data.risk_masks);
+}
+
+/** Writes a synthetic dataset in the format read by hpg-var-gwas epi. */
+static int write_dataset(char *filename, uint8_t *genotypes, size_t num_variants, int num_affected, int num_unaffected) {
+    epistasis_dataset_header header;
+    epistasis_dataset_header_init(num_affected, num_unaffected, EPISTASIS_DATASET_GENOTYPES, &header);
+    header.num_variants = num_variants;
+    header.genotypes_offset = sizeof(epistasis_dataset_header);
+    
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return errno;
+    }
+    size_t num_genotypes = num_variants * (num_affected + num_unaffected);
+    int ret_code = (fwrite(&header, sizeof(epistasis_dataset_header), 1, fp) != 1 ||
+                    fwrite(genotypes, sizeof(uint8_t), num_genotypes, fp) != num_genotypes);
+    fclose(fp);
+    return ret_code;
+}
+
+/** Runs the whole search over a dataset, and writes its throughput. */
+static void run_search(char *output_directory, int order, int stride, int num_folds, int num_cv_repetitions, int use_bitplanes,
+                       int num_threads, uint8_t *genotypes, size_t num_variants, int num_affected, int num_unaffected) {
+    char filename[strlen(output_directory) + 32];
+    sprintf(filename, "%s/epistasis_bench.bin", output_directory);
+    if (write_dataset(filename, genotypes, num_variants, num_affected, num_unaffected)) {
+        LOG_FATAL_F("The synthetic dataset could not be written to %s\n", filename);
+    }
+    
+    shared_options_data_t *shared_options_data = calloc(1, sizeof(shared_options_data_t));
+    shared_options_data->output_directory = output_directory;
+    shared_options_data->num_threads = num_threads;
+    
+    epistasis_options_data_t *options_data = calloc(1, sizeof(epistasis_options_data_t));
+    options_data->dataset_filename = filename;
+    options_data->order = order;
+    options_data->stride = stride;
+    options_data->num_folds = num_folds;
+    options_data->num_cv_repetitions = num_cv_repetitions;
+    options_data->max_ranking_size = 50;
+    options_data->eval_subset = TRAINING;
+    options_data->eval_mode = CV_C;
+    options_data->eval_function = BA;
+    options_data->use_bitplanes = use_bitplanes;
+    
+    double start = omp_get_wtime();
+    run_epistasis(shared_options_data, options_data);
+    double elapsed = omp_get_wtime() - start;
+    
+    // Combinations are evaluated once per repetition
+    double num_combinations = 1;
+    for (int i = 0; i < order; i++) {
+        num_combinations = num_combinations * (num_variants - i) / (i + 1);
+    }
+    num_combinations *= num_cv_repetitions;
+    printf("run_epistasis\t%s\t1\t%.6f\t%.0f\t%.0f\n", use_bitplanes ? "bitplanes" : "masks", elapsed, num_combinations / elapsed,
+           (double) num_cv_repetitions * num_variants * (num_affected + num_unaffected) / elapsed);
+    
+    remove(filename);
+    free(options_data);
+    free(shared_options_data);
+}
+
+
+/* **********************************************
+ *                     Main                     *
+ * **********************************************/
+
+static void show_bench_usage(char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -n <num>    SNPs in the synthetic dataset (default 1000)\n");
+    printf("  -a <num>    Affected samples (default 1000)\n");
+    printf("  -u <num>    Unaffected samples (default 1000)\n");
+    printf("  -o <num>    Order of the combinations (default 2)\n");
+    printf("  -s <num>    SNPs per block in the whole search (default 100)\n");
+    printf("  -f <num>    Folds of the cross-validation (default 10)\n");
+    printf("  -c <num>    Cross-validation repetitions in the whole search (default 1)\n");
+    printf("  -r <num>    Rows of combinations each kernel processes per iteration (default 1000)\n");
+    printf("  -t <secs>   Minimum time each kernel is run for (default 0.5)\n");
+    printf("  -j <num>    Threads of the whole search (default, all available)\n");
+    printf("  -d <dir>    Directory for the dataset and reports of the whole search (default .)\n");
+    printf("  -k          Only run the kernels, not the whole search\n");
+    printf("  -S <num>    Seed of the synthetic genotypes (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_variants = 1000;
+    int num_affected = 1000, num_unaffected = 1000;
+    int order = 2, stride = 100, num_folds = 10, num_cv_repetitions = 1, num_rows = 1000;
+    int num_threads = omp_get_max_threads(), only_kernels = 0, seed = 1;
+    char *output_directory = ".";
+    
+    int option;
+    while ((option = getopt(argc, argv, "n:a:u:o:s:f:c:r:t:j:d:kS:h")) != -1) {
+        switch (option) {
+            case 'n': num_variants = atol(optarg); break;
+            case 'a': num_affected = atoi(optarg); break;
+            case 'u': num_unaffected = atoi(optarg); break;
+            case 'o': order = atoi(optarg); break;
+            case 's': stride = atoi(optarg); break;
+            case 'f': num_folds = atoi(optarg); break;
+            case 'c': num_cv_repetitions = atoi(optarg); break;
+            case 'r': num_rows = atoi(optarg); break;
+            case 't': min_stage_time = atof(optarg); break;
+            case 'j': num_threads = atoi(optarg); break;
+            case 'd': output_directory = optarg; break;
+            case 'k': only_kernels = 1; break;
+            case 'S': seed = atoi(optarg); break;
+            default:
+                show_bench_usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (num_variants < order || num_affected < num_folds || num_unaffected < num_folds) {
+        LOG_ERROR("The dataset must contain at least 'order' SNPs, and 'num-folds' affected and unaffected samples\n");
+        return 1;
+    }
+    
+    // Genotypes are uniformly distributed, so the cells of each combination are balanced
+    int num_samples = num_affected + num_unaffected;
+    uint8_t *genotypes = malloc(num_variants * num_samples * sizeof(uint8_t));
+    srand(seed);
+    for (size_t i = 0; i < num_variants * num_samples; i++) {
+        genotypes[i] = rand() % NUM_DATASET_GENOTYPES;
+    }
+    
+    printf("#DATASET: %zu SNPs, %d affected, %d unaffected\n", num_variants, num_affected, num_unaffected);
+    printf("#COMBINATIONS OF: %d SNPs, %d folds, %d combinations per row\n", order, num_folds, COMBINATIONS_ROW_SSE);
+    printf("#STAGE\tKERNELS\tITERATIONS\tSECONDS\tCOMBINATIONS/S\tBYTES/S\n");
+    
+    for (enum kernel_isa isa = KERNEL_SSE42; isa <= KERNEL_AVX512; isa++) {
+        if (epistasis_kernels_supported(isa)) {
+            run_kernel_stages(isa, order, num_folds, num_rows, genotypes, num_variants, num_affected, num_unaffected);
+        }
+    }
+    
+    if (!only_kernels) {
+        run_search(output_directory, order, stride, num_folds, num_cv_repetitions, 0, 
+                   num_threads, genotypes, num_variants, num_affected, num_unaffected);
+        run_search(output_directory, order, stride, num_folds, num_cv_repetitions, 1, 
+                   num_threads, genotypes, num_variants, num_affected, num_unaffected);
+    }
+    
+    free(genotypes);
+    return 0;
+}
@@ -48,6 +48,10 @@
 #define EPISTASIS_EVAL_SUBSET_NOT_SPECIFIED     214
 #define EPISTASIS_EVAL_MODE_NOT_SPECIFIED       215
 #define EPISTASIS_STRIDE_NOT_SPECIFIED          216
+#define EPISTASIS_DATASET_NOT_SUPPORTED         217
+#define EPISTASIS_CHECKPOINT_NOT_VALID          218
+#define EPISTASIS_CHECKPOINT_CANT_WRITE         219
+#define EPISTASIS_EVAL_FUNCTION_NOT_VALID       220
 
 // VCF tools errors
 // -- Filter tool errors
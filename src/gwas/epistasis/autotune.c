@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "autotune.h"
+
+/**
+ * Data shared by the calibration of all candidates.
+ */
+typedef struct {
+    int order;
+    uint8_t *genotypes;
+    uint64_t *dataset_bitplanes;
+    size_t num_variants;
+    int num_affected;
+    int num_unaffected;
+    int num_folds;                      /**< Folds of all repetitions in a sweep */
+    int max_ranking_size;
+    int use_bitplanes;
+    enum eval_function function;
+    enum evaluation_subset subset;
+    uint8_t **genotype_permutations;
+    uint8_t *fold_masks;                /**< Masks of the folds, followed by a mask of all samples */
+    uint64_t *fold_bitmasks;
+    unsigned int *training_sizes;
+    unsigned int *testing_sizes;
+} autotune_data;
+
+static int row_candidates[] = { 4, 8, 16, 32, 64 };
+
+
+/* **********************************************
+ *                  Cache sizes                 *
+ * **********************************************/
+
+/**
+ * Reads a line of a sysfs file, returns 0 if it could be read.
+ */
+static int read_sysfs_line(char *path, char *line, int max_len) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 1;
+    }
+    int ret_code = fgets(line, max_len, fp) ? 0 : 1;
+    fclose(fp);
+    return ret_code;
+}
+
+void get_cache_sizes(cache_sizes *sizes) {
+    memset(sizes, 0, sizeof(cache_sizes));
+    
+    char path[128], line[64];
+    for (int i = 0; ; i++) {
+        int level;
+        char type[32], unit = 'K';
+        size_t size;
+        
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        if (read_sysfs_line(path, line, sizeof(line)) || sscanf(line, "%d", &level) != 1) {
+            break;
+        }
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        if (read_sysfs_line(path, line, sizeof(line)) || sscanf(line, "%31s", type) != 1 || !strcmp(type, "Instruction")) {
+            continue;
+        }
+        // Size is written as "32K" or "8M"
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        if (read_sysfs_line(path, line, sizeof(line)) || sscanf(line, "%zu%c", &size, &unit) < 1) {
+            continue;
+        }
+        size *= (unit == 'M') ? 1024 * 1024 : (unit == 'K') ? 1024 : 1;
+        
+        if (level == 1) {
+            sizes->l1_size = size;
+        } else if (level == 2) {
+            sizes->l2_size = size;
+        } else if (level == 3) {
+            sizes->l3_size = size;
+        }
+    }
+    
+    if (!sizes->l1_size) {
+        sizes->l1_size = 32 * 1024;
+    }
+    if (!sizes->l2_size) {
+        sizes->l2_size = 256 * 1024;
+    }
+    if (!sizes->l3_size) {
+        sizes->l3_size = 8 * 1024 * 1024;
+    }
+}
+
+
+/* **********************************************
+ *                  Calibration                 *
+ * **********************************************/
+
+/**
+ * Processes the combinations of a block for at most max_seconds, and returns the time the whole block 
+ * would take, including getting its masks.
+ */
+static double time_block(autotune_data *data, int stride, int *block_coords, masks_info info, 
+                         epistasis_workspace *workspace, double max_seconds) {
+    int order = data->order;
+    double start = omp_get_wtime();
+    
+    uint64_t *bitplanes_buffer[order];
+    uint64_t **block_bitplanes = data->use_bitplanes ? bitplanes_buffer : NULL;
+    uint8_t *block_masks[order];
+    int num_loaded = get_planes_of_block(order, block_coords, data->genotypes, data->dataset_bitplanes, data->num_variants, 
+                                         stride, info, workspace, block_masks, block_bitplanes);
+    if (workspace->prefix_cache) {
+        prefix_masks_cache_reset(workspace->prefix_cache);
+    }
+    
+    // Consecutive blocks of a thread usually load a single coordinate
+    double setup_time = (omp_get_wtime() - start) / (num_loaded > 1 ? num_loaded : 1);
+    
+    // Rows of combinations until the time is up
+    int comb[order];
+    int combs[info.num_combinations_in_a_row * order];
+    unsigned int conf_matrix[4];
+    size_t num_processed = 0;
+    int cur_comb_idx = 0;
+    bool more_combinations = true;
+    
+    start = omp_get_wtime();
+    get_first_combination_in_block(order, comb, block_coords, stride);
+    while (more_combinations && omp_get_wtime() - start < max_seconds) {
+        for (cur_comb_idx = 0; more_combinations && cur_comb_idx < info.num_combinations_in_a_row; cur_comb_idx++) {
+            memcpy(combs + cur_comb_idx * order, comb, order * sizeof(int));
+            more_combinations = get_next_combination_in_block(order, comb, block_coords, stride, data->num_variants);
+        }
+        
+        process_set_of_combinations(cur_comb_idx, combs, order, stride, data->num_folds, data->fold_masks,
+                                    data->training_sizes, data->testing_sizes, NULL, block_bitplanes, data->fold_bitmasks, 
+                                    data->genotype_permutations, block_masks, workspace->prefix_cache, false, 
+                                    data->function, data->subset, info, workspace->counts_aff, workspace->counts_unaff, 
+                                    workspace->risk_masks, conf_matrix, workspace->rankings, &(workspace->risky_scratch));
+        num_processed += cur_comb_idx;
+    }
+    double combinations_time = omp_get_wtime() - start;
+    
+    if (!num_processed) {
+        return setup_time;
+    }
+    size_t num_combinations = get_block_num_combinations(order, block_coords, stride, data->num_variants);
+    return setup_time + combinations_time * num_combinations / num_processed;
+}
+
+/**
+ * Gets the combinations per second of a stride and combinations per row, over a sample of blocks spread 
+ * across the dataset.
+ */
+static double calibrate(autotune_data *data, int stride, int num_combinations_in_a_row) {
+    int order = data->order;
+    masks_info info; masks_info_init(order, num_combinations_in_a_row, data->num_affected, data->num_unaffected, &info);
+    epistasis_workspace *workspace = epistasis_workspace_new(order, stride, data->num_folds, 0, data->max_ranking_size, 
+                                                             data->use_bitplanes, !data->dataset_bitplanes, info);
+    
+    // Blocks with consecutive coordinates, so they are different whenever possible, as most blocks are
+    int num_blocks_per_dim = ceil((double) data->num_variants / stride);
+    int num_sample_blocks = MIN(AUTOTUNE_NUM_BLOCKS, num_blocks_per_dim);
+    double total_time = 0;
+    size_t total_combinations = 0;
+    
+    for (int b = 0; b < num_sample_blocks; b++) {
+        int block_coords[order];
+        int first = (num_sample_blocks > 1 && num_blocks_per_dim > order) ? 
+                    b * (num_blocks_per_dim - order) / (num_sample_blocks - 1) : 0;
+        for (int s = 0; s < order; s++) {
+            block_coords[s] = MIN(first + s, num_blocks_per_dim - 1);
+        }
+        
+        total_time += time_block(data, stride, block_coords, info, workspace, AUTOTUNE_CANDIDATE_SECONDS / num_sample_blocks);
+        total_combinations += get_block_num_combinations(order, block_coords, stride, data->num_variants);
+    }
+    
+    epistasis_workspace_free(workspace);
+    
+    double throughput = total_combinations / total_time;
+    LOG_DEBUG_F("Stride %d, %d combinations per row: %.0f combinations/s\n", stride, num_combinations_in_a_row, throughput);
+    return throughput;
+}
+
+
+/* **********************************************
+ *                    Tuning                    *
+ * **********************************************/
+
+void epistasis_autotune(int order, uint8_t *genotypes, uint64_t *dataset_bitplanes, size_t num_variants, 
+                        int num_affected, int num_unaffected, int num_repetitions, int num_folds, int max_ranking_size, 
+                        int use_bitplanes, enum eval_function function, enum evaluation_subset subset, 
+                        int num_threads, int fixed_stride, int *stride, int *num_combinations_in_a_row) {
+    cache_sizes caches;
+    get_cache_sizes(&caches);
+    LOG_INFO_F("Cache sizes: L1 %zu KB, L2 %zu KB, L3 %zu KB\n", caches.l1_size / 1024, caches.l2_size / 1024, caches.l3_size / 1024);
+    
+    masks_info info; masks_info_init(order, 1, num_affected, num_unaffected, &info);
+    int num_sweep_folds = num_repetitions * num_folds;
+    
+    autotune_data data = { 
+        .order = order, .genotypes = genotypes, .dataset_bitplanes = dataset_bitplanes, .num_variants = num_variants, 
+        .num_affected = num_affected, .num_unaffected = num_unaffected, .num_folds = num_sweep_folds, 
+        .max_ranking_size = max_ranking_size, .use_bitplanes = use_bitplanes, .function = function, .subset = subset,
+        .fold_bitmasks = NULL
+    };
+    
+    int num_genotype_permutations;
+    data.genotype_permutations = get_genotype_combinations(order, &num_genotype_permutations);
+    
+    // Folds of a sweep, as in the search, drawn from a state of their own so the folds of the search drawn
+    // from rand are the same with and without tuning, and for all nodes although only the root one is tuned
+    unsigned int seed = AUTOTUNE_SEED, *testing_sizes;
+    int *fold_assignment = get_k_folds_assignment_repetitions(num_repetitions, num_affected, num_unaffected, num_folds, &seed);
+    uint8_t *fold_masks = get_k_folds_masks_from_assignment(num_repetitions, num_affected, num_unaffected, num_folds, 
+                                                            fold_assignment, &testing_sizes);
+    free(fold_assignment);
+    data.fold_masks = add_all_samples_mask(num_sweep_folds, fold_masks, info);
+    data.testing_sizes = testing_sizes;
+    data.training_sizes = malloc(3 * num_sweep_folds * sizeof(unsigned int));
+    for (int f = 0; f < num_sweep_folds; f++) {
+        data.training_sizes[3 * f] = num_affected + num_unaffected - testing_sizes[3 * f];
+        data.training_sizes[3 * f + 1] = num_affected - testing_sizes[3 * f + 1];
+        data.training_sizes[3 * f + 2] = num_unaffected - testing_sizes[3 * f + 2];
+    }
+    if (use_bitplanes) {
+        data.fold_bitmasks = _mm_malloc((num_sweep_folds + 1) * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+        set_fold_bitmasks(num_sweep_folds + 1, data.fold_masks, info, data.fold_bitmasks);
+    }
+    
+    if (fixed_stride > 0) {
+        *stride = fixed_stride;
+    } else {
+        *stride = MIN(*stride, num_variants);
+    }
+    
+    // Combinations per row, whose counts (and masks of their SNPs, if not using bitplanes) should fit in L2
+    size_t row_bytes = 2 * (num_sweep_folds + 1) * info.num_cell_counts_per_combination * sizeof(int);
+    if (!use_bitplanes) {
+        row_bytes += order * NUM_GENOTYPES * info.num_samples_with_padding;
+    }
+    double best_throughput = 0;
+    int num_row_candidates = sizeof(row_candidates) / sizeof(int);
+    for (int i = 0; i < num_row_candidates; i++) {
+        if (i > 0 && row_candidates[i] * row_bytes > caches.l2_size) {
+            break;
+        }
+        double throughput = calibrate(&data, *stride, row_candidates[i]);
+        if (throughput > best_throughput) {
+            best_throughput = throughput;
+            *num_combinations_in_a_row = row_candidates[i];
+        }
+    }
+    
+    // Strides whose block fits in the share of the last level cache of a thread
+    if (fixed_stride <= 0) {
+        size_t snp_bytes = use_bitplanes ? info.num_words_per_snp * sizeof(uint64_t) : NUM_GENOTYPES * info.num_samples_with_padding;
+        size_t thread_cache = caches.l3_size / (num_threads > 0 ? num_threads : 1);
+        int user_stride = *stride;
+        for (int candidate = AUTOTUNE_MIN_STRIDE; candidate <= AUTOTUNE_MAX_STRIDE && candidate < num_variants; candidate *= 2) {
+            if (candidate == user_stride || 
+                (candidate > AUTOTUNE_MIN_STRIDE && (size_t) order * candidate * snp_bytes > thread_cache)) {
+                continue;
+            }
+            double throughput = calibrate(&data, candidate, *num_combinations_in_a_row);
+            if (throughput > best_throughput) {
+                best_throughput = throughput;
+                *stride = candidate;
+            }
+        }
+    }
+    
+    LOG_INFO_F("Auto-tuned to %d variants per block and %d combinations per row (%.0f combinations/s)\n", 
+               *stride, *num_combinations_in_a_row, best_throughput);
+    
+    for (int i = 0; i < num_genotype_permutations; i++) {
+        free(data.genotype_permutations[i]);
+    }
+    free(data.genotype_permutations);
+    _mm_free(data.fold_masks);
+    if (data.fold_bitmasks) {
+        _mm_free(data.fold_bitmasks);
+    }
+    free(testing_sizes);
+    free(data.training_sizes);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_AUTOTUNE_H
+#define EPISTASIS_AUTOTUNE_H
+
+/**
+ * @file autotune.h
+ * @brief Choice of the block stride and the combinations per row that run fastest on this machine
+ *
+ * The candidates are limited by the size of the caches, read from sysfs: the masks (or bitplanes) of a block 
+ * should fit in the share of the last level cache of a thread, and the counts of a row of combinations in L2. 
+ * Each candidate is then timed over a sample of blocks of the dataset, with the same steps as the search. 
+ * The time of the combinations not processed is extrapolated, so the time spent getting the masks of a block 
+ * is weighed against the whole block, as it happens in the search.
+ *
+ * Rows are tuned first with the stride given by the user, and then the stride with the best rows.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include <commons/log.h>
+
+#include "cross_validation.h"
+#include "dataset.h"
+#include "epistasis.h"
+#include "model.h"
+#include "scheduler.h"
+
+#define AUTOTUNE_MIN_STRIDE             16
+#define AUTOTUNE_MAX_STRIDE             2048
+#define AUTOTUNE_NUM_BLOCKS             3       /**< Blocks each candidate is timed over */
+#define AUTOTUNE_CANDIDATE_SECONDS      0.3     /**< Time spent processing the combinations of each candidate */
+#define AUTOTUNE_SEED                   1       /**< Initial state of the generator of the folds used for timing */
+
+/**
+ * Size in bytes of the data caches of a CPU, 0 if unknown.
+ */
+typedef struct {
+    size_t l1_size;
+    size_t l2_size;
+    size_t l3_size;
+} cache_sizes;
+
+
+/**
+ * @brief Reads the size of the data caches of the first CPU from sysfs.
+ * @details Reads the size of the data caches of the first CPU from sysfs. If they can't be read, the sizes 
+ * of a common desktop CPU are assumed.
+ **/
+void get_cache_sizes(cache_sizes *sizes);
+
+/**
+ * @brief Chooses the block stride and the combinations per row that run fastest with a dataset.
+ * 
+ * @param genotypes Genotypes of the dataset, affected samples first
+ * @param dataset_bitplanes Bitplanes stored in the dataset, NULL if not available
+ * @param num_repetitions Cross-validation repetitions evaluated in each sweep
+ * @param num_threads Threads sharing the last level cache
+ * @param fixed_stride Stride to use instead of tuning it (i.e. when resuming a search), 0 for tuning it
+ * @param[in,out] stride Stride given by the user, replaced by the chosen one
+ * @param[out] num_combinations_in_a_row Combinations per row chosen
+ **/
+void epistasis_autotune(int order, uint8_t *genotypes, uint64_t *dataset_bitplanes, size_t num_variants, 
+                        int num_affected, int num_unaffected, int num_repetitions, int num_folds, int max_ranking_size, 
+                        int use_bitplanes, enum eval_function function, enum evaluation_subset subset, 
+                        int num_threads, int fixed_stride, int *stride, int *num_combinations_in_a_row);
+
+#endif
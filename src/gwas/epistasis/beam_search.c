@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "beam_search.h"
+
+typedef struct {
+    double score;
+    int *combination;
+    int order;
+} scored_combination;
+
+static int compare_combinations(int *combination_1, int *combination_2, int order);
+static int compare_scored_combinations(const void *comb_1, const void *comb_2);
+
+
+epistasis_beam *epistasis_beam_new(int order, int width) {
+    epistasis_beam *beam = malloc(sizeof(epistasis_beam));
+    beam->order = order;
+    beam->width = width;
+    beam->size = 0;
+    beam->combinations = malloc(width * (order > 0 ? order : 1) * sizeof(int));
+    beam->scores = malloc(width * sizeof(double));
+    return beam;
+}
+
+void epistasis_beam_free(epistasis_beam *beam) {
+    free(beam->combinations);
+    free(beam->scores);
+    free(beam);
+}
+
+/** Whether the combination at position i of a beam is worse than the one at position j. */
+static bool beam_worse(epistasis_beam *beam, int i, int j) {
+    if (beam->scores[i] != beam->scores[j]) {
+        return beam->scores[i] < beam->scores[j];
+    }
+    return compare_combinations(beam->combinations + i * beam->order, beam->combinations + j * beam->order, beam->order) > 0;
+}
+
+static void beam_swap(epistasis_beam *beam, int i, int j) {
+    int order = beam->order;
+    int combination[order];
+    memcpy(combination, beam->combinations + i * order, order * sizeof(int));
+    memcpy(beam->combinations + i * order, beam->combinations + j * order, order * sizeof(int));
+    memcpy(beam->combinations + j * order, combination, order * sizeof(int));
+
+    double score = beam->scores[i];
+    beam->scores[i] = beam->scores[j];
+    beam->scores[j] = score;
+}
+
+/**
+ * Offers a combination to a beam that is being filled, kept as a heap with the worst combination on top.
+ */
+static void beam_offer(epistasis_beam *beam, int *combination, double score) {
+    int order = beam->order;
+    int i;
+    if (beam->size < beam->width) {
+        i = beam->size++;
+    } else {
+        // Same criteria as beam_worse, without copying the candidate into the beam
+        double worst = beam->scores[0];
+        if (score < worst || (score == worst && compare_combinations(combination, beam->combinations, order) > 0)) {
+            return;
+        }
+        i = 0;
+    }
+
+    memcpy(beam->combinations + i * order, combination, order * sizeof(int));
+    beam->scores[i] = score;
+
+    if (i > 0) {
+        // Sift up the new combination
+        while (i > 0 && beam_worse(beam, i, (i - 1) / 2)) {
+            beam_swap(beam, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    } else {
+        // Sift down the combination that replaced the worst one
+        while (2 * i + 1 < beam->size) {
+            int child = 2 * i + 1;
+            if (child + 1 < beam->size && beam_worse(beam, child + 1, child)) {
+                child++;
+            }
+            if (!beam_worse(beam, child, i)) {
+                break;
+            }
+            beam_swap(beam, i, child);
+            i = child;
+        }
+    }
+}
+
+void epistasis_beam_merge(int num_beams, epistasis_beam **beams, epistasis_beam *merged) {
+    int order = merged->order;
+    int num_combinations = 0;
+    for (int b = 0; b < num_beams; b++) {
+        num_combinations += beams[b]->size;
+    }
+
+    scored_combination *all = malloc(num_combinations * sizeof(scored_combination));
+    int *combinations = malloc(num_combinations * order * sizeof(int));
+    for (int b = 0, i = 0; b < num_beams; b++) {
+        for (int c = 0; c < beams[b]->size; c++, i++) {
+            memcpy(combinations + i * order, beams[b]->combinations + c * order, order * sizeof(int));
+            all[i].combination = combinations + i * order;
+            all[i].score = beams[b]->scores[c];
+            all[i].order = order;
+        }
+    }
+
+    // Best combinations first, ties broken by their SNPs so the result doesn't depend on the beams given
+    qsort(all, num_combinations, sizeof(scored_combination), compare_scored_combinations);
+
+    merged->size = (num_combinations < merged->width) ? num_combinations : merged->width;
+    for (int i = 0; i < merged->size; i++) {
+        memcpy(merged->combinations + i * order, all[i].combination, order * sizeof(int));
+        merged->scores[i] = all[i].score;
+    }
+
+    free(combinations);
+    free(all);
+}
+
+uint64_t *beam_search_bitplanes(uint8_t *genotypes, size_t num_variants, masks_info info, int num_threads) {
+    int num_samples = info.num_affected + info.num_unaffected;
+    size_t num_chunks = (num_variants + BEAM_SEARCH_SNPS_PER_TASK - 1) / BEAM_SEARCH_SNPS_PER_TASK;
+    uint64_t *bitplanes = _mm_malloc(num_variants * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        uint8_t *scratchpad = _mm_malloc(BEAM_SEARCH_SNPS_PER_TASK * info.num_samples_with_padding * sizeof(uint8_t),
+                                         KERNEL_MAX_VECTOR_WIDTH);
+
+#pragma omp for schedule(static)
+        for (size_t c = 0; c < num_chunks; c++) {
+            size_t first_snp = c * BEAM_SEARCH_SNPS_PER_TASK;
+            int num_snps = MIN(BEAM_SEARCH_SNPS_PER_TASK, num_variants - first_snp);
+            uint8_t *padded_genotypes = get_genotypes_of_block_coord(num_variants, num_samples, info, BEAM_SEARCH_SNPS_PER_TASK, c,
+                                                                     genotypes + first_snp * num_samples, scratchpad);
+            set_genotypes_bitplanes(num_snps, padded_genotypes, info, bitplanes + first_snp * info.num_words_per_snp);
+        }
+
+        _mm_free(scratchpad);
+    }
+
+    return bitplanes;
+}
+
+/**
+ * Gets the position of a combination in a beam, given the positions of its combinations sorted by their SNPs,
+ * or -1 if not found.
+ */
+static int beam_find(epistasis_beam *beam, int *sorted, int *combination) {
+    int low = 0, high = beam->size - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int cmp = compare_combinations(beam->combinations + sorted[middle] * beam->order, combination, beam->order);
+        if (cmp == 0) {
+            return sorted[middle];
+        } else if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Gets the mean evaluation over the folds of a row of combinations, counted over bitplanes of the whole dataset.
+ */
+static void score_set_of_combinations(int num_combinations, int *combs, int order, uint64_t *bitplanes,
+                                      int num_folds, uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes,
+                                      uint8_t **genotype_permutations, enum eval_function function, enum evaluation_subset subset,
+                                      masks_info info, int *counts_aff, int *counts_unaff, uint64_t *risk_masks, double *scores) {
+    uint64_t *combination_bitplanes[info.num_combinations_in_a_row * order];
+    for (int c = 0; c < num_combinations * order; c++) {
+        combination_bitplanes[c] = bitplanes + (size_t) combs[c] * info.num_words_per_snp;
+    }
+
+    // Counts of each fold and all samples, then the models of each fold as in process_set_of_combinations
+    combination_counts_all_folds_bitplanes(order, num_combinations, fold_bitmasks, num_folds + 1, genotype_permutations,
+                                           combination_bitplanes, info, counts_aff, counts_unaff);
+    mdr_high_risk_masks(counts_aff, counts_unaff, num_folds * info.num_combinations_in_a_row, info.num_cell_counts_per_combination,
+                        info.num_affected, info.num_unaffected, risk_masks);
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        double sum = 0;
+        for (int f = 0; f < num_folds; f++) {
+            uint64_t *risk_mask = risk_masks + (f * info.num_combinations_in_a_row + rc) * info.num_words_per_risk_mask;
+            size_t counts_offset = (f * info.num_combinations_in_a_row + rc) * info.num_cell_counts_per_combination;
+            size_t all_counts_offset = (num_folds * info.num_combinations_in_a_row + rc) * info.num_cell_counts_per_combination;
+            unsigned int conf_matrix[4];
+            sum += test_model_counts(risk_mask, counts_aff + counts_offset, counts_unaff + counts_offset,
+                                     counts_aff + all_counts_offset, counts_unaff + all_counts_offset, function, subset,
+                                     training_sizes + 3 * f + 1, testing_sizes + 3 * f + 1, info, conf_matrix);
+        }
+        // Models that can't be evaluated (i.e. a group without samples) are never chosen
+        scores[rc] = isnan(sum) ? -INFINITY : sum / num_folds;
+    }
+}
+
+/**
+ * Tests a row of candidates: keeps the best ones in the beam of the thread for the intermediate orders, or 
+ * evaluates them in all folds and inserts them into the rankings of the workspace for the last one.
+ */
+static void test_set_of_candidates(int num_combinations, int *combs, int order, uint64_t *bitplanes, uint64_t **dataset_planes, 
+                                   size_t num_variants, int num_folds, uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, 
+                                   uint8_t **genotype_permutations, bool prune, enum eval_function function, enum evaluation_subset subset, 
+                                   masks_info info, int *counts_aff, int *counts_unaff, uint64_t *risk_masks, 
+                                   epistasis_workspace *workspace, epistasis_beam *thread_beam) {
+    if (thread_beam) {
+        double scores[info.num_combinations_in_a_row];
+        score_set_of_combinations(num_combinations, combs, order, bitplanes, num_folds, fold_bitmasks, training_sizes, testing_sizes,
+                                  genotype_permutations, function, subset, info, counts_aff, counts_unaff, risk_masks, scores);
+        for (int c = 0; c < num_combinations; c++) {
+            beam_offer(thread_beam, combs + c * order, scores[c]);
+        }
+        return;
+    }
+    
+    // SNPs are found in the bitplanes of the whole dataset, like in a block as long as the dataset
+    unsigned int conf_matrix[4];
+    process_set_of_combinations(num_combinations, combs, order, num_variants, num_folds, NULL, training_sizes, testing_sizes,
+                                NULL, dataset_planes, fold_bitmasks, genotype_permutations, NULL, NULL, prune, function, subset, info, 
+                                workspace->counts_aff, workspace->counts_unaff, workspace->risk_masks, conf_matrix, 
+                                workspace->rankings, &(workspace->risky_scratch));
+}
+
+void beam_search_extend(epistasis_beam *beam, uint64_t *bitplanes, size_t num_variants, int num_folds,
+                        uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, bool prune,
+                        enum eval_function function, enum evaluation_subset subset, masks_info info,
+                        int process, int num_processes, int num_threads, epistasis_workspace **workspaces,
+                        epistasis_beam *next) {
+    int order = beam->order + 1;
+
+    // The last order is evaluated with the layout of the search, the rest with their own one
+    masks_info order_info = info;
+    if (next) {
+        masks_info_init(order, info.num_combinations_in_a_row, info.num_affected, info.num_unaffected, &order_info);
+    }
+    int num_genotype_permutations;
+    uint8_t **genotype_permutations = get_genotype_combinations(order, &num_genotype_permutations);
+
+    // Combinations of the beam sorted by their SNPs, for finding them
+    int sorted[beam->size];
+    scored_combination by_snps[beam->size];
+    for (int i = 0; i < beam->size; i++) {
+        by_snps[i].combination = beam->combinations + i * beam->order;
+        by_snps[i].score = 0;
+        by_snps[i].order = beam->order;
+    }
+    qsort(by_snps, beam->size, sizeof(scored_combination), compare_scored_combinations);
+    for (int i = 0; i < beam->size; i++) {
+        sorted[i] = (by_snps[i].combination - beam->combinations) / (beam->order > 0 ? beam->order : 1);
+    }
+
+    // Each task extends a combination of the beam with a range of SNPs, and tasks are split among processes
+    size_t num_chunks = (num_variants + BEAM_SEARCH_SNPS_PER_TASK - 1) / BEAM_SEARCH_SNPS_PER_TASK;
+    size_t num_tasks = beam->size * num_chunks;
+    size_t num_process_tasks = (num_tasks > process) ? (num_tasks - process + num_processes - 1) / num_processes : 0;
+
+    epistasis_beam *thread_beams[num_threads];
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        int thread = omp_get_thread_num();
+        epistasis_beam *thread_beam = thread_beams[thread] = next ? epistasis_beam_new(order, next->width) : NULL;
+
+        // Buffers for the intermediate orders, the workspace of the thread is used for the last one
+        int max_num_counts = order_info.num_cell_counts_per_combination * order_info.num_combinations_in_a_row * (num_folds + 1);
+        int *counts_aff = next ? _mm_malloc(max_num_counts * sizeof(int), KERNEL_MAX_VECTOR_WIDTH) : NULL;
+        int *counts_unaff = next ? _mm_malloc(max_num_counts * sizeof(int), KERNEL_MAX_VECTOR_WIDTH) : NULL;
+        uint64_t *risk_masks = next ? malloc(order_info.num_combinations_in_a_row * num_folds *
+                                             order_info.num_words_per_risk_mask * sizeof(uint64_t)) : NULL;
+
+        uint64_t *dataset_planes[order];
+        for (int s = 0; s < order; s++) {
+            dataset_planes[s] = bitplanes;
+        }
+
+        int combs[order_info.num_combinations_in_a_row * order];
+
+#pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < num_process_tasks; t++) {
+            size_t task = process + t * num_processes;
+            int *parent = beam->combinations + (task / num_chunks) * beam->order;
+            size_t first_snp = (task % num_chunks) * BEAM_SEARCH_SNPS_PER_TASK;
+            size_t last_snp = MIN(first_snp + BEAM_SEARCH_SNPS_PER_TASK, num_variants);
+            int num_combs = 0;
+
+            for (size_t snp = first_snp; snp < last_snp; snp++) {
+                // Candidate with the SNPs in increasing order
+                int *candidate = combs + num_combs * order;
+                int num_snps = 0;
+                bool repeated = false;
+                for (int s = 0; s < beam->order; s++) {
+                    if (parent[s] == snp) {
+                        repeated = true;
+                        break;
+                    }
+                    if (parent[s] > snp && num_snps == s) {
+                        candidate[num_snps++] = snp;
+                    }
+                    candidate[num_snps++] = parent[s];
+                }
+                if (repeated) {
+                    continue;
+                }
+                if (num_snps == beam->order) {
+                    candidate[num_snps++] = snp;
+                }
+
+                // Only tested from the first combination of the beam (by their SNPs) it can be grown from
+                bool first = true;
+                int subset_snps[order];
+                for (int removed = 0; removed < order && first; removed++) {
+                    if (candidate[removed] == snp) {
+                        continue;
+                    }
+                    for (int s = 0, j = 0; s < order; s++) {
+                        if (s != removed) {
+                            subset_snps[j++] = candidate[s];
+                        }
+                    }
+                    first = compare_combinations(subset_snps, parent, beam->order) > 0 || beam_find(beam, sorted, subset_snps) < 0;
+                }
+                if (!first) {
+                    continue;
+                }
+
+                if (++num_combs < order_info.num_combinations_in_a_row) {
+                    continue;
+                }
+                test_set_of_candidates(num_combs, combs, order, bitplanes, dataset_planes, num_variants, num_folds, fold_bitmasks, 
+                                       training_sizes, testing_sizes, genotype_permutations, prune, function, subset, order_info, 
+                                       counts_aff, counts_unaff, risk_masks, workspaces ? workspaces[thread] : NULL, thread_beam);
+                num_combs = 0;
+            }
+            
+            // Candidates out of a full row
+            if (num_combs > 0) {
+                test_set_of_candidates(num_combs, combs, order, bitplanes, dataset_planes, num_variants, num_folds, fold_bitmasks, 
+                                       training_sizes, testing_sizes, genotype_permutations, prune, function, subset, order_info, 
+                                       counts_aff, counts_unaff, risk_masks, workspaces ? workspaces[thread] : NULL, thread_beam);
+            }
+        }
+
+        if (next) {
+            _mm_free(counts_aff);
+            _mm_free(counts_unaff);
+            free(risk_masks);
+        }
+    }
+
+    if (next) {
+        epistasis_beam_merge(num_threads, thread_beams, next);
+        for (int t = 0; t < num_threads; t++) {
+            epistasis_beam_free(thread_beams[t]);
+        }
+    }
+
+    for (int i = 0; i < num_genotype_permutations; i++) {
+        free(genotype_permutations[i]);
+    }
+    free(genotype_permutations);
+}
+
+void epistasis_beam_search(int order, int width, uint64_t *bitplanes, size_t num_variants, int num_folds,
+                           uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, bool prune,
+                           enum eval_function function, enum evaluation_subset subset, masks_info info,
+                           int num_threads, epistasis_workspace **workspaces) {
+    // The search starts from a single combination without SNPs
+    epistasis_beam *beam = epistasis_beam_new(0, 1);
+    beam->size = 1;
+
+    for (int k = 1; k < order; k++) {
+        epistasis_beam *next = epistasis_beam_new(k, width);
+        beam_search_extend(beam, bitplanes, num_variants, num_folds, fold_bitmasks, training_sizes, testing_sizes, prune,
+                           function, subset, info, 0, 1, num_threads, workspaces, next);
+        epistasis_beam_free(beam);
+        beam = next;
+
+        if (beam->size > 0) {
+            LOG_INFO_F("Beam of order %d: %d combinations, the best one scores %.3f\n", k, beam->size, beam->scores[0]);
+        }
+    }
+
+    beam_search_extend(beam, bitplanes, num_variants, num_folds, fold_bitmasks, training_sizes, testing_sizes, prune,
+                       function, subset, info, 0, 1, num_threads, workspaces, NULL);
+    epistasis_beam_free(beam);
+}
+
+
+/* **********************************************
+ *                  Comparators                 *
+ * **********************************************/
+
+static int compare_combinations(int *combination_1, int *combination_2, int order) {
+    for (int s = 0; s < order; s++) {
+        if (combination_1[s] != combination_2[s]) {
+            return (combination_1[s] < combination_2[s]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_scored_combinations(const void *comb_1, const void *comb_2) {
+    const scored_combination *c1 = comb_1, *c2 = comb_2;
+    if (c1->score != c2->score) {
+        return (c1->score > c2->score) ? -1 : 1;
+    }
+    return compare_combinations(c1->combination, c2->combination, c1->order);
+}
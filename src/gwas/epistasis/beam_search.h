@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_BEAM_SEARCH_H
+#define EPISTASIS_BEAM_SEARCH_H
+
+/**
+ * @file beam_search.h
+ * @brief Heuristic search of high order combinations, grown one SNP at a time
+ *
+ * The exhaustive search tests every combination of the given order, which is not feasible over real panels
+ * beyond order 3. The beam search starts from every SNP alone, keeps the best 'width' combinations of each
+ * order, and extends each of them with every other SNP to get the candidates of the next order. Only about
+ * width * num_variants combinations are tested per order, but interactions whose subsets are not among the
+ * best ones of lower orders are missed.
+ *
+ * Candidates are counted with the bitplanes of the whole dataset, and scored by their mean evaluation over
+ * the folds. Ties are broken by their SNPs, so the beam does not depend on the number of threads or processes.
+ * A combination reachable from several members of the beam is only tested from the first of them. The candidates
+ * of the last order are evaluated like in the exhaustive search, and inserted into the rankings of the workspaces,
+ * so they are merged and reported as usual.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include <commons/log.h>
+
+#include "cross_validation.h"
+#include "epistasis.h"
+#include "mdr.h"
+#include "model.h"
+
+#define BEAM_SEARCH_SNPS_PER_TASK       1024    /**< SNPs a member of the beam is extended with in each task */
+
+/**
+ * Best combinations of an order found so far, with their mean evaluation over the folds.
+ */
+typedef struct {
+    int order;                  /**< SNPs in each combination */
+    int width;                  /**< Maximum number of combinations */
+    int size;
+    int *combinations;          /**< SNPs of each combination, in increasing order */
+    double *scores;
+} epistasis_beam;
+
+
+epistasis_beam *epistasis_beam_new(int order, int width);
+
+void epistasis_beam_free(epistasis_beam *beam);
+
+/**
+ * @brief Merges several beams of the same order, keeping the best combinations of all of them.
+ * @details Merges several beams of the same order, keeping the best combinations of all of them. The result
+ * is sorted from the best combination to the worst, and is the same whatever the order of the beams.
+ **/
+void epistasis_beam_merge(int num_beams, epistasis_beam **beams, epistasis_beam *merged);
+
+/**
+ * @brief Packs the genotypes of the whole dataset into bitplanes, with the same layout as in the datasets.
+ **/
+uint64_t *beam_search_bitplanes(uint8_t *genotypes, size_t num_variants, masks_info info, int num_threads);
+
+/**
+ * @brief Extends each combination of a beam with every SNP not in it.
+ * @details Extends each combination of a beam with every SNP not in it. If a beam of the next order is given,
+ * the best candidates are kept there; otherwise, the candidates are evaluated in all folds and inserted into
+ * the rankings of the workspaces, like the combinations of a block. The work can be split among processes,
+ * each one testing a share of the candidates, and their beams merged afterwards.
+ *
+ * @param beam Best combinations of the previous order (an empty combination of order 0 to start)
+ * @param bitplanes Bitplanes of the whole dataset (see beam_search_bitplanes)
+ * @param fold_bitmasks Bitmasks of the folds, followed by the one of all samples
+ * @param info Masks information of the last order, with the combinations per row
+ * @param process Index of this process among the ones sharing the work
+ * @param workspaces Buffers and rankings of each thread, only used for the last order
+ * @param[out] next Best candidates tested by this process, NULL for the last order
+ **/
+void beam_search_extend(epistasis_beam *beam, uint64_t *bitplanes, size_t num_variants, int num_folds,
+                        uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, bool prune,
+                        enum eval_function function, enum evaluation_subset subset, masks_info info,
+                        int process, int num_processes, int num_threads, epistasis_workspace **workspaces,
+                        epistasis_beam *next);
+
+/**
+ * @brief Runs a whole beam search in a single process, leaving the best models in the rankings of the workspaces.
+ **/
+void epistasis_beam_search(int order, int width, uint64_t *bitplanes, size_t num_variants, int num_folds,
+                           uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, bool prune,
+                           enum eval_function function, enum evaluation_subset subset, masks_info info,
+                           int num_threads, epistasis_workspace **workspaces);
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/time.h>
+
+#include "checkpoint.h"
+
+
+static void get_checkpoint_path(epistasis_checkpoint *checkpoint, int thread, char *path) {
+    if (thread < 0) {
+        sprintf(path, "%s.ckpt", checkpoint->prefix);
+    } else {
+        sprintf(path, "%s.T%d.ckpt", checkpoint->prefix, thread);
+    }
+}
+
+static bool checkpoint_header_matches(epistasis_checkpoint_header *expected, epistasis_checkpoint_header *read) {
+    return !memcmp(read->magic, EPISTASIS_CHECKPOINT_MAGIC, EPISTASIS_CHECKPOINT_MAGIC_LEN) &&
+           read->version == EPISTASIS_CHECKPOINT_VERSION &&
+           read->order == expected->order &&
+           read->stride == expected->stride &&
+           read->num_folds == expected->num_folds &&
+           read->num_samples_with_padding == expected->num_samples_with_padding &&
+           read->eval_function == expected->eval_function &&
+           read->eval_subset == expected->eval_subset &&
+           read->eval_mode == expected->eval_mode &&
+           read->max_ranking_size == expected->max_ranking_size &&
+           read->num_phenotypes == expected->num_phenotypes &&
+           read->num_variants == expected->num_variants &&
+           read->num_blocks == expected->num_blocks;
+}
+
+static uint64_t new_sweep_id(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/**
+ * Files are written under a temporary name and renamed once complete, so the previous version is kept if
+ * the process dies while writing.
+ */
+static int commit_checkpoint_file(FILE *fp, bool write_ok, char *tmp_path, char *path) {
+    if (fclose(fp) || !write_ok || rename(tmp_path, path)) {
+        LOG_ERROR_F("Can't write checkpoint file %s\n", path);
+        remove(tmp_path);
+        return EPISTASIS_CHECKPOINT_CANT_WRITE;
+    }
+    return 0;
+}
+
+
+/* **************************************
+ *          Risky combinations          *
+ * **************************************/
+
+static bool write_risky_combination(risky_combination *risky, FILE *fp) {
+    int32_t members[3] = { risky->order, risky->num_risky_genotypes, risky->cross_validation_count };
+
+    return fwrite(&(risky->accuracy), sizeof(double), 1, fp) == 1 &&
+           fwrite(members, sizeof(int32_t), 3, fp) == 3 &&
+           fwrite(risky->combination, sizeof(int), risky->order, fp) == risky->order &&
+           fwrite(risky->genotypes, sizeof(uint8_t), risky->num_risky_genotypes * risky->order, fp) == risky->num_risky_genotypes * risky->order;
+}
+
+static risky_combination *read_risky_combination(int order, masks_info info, FILE *fp) {
+    double accuracy;
+    int32_t members[3];
+    if (fread(&accuracy, sizeof(double), 1, fp) != 1 || fread(members, sizeof(int32_t), 3, fp) != 3 ||
+        members[0] != order || members[1] < 0 || members[1] > info.num_cell_counts_per_combination) {
+        return NULL;
+    }
+
+    int comb[order]; memset(comb, 0, order * sizeof(int));
+    risky_combination *risky = risky_combination_new(order, comb, NULL, NULL, NULL, info);
+    risky->accuracy = accuracy;
+    risky->num_risky_genotypes = members[1];
+    risky->cross_validation_count = members[2];
+
+    if (fread(risky->combination, sizeof(int), order, fp) != order ||
+        fread(risky->genotypes, sizeof(uint8_t), risky->num_risky_genotypes * order, fp) != risky->num_risky_genotypes * order) {
+        risky_combination_free(risky);
+        return NULL;
+    }
+
+    return risky;
+}
+
+static bool write_ranking(model_ranking *ranking, FILE *fp) {
+    uint64_t ranking_size = ranking->size;
+    bool write_ok = fwrite(&ranking_size, sizeof(uint64_t), 1, fp) == 1;
+    for (size_t i = 0; i < ranking_size; i++) {
+        write_ok = write_ok && write_risky_combination(ranking->entries[i].model, fp);
+    }
+
+    return write_ok;
+}
+
+
+/* **************************************
+ *           Checkpoint files           *
+ * **************************************/
+
+static int save_checkpoint_state(epistasis_checkpoint *checkpoint, uint8_t *fold_masks, unsigned int *testing_sizes) {
+    char path[strlen(checkpoint->prefix) + 32], tmp_path[strlen(checkpoint->prefix) + 40];
+    get_checkpoint_path(checkpoint, -1, path);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        LOG_ERROR_F("Can't write checkpoint file %s\n", path);
+        return EPISTASIS_CHECKPOINT_CANT_WRITE;
+    }
+
+    epistasis_checkpoint_header *header = &(checkpoint->header);
+    bool write_ok = fwrite(header, sizeof(epistasis_checkpoint_header), 1, fp) == 1;
+    if (header->in_progress) {
+        write_ok = write_ok &&
+                   fwrite(testing_sizes, sizeof(unsigned int), 3 * header->num_folds, fp) == 3 * header->num_folds &&
+                   fwrite(fold_masks, sizeof(uint8_t), header->num_folds * header->num_samples_with_padding, fp) ==
+                        header->num_folds * header->num_samples_with_padding;
+    }
+
+    return commit_checkpoint_file(fp, write_ok, tmp_path, path);
+}
+
+static int save_checkpoint_thread(epistasis_checkpoint *checkpoint, int thread, epistasis_workspace *workspace) {
+    char path[strlen(checkpoint->prefix) + 32], tmp_path[strlen(checkpoint->prefix) + 40];
+    get_checkpoint_path(checkpoint, thread, path);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        LOG_ERROR_F("Can't write checkpoint file %s\n", path);
+        return EPISTASIS_CHECKPOINT_CANT_WRITE;
+    }
+
+    epistasis_checkpoint_thread *thread_state = checkpoint->threads + thread;
+    uint64_t num_completed_blocks = thread_state->num_completed_blocks;
+
+    bool write_ok = fwrite(&(checkpoint->header), sizeof(epistasis_checkpoint_header), 1, fp) == 1 &&
+                    fwrite(&num_completed_blocks, sizeof(uint64_t), 1, fp) == 1;
+    for (size_t i = 0; i < num_completed_blocks && write_ok; i++) {
+        uint64_t block = thread_state->completed_blocks[i];
+        write_ok = fwrite(&block, sizeof(uint64_t), 1, fp) == 1;
+    }
+    // Rankings of the main phenotype, followed by the ones of the rest
+    for (int f = 0; f < (1 + checkpoint->header.num_phenotypes) * checkpoint->header.num_folds && write_ok; f++) {
+        write_ok = write_ranking(workspace->rankings[f], fp);
+    }
+
+    return commit_checkpoint_file(fp, write_ok, tmp_path, path);
+}
+
+static void add_completed_block(epistasis_checkpoint_thread *thread_state, size_t block) {
+    if (thread_state->num_completed_blocks == thread_state->max_completed_blocks) {
+        thread_state->max_completed_blocks *= 2;
+        thread_state->completed_blocks = realloc(thread_state->completed_blocks,
+                                                 thread_state->max_completed_blocks * sizeof(size_t));
+    }
+    thread_state->completed_blocks[thread_state->num_completed_blocks++] = block;
+}
+
+/**
+ * Loads the progress saved by a thread of the previous run. A thread can have taken the progress of another
+ * one if the number of threads changed, so files whose blocks were already loaded are skipped.
+ */
+static int load_checkpoint_thread(epistasis_checkpoint *checkpoint, int thread, uint64_t sweep_id, epistasis_workspace **workspaces,
+                                  masks_info info) {
+    char path[strlen(checkpoint->prefix) + 32];
+    get_checkpoint_path(checkpoint, thread, path);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return 0; // The thread didn't save any progress
+    }
+
+    epistasis_checkpoint_header header;
+    uint64_t num_completed_blocks;
+    if (fread(&header, sizeof(epistasis_checkpoint_header), 1, fp) != 1 ||
+        !checkpoint_header_matches(&(checkpoint->header), &header) || header.sweep_id != sweep_id ||
+        fread(&num_completed_blocks, sizeof(uint64_t), 1, fp) != 1 || num_completed_blocks > header.num_blocks) {
+        LOG_WARN_F("Checkpoint file %s does not belong to the sweep being resumed, ignoring it\n", path);
+        fclose(fp);
+        return 0;
+    }
+
+    uint64_t *blocks = malloc(num_completed_blocks * sizeof(uint64_t));
+    bool already_loaded = false;
+    if (fread(blocks, sizeof(uint64_t), num_completed_blocks, fp) != num_completed_blocks) {
+        free(blocks);
+        fclose(fp);
+        return EPISTASIS_CHECKPOINT_NOT_VALID;
+    }
+    for (size_t i = 0; i < num_completed_blocks; i++) {
+        if (blocks[i] >= header.num_blocks) {
+            free(blocks);
+            fclose(fp);
+            return EPISTASIS_CHECKPOINT_NOT_VALID;
+        }
+        already_loaded = already_loaded || checkpoint->completed[blocks[i]];
+    }
+
+    if (already_loaded) {
+        LOG_DEBUG_F("Checkpoint file %s was already included in another one\n", path);
+        free(blocks);
+        fclose(fp);
+        return 0;
+    }
+
+    // If there are less threads than in the previous run, some of them take the progress of several
+    int owner = thread % checkpoint->num_threads;
+    for (size_t i = 0; i < num_completed_blocks; i++) {
+        checkpoint->completed[blocks[i]] = true;
+        add_completed_block(checkpoint->threads + owner, blocks[i]);
+    }
+    free(blocks);
+
+    for (int f = 0; f < (1 + header.num_phenotypes) * header.num_folds; f++) {
+        uint64_t ranking_size;
+        if (fread(&ranking_size, sizeof(uint64_t), 1, fp) != 1) {
+            fclose(fp);
+            return EPISTASIS_CHECKPOINT_NOT_VALID;
+        }
+        for (size_t i = 0; i < ranking_size; i++) {
+            risky_combination *risky = read_risky_combination(header.order, info, fp);
+            if (!risky) {
+                fclose(fp);
+                return EPISTASIS_CHECKPOINT_NOT_VALID;
+            }
+            risky_combination *left_out = model_ranking_insert(workspaces[owner]->rankings[f], risky);
+            if (left_out) {
+                risky_combination_free(left_out);
+            }
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void remove_checkpoint_threads(epistasis_checkpoint *checkpoint, int first_thread, int last_thread) {
+    char path[strlen(checkpoint->prefix) + 32];
+    for (int t = first_thread; t < last_thread; t++) {
+        get_checkpoint_path(checkpoint, t, path);
+        remove(path);
+    }
+}
+
+
+/* **************************************
+ *              Public API              *
+ * **************************************/
+
+epistasis_checkpoint *epistasis_checkpoint_new(char *output_directory, int process, int num_threads, int interval,
+                                               int order, int stride, size_t num_variants, int num_folds, int num_phenotypes,
+                                               enum eval_function function, enum evaluation_subset subset, enum evaluation_mode mode,
+                                               int max_ranking_size, size_t num_blocks, masks_info info) {
+    epistasis_checkpoint *checkpoint = malloc(sizeof(epistasis_checkpoint));
+    checkpoint->prefix = malloc(strlen(output_directory) + 32);
+    sprintf(checkpoint->prefix, "%s/hpg-variant.epi.P%d", output_directory, process);
+    checkpoint->num_threads = num_threads;
+    checkpoint->interval = interval;
+    checkpoint->resumed = false;
+    checkpoint->resumed_num_threads = 0;
+    checkpoint->completed = calloc(num_blocks, sizeof(bool));
+    checkpoint->start_pending = false;
+    checkpoint->pending_fold_masks = NULL;
+    checkpoint->pending_testing_sizes = NULL;
+
+    epistasis_checkpoint_header *header = &(checkpoint->header);
+    memset(header, 0, sizeof(epistasis_checkpoint_header));
+    memcpy(header->magic, EPISTASIS_CHECKPOINT_MAGIC, EPISTASIS_CHECKPOINT_MAGIC_LEN);
+    header->version = EPISTASIS_CHECKPOINT_VERSION;
+    header->order = order;
+    header->stride = stride;
+    header->num_folds = num_folds;
+    header->num_samples_with_padding = info.num_samples_with_padding;
+    header->eval_function = function;
+    header->eval_subset = subset;
+    header->eval_mode = mode;
+    header->max_ranking_size = max_ranking_size;
+    header->num_phenotypes = num_phenotypes;
+    header->num_threads = num_threads;
+    header->num_variants = num_variants;
+    header->num_blocks = num_blocks;
+
+    checkpoint->threads = calloc(num_threads, sizeof(epistasis_checkpoint_thread));
+    for (int t = 0; t < num_threads; t++) {
+        checkpoint->threads[t].max_completed_blocks = 16;
+        checkpoint->threads[t].completed_blocks = malloc(16 * sizeof(size_t));
+    }
+
+    return checkpoint;
+}
+
+int epistasis_checkpoint_saved_stride(char *output_directory, int process) {
+    char path[strlen(output_directory) + 64];
+    sprintf(path, "%s/hpg-variant.epi.P%d.ckpt", output_directory, process);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return 0;
+    }
+
+    epistasis_checkpoint_header header;
+    int stride = 0;
+    if (fread(&header, sizeof(epistasis_checkpoint_header), 1, fp) == 1 &&
+        !memcmp(header.magic, EPISTASIS_CHECKPOINT_MAGIC, EPISTASIS_CHECKPOINT_MAGIC_LEN) &&
+        header.version == EPISTASIS_CHECKPOINT_VERSION) {
+        stride = header.stride;
+    }
+    fclose(fp);
+    return stride;
+}
+
+int epistasis_checkpoint_load(epistasis_checkpoint *checkpoint, epistasis_workspace **workspaces, masks_info info, 
+                              int *first_repetition, uint8_t **fold_masks, unsigned int **testing_sizes) {
+    *first_repetition = 0;
+    *fold_masks = NULL;
+    *testing_sizes = NULL;
+
+    char path[strlen(checkpoint->prefix) + 32];
+    get_checkpoint_path(checkpoint, -1, path);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        LOG_WARN_F("Checkpoint file %s not found, starting from the beginning\n", path);
+        return 0;
+    }
+
+    epistasis_checkpoint_header header;
+    if (fread(&header, sizeof(epistasis_checkpoint_header), 1, fp) != 1 ||
+        !checkpoint_header_matches(&(checkpoint->header), &header)) {
+        LOG_ERROR_F("Checkpoint file %s was not created with the same dataset and options\n", path);
+        fclose(fp);
+        return EPISTASIS_CHECKPOINT_NOT_VALID;
+    }
+
+    *first_repetition = header.first_repetition;
+    if (!header.in_progress) {
+        fclose(fp);
+        return 0;
+    }
+
+    // Folds of the sweep in progress
+    *testing_sizes = malloc(3 * header.num_folds * sizeof(unsigned int));
+    *fold_masks = _mm_malloc(header.num_folds * header.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    if (fread(*testing_sizes, sizeof(unsigned int), 3 * header.num_folds, fp) != 3 * header.num_folds ||
+        fread(*fold_masks, sizeof(uint8_t), header.num_folds * header.num_samples_with_padding, fp) !=
+            header.num_folds * header.num_samples_with_padding) {
+        LOG_ERROR_F("Checkpoint file %s is truncated\n", path);
+        free(*testing_sizes);
+        _mm_free(*fold_masks);
+        *testing_sizes = NULL;
+        *fold_masks = NULL;
+        fclose(fp);
+        return EPISTASIS_CHECKPOINT_NOT_VALID;
+    }
+    fclose(fp);
+
+    // Blocks finished and models found by each thread
+    for (int t = 0; t < header.num_threads; t++) {
+        int ret_code = load_checkpoint_thread(checkpoint, t, header.sweep_id, workspaces, info);
+        if (ret_code) {
+            LOG_ERROR_F("Checkpoint of thread %d is not valid\n", t);
+            return ret_code;
+        }
+    }
+
+    size_t num_completed = 0;
+    for (size_t i = 0; i < header.num_blocks; i++) {
+        num_completed += checkpoint->completed[i];
+    }
+    LOG_INFO_F("Resuming cross-validation #%d, %zu of %zu blocks already finished\n",
+               *first_repetition + 1, num_completed, (size_t) header.num_blocks);
+
+    checkpoint->header.sweep_id = header.sweep_id;
+    checkpoint->resumed = true;
+    checkpoint->resumed_num_threads = header.num_threads;
+    return 0;
+}
+
+int epistasis_checkpoint_begin_sweep(epistasis_checkpoint *checkpoint, int first_repetition, uint8_t *fold_masks,
+                                     unsigned int *testing_sizes, epistasis_workspace **workspaces, bool deferred) {
+    int ret_code = 0;
+    assert(!(deferred && checkpoint->resumed));
+
+    if (!checkpoint->resumed) {
+        memset(checkpoint->completed, 0, checkpoint->header.num_blocks * sizeof(bool));
+        for (int t = 0; t < checkpoint->num_threads; t++) {
+            checkpoint->threads[t].num_completed_blocks = 0;
+        }
+        checkpoint->header.sweep_id = new_sweep_id();
+    }
+
+    double now = omp_get_wtime();
+    for (int t = 0; t < checkpoint->num_threads; t++) {
+        checkpoint->threads[t].last_save_time = now;
+    }
+
+    if (checkpoint->interval <= 0) {
+        checkpoint->resumed = false;
+        return 0;
+    }
+
+    if (deferred) {
+        checkpoint->pending_first_repetition = first_repetition;
+        checkpoint->pending_fold_masks = fold_masks;
+        checkpoint->pending_testing_sizes = testing_sizes;
+#pragma omp atomic write
+        checkpoint->start_pending = true;
+        return 0;
+    }
+
+    // The progress loaded from the previous run is saved by the current threads before it is referenced by the
+    // new state, so it is never lost, even if the number of threads changed
+    if (checkpoint->resumed) {
+        for (int t = 0; t < checkpoint->num_threads && !ret_code; t++) {
+            ret_code = save_checkpoint_thread(checkpoint, t, workspaces[t]);
+        }
+    }
+
+    if (!ret_code) {
+        checkpoint->header.first_repetition = first_repetition;
+        checkpoint->header.in_progress = 1;
+        checkpoint->header.num_threads = checkpoint->num_threads;
+        ret_code = save_checkpoint_state(checkpoint, fold_masks, testing_sizes);
+    }
+
+    if (!ret_code && checkpoint->resumed) {
+        remove_checkpoint_threads(checkpoint, checkpoint->num_threads, checkpoint->resumed_num_threads);
+    }
+
+    checkpoint->resumed = false;
+    return ret_code;
+}
+
+size_t epistasis_checkpoint_pending_blocks(epistasis_checkpoint *checkpoint, int order, int *block_coords, size_t num_blocks,
+                                           int *pending_coords, size_t *pending_blocks) {
+    size_t num_pending = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        if (!checkpoint->completed[i]) {
+            memcpy(pending_coords + num_pending * order, block_coords + i * order, order * sizeof(int));
+            pending_blocks[num_pending] = i;
+            num_pending++;
+        }
+    }
+    return num_pending;
+}
+
+void epistasis_checkpoint_block_finished(epistasis_checkpoint *checkpoint, int thread, size_t block,
+                                         epistasis_workspace *workspace) {
+    epistasis_checkpoint_thread *thread_state = checkpoint->threads + thread;
+    add_completed_block(thread_state, block);
+
+    // The files of the threads can't be written until the previous sweep is finished, and then they must see
+    // the header of the new one, which is flushed before the flag is cleared
+    bool start_pending;
+#pragma omp atomic read
+    start_pending = checkpoint->start_pending;
+#pragma omp flush
+
+    double now = omp_get_wtime();
+    if (checkpoint->interval > 0 && !start_pending && now - thread_state->last_save_time >= checkpoint->interval) {
+        if (save_checkpoint_thread(checkpoint, thread, workspace)) {
+            LOG_WARN_F("Progress of thread %d could not be saved, it will be retried later\n", thread);
+        }
+        thread_state->last_save_time = now;
+    }
+}
+
+int epistasis_checkpoint_end_sweep(epistasis_checkpoint *checkpoint, int next_repetition) {
+    if (checkpoint->interval <= 0) {
+        return 0;
+    }
+
+    checkpoint->header.first_repetition = next_repetition;
+    checkpoint->header.in_progress = 0;
+    int ret_code = save_checkpoint_state(checkpoint, NULL, NULL);
+
+    // The progress of the threads is not needed anymore
+    if (!ret_code) {
+        remove_checkpoint_threads(checkpoint, 0, checkpoint->num_threads);
+    }
+
+    // The next sweep is already in progress
+    bool start_pending;
+#pragma omp atomic read
+    start_pending = checkpoint->start_pending;
+    if (start_pending) {
+        checkpoint->header.first_repetition = checkpoint->pending_first_repetition;
+        checkpoint->header.in_progress = 1;
+        checkpoint->header.num_threads = checkpoint->num_threads;
+        ret_code = save_checkpoint_state(checkpoint, checkpoint->pending_fold_masks, checkpoint->pending_testing_sizes) || ret_code;
+#pragma omp flush
+#pragma omp atomic write
+        checkpoint->start_pending = false;
+    }
+
+    return ret_code;
+}
+
+void epistasis_checkpoint_remove(epistasis_checkpoint *checkpoint) {
+    char path[strlen(checkpoint->prefix) + 32];
+    get_checkpoint_path(checkpoint, -1, path);
+    remove(path);
+    remove_checkpoint_threads(checkpoint, 0, checkpoint->num_threads);
+}
+
+void epistasis_checkpoint_free(epistasis_checkpoint *checkpoint) {
+    for (int t = 0; t < checkpoint->num_threads; t++) {
+        free(checkpoint->threads[t].completed_blocks);
+    }
+    free(checkpoint->threads);
+    free(checkpoint->completed);
+    free(checkpoint->prefix);
+    free(checkpoint);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_CHECKPOINT_H
+#define EPISTASIS_CHECKPOINT_H
+
+/**
+ * @file checkpoint.h
+ * @brief Checkpoints of an epistasis search, so it can be resumed after a failure
+ *
+ * Each process stores its progress in the output directory:
+ * - hpg-variant.epi.P<process>.ckpt: the first cross-validation repetition not finished yet and, if a sweep
+ *   over the combinations was in progress, the folds it was using.
+ * - hpg-variant.epi.P<process>.T<thread>.ckpt: the blocks a thread finished in the sweep in progress, and
+ *   the best models it found in each fold.
+ *
+ * Threads save their own file independently, so no synchronization is needed. Every file is written under
+ * a temporary name and then renamed, so a failure while saving leaves the previous checkpoint untouched.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include <commons/log.h>
+#include <containers/heap.h>
+
+#include "error.h"
+#include "epistasis.h"
+#include "model.h"
+
+#define EPISTASIS_CHECKPOINT_MAGIC          "HPGEPICK"
+#define EPISTASIS_CHECKPOINT_MAGIC_LEN      8
+#define EPISTASIS_CHECKPOINT_VERSION        2
+
+/**
+ * Header of all checkpoint files, 88 bytes long. Members from order to num_blocks (except first_repetition, 
+ * in_progress and num_threads) must match the ones of the run being resumed, as the rankings saved would 
+ * otherwise be scored differently or have a different number of folds.
+ */
+typedef struct {
+    char magic[EPISTASIS_CHECKPOINT_MAGIC_LEN];
+    uint32_t version;
+    uint32_t order;
+    uint32_t stride;
+    uint32_t num_folds;                 /**< Folds evaluated in each sweep (all repetitions, if fused) */
+    uint32_t num_samples_with_padding;
+    uint32_t eval_function;             /**< Function the models are ranked by */
+    uint32_t eval_subset;
+    uint32_t eval_mode;
+    uint32_t max_ranking_size;
+    uint32_t num_phenotypes;            /**< Phenotypes ranked besides the main one, each one in all folds */
+    uint32_t first_repetition;          /**< First CV repetition not finished yet */
+    uint32_t in_progress;               /**< Whether the sweep starting at first_repetition was in progress */
+    uint32_t num_threads;               /**< Threads that saved their progress */
+    uint32_t reserved;                  /**< Always 0, so the 64-bit members are aligned */
+    uint64_t num_variants;
+    uint64_t num_blocks;                /**< Blocks processed by the process in each sweep */
+    uint64_t sweep_id;                  /**< Identifier of the sweep, so files of other runs are not mixed */
+} epistasis_checkpoint_header;
+
+typedef struct {
+    size_t *completed_blocks;           /**< Blocks finished in the current sweep */
+    size_t num_completed_blocks;
+    size_t max_completed_blocks;
+    double last_save_time;
+} epistasis_checkpoint_thread;
+
+typedef struct {
+    char *prefix;                       /**< Path of the checkpoint files, without the suffix */
+    int num_threads;
+    int interval;                       /**< Seconds between checkpoints of each thread, 0 if disabled */
+    bool resumed;                       /**< Whether the progress of a sweep has been loaded and not saved yet */
+    int resumed_num_threads;
+    bool *completed;                    /**< Blocks finished before the sweep was resumed */
+    bool start_pending;                 /**< Whether the start of the sweep is saved once the previous one ends */
+    int pending_first_repetition;
+    uint8_t *pending_fold_masks;
+    unsigned int *pending_testing_sizes;
+    epistasis_checkpoint_header header;
+    epistasis_checkpoint_thread *threads;
+} epistasis_checkpoint;
+
+
+/**
+ * @brief Creates the checkpoints of a process.
+ *
+ * @param output_directory Directory where the checkpoint files are stored
+ * @param process Number of the process (MPI rank)
+ * @param num_threads Number of threads that process blocks
+ * @param interval Seconds between checkpoints of each thread, 0 for not saving any checkpoint
+ * @param num_folds Folds evaluated in each sweep over the combinations
+ * @param num_phenotypes Phenotypes ranked besides the main one
+ * @param num_blocks Number of blocks processed by the process in each sweep
+ * @return A new checkpoint
+ **/
+epistasis_checkpoint *epistasis_checkpoint_new(char *output_directory, int process, int num_threads, int interval,
+                                               int order, int stride, size_t num_variants, int num_folds, int num_phenotypes,
+                                               enum eval_function function, enum evaluation_subset subset, enum evaluation_mode mode,
+                                               int max_ranking_size, size_t num_blocks, masks_info info);
+
+/**
+ * @brief Gets the block stride of the run that saved the last checkpoint of a process.
+ * @details Gets the block stride of the run that saved the last checkpoint of a process, so a search whose stride 
+ * was chosen at runtime can be resumed with the same blocks.
+ *
+ * @return The stride of the checkpoint, 0 if there is no valid one
+ **/
+int epistasis_checkpoint_saved_stride(char *output_directory, int process);
+
+/**
+ * @brief Loads the last checkpoint of a process.
+ * @details Loads the last checkpoint of a process. If a sweep was in progress, its folds are returned, and the
+ * models found by each thread are inserted in the rankings of the workspaces, so the sweep can go on from where
+ * it was left. If no checkpoint exists, the search starts from the beginning.
+ *
+ * @param workspaces Workspaces of each thread
+ * @param[out] first_repetition First CV repetition not finished yet
+ * @param[out] fold_masks Fold masks of the sweep in progress, NULL if none
+ * @param[out] testing_sizes Sizes of the testing partitions of the sweep in progress, NULL if none
+ * @return 0 if the checkpoint could be loaded or did not exist, an error code otherwise
+ **/
+int epistasis_checkpoint_load(epistasis_checkpoint *checkpoint, epistasis_workspace **workspaces, masks_info info, 
+                              int *first_repetition, uint8_t **fold_masks, unsigned int **testing_sizes);
+
+/**
+ * @brief Saves the folds of a sweep, before any block of it is processed.
+ * @details Saves the folds of a sweep, before any block of it is processed. If the sweep was resumed, the
+ * progress of all threads is saved again so it doesn't depend on the files of the previous run.
+ * 
+ * If the previous sweep has not been reported yet, the folds are saved by epistasis_checkpoint_end_sweep once 
+ * it is, so a failure in between resumes the previous sweep. Threads don't save their progress until then, so 
+ * if the previous sweep is not reported until all blocks are processed, none of them is saved and the whole 
+ * sweep is run again when resumed.
+ *
+ * @param deferred Whether the previous sweep has not been reported yet, never true for a resumed sweep
+ **/
+int epistasis_checkpoint_begin_sweep(epistasis_checkpoint *checkpoint, int first_repetition, uint8_t *fold_masks,
+                                     unsigned int *testing_sizes, epistasis_workspace **workspaces, bool deferred);
+
+/**
+ * @brief Gets the blocks of a sweep that were not finished before the last checkpoint.
+ *
+ * @param block_coords Coordinates of all blocks, order values per block
+ * @param num_blocks Number of blocks
+ * @param[out] pending_coords Coordinates of the pending blocks
+ * @param[out] pending_blocks Index of each pending block in block_coords
+ * @return Number of pending blocks
+ **/
+size_t epistasis_checkpoint_pending_blocks(epistasis_checkpoint *checkpoint, int order, int *block_coords, size_t num_blocks,
+                                           int *pending_coords, size_t *pending_blocks);
+
+/**
+ * @brief Marks a block as finished by a thread, and saves its progress if the interval has elapsed.
+ **/
+void epistasis_checkpoint_block_finished(epistasis_checkpoint *checkpoint, int thread, size_t block,
+                                         epistasis_workspace *workspace);
+
+/**
+ * @brief Marks a sweep as finished, once its results have been reported.
+ * @details Marks a sweep as finished, once its results have been reported. If the start of the next sweep was 
+ * deferred, it is saved now. It can be called while the threads process the blocks of the next sweep.
+ *
+ * @param next_repetition First CV repetition of the next sweep
+ **/
+int epistasis_checkpoint_end_sweep(epistasis_checkpoint *checkpoint, int next_repetition);
+
+/**
+ * @brief Removes the checkpoint files, once the search has finished.
+ **/
+void epistasis_checkpoint_remove(epistasis_checkpoint *checkpoint);
+
+void epistasis_checkpoint_free(epistasis_checkpoint *checkpoint);
+
+#endif
@@ -1,7 +1,27 @@
 #include "cross_validation.h"
 
 
+void shuffle_samples(int *samples, int num_samples, unsigned int *seed) {
+    if (!seed) {
+        array_shuffle_int(samples, num_samples);
+        return;
+    }
+    
+    // Fisher-Yates, drawing from the state of the caller
+    for (int i = num_samples - 1; i > 0; i--) {
+        int j = rand_r(seed) % (i + 1);
+        int tmp = samples[i];
+        samples[i] = samples[j];
+        samples[j] = tmp;
+    }
+}
+
 int** get_k_folds(unsigned int num_samples_affected, unsigned int num_samples_unaffected, unsigned int k, unsigned int **sizes) {
+    return get_k_folds_seeded(num_samples_affected, num_samples_unaffected, k, NULL, sizes);
+}
+
+int** get_k_folds_seeded(unsigned int num_samples_affected, unsigned int num_samples_unaffected, unsigned int k, 
+                         unsigned int *seed, unsigned int **sizes) {
     if (num_samples_affected < k) {
         LOG_WARN("There are less affected samples than folds and they won't be properly distributed\n");
     }
@@ -17,8 +37,8 @@ int** get_k_folds(unsigned int num_samples_affected, unsigned int num_samples_un
     }
     
     // Shuffle affected and unaffected samples separately in order to guarantee they are not mixed
-    array_shuffle_int(samples, num_samples_affected);
-    array_shuffle_int(samples + num_samples_affected, num_samples_unaffected);
+    shuffle_samples(samples, num_samples_affected, seed);
+    shuffle_samples(samples + num_samples_affected, num_samples_unaffected, seed);
     
     // Get size of each fold (total, affected, unaffected) and initialize them
     int **folds = malloc (k * sizeof(unsigned int*));
@@ -101,13 +121,14 @@ int** get_k_folds(unsigned int num_samples_affected, unsigned int num_samples_un
 
 uint8_t *get_k_folds_masks(unsigned int num_samples_affected, unsigned int num_samples_unaffected, unsigned int k, int **folds, unsigned int *sizes) {
     // TODO use masks_info members instead of num_samples_affected and num_samples_unaffected
-    unsigned int num_affected_with_padding = 16 * (int) ceil(((double) num_samples_affected) / 16);
-    unsigned int num_unaffected_with_padding = 16 * (int) ceil(((double) num_samples_unaffected) / 16);
+    int width = epistasis_kernels_get()->vector_width;
+    unsigned int num_affected_with_padding = width * (int) ceil(((double) num_samples_affected) / width);
+    unsigned int num_unaffected_with_padding = width * (int) ceil(((double) num_samples_unaffected) / width);
     unsigned int num_samples_with_padding = num_affected_with_padding + num_unaffected_with_padding;
     unsigned int padding_size_affected = num_affected_with_padding - num_samples_affected;
     unsigned int padding_size_unaffected = num_unaffected_with_padding - num_samples_unaffected;
 
-    uint8_t *fold_masks = _mm_malloc (num_samples_with_padding * k * sizeof(uint8_t), 16);
+    uint8_t *fold_masks = _mm_malloc (num_samples_with_padding * k * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
     memset(fold_masks, 1, num_samples_with_padding * k * sizeof(uint8_t));
 
     for (int i = 0; i < k; i++) {
@@ -131,6 +152,67 @@ uint8_t *get_k_folds_masks(unsigned int num_samples_affected, unsigned int num_s
     return fold_masks;
 }
 
+uint8_t *get_k_folds_masks_repetitions(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                       unsigned int k, unsigned int **sizes) {
+    int *assignment = get_k_folds_assignment_repetitions(num_repetitions, num_samples_affected, num_samples_unaffected, k, NULL);
+    uint8_t *fold_masks = get_k_folds_masks_from_assignment(num_repetitions, num_samples_affected, num_samples_unaffected, k, 
+                                                            assignment, sizes);
+    free(assignment);
+    return fold_masks;
+}
+
+int *get_k_folds_assignment_repetitions(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                        unsigned int k, unsigned int *seed) {
+    unsigned int num_samples = num_samples_affected + num_samples_unaffected;
+    int *assignment = malloc(num_repetitions * num_samples * sizeof(int));
+    
+    // Folds are generated in the same order as if each repetition was run independently
+    for (int r = 0; r < num_repetitions; r++) {
+        unsigned int *repetition_sizes;
+        int **folds = get_k_folds_seeded(num_samples_affected, num_samples_unaffected, k, seed, &repetition_sizes);
+        
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < repetition_sizes[3 * i]; j++) {
+                assignment[r * num_samples + folds[i][j]] = i;
+            }
+            free(folds[i]);
+        }
+        free(folds);
+        free(repetition_sizes);
+    }
+    
+    return assignment;
+}
+
+uint8_t *get_k_folds_masks_from_assignment(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                           unsigned int k, int *assignment, unsigned int **sizes) {
+    int width = epistasis_kernels_get()->vector_width;
+    unsigned int num_affected_with_padding = width * (int) ceil(((double) num_samples_affected) / width);
+    unsigned int num_samples_with_padding = num_affected_with_padding + width * (int) ceil(((double) num_samples_unaffected) / width);
+    unsigned int num_samples = num_samples_affected + num_samples_unaffected;
+    
+    // Samples are left in the training partition of all folds but the one they are tested in, while the padding is in none
+    uint8_t *fold_masks = _mm_malloc(num_samples_with_padding * k * num_repetitions * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    unsigned int *fold_sizes = calloc(3 * k * num_repetitions, sizeof(unsigned int));
+    memset(fold_masks, 0, num_samples_with_padding * k * num_repetitions * sizeof(uint8_t));
+    
+    for (int r = 0; r < num_repetitions; r++) {
+        for (int s = 0; s < num_samples; s++) {
+            int testing_fold = r * k + assignment[r * num_samples + s];
+            int position = (s < num_samples_affected) ? s : num_affected_with_padding + s - num_samples_affected;
+            for (int i = r * k; i < (r + 1) * k; i++) {
+                fold_masks[i * num_samples_with_padding + position] = (i != testing_fold);
+            }
+            
+            fold_sizes[3 * testing_fold]++;
+            fold_sizes[3 * testing_fold + ((s < num_samples_affected) ? 1 : 2)]++;
+        }
+    }
+    
+    *sizes = fold_sizes;
+    return fold_masks;
+}
+
 
 uint8_t *get_genotypes_for_combination_and_fold(int order, int comb[order], int num_samples, 
                                                 int num_samples_in_fold, int fold_samples[num_samples_in_fold], 
@@ -9,12 +9,52 @@
 #include <math/data/array_utils.h>
 
 #include "hpg_variant_utils.h"
+#include "kernels.h"
 #include "model.h"
 
+/**
+ * @brief Shuffles the identifiers of some samples.
+ * @details Shuffles the identifiers of some samples, drawing from the state in seed with rand_r, or from 
+ * rand if it is NULL. A state of their own keeps the sequence of rand unchanged for the rest of the callers.
+ */
+void shuffle_samples(int *samples, int num_samples, unsigned int *seed);
+
 int** get_k_folds(unsigned int samples_affected, unsigned int samples_unaffected, unsigned int k, unsigned int **sizes);
 
+/**
+ * @brief Same as get_k_folds, but shuffling the samples as shuffle_samples does with the given seed.
+ */
+int** get_k_folds_seeded(unsigned int samples_affected, unsigned int samples_unaffected, unsigned int k, 
+                         unsigned int *seed, unsigned int **sizes);
+
 uint8_t *get_k_folds_masks(unsigned int num_samples_affected, unsigned int num_samples_unaffected, unsigned int k, int **folds, unsigned int *sizes);
 
+/**
+ * @brief Gets the masks of the k folds of several cross-validation repetitions, one after another.
+ * @details Gets the masks of the k folds of several cross-validation repetitions, one after another, so 
+ * all repetitions can be evaluated in a single sweep over the combinations. Fold f of repetition r is 
+ * stored as fold r * k + f, and so are its sizes (total, affected, unaffected).
+ */
+uint8_t *get_k_folds_masks_repetitions(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                       unsigned int k, unsigned int **sizes);
+
+/**
+ * @brief Gets the fold each sample is tested in, for several cross-validation repetitions.
+ * @details Gets the fold each sample is tested in, for several cross-validation repetitions. The fold of 
+ * sample s in repetition r is stored at position r * num_samples + s. Unlike the masks, it does not depend 
+ * on the padding of the kernels, so it can be shared by processes with kernels of different width. The 
+ * samples are shuffled as shuffle_samples does with the given seed.
+ */
+int *get_k_folds_assignment_repetitions(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                        unsigned int k, unsigned int *seed);
+
+/**
+ * @brief Gets the masks and sizes of the folds of several cross-validation repetitions, as described in 
+ * get_k_folds_masks_repetitions, from the fold each sample is tested in.
+ */
+uint8_t *get_k_folds_masks_from_assignment(unsigned int num_repetitions, unsigned int num_samples_affected, unsigned int num_samples_unaffected, 
+                                           unsigned int k, int *assignment, unsigned int **sizes);
+
 uint8_t *get_genotypes_for_combination_and_fold(int order, int comb[order], int num_samples, 
                                                 int num_samples_in_fold, int fold_samples[num_samples_in_fold], 
                                                 int stride, uint8_t **block_starts);
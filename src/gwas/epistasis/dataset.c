@@ -7,61 +7,173 @@
  *  Whole dataset management *
  * ***************************/
 
+/**
+ * Reads the header of a dataset in any of the supported versions. The bitplanes offset is set to zero 
+ * when the dataset does not contain them.
+ */
+static int read_dataset_header(uint8_t *contents, size_t len, int *num_affected, int *num_unaffected, size_t *num_variants, 
+                               size_t *genotypes_offset, size_t *bitplanes_offset) {
+    if (len >= sizeof(epistasis_dataset_header) && !memcmp(contents, EPISTASIS_DATASET_MAGIC, EPISTASIS_DATASET_MAGIC_LEN)) {
+        epistasis_dataset_header *header = (epistasis_dataset_header*) contents;
+        if (header->version > EPISTASIS_DATASET_VERSION) {
+            LOG_ERROR_F("Dataset version %u is not supported (up to version %d)\n", header->version, EPISTASIS_DATASET_VERSION);
+            return EPISTASIS_DATASET_NOT_SUPPORTED;
+        }
+        if (!(header->layout_flags & EPISTASIS_DATASET_GENOTYPES)) {
+            LOG_ERROR("The dataset does not contain a matrix of genotypes\n");
+            return EPISTASIS_DATASET_NOT_SUPPORTED;
+        }
+        
+        *num_variants = header->num_variants;
+        *num_affected = header->num_affected;
+        *num_unaffected = header->num_unaffected;
+        *genotypes_offset = header->genotypes_offset;
+        *bitplanes_offset = 0;
+        
+        if (header->layout_flags & EPISTASIS_DATASET_BITPLANES) {
+            // Bitplanes can be used directly only if their layout matches the one expected by the kernels
+            if (header->num_words_per_snp == dataset_num_words_per_snp(header->num_affected, header->num_unaffected) &&
+                header->bitplanes_offset % EPISTASIS_DATASET_ALIGNMENT == 0) {
+                *bitplanes_offset = header->bitplanes_offset;
+            } else {
+                LOG_WARN("The layout of the bitplanes in the dataset is not supported, they will be ignored\n");
+            }
+        }
+    } else if (len >= 3 * sizeof(uint32_t)) {
+        // Version 1 datasets only contain the number of variants and samples
+        uint32_t *header = (uint32_t*) contents;
+        *num_variants = header[0];
+        *num_affected = header[1];
+        *num_unaffected = header[2];
+        *genotypes_offset = 3 * sizeof(uint32_t);
+        *bitplanes_offset = 0;
+    } else {
+        LOG_ERROR("The dataset header is truncated\n");
+        return EPISTASIS_DATASET_NOT_SUPPORTED;
+    }
+    
+    LOG_DEBUG_F("num variants = %zu, aff = %d, unaff = %d, bitplanes offset = %zu\n", 
+                *num_variants, *num_affected, *num_unaffected, *bitplanes_offset);
+    return 0;
+}
+
 #ifdef _USE_MPI
 
+/**
+ * Reads a whole file, in pieces small enough for the int counts of MPI.
+ */
+static int read_file_mpi(MPI_File fd, uint8_t *contents, size_t len) {
+    const size_t max_piece_len = 1 << 30;
+    MPI_Status status;
+    
+    for (size_t offset = 0; offset < len; offset += max_piece_len) {
+        int piece_len = (len - offset < max_piece_len) ? len - offset : max_piece_len;
+        if (MPI_File_read_at(fd, offset, contents + offset, piece_len, MPI_BYTE, &status) != MPI_SUCCESS) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
 uint8_t *epistasis_dataset_load_mpi(char *filename, int *num_affected, int *num_unaffected, size_t *num_variants, 
-                                    size_t *file_len, size_t *genotypes_offset, MPI_File *fd) {
+                                    size_t *file_len, size_t *genotypes_offset, size_t *bitplanes_offset, 
+                                    epistasis_dataset_mpi *dataset) {
+    MPI_File fd;
     MPI_Offset len;
-    MPI_Status status;
     
     // Check if file exists
     FILE *fp = fopen(filename, "rb");
     if (!fp) { return NULL; }
+    fclose(fp);
     
-    MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, fd);
+    MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fd);
     
-    MPI_File_get_size(*fd, &len);
+    MPI_File_get_size(fd, &len);
     
-    LOG_DEBUG_F("File %s length = %llu bytes / %zu bytes\n", filename, len);
+    LOG_DEBUG_F("File %s length = %llu bytes\n", filename, len);
     
-    uint8_t *map = malloc(len * sizeof(uint8_t));
+    uint8_t *map;
+    int read_error = 0;
     
-    MPI_File_seek(*fd, 0, MPI_SEEK_SET);
-    MPI_Barrier(MPI_COMM_WORLD);
-
-    *genotypes_offset = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t);
+#if MPI_VERSION >= 3
+    // The first process in each node reads the file into memory shared with the rest of the node
+    int node_rank;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &(dataset->node_comm));
+    MPI_Comm_rank(dataset->node_comm, &node_rank);
+    
+    // Extra room so the contents can be aligned, as the window may not be
+    MPI_Aint window_len = (node_rank == 0) ? len + EPISTASIS_DATASET_ALIGNMENT : 0;
+    uint8_t *window_base;
+    MPI_Win_allocate_shared(window_len, 1, MPI_INFO_NULL, dataset->node_comm, &window_base, &(dataset->window));
+    
+    int disp_unit;
+    MPI_Win_shared_query(dataset->window, 0, &window_len, &disp_unit, &window_base);
+    dataset->own_copy = NULL;
+    
+    // Aligned so the bitplanes, if present, can be used directly by the kernels
+    map = window_base + (EPISTASIS_DATASET_ALIGNMENT - (uintptr_t) window_base % EPISTASIS_DATASET_ALIGNMENT) % EPISTASIS_DATASET_ALIGNMENT;
+    
+    MPI_Win_fence(0, dataset->window);
+    if (node_rank == 0) {
+        read_error = read_file_mpi(fd, map, len);
+    }
+    MPI_Win_fence(0, dataset->window);
+    
+    LOG_DEBUG_F("Node rank %d) Dataset %s shared memory\n", node_rank, (node_rank == 0) ? "loaded into" : "attached to");
+#else
+    // Each process reads its own copy of the file
+    dataset->node_comm = MPI_COMM_NULL;
+    dataset->window = MPI_WIN_NULL;
+    
+    // Aligned so the bitplanes, if present, can be used directly by the kernels
+    map = dataset->own_copy = _mm_malloc(len * sizeof(uint8_t), EPISTASIS_DATASET_ALIGNMENT);
+    read_error = read_file_mpi(fd, map, len);
+#endif
+    
+    MPI_File_close(&fd);
     
-    MPI_File_read(*fd, map, len, MPI_BYTE, &status);
+    // All processes must agree on the dataset being valid, because releasing it is collective
+    MPI_Allreduce(MPI_IN_PLACE, &read_error, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    if (read_error) {
+        LOG_ERROR_F("Dataset %s could not be read\n", filename);
+    }
     
-    uint32_t *map_uint32 = (uint32_t*) map;
-    *num_variants = map_uint32[0];
-    *num_affected = map_uint32[1];
-    *num_unaffected = map_uint32[2];
-    LOG_DEBUG_F("num variants = %zu, aff = %d, unaff = %d\n", *num_variants, *num_affected, *num_unaffected);
+    if (read_error || read_dataset_header(map, len, num_affected, num_unaffected, num_variants, genotypes_offset, bitplanes_offset)) {
+        epistasis_dataset_close_mpi(map, *dataset);
+        return NULL;
+    }
     
     *file_len = len;
     
     return map;
 }
 
-void epistasis_dataset_close_mpi(uint8_t *contents, MPI_File fd) {
-    free(contents);
-    MPI_File_close(&fd);
+void epistasis_dataset_close_mpi(uint8_t *contents, epistasis_dataset_mpi dataset) {
+    if (dataset.window != MPI_WIN_NULL) {
+        MPI_Win_free(&(dataset.window));
+        MPI_Comm_free(&(dataset.node_comm));
+    } else {
+        _mm_free(dataset.own_copy);
+    }
 }
 
 #else
 
-uint8_t *epistasis_dataset_load(int *num_affected, int *num_unaffected, size_t *num_variants, size_t *file_len, size_t *genotypes_offset, char *filename) {
+uint8_t *epistasis_dataset_load(int *num_affected, int *num_unaffected, size_t *num_variants, size_t *file_len, 
+                                size_t *genotypes_offset, size_t *bitplanes_offset, char *filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) { return NULL; }
     
-    fread(num_variants, 1, sizeof(uint32_t), fp);
-    fread(num_affected, 1, sizeof(uint32_t), fp);
-    fread(num_unaffected, 1, sizeof(uint32_t), fp);
+    uint8_t header[sizeof(epistasis_dataset_header)];
+    size_t header_len = fread(header, 1, sizeof(epistasis_dataset_header), fp);
     fclose(fp);
     
-    *genotypes_offset = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t);
+    if (read_dataset_header(header, header_len, num_affected, num_unaffected, num_variants, genotypes_offset, bitplanes_offset)) {
+        return NULL;
+    }
     
+    // The mapping starts at a page boundary, so sections aligned in the file are aligned in memory too
     return mmap_file(file_len, filename);
 }
 
@@ -119,6 +231,18 @@ void get_first_combination_in_block(int order, int init_coordinates[order], int
 }
 
 
+/**
+ * @brief  Gets the first position that position i of a combination can't take in its block, leaving 
+ * room for the later positions in the same block (the ones in other blocks don't limit it)
+ **/
+static inline int get_position_limit_in_block(int i, int order, int block_coordinates[order], int stride, int num_variants) {
+    int limit = MIN((block_coordinates[i] + 1) * stride, num_variants);
+    for (int j = i + 1; j < order && block_coordinates[j] == block_coordinates[i]; j++) {
+        limit--;
+    }
+    return limit;
+}
+
 /**
  * @brief  Generates the next combination of n elements as k after comb
  *
@@ -134,14 +258,14 @@ int get_next_combination_in_block(int order, int comb[order], int block_coordina
     
     // comb[i] compared against last position allowed in its block,
     // or in the whole dataset, if the last index in the block exceeds the number of variants
-    while (i > 0 && comb[i] >= MIN((block_coordinates[i] + 1) * stride - order + 1 + i, num_variants)) {
+    while (i > 0 && comb[i] >= get_position_limit_in_block(i, order, block_coordinates, stride, num_variants)) {
 //         printf("** comb[i] = %d\tlimit = %d\n", comb[i], ((block_coordinates[i] + 1) * stride) - order + 1 + i);
         --i;
         ++comb[i];
     }
     
     /* Combination (n-k, n-k+1, ..., n) reached */
-    if (comb[0] > (block_coordinates[0] + 1) * stride - 1 || comb[0] >= num_variants) {
+    if (comb[0] >= get_position_limit_in_block(0, order, block_coordinates, stride, num_variants)) {
 //         printf("-- comb[i] = %d\tlimit = %d\n", comb[i], ((block_coordinates[i] + 1) * stride) - order + 1 + i);
         return 0; /* No more combinations can be generated */
     }
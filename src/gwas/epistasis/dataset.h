@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include <xmmintrin.h>
+
 #ifdef _USE_MPI
 #include <mpi.h>
 #endif
@@ -36,21 +38,56 @@
 #include <commons/file_utils.h>
 #include <containers/array_list.h>
 
+#include "error.h"
 #include "hpg_variant_utils.h"
 
+#include "dataset_format.h"
+
 /* ***************************
  *  Whole dataset management *
  * ***************************/
 
 #ifdef _USE_MPI
+
+/**
+ * Memory that stores a dataset loaded by an MPI process.
+ */
+typedef struct {
+    MPI_Comm node_comm;     /**< Processes in the same node, which share the dataset */
+    MPI_Win window;         /**< Shared memory window, or MPI_WIN_NULL if the process has its own copy */
+    uint8_t *own_copy;      /**< Contents of the dataset when they are not shared */
+} epistasis_dataset_mpi;
+
+/**
+ * @brief Loads a dataset into the memory of the MPI processes.
+ * @details Loads a dataset into the memory of the MPI processes. With MPI-3 or later, only the first process 
+ * in each node reads the file, into a shared memory window the rest of the processes in the node attach to, 
+ * so the dataset is resident once per node. Otherwise every process reads its own copy. This is a collective 
+ * operation over MPI_COMM_WORLD.
+ *
+ * @param[out] dataset Memory that stores the dataset, needed for releasing it
+ * @return The contents of the file (read-only), or NULL if it does not exist or is not a valid dataset
+ **/
 uint8_t *epistasis_dataset_load_mpi(char *filename, int *num_affected, int *num_unaffected, size_t *num_variants, 
-                                    size_t *file_len, size_t *genotypes_offset, MPI_File *fd);
+                                    size_t *file_len, size_t *genotypes_offset, size_t *bitplanes_offset, 
+                                    epistasis_dataset_mpi *dataset);
 
-void epistasis_dataset_close_mpi(uint8_t *contents, MPI_File fd);
+/**
+ * @brief Releases a dataset loaded by epistasis_dataset_load_mpi. This is a collective operation over MPI_COMM_WORLD.
+ **/
+void epistasis_dataset_close_mpi(uint8_t *contents, epistasis_dataset_mpi dataset);
 
 #else
 
-uint8_t *epistasis_dataset_load(int *num_affected, int *num_unaffected, size_t *num_variants, size_t *file_len, size_t *genotypes_offset, char *filename);
+/**
+ * @brief Maps a dataset to memory.
+ * @details Maps a dataset to memory. Both legacy (version 1) and versioned datasets are supported. If the dataset 
+ * contains precomputed bitplanes, their position is returned in bitplanes_offset (zero otherwise).
+ *
+ * @return The contents of the file, or NULL if it does not exist or is not a valid dataset
+ **/
+uint8_t *epistasis_dataset_load(int *num_affected, int *num_unaffected, size_t *num_variants, size_t *file_len, 
+                                size_t *genotypes_offset, size_t *bitplanes_offset, char *filename);
 
 int epistasis_dataset_close(uint8_t *contents, size_t file_len);
 
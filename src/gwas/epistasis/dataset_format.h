@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_DATASET_FORMAT_H
+#define EPISTASIS_DATASET_FORMAT_H
+
+/**
+ * @file dataset_format.h
+ * @brief Binary format of the datasets created by hpg-var-vcf epi and read by hpg-var-gwas epi
+ *
+ * Version 1 (legacy) files contain a 12-byte header (number of variants, affected and unaffected samples,
+ * as uint32_t) followed by a matrix of num_variants x num_samples genotypes, one byte each, where affected
+ * samples come first.
+ *
+ * Version 2 files start with an epistasis_dataset_header, whose flags describe which sections are present:
+ * - Genotypes: the same matrix as in version 1, starting at genotypes_offset.
+ * - Bitplanes: NUM_DATASET_GENOTYPES bit-vectors per SNP (one per genotype, affected words followed by
+ *   unaffected words), starting at bitplanes_offset. The bitplanes of each SNP start at a 64-byte boundary,
+ *   so they can be used by the counting kernels without any transformation.
+ * - Phenotypes: num_phenotypes records right after the header, before the genotypes. Each one contains the name 
+ *   of a phenotype (EPISTASIS_DATASET_PHENOTYPE_NAME_LEN bytes, padded with zeros) and a label per sample, in 
+ *   the same order as the genotypes: 1 if affected, 0 if unaffected, EPISTASIS_DATASET_PHENOTYPE_MISSING if 
+ *   unknown. Samples are still grouped by the phenotype in the PED file, and these are searched along with it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define EPISTASIS_DATASET_MAGIC             "HPGEPIDS"
+#define EPISTASIS_DATASET_MAGIC_LEN         8
+#define EPISTASIS_DATASET_VERSION           2
+#define EPISTASIS_DATASET_ALIGNMENT         64
+
+#define NUM_DATASET_GENOTYPES               3
+
+#define EPISTASIS_DATASET_PHENOTYPE_NAME_LEN    32
+#define EPISTASIS_DATASET_PHENOTYPE_MISSING     255
+
+enum epistasis_dataset_layout {
+    EPISTASIS_DATASET_GENOTYPES = 1,        /**< Contains a matrix with one byte per genotype */
+    EPISTASIS_DATASET_BITPLANES = 2,        /**< Contains the genotypes of each SNP packed into bitplanes */
+    EPISTASIS_DATASET_PHENOTYPES = 4        /**< Contains other phenotypes of the samples */
+};
+
+/**
+ * Header of version 2 datasets, 64 bytes long so the next section is already aligned.
+ */
+typedef struct {
+    char magic[EPISTASIS_DATASET_MAGIC_LEN];
+    uint32_t version;
+    uint32_t layout_flags;              /**< Sections in the file, as a combination of epistasis_dataset_layout values */
+    uint64_t num_variants;
+    uint32_t num_affected;
+    uint32_t num_unaffected;
+    uint32_t num_words_affected;        /**< 64-bit words per bitplane used by affected samples */
+    uint32_t num_words_unaffected;      /**< 64-bit words per bitplane used by unaffected samples */
+    uint32_t num_words_per_snp;         /**< 64-bit words between the bitplanes of consecutive SNPs */
+    uint32_t num_phenotypes;            /**< Phenotypes stored besides the one samples are grouped by */
+    uint64_t genotypes_offset;          /**< Position of the genotypes matrix, 0 if not present */
+    uint64_t bitplanes_offset;          /**< Position of the bitplanes, 0 if not present */
+} epistasis_dataset_header;
+
+
+static inline int dataset_num_words(int num_samples) {
+    return (num_samples + 63) / 64;
+}
+
+static inline int dataset_num_words_per_snp(int num_affected, int num_unaffected) {
+    int num_words = NUM_DATASET_GENOTYPES * (dataset_num_words(num_affected) + dataset_num_words(num_unaffected));
+    int alignment_words = EPISTASIS_DATASET_ALIGNMENT / sizeof(uint64_t);
+    return alignment_words * ((num_words + alignment_words - 1) / alignment_words);
+}
+
+static inline size_t dataset_phenotypes_len(int num_phenotypes, int num_samples) {
+    return (size_t) num_phenotypes * (EPISTASIS_DATASET_PHENOTYPE_NAME_LEN + num_samples);
+}
+
+static inline size_t dataset_aligned_offset(size_t offset) {
+    return EPISTASIS_DATASET_ALIGNMENT * ((offset + EPISTASIS_DATASET_ALIGNMENT - 1) / EPISTASIS_DATASET_ALIGNMENT);
+}
+
+static inline void epistasis_dataset_header_init(int num_affected, int num_unaffected, uint32_t layout_flags,
+                                                 epistasis_dataset_header *header) {
+    memset(header, 0, sizeof(epistasis_dataset_header));
+    memcpy(header->magic, EPISTASIS_DATASET_MAGIC, EPISTASIS_DATASET_MAGIC_LEN);
+    header->version = EPISTASIS_DATASET_VERSION;
+    header->layout_flags = layout_flags;
+    header->num_affected = num_affected;
+    header->num_unaffected = num_unaffected;
+    header->num_words_affected = dataset_num_words(num_affected);
+    header->num_words_unaffected = dataset_num_words(num_unaffected);
+    header->num_words_per_snp = dataset_num_words_per_snp(num_affected, num_unaffected);
+}
+
+/**
+ * @brief Packs the genotypes of a SNP (affected samples first, no padding) into bitplanes.
+ * @details Packs the genotypes of a SNP (affected samples first, no padding) into bitplanes. The output
+ * buffer must be num_words_per_snp words long, and all bits not associated to a sample are set to zero.
+ */
+static inline void epistasis_dataset_pack_bitplanes(uint8_t *genotypes, epistasis_dataset_header *header, uint64_t *bitplanes) {
+    int num_words_per_bitplane = header->num_words_affected + header->num_words_unaffected;
+    memset(bitplanes, 0, header->num_words_per_snp * sizeof(uint64_t));
+
+    for (int i = 0; i < header->num_affected + header->num_unaffected; i++) {
+        // Missing genotypes are not set in any bitplane
+        if (genotypes[i] >= NUM_DATASET_GENOTYPES) {
+            continue;
+        }
+        int bit = (i < header->num_affected) ? i : (header->num_words_affected * 64 + i - header->num_affected);
+        bitplanes[genotypes[i] * num_words_per_bitplane + bit / 64] |= ((uint64_t) 1) << (bit % 64);
+    }
+}
+
+#endif
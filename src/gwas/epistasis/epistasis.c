@@ -1,94 +1,364 @@
+#include "cross_validation.h"
 #include "epistasis.h"
 
 
-void process_set_of_combinations(int num_combinations, int *combs, int order, int stride, 
-                                 int num_folds, uint8_t *fold_masks, int *training_sizes, int *testing_sizes,
-                                 uint8_t **block_genotypes, uint8_t **genotype_permutations,
-                                 uint8_t *masks, enum evaluation_subset subset, masks_info info, 
-                                 compare_risky_heap_func cmp_heap_func,
-                                 int *counts_aff, int *counts_unaff, unsigned int conf_matrix[4], 
-                                 int max_ranking_size, struct heap **ranking_risky_local) {
-    // Get genotypes of a row of combinations
-    uint8_t *combination_genotypes[info.num_combinations_in_a_row * order];
+/**
+ * Counts the genotype permutations of a row of combinations with a set of masks (or bitmasks) of samples.
+ */
+static void count_set_of_combinations(int num_combinations, int *combs, int order, int stride, 
+                                      int num_count_masks, uint8_t *count_masks, uint64_t *count_bitmasks,
+                                      uint64_t **block_bitplanes, uint8_t **genotype_permutations,
+                                      uint8_t **block_masks, prefix_masks_cache *prefix_cache, masks_info info, 
+                                      int *counts_aff, int *counts_unaff) {
+    // Get masks or bitplanes (depending on the representation in use) of a row of combinations
+    uint8_t *combination_masks[info.num_combinations_in_a_row * order];
+    uint64_t *combination_bitplanes[info.num_combinations_in_a_row * order];
     for (int c = 0; c < num_combinations; c++) {
         for (int s = 0; s < order; s++) {
             // Derive combination address from block
-            combination_genotypes[c * order + s] = block_genotypes[s] +
-                                                    (combs[c * order + s] % stride) * info.num_samples_with_padding;
+            int snp_in_block = combs[c * order + s] % stride;
+            if (block_bitplanes) {
+                combination_bitplanes[c * order + s] = block_bitplanes[s] + snp_in_block * info.num_words_per_snp;
+            } else {
+                combination_masks[c * order + s] = block_masks[s] + snp_in_block * NUM_GENOTYPES * info.num_samples_with_padding;
+            }
         }
     }
 
-    set_genotypes_masks(order, combination_genotypes, num_combinations, masks, info); // Grouped by SNP
-
-    // Get counts for the provided genotypes
-    combination_counts_all_folds(order, fold_masks, num_folds, genotype_permutations, masks, info, counts_aff, counts_unaff);
+    if (prefix_cache) {
+        // Combine the cached masks of the first order-1 SNPs with the last one, like an order 2 combination
+        uint8_t *pair_planes[info.num_combinations_in_a_row * 2];
+        for (int c = 0; c < num_combinations; c++) {
+            uint8_t *prefix_snps[order];
+            for (int s = 0; s < order; s++) {
+                prefix_snps[s] = block_bitplanes ? (uint8_t*) combination_bitplanes[c * order + s] : combination_masks[c * order + s];
+            }
+            pair_planes[c * 2] = prefix_masks_cache_get(prefix_snps, prefix_cache);
+            pair_planes[c * 2 + 1] = prefix_snps[order - 1];
+        }
+        
+        if (block_bitplanes) {
+            combination_counts_all_folds_bitplanes(2, num_combinations, count_bitmasks, num_count_masks, prefix_cache->pair_permutations, 
+                                                   (uint64_t**) pair_planes, info, counts_aff, counts_unaff);
+        } else {
+            combination_counts_all_folds_cached(2, num_combinations, count_masks, num_count_masks, prefix_cache->pair_permutations, 
+                                                pair_planes, info, counts_aff, counts_unaff);
+        }
+    } else if (block_bitplanes) {
+        combination_counts_all_folds_bitplanes(order, num_combinations, count_bitmasks, num_count_masks, genotype_permutations, 
+                                               combination_bitplanes, info, counts_aff, counts_unaff);
+    } else {
+        combination_counts_all_folds_cached(order, num_combinations, count_masks, num_count_masks, genotype_permutations, 
+                                            combination_masks, info, counts_aff, counts_unaff);
+    }
+}
 
-    // TODO Right now the rest of the pipeline is executed as it previously was, but for the sake of parallelization
-    // it could be better to make the choose_high_risk_combinations function work over several combinations
+/**
+ * Removes from a row the combinations that can't enter the ranking of any fold, bounding their evaluation 
+ * with their counts over all samples. Returns the number of combinations left, which are moved to the 
+ * front of the row.
+ */
+static int prune_set_of_combinations(int num_combinations, int *combs, int order, int stride, 
+                                     int num_folds, uint8_t *fold_masks, unsigned int *training_sizes,
+                                     uint64_t **block_bitplanes, uint64_t *fold_bitmasks,
+                                     uint8_t **genotype_permutations, uint8_t **block_masks, prefix_masks_cache *prefix_cache, 
+                                     enum eval_function function, masks_info info, int *counts_aff, int *counts_unaff, 
+                                     model_ranking **ranking_risky_local) {
+    // Nothing can be pruned until all rankings are full
     for (int f = 0; f < num_folds; f++) {
-        // Get high risk pairs for those counts
-        void *aux_info;
-        unsigned int num_risky[info.num_combinations_in_a_row];
-        memset(num_risky, 0, info.num_combinations_in_a_row * sizeof(int));
-
-        int *risky_idx = choose_high_risk_combinations2(counts_aff + f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination,
-                                                        counts_unaff + f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination,
-                                                        info.num_combinations_in_a_row, info.num_cell_counts_per_combination,
-                                                        info.num_affected, info.num_unaffected,
-                                                        num_risky, &aux_info, mdr_high_risk_combinations2);
-
-/*
-        printf("num risky = { ");
-        for (int rc = 0; rc < info.num_combinations_in_a_row; rc++) {
-            printf("%d ", num_risky[rc]);
+        if (ranking_risky_local[f]->threshold == -INFINITY) {
+            return num_combinations;
         }
-        printf("}\n");
-
-        printf("risky gts = { ");
-        for (int rc = 0; rc < info.num_combinations_in_a_row * info.num_counts_per_combination; rc++) {
-            printf("%d ", risky_idx[rc]);
+    }
+    
+    // Only the mask of all samples, placed after the folds
+    count_set_of_combinations(num_combinations, combs, order, stride, 1, 
+                              fold_masks ? fold_masks + num_folds * info.num_samples_with_padding : NULL, 
+                              fold_bitmasks ? fold_bitmasks + num_folds * info.num_words_per_bitplane : NULL, 
+                              block_bitplanes, genotype_permutations, block_masks, prefix_cache, info, counts_aff, counts_unaff);
+    
+    int num_left = 0;
+    for (int c = 0; c < num_combinations; c++) {
+        int *all_counts_aff = counts_aff + c * info.num_cell_counts_per_combination;
+        int *all_counts_unaff = counts_unaff + c * info.num_cell_counts_per_combination;
+        
+        // The margin covers the rounding of the evaluation, which is computed in a different order
+        bool accepted = false;
+        for (int f = 0; f < num_folds && !accepted; f++) {
+            double bound = model_upper_bound(all_counts_aff, all_counts_unaff, function, training_sizes + 3 * f + 1, info);
+            accepted = model_ranking_accepts(ranking_risky_local[f], bound + 1e-9);
         }
-        printf("}\n");
-*/
+        
+        if (accepted) {
+            memmove(combs + num_left * order, combs + c * order, order * sizeof(int));
+            num_left++;
+        }
+    }
+    
+    return num_left;
+}
 
-        int risky_begin_idx = 0;
+/**
+ * Classifies the genotype permutations of a row of combinations in all folds, and inserts the best models in 
+ * the rankings. Counts are laid out as fold, combination, permutation, followed by the counts over all samples.
+ */
+static void rank_set_of_combinations(int num_combinations, int *combs, int order, int num_folds, 
+                                     int num_affected, int num_unaffected, unsigned int *training_sizes, unsigned int *testing_sizes,
+                                     uint8_t **genotype_permutations, enum eval_function function, enum evaluation_subset subset, 
+                                     masks_info info, int *counts_aff, int *counts_unaff, uint64_t *risk_masks, 
+                                     unsigned int conf_matrix[4], model_ranking **ranking_risky_local, risky_combination **risky_scratch) {
+    // Classify the genotype permutations of all folds at once
+    mdr_high_risk_masks(counts_aff, counts_unaff, num_folds * info.num_combinations_in_a_row, info.num_cell_counts_per_combination,
+                        num_affected, num_unaffected, risk_masks);
+    
+    for (int f = 0; f < num_folds; f++) {
         for (int rc = 0; rc < num_combinations; rc++) {
             int *comb = combs + rc * order;
-            uint8_t **my_genotypes = combination_genotypes + rc * order;
+            uint64_t *risk_mask = risk_masks + (f * info.num_combinations_in_a_row + rc) * info.num_words_per_risk_mask;
+            
+            // Check the model against the testing dataset, deriving its confusion matrix from the counts
+            size_t counts_offset = (f * info.num_combinations_in_a_row + rc) * info.num_cell_counts_per_combination;
+            size_t all_counts_offset = (num_folds * info.num_combinations_in_a_row + rc) * info.num_cell_counts_per_combination;
+            double accuracy = test_model_counts(risk_mask, counts_aff + counts_offset, counts_unaff + counts_offset, 
+                                                counts_aff + all_counts_offset, counts_unaff + all_counts_offset, function, subset, 
+                                                training_sizes + 3 * f + 1, testing_sizes + 3 * f + 1, info, conf_matrix);
+            
+            // The record of the model is only filled if it enters the ranking
+            if (!model_ranking_accepts(ranking_risky_local[f], accuracy)) {
+                continue;
+            }
+            
+            // Put together the info about the SNP combination and its genotype combinations, 
+            // reusing the record of the last one that was not inserted in the ranking
+            risky_combination *risky_comb;
+            if (*risky_scratch) {
+                risky_comb = risky_combination_copy(order, comb, genotype_permutations, risk_mask, NULL, info, *risky_scratch);
+            } else {
+                risky_comb = risky_combination_new(order, comb, genotype_permutations, risk_mask, NULL, info);
+            }
+            risky_comb->accuracy = accuracy;
+            
+            // The record of the model left out of the ranking (the one this replaced) is reused by the next combination
+            *risky_scratch = model_ranking_insert(ranking_risky_local[f], risky_comb);
+        }
+    }
+}
 
-            // ------------------- BEGIN get_model_from_combination_in_fold -----------------------
+void process_set_of_combinations(int num_combinations, int *combs, int order, int stride, 
+                                 int num_folds, uint8_t *fold_masks, unsigned int *training_sizes, unsigned int *testing_sizes,
+                                 epistasis_phenotypes *phenotypes, uint64_t **block_bitplanes, uint64_t *fold_bitmasks,
+                                 uint8_t **genotype_permutations,
+                                 uint8_t **block_masks, prefix_masks_cache *prefix_cache, bool prune,
+                                 enum eval_function function, enum evaluation_subset subset, masks_info info, 
+                                 int *counts_aff, int *counts_unaff, uint64_t *risk_masks, unsigned int conf_matrix[4], 
+                                 model_ranking **ranking_risky_local, risky_combination **risky_scratch) {
+    if (prune) {
+        num_combinations = prune_set_of_combinations(num_combinations, combs, order, stride, num_folds, fold_masks, training_sizes, 
+                                                     block_bitplanes, fold_bitmasks, genotype_permutations, block_masks, prefix_cache, 
+                                                     function, info, counts_aff, counts_unaff, ranking_risky_local);
+        if (!num_combinations) {
+            return;
+        }
+    }
+    
+    // Get counts for the provided genotypes, in each fold and (with the last mask) in all samples, 
+    // followed by the same counts restricted to the cases and to the controls of each phenotype
+    int num_phenotypes = phenotypes ? phenotypes->num_phenotypes : 0;
+    count_set_of_combinations(num_combinations, combs, order, stride, (1 + 2 * num_phenotypes) * (num_folds + 1), fold_masks, fold_bitmasks, 
+                              block_bitplanes, genotype_permutations, block_masks, prefix_cache, info, counts_aff, counts_unaff);
+    
+    rank_set_of_combinations(num_combinations, combs, order, num_folds, info.num_affected, info.num_unaffected, 
+                             training_sizes, testing_sizes, genotype_permutations, function, subset, info, 
+                             counts_aff, counts_unaff, risk_masks, conf_matrix, ranking_risky_local, risky_scratch);
+    
+    for (int p = 0; p < num_phenotypes; p++) {
+        // The cases (or controls) of a phenotype can be in both groups of the main one, so their counts are merged 
+        // into the counts of the cases, which then are ranked like the ones of the main phenotype
+        size_t group_len = (num_folds + 1) * info.num_combinations_in_a_row * info.num_cell_counts_per_combination;
+        int *cases_aff = counts_aff + (1 + 2 * p) * group_len, *cases_unaff = counts_unaff + (1 + 2 * p) * group_len;
+        int *controls_aff = cases_aff + group_len, *controls_unaff = cases_unaff + group_len;
+        for (int m = 0; m <= num_folds; m++) {
+            for (int i = 0; i < num_combinations * info.num_cell_counts_per_combination; i++) {
+                size_t offset = m * info.num_combinations_in_a_row * info.num_cell_counts_per_combination + i;
+                cases_aff[offset] += cases_unaff[offset];
+                cases_unaff[offset] = controls_aff[offset] + controls_unaff[offset];
+            }
+        }
+        
+        rank_set_of_combinations(num_combinations, combs, order, num_folds, phenotypes->num_affected[p], phenotypes->num_unaffected[p], 
+                                 training_sizes + 3 * (p + 1) * num_folds, testing_sizes + 3 * (p + 1) * num_folds, 
+                                 genotype_permutations, function, subset, info, cases_aff, cases_unaff, risk_masks, conf_matrix, 
+                                 ranking_risky_local + (p + 1) * num_folds, risky_scratch);
+    }
+}
 
-            risky_combination *risky_comb = NULL;
 
-            // Filter non-risky SNP combinations
-            if (num_risky > 0) {
-                // Put together the info about the SNP combination and its genotype combinations
-                risky_comb = risky_combination_new(order, comb, genotype_permutations,
-                                                    num_risky[rc], risky_idx + risky_begin_idx,
-                                                    aux_info, info);
-            }
+/**
+ * Gets the entry of the cache that stores a block coordinate, or loads it into the least recently used 
+ * entry not used by the current block. Returns whether the coordinate was loaded.
+ */
+static bool block_cache_get(int block_coord, uint8_t *genotypes, size_t num_variants, int stride, masks_info info, 
+                            uint8_t *scratchpad, block_cache *cache, uint8_t **planes) {
+    for (int e = 0; e < cache->num_entries; e++) {
+        if (cache->coords[e] == block_coord) {
+            cache->last_use[e] = cache->num_uses;
+            cache->num_hits++;
+            *planes = cache->planes[e];
+            return false;
+        }
+    }
+    
+    // Entries used by the current block are never evicted, and there is always one more entry than coordinates
+    int entry = -1;
+    for (int e = 0; e < cache->num_entries; e++) {
+        if (cache->last_use[e] < cache->num_uses && (entry < 0 || cache->last_use[e] < cache->last_use[entry])) {
+            entry = e;
+        }
+    }
+    cache->coords[entry] = block_coord;
+    cache->last_use[entry] = cache->num_uses;
+    cache->num_misses++;
+    
+    // The last block can contain less than 'stride' SNPs
+    int num_samples = info.num_affected + info.num_unaffected;
+    int num_snps = MIN(stride, num_variants - (size_t) block_coord * stride);
+    uint8_t *block_genotypes = get_genotypes_of_block_coord(num_variants, num_samples, info, stride, block_coord, 
+                                                            genotypes + (size_t) block_coord * stride * num_samples, scratchpad);
+    if (cache->use_bitplanes) {
+        set_genotypes_bitplanes(num_snps, block_genotypes, info, (uint64_t*) cache->planes[entry]);
+    } else {
+        set_block_genotypes_masks(num_snps, block_genotypes, info, cache->planes[entry]);
+    }
+    
+    *planes = cache->planes[entry];
+    return true;
+}
 
-            risky_begin_idx += num_risky[rc];
+int get_planes_of_block(int order, int *block_coords, uint8_t *genotypes, uint64_t *dataset_bitplanes, size_t num_variants, 
+                        int stride, masks_info info, epistasis_workspace *workspace, uint8_t **block_masks, uint64_t **block_bitplanes) {
+    // Bitplanes precomputed in the dataset don't need any transformation
+    if (dataset_bitplanes) {
+        for (int m = 0; m < order; m++) {
+            block_bitplanes[m] = dataset_bitplanes + (size_t) block_coords[m] * stride * info.num_words_per_snp;
+        }
+        return 0;
+    }
+    
+    block_cache *cache = workspace->block_cache;
+    cache->num_uses++;
+    
+    // Repeated coordinates are found in the cache, so they are loaded only once
+    int num_loaded = 0;
+    for (int m = 0; m < order; m++) {
+        uint8_t *planes;
+        num_loaded += block_cache_get(block_coords[m], genotypes, num_variants, stride, info, workspace->scratchpad, cache, &planes);
+        if (cache->use_bitplanes) {
+            block_bitplanes[m] = (uint64_t*) planes;
+        } else {
+            block_masks[m] = planes;
+        }
+    }
+    
+    return num_loaded;
+}
 
-            // ------------------- END get_model_from_combination_in_fold -----------------------
 
-            if (risky_comb) {
-                // Check the model against the testing dataset
-                double accuracy = test_model(order, risky_comb, my_genotypes, fold_masks + f * info.num_samples_with_padding, subset, 
-                                             training_sizes + 3 * f + 1, testing_sizes + 3 * f + 1, info, conf_matrix);
-//               printf("*  Balanced accuracy: %.3f\n", accuracy);
+epistasis_workspace *epistasis_workspace_new(int order, int stride, int num_folds, int num_phenotypes, int max_ranking_size, 
+                                             int use_bitplanes, int pack_bitplanes, masks_info info) {
+    epistasis_workspace *workspace = calloc(1, sizeof(epistasis_workspace));
+    workspace->order = order;
+    workspace->num_folds = num_folds;
+    workspace->num_phenotypes = num_phenotypes;
+    
+    // Masks (or bitplanes) of the last block coordinates, one more than needed by a block
+    if (!use_bitplanes || pack_bitplanes) {
+        workspace->scratchpad = _mm_malloc(stride * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+        
+        block_cache *cache = workspace->block_cache = calloc(1, sizeof(block_cache));
+        cache->num_entries = order + 1;
+        cache->use_bitplanes = use_bitplanes;
+        size_t planes_size = use_bitplanes ? stride * info.num_words_per_snp * sizeof(uint64_t) : 
+                                             stride * NUM_GENOTYPES * info.num_samples_with_padding * sizeof(uint8_t);
+        cache->coords = malloc(cache->num_entries * sizeof(int));
+        cache->last_use = calloc(cache->num_entries, sizeof(uint64_t));
+        cache->planes = malloc(cache->num_entries * sizeof(uint8_t*));
+        for (int e = 0; e < cache->num_entries; e++) {
+            cache->coords[e] = -1;
+            cache->planes[e] = _mm_malloc(planes_size, KERNEL_MAX_VECTOR_WIDTH);
+        }
+    }
+    
+    if (order >= 3) {
+        workspace->prefix_cache = malloc(sizeof(prefix_masks_cache));
+        prefix_masks_cache_init(order, use_bitplanes ? info.num_words_per_bitplane * sizeof(uint64_t) : info.num_samples_with_padding, 
+                                info, workspace->prefix_cache);
+    }
+    
+    // Counts per genotype combination
+    // Grouped by fold, then combination, then permutation, so there is spatial locality when getting confusion matrix
+    // An extra group is counted over all samples, so the counts out of each fold can be derived, 
+    // and all of them are repeated for the cases and the controls of each phenotype
+    int max_num_counts = 16 * (int) ceil(((double) info.num_cell_counts_per_combination * info.num_combinations_in_a_row * 
+                                          (1 + 2 * num_phenotypes) * (num_folds + 1)) / 16);
+    workspace->counts_aff = _mm_malloc(max_num_counts * sizeof(int), KERNEL_MAX_VECTOR_WIDTH);
+    workspace->counts_unaff = _mm_malloc(max_num_counts * sizeof(int), KERNEL_MAX_VECTOR_WIDTH);
+    workspace->risk_masks = malloc(info.num_combinations_in_a_row * num_folds * info.num_words_per_risk_mask * sizeof(uint64_t));
+    
+    workspace->rankings = malloc((1 + num_phenotypes) * num_folds * sizeof(model_ranking*));
+    for (int f = 0; f < (1 + num_phenotypes) * num_folds; f++) {
+        workspace->rankings[f] = model_ranking_new(max_ranking_size);
+    }
+    
+    return workspace;
+}
 
-                int position = add_to_model_ranking(risky_comb, max_ranking_size, ranking_risky_local[f], cmp_heap_func);
+void epistasis_workspace_free(epistasis_workspace *workspace) {
+    if (workspace->block_cache) {
+        block_cache *cache = workspace->block_cache;
+        LOG_DEBUG_F("Block coordinates found in the cache: %zu, loaded: %zu\n", cache->num_hits, cache->num_misses);
+        for (int e = 0; e < cache->num_entries; e++) {
+            _mm_free(cache->planes[e]);
+        }
+        free(cache->planes);
+        free(cache->coords);
+        free(cache->last_use);
+        free(cache);
+        _mm_free(workspace->scratchpad);
+    }
+    if (workspace->prefix_cache) {
+        prefix_masks_cache_free(workspace->prefix_cache);
+        free(workspace->prefix_cache);
+    }
+    
+    _mm_free(workspace->counts_aff);
+    _mm_free(workspace->counts_unaff);
+    free(workspace->risk_masks);
+    
+    if (workspace->risky_scratch) {
+        risky_combination_free(workspace->risky_scratch);
+    }
+    for (int f = 0; f < (1 + workspace->num_phenotypes) * workspace->num_folds; f++) {
+        model_ranking_free(workspace->rankings[f]);
+    }
+    free(workspace->rankings);
+    free(workspace);
+}
 
-                // If not inserted it means it is not among the most risky combinations, so free it
+void merge_workspace_rankings(int num_workspaces, epistasis_workspace **workspaces, int max_ranking_size, 
+                              compare_risky_heap_func cmp_heap_func, struct heap **ranking_risky) {
+    int num_folds = (1 + workspaces[0]->num_phenotypes) * workspaces[0]->num_folds;
+    
+    #pragma omp parallel for
+    for (int f = 0; f < num_folds; f++) {
+        for (int w = 0; w < num_workspaces; w++) {
+            risky_combination *risky_comb;
+            while ((risky_comb = model_ranking_take(workspaces[w]->rankings[f]))) {
+                int position = add_to_model_ranking(risky_comb, max_ranking_size, ranking_risky[f], cmp_heap_func);
                 if (position < 0) {
                     risky_combination_free(risky_comb);
                 }
             }
-
         }
-
-        free(risky_idx);
     }
 }
 
@@ -98,6 +368,12 @@ struct heap* merge_rankings(int num_folds, struct heap **ranking_risky, compare_
     for (int i = 0; i < num_folds; i++) {
         repetition_ranking_size += ranking_risky[i]->size;
     }
+    
+    // No model could be evaluated, for example when a phenotype has no cases
+    struct heap *sorted_repetition_ranking = malloc(sizeof(struct heap)); heap_init(sorted_repetition_ranking);
+    if (!repetition_ranking_size) {
+        return sorted_repetition_ranking;
+    }
     risky_combination *repetition_ranking[repetition_ranking_size];
     size_t current_index = 0;
 
@@ -128,7 +404,6 @@ struct heap* merge_rankings(int num_folds, struct heap **ranking_risky, compare_
     qsort(repetition_ranking, repetition_ranking_size, sizeof(risky_combination*), compare_risky);
 
     // Sum all values of each position and get the mean of accuracies
-    struct heap *sorted_repetition_ranking = malloc(sizeof(struct heap)); heap_init(sorted_repetition_ranking);
     risky_combination *current = repetition_ranking[0];
 
     for (int i = 1; i < repetition_ranking_size; i++) {
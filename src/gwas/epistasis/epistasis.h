@@ -44,14 +44,19 @@
 #include <math/math_utils.h>
 
 #include "error.h"
+#include "hpg_variant_utils.h"
 #include "shared_options.h"
 
+#include "kernels.h"
 #include "model.h"
+#include "permutation.h"
+#include "phenotype.h"
+#include "prefilter.h"
 
 /**
  * Number of options applicable to the epistasis tool.
  */
-#define NUM_EPISTASIS_OPTIONS  7
+#define NUM_EPISTASIS_OPTIONS  19
 
 KHASH_MAP_INIT_STR(cvc, int);
 
@@ -67,6 +72,24 @@ typedef struct epistasis_options {
     struct arg_int *max_ranking_size;
     struct arg_str *evaluation_subset;
     struct arg_str *evaluation_mode;
+    struct arg_lit *use_bitplanes;
+    struct arg_lit *fuse_cv_repetitions;
+    struct arg_int *checkpoint_interval;
+    struct arg_lit *resume;
+    struct arg_lit *dynamic_blocks;
+    struct arg_str *evaluation_function;
+    struct arg_int *num_permutations;
+    struct arg_int *num_prefilter_snps;
+    struct arg_lit *auto_tune;
+    struct arg_lit *prune;
+    struct arg_int *beam_width;
+    
+    // Flags read from the configuration file, as parsing the command-line resets the count of the arg_lit
+    int config_bitplanes;
+    int config_fuse_cv_repetitions;
+    int config_dynamic_blocks;
+    int config_auto_tune;
+    int config_prune;
 } epistasis_options_t;
 
 /**
@@ -84,6 +107,17 @@ typedef struct epistasis_options_data {
     int max_ranking_size;
     enum evaluation_subset eval_subset;
     enum evaluation_mode eval_mode;
+    int use_bitplanes;          /**< Whether genotypes are packed into bitplanes instead of byte masks. */
+    int fuse_cv_repetitions;    /**< Whether all cross-validation repetitions are evaluated in a single sweep. */
+    int checkpoint_interval;    /**< Seconds between checkpoints of the progress, 0 for disabling them. */
+    int resume;                 /**< Whether to resume the search from the last checkpoint. */
+    int dynamic_blocks;         /**< Whether blocks are handed out to MPI processes on request instead of split up front. */
+    enum eval_function eval_function;   /**< Function the models are ranked by. */
+    int num_permutations;       /**< Permutations of the phenotypes used for the p-values of the best models, 0 for none. */
+    int num_prefilter_snps;     /**< SNPs with the strongest marginal effect the search is restricted to, 0 for all. */
+    int auto_tune;              /**< Whether the stride and combinations per row are chosen by timing them on this machine. */
+    int prune;                  /**< Whether combinations that can't enter the rankings are discarded before counting the folds. */
+    int beam_width;             /**< Combinations of each order kept by the heuristic search, 0 for the exhaustive one. */
 } epistasis_options_data_t;
 
 
@@ -153,13 +187,109 @@ int verify_epistasis_options(epistasis_options_t *epistasis_options, shared_opti
  *               Epistasis execution            *
  * **********************************************/
 
+/**
+ * @brief Masks (or bitplanes) of the last block coordinates processed by a thread.
+ * @details Masks (or bitplanes) of the last block coordinates processed by a thread. Consecutive blocks of a 
+ * thread usually share all coordinates but the last one, so only the SNPs of a coordinate have to be padded and 
+ * transformed again. The least recently used entry is replaced when a coordinate is not found.
+ */
+typedef struct {
+    int num_entries;
+    int use_bitplanes;                  /**< Whether entries store bitplanes instead of byte masks */
+    int *coords;                        /**< Block coordinate stored in each entry, -1 if empty */
+    uint64_t *last_use;                 /**< Last block each entry was used by */
+    uint64_t num_uses;                  /**< Blocks requested so far */
+    uint8_t **planes;                   /**< Masks (or bitplanes) of the SNPs of each entry */
+    size_t num_hits;
+    size_t num_misses;
+} block_cache;
+
+/**
+ * @brief Buffers a thread needs for processing blocks of combinations.
+ * @details Buffers a thread needs for processing blocks of combinations. They are allocated once per run and 
+ * reused by every block the thread processes. The thread also keeps its own rankings, which are merged with 
+ * the rest only once all blocks of a repetition have been processed.
+ */
+typedef struct {
+    int order;
+    int num_folds;
+    int num_phenotypes;                 /**< Phenotypes evaluated besides the main one */
+    uint8_t *scratchpad;                /**< Genotypes of a block coordinate, padded */
+    block_cache *block_cache;           /**< Masks (or bitplanes) of the last block coordinates, NULL if stored in the dataset */
+    prefix_masks_cache *prefix_cache;   /**< Masks of the first SNPs of each combination, NULL for order 2 */
+    int *counts_aff;
+    int *counts_unaff;
+    uint64_t *risk_masks;               /**< High risk genotype permutations of each combination and fold */
+    risky_combination *risky_scratch;   /**< Record reused by the combinations that don't enter the rankings */
+    model_ranking **rankings;           /**< Best combinations found by the thread in each fold, of each phenotype */
+} epistasis_workspace;
+
+/**
+ * @brief Allocates the buffers a thread needs for processing blocks of combinations.
+ * 
+ * @param num_phenotypes Phenotypes evaluated besides the main one, each one with its own rankings
+ * @param use_bitplanes Whether genotypes are packed into bitplanes instead of byte masks
+ * @param pack_bitplanes Whether bitplanes are packed at runtime (not when they are stored in the dataset)
+ **/
+epistasis_workspace *epistasis_workspace_new(int order, int stride, int num_folds, int num_phenotypes, int max_ranking_size, 
+                                             int use_bitplanes, int pack_bitplanes, masks_info info);
+
+void epistasis_workspace_free(epistasis_workspace *workspace);
+
+/**
+ * @brief Merges the rankings of all threads into the global rankings of a repetition.
+ * @details Merges the rankings of all threads into the global rankings of a repetition. Must be called once 
+ * all blocks have been processed. Folds are merged in parallel, as they are independent. Rankings of the 
+ * workspaces are left empty, ready for the next repetition.
+ **/
+void merge_workspace_rankings(int num_workspaces, epistasis_workspace **workspaces, int max_ranking_size, 
+                              compare_risky_heap_func cmp_heap_func, struct heap **ranking_risky);
+
+/**
+ * @brief Evaluates a row of combinations in all folds, and inserts the best models in the rankings of the thread.
+ * @details Evaluates a row of combinations in all folds, and inserts the best models in the rankings of the thread. 
+ * The masks of the folds (or their bitmasks) must be followed by a mask of all samples (see add_all_samples_mask), 
+ * so the confusion matrices can be derived from the counts of each genotype permutation. The masks of the folds 
+ * are not needed (can be NULL) when counting over bitplanes.
+ * 
+ * When pruning, the combinations are counted over all samples first, and those whose upper bound (see 
+ * model_upper_bound) can't enter the ranking of any fold are not counted in the folds. The rankings are the 
+ * same as without pruning, and the combinations left are moved to the front of combs. Pruning pays off with many 
+ * folds and short rankings, once a few models stand out; otherwise counting all samples first is an overhead.
+ * 
+ * When other phenotypes are evaluated, the masks are the ones returned by get_phenotype_masks, and the sizes 
+ * and rankings of their folds follow the ones of the main phenotype. All of them are counted at once, so the 
+ * SNPs of each combination are only combined once.
+ * 
+ * @param phenotypes Phenotypes evaluated besides the main one, NULL for none. Not compatible with pruning
+ * @param prune Whether to prune the combinations, only if model_upper_bound_available
+ **/
 void process_set_of_combinations(int num_combinations, int *combs, int order, int stride, 
-                                 int num_folds, uint8_t *fold_masks, int *training_sizes, int *testing_sizes,
-                                 uint8_t **block_genotypes, uint8_t **genotype_permutations,
-                                 uint8_t *masks, enum evaluation_subset subset, masks_info info, 
-                                 compare_risky_heap_func cmp_heap_func,
-                                 int *counts_aff, int *counts_unaff, unsigned int conf_matrix[4], 
-                                 int max_ranking_size, struct heap **ranking_risky_local);
+                                 int num_folds, uint8_t *fold_masks, unsigned int *training_sizes, unsigned int *testing_sizes,
+                                 epistasis_phenotypes *phenotypes, uint64_t **block_bitplanes, uint64_t *fold_bitmasks,
+                                 uint8_t **genotype_permutations,
+                                 uint8_t **block_masks, prefix_masks_cache *prefix_cache, bool prune,
+                                 enum eval_function function, enum evaluation_subset subset, masks_info info, 
+                                 int *counts_aff, int *counts_unaff, uint64_t *risk_masks, unsigned int conf_matrix[4], 
+                                 model_ranking **ranking_risky_local, risky_combination **risky_scratch);
+
+/**
+ * @brief Gets the masks (or bitplanes) of the blocks being tested.
+ * @details Gets the masks (or bitplanes) of the blocks being tested, so the masks of each SNP are generated once 
+ * per block instead of once per combination. Coordinates already in the cache of the workspace (such as the ones 
+ * shared with the previous block, or repeated in the same block) are not loaded again. Bitplanes stored in the 
+ * dataset are referenced directly.
+ * 
+ * @param block_coords Coordinates of the blocks
+ * @param genotypes Genotypes of the dataset, num_samples per SNP
+ * @param dataset_bitplanes Bitplanes stored in the dataset, NULL if not available
+ * @param workspace Workspace of the calling thread
+ * @param[out] block_masks Masks of each block, when using byte masks
+ * @param[out] block_bitplanes Bitplanes of each block, when using bitplanes
+ * @return Number of coordinates loaded into the cache, which replace the masks of previous blocks
+ **/
+int get_planes_of_block(int order, int *block_coords, uint8_t *genotypes, uint64_t *dataset_bitplanes, size_t num_variants, 
+                        int stride, masks_info info, epistasis_workspace *workspace, uint8_t **block_masks, uint64_t **block_bitplanes);
 
 struct heap* merge_rankings(int num_folds, struct heap **ranking_risky, compare_risky_heap_func heap_min_func, compare_risky_heap_func heap_max_func);
 
@@ -170,7 +300,31 @@ int compare_risky(const void *risky_1, const void *risky_2);
  *                  Final report                *
  * **********************************************/
 
-void epistasis_report(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, 
-                      struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, FILE *fd);
+/**
+ * @brief Writes the best models of a cross-validation repetition.
+ * @details Writes the best models of a cross-validation repetition. If a permutation test is provided, each model 
+ * is fitted again with all samples, and its evaluation and p-value are written too.
+ *
+ * @param function Function the models were evaluated with
+ * @param beam_width Combinations of each order kept by the heuristic search, 0 if the search was exhaustive
+ * @param permutations Permutation test of the significance of the models, NULL for not testing them
+ * @param snp_indexes Position in the dataset of each SNP searched, NULL if all of them were
+ **/
+void epistasis_report(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, enum eval_function function,
+                      int beam_width, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, 
+                      permutation_test *permutations, int *snp_indexes, FILE *fd);
+
+/**
+ * @brief Writes the best models of a cross-validation repetition for each phenotype besides the main one.
+ * @details Writes the best models of a cross-validation repetition for each phenotype besides the main one, 
+ * each of them to its own file. Their rankings are merged and emptied like the ones of the main phenotype.
+ *
+ * @param num_sweep_folds Folds evaluated in each sweep, between the rankings of consecutive phenotypes
+ * @param ranking_risky Rankings of the folds of the repetition, for the main phenotype
+ **/
+void epistasis_report_phenotypes(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, 
+                                 enum eval_function function, epistasis_phenotypes *phenotypes, int num_folds, int num_sweep_folds, 
+                                 struct heap **ranking_risky, int max_ranking_size, compare_risky_heap_func cmp_heap_min, 
+                                 compare_risky_heap_func cmp_heap_max, int *snp_indexes, shared_options_data_t *shared_options_data);
 
 #endif
@@ -95,6 +95,98 @@ int read_epistasis_configuration(const char *filename, epistasis_options_t *epis
                    *(epistasis_options->evaluation_mode->sval), strlen(*(epistasis_options->evaluation_mode->sval)));
     }
 
+    // Read whether genotypes will be packed into bitplanes
+    int use_bitplanes;
+    ret_code = config_lookup_bool(config, "gwas.epistasis.bitplanes", &use_bitplanes);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Genotypes representation not found in configuration file, must be set via command-line\n");
+    } else {
+        epistasis_options->config_bitplanes = use_bitplanes;
+        LOG_DEBUG_F("bitplanes = %d\n", use_bitplanes);
+    }
+
+    // Read whether all cross-validation repetitions will be run in a single sweep
+    int fuse_cv_repetitions;
+    ret_code = config_lookup_bool(config, "gwas.epistasis.fuse-cv-runs", &fuse_cv_repetitions);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Whether to fuse cross-validation runs not found in configuration file, must be set via command-line\n");
+    } else {
+        epistasis_options->config_fuse_cv_repetitions = fuse_cv_repetitions;
+        LOG_DEBUG_F("fuse-cv-runs = %d\n", fuse_cv_repetitions);
+    }
+
+    // Read the number of seconds between checkpoints of the progress
+    ret_code = config_lookup_int(config, "gwas.epistasis.checkpoint-interval", epistasis_options->checkpoint_interval->ival);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Interval between checkpoints not found in configuration file, must be set via command-line\n");
+    } else {
+        LOG_DEBUG_F("checkpoint-interval = %ld\n", *(epistasis_options->checkpoint_interval->ival));
+    }
+
+    // Read whether blocks will be distributed among MPI processes on request
+    int dynamic_blocks;
+    ret_code = config_lookup_bool(config, "gwas.epistasis.dynamic-blocks", &dynamic_blocks);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Distribution of blocks among processes not found in configuration file, must be set via command-line\n");
+    } else {
+        epistasis_options->config_dynamic_blocks = dynamic_blocks;
+        LOG_DEBUG_F("dynamic-blocks = %d\n", dynamic_blocks);
+    }
+
+    // Read the function the models will be ranked by
+    ret_code = config_lookup_string(config, "gwas.epistasis.evaluation-function", &tmp_string);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Evaluation function not found in configuration file, must be set via command-line\n");
+    } else {
+        *(epistasis_options->evaluation_function->sval) = strdup(tmp_string);
+        LOG_DEBUG_F("evaluation function = %s (%zu chars)\n",
+                   *(epistasis_options->evaluation_function->sval), strlen(*(epistasis_options->evaluation_function->sval)));
+    }
+
+    // Read the number of permutations used for testing the significance of the best models
+    ret_code = config_lookup_int(config, "gwas.epistasis.num-permutations", epistasis_options->num_permutations->ival);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Number of permutations not found in configuration file, must be set via command-line\n");
+    } else {
+        LOG_DEBUG_F("num-permutations = %ld\n", *(epistasis_options->num_permutations->ival));
+    }
+
+    // Read the number of SNPs the search is restricted to
+    ret_code = config_lookup_int(config, "gwas.epistasis.prefilter-snps", epistasis_options->num_prefilter_snps->ival);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Number of prefiltered SNPs not found in configuration file, must be set via command-line\n");
+    } else {
+        LOG_DEBUG_F("prefilter-snps = %ld\n", *(epistasis_options->num_prefilter_snps->ival));
+    }
+
+    // Read whether the stride and combinations per row will be chosen at runtime
+    int auto_tune;
+    ret_code = config_lookup_bool(config, "gwas.epistasis.auto-tune", &auto_tune);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Auto-tuning not found in configuration file, must be set via command-line\n");
+    } else {
+        epistasis_options->config_auto_tune = auto_tune;
+        LOG_DEBUG_F("auto-tune = %d\n", auto_tune);
+    }
+
+    // Read whether the combinations that can't be among the best models will be pruned
+    int prune;
+    ret_code = config_lookup_bool(config, "gwas.epistasis.prune", &prune);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Pruning not found in configuration file, must be set via command-line\n");
+    } else {
+        epistasis_options->config_prune = prune;
+        LOG_DEBUG_F("prune = %d\n", prune);
+    }
+
+    // Read the number of combinations of each order kept by the heuristic search
+    ret_code = config_lookup_int(config, "gwas.epistasis.beam-width", epistasis_options->beam_width->ival);
+    if (ret_code == CONFIG_FALSE) {
+        LOG_WARN("Beam width not found in configuration file, must be set via command-line\n");
+    } else {
+        LOG_DEBUG_F("beam-width = %ld\n", *(epistasis_options->beam_width->ival));
+    }
+
     config_destroy(config);
     free(config);
 
@@ -114,7 +206,7 @@ void **parse_epistasis_options(int argc, char *argv[], epistasis_options_t *epis
 }
 
 void **merge_epistasis_options(epistasis_options_t *epistasis_options, shared_options_t *shared_options, struct arg_end *arg_end) {
-    void **tool_options = malloc (12 * sizeof(void*));
+    void **tool_options = malloc (23 * sizeof(void*));
     // Input/output files
     tool_options[0] = epistasis_options->dataset_filename;
     tool_options[1] = shared_options->output_directory;
@@ -127,14 +219,25 @@ void **merge_epistasis_options(epistasis_options_t *epistasis_options, shared_op
     tool_options[6] = epistasis_options->evaluation_subset;
     tool_options[7] = epistasis_options->evaluation_mode;
     tool_options[8] = epistasis_options->stride;
+    tool_options[9] = epistasis_options->evaluation_function;
+    tool_options[10] = epistasis_options->num_permutations;
+    tool_options[11] = epistasis_options->num_prefilter_snps;
     
     // Configuration file
-    tool_options[9] = shared_options->config_file;
+    tool_options[12] = shared_options->config_file;
     
     // Advanced configuration
-    tool_options[10] = shared_options->num_threads;
+    tool_options[13] = shared_options->num_threads;
+    tool_options[14] = epistasis_options->use_bitplanes;
+    tool_options[15] = epistasis_options->fuse_cv_repetitions;
+    tool_options[16] = epistasis_options->checkpoint_interval;
+    tool_options[17] = epistasis_options->resume;
+    tool_options[18] = epistasis_options->dynamic_blocks;
+    tool_options[19] = epistasis_options->auto_tune;
+    tool_options[20] = epistasis_options->prune;
+    tool_options[21] = epistasis_options->beam_width;
     
-    tool_options[11] = arg_end;
+    tool_options[22] = arg_end;
     
     return tool_options;
 }
@@ -172,6 +275,13 @@ int verify_epistasis_options(epistasis_options_t *epistasis_options, shared_opti
         return EPISTASIS_EVAL_SUBSET_NOT_SPECIFIED;
     }
     
+    // Checker whether the function for evaluating the models is valid
+    if (*(epistasis_options->evaluation_function->sval) && strlen(*(epistasis_options->evaluation_function->sval)) &&
+        eval_function_from_name(*(epistasis_options->evaluation_function->sval)) < 0) {
+        LOG_ERROR("Please specify a valid function for evaluating the models (ca/ba/wba/gamma/tau-b/chi-square/likelihood-ratio).\n");
+        return EPISTASIS_EVAL_FUNCTION_NOT_VALID;
+    }
+    
     // Checker whether the number of SNPs per block partition of the dataset
     if (*(epistasis_options->stride->ival) == 0) {
         LOG_ERROR("Please specify the number of SNPs per block partition of the dataset.\n");
@@ -20,18 +20,50 @@
 
 #include "epistasis.h"
 #include "model.h"
+#include "permutation.h"
 
-static void show_cross_validation_arguments(int cv_repetition, int order, enum evaluation_mode mode, enum evaluation_subset subset, FILE *fd);
-static void show_cross_validation_best_models(int order, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, FILE *fd);
+static void show_cross_validation_arguments(int cv_repetition, int order, enum evaluation_mode mode, enum evaluation_subset subset, 
+                                            enum eval_function function, int beam_width, permutation_test *permutations, FILE *fd);
+static void show_cross_validation_best_models(int order, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, 
+                                              permutation_test *permutations, int *snp_indexes, FILE *fd);
 
 
-void epistasis_report(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, 
-                      struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, FILE *fd) {
-    show_cross_validation_arguments(cv_repetition, order, mode, subset, fd);
-    show_cross_validation_best_models(order, best_models, max_ranking_size, cmp_heap_max, fd);
+void epistasis_report(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, enum eval_function function,
+                      int beam_width, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, 
+                      permutation_test *permutations, int *snp_indexes, FILE *fd) {
+    show_cross_validation_arguments(cv_repetition, order, mode, subset, function, beam_width, permutations, fd);
+    show_cross_validation_best_models(order, best_models, max_ranking_size, cmp_heap_max, permutations, snp_indexes, fd);
 }
 
-static void show_cross_validation_arguments(int cv_repetition, int order, enum evaluation_mode mode, enum evaluation_subset subset, FILE *fd) {
+void epistasis_report_phenotypes(int order, int cv_repetition, enum evaluation_mode mode, enum evaluation_subset subset, 
+                                 enum eval_function function, epistasis_phenotypes *phenotypes, int num_folds, int num_sweep_folds, 
+                                 struct heap **ranking_risky, int max_ranking_size, compare_risky_heap_func cmp_heap_min, 
+                                 compare_risky_heap_func cmp_heap_max, int *snp_indexes, shared_options_data_t *shared_options_data) {
+    for (int p = 0; p < phenotypes->num_phenotypes; p++) {
+        // The rankings of each phenotype are laid out like the ones of the main phenotype, after them
+        struct heap *best_models = merge_rankings(num_folds, ranking_risky + (p + 1) * num_sweep_folds, cmp_heap_min, cmp_heap_max);
+        
+        char *path, default_path[EPISTASIS_DATASET_PHENOTYPE_NAME_LEN + 32];
+        sprintf(default_path, "hpg-variant.%s.cv%d.epi", phenotypes->names[p], cv_repetition+1);
+        FILE *fd = get_output_file(shared_options_data, default_path, &path);
+        fprintf(fd, "#PHENOTYPE: %s\n", phenotypes->names[p]);
+        epistasis_report(order, cv_repetition, mode, subset, function, 0, best_models, max_ranking_size, cmp_heap_max, 
+                         NULL, snp_indexes, fd);
+        fclose(fd);
+        free(path);
+        
+        // Models out of the report are not needed anymore
+        while (!heap_empty(best_models)) {
+            struct heap_node *hn = heap_take(cmp_heap_max, best_models);
+            risky_combination_free((risky_combination*) hn->value);
+            free(hn);
+        }
+        free(best_models);
+    }
+}
+
+static void show_cross_validation_arguments(int cv_repetition, int order, enum evaluation_mode mode, enum evaluation_subset subset, 
+                                            enum eval_function function, int beam_width, permutation_test *permutations, FILE *fd) {
     fprintf(fd, "#CROSS VALIDATION %d\n", cv_repetition+1);
     fprintf(fd, "#COMBINATIONS OF: %d SNPs\n", order);
     
@@ -46,23 +78,37 @@ static void show_cross_validation_arguments(int cv_repetition, int order, enum e
     } else if (subset == TESTING) {
         fprintf(fd, "#EVALUATION PARTITION: Testing\n");
     }
+    
+    fprintf(fd, "#EVALUATION FUNCTION: %s\n", eval_function_name(function));
+    if (beam_width > 0) {
+        // Not every combination was tested, so better models could exist
+        fprintf(fd, "#SEARCH: Heuristic, beam of %d combinations per order\n", beam_width);
+    }
+    if (permutations) {
+        fprintf(fd, "#PERMUTATIONS: %d\n", permutations->num_permutations);
+    }
 }
 
-static void show_cross_validation_best_models(int order, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, FILE *fd) {
+static void show_cross_validation_best_models(int order, struct heap *best_models, int max_ranking_size, compare_risky_heap_func cmp_heap_max, 
+                                              permutation_test *permutations, int *snp_indexes, FILE *fd) {
     struct heap_node *hn;
     risky_combination *element = NULL;
 
     int position = 0;
-    fprintf(fd, "#POSITION\tSNPs\tGENOTYPES\tCV-C\tCV-A\n");
+    if (permutations) {
+        fprintf(fd, "#POSITION\tSNPs\tGENOTYPES\tCV-C\tCV-A\tSTATISTIC\tP-VALUE\n");
+    } else {
+        fprintf(fd, "#POSITION\tSNPs\tGENOTYPES\tCV-C\tCV-A\n");
+    }
     while (!heap_empty(best_models) && position < max_ranking_size) {
         hn = heap_take(cmp_heap_max, best_models);
         element = (risky_combination*) hn->value;
-        // SNPs
+        // SNPs, at their position in the dataset if the search was restricted to some of them
         fprintf(fd, "%d\t(", position+1);
         for (int i = 0; i < order - 1; i++) {
-            fprintf(fd, " %d,", element->combination[i]);
+            fprintf(fd, " %d,", snp_indexes ? snp_indexes[element->combination[i]] : element->combination[i]);
         }
-        fprintf(fd, " %d )\t", element->combination[order - 1]);
+        fprintf(fd, " %d )\t", snp_indexes ? snp_indexes[element->combination[order - 1]] : element->combination[order - 1]);
         
         // Genotypes
         for (int i = 0; i < element->num_risky_genotypes; i++) {
@@ -74,7 +120,15 @@ static void show_cross_validation_best_models(int order, struct heap *best_model
         }
         
         // Counts
-        fprintf(fd, "%d\t%.3f\n", element->cross_validation_count, element->accuracy);
+        fprintf(fd, "%d\t%.3f", element->cross_validation_count, element->accuracy);
+        
+        // Significance of the model fitted with all samples
+        if (permutations) {
+            double statistic;
+            double pvalue = permutation_test_pvalue(element->combination, permutations, &statistic);
+            fprintf(fd, "\t%.3f\t%.3g", statistic, pvalue);
+        }
+        fprintf(fd, "\n");
         risky_combination_free(element);
         free(hn);
         position++;
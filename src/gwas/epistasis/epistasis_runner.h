@@ -36,14 +36,19 @@
 #include "shared_options.h"
 #include "hpg_variant_utils.h"
 
+#include "autotune.h"
+#include "beam_search.h"
 #include "cross_validation.h"
 #include "dataset.h"
 #include "epistasis.h"
 #include "model.h"
+#include "checkpoint.h"
+#include "scheduler.h"
 
 #ifdef _USE_MPI
 #include <mpi.h>
 #include "mpi/mpi_epistasis_helper.h"
+#include "mpi/block_dispatcher.h"
 #endif
 
 int run_epistasis(shared_options_data_t *global_options_data, epistasis_options_data_t* options_data);
@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <immintrin.h>
+
+#include "kernels.h"
+
+/*
+ * Only SSE4.2 is enabled for the whole application (see SConstruct), so wider kernels
+ * are compiled with a per-function target and are never called unless CPUID reports
+ * support for them.
+ */
+#define TARGET_AVX2     __attribute__((target("avx2,popcnt")))
+#define TARGET_AVX512   __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt")))
+
+
+/* **************************
+ *          SSE4.2          *
+ * **************************/
+
+static void set_genotypes_masks_sse42(int order, uint8_t **genotypes, int num_combinations, uint8_t *in_masks, masks_info info) {
+    __m128i reference_genotype; // The genotype to compare for generating a mask (of the form {0 0 0 0 ... }, {1 1 1 1 ... })
+    __m128i input_genotypes;    // Genotypes from the input dataset
+    __m128i mask;               // Comparison between the reference genotype and input genotypes
+
+    for (int c = 0; c < num_combinations; c++) {
+        uint8_t *masks = in_masks + c * info.num_masks;
+        uint8_t **combination_genotypes = genotypes + c * order;
+
+        for (int j = 0; j < order; j++) {
+            for (int i = 0; i < NUM_GENOTYPES; i++) {
+                reference_genotype = _mm_set1_epi8(i);
+
+                // Set value of masks
+                for (int k = 0; k < info.num_samples_with_padding; k += 16) {
+                    input_genotypes = _mm_load_si128(combination_genotypes[j] + k);
+                    mask = _mm_cmpeq_epi8(input_genotypes, reference_genotype);
+                    _mm_store_si128(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) + k, mask);
+                }
+
+                // Set padding with zeroes
+                memset(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) + info.num_affected,
+                    0, info.num_affected_with_padding - info.num_affected);
+                memset(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) +
+                    info.num_affected_with_padding + info.num_unaffected,
+                    0, info.num_unaffected_with_padding - info.num_unaffected);
+            }
+        }
+    }
+}
+
+static void combination_counts_all_folds_sse42(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                               uint8_t **genotype_permutations, uint8_t **masks, masks_info info,
+                                               int *counts_aff, int *counts_unaff) {
+    uint8_t *permutation;
+    int count[num_folds];
+
+    __m128i snp_and, snp_cmp, snp_result;
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint8_t **rc_masks = masks + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            permutation = genotype_permutations[c];
+
+            memset(count, 0, num_folds * sizeof(int));
+
+            for (int i = 0; i < info.num_affected; i += 16) {
+                // Aligned loading
+                snp_and = _mm_load_si128(rc_masks[0] + permutation[0] * info.num_samples_with_padding + i);
+
+                // Perform AND operation with all SNPs in the combination
+                for (int j = 1; j < order; j++) {
+                    snp_cmp = _mm_load_si128(rc_masks[j] + permutation[j] * info.num_samples_with_padding + i);
+                    snp_and = _mm_and_si128(snp_and, snp_cmp);
+                }
+
+                // Final AND with fold_masks
+                for (int f = 0; f < num_folds; f++) {
+                    snp_cmp = _mm_load_si128(fold_masks + f * info.num_samples_with_padding + i);
+                    snp_result = _mm_and_si128(snp_and, snp_cmp);
+
+                    count[f] += _mm_popcnt_u64(_mm_extract_epi64(snp_result, 0)) +
+                                _mm_popcnt_u64(_mm_extract_epi64(snp_result, 1));
+                }
+            }
+
+            // Assign to count in fold
+            for (int f = 0; f < num_folds; f++) {
+                LOG_DEBUG_F("%d) aff comb idx (%d) = %d\n", f, c, count[f]);
+                counts_aff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                           rc * info.num_cell_counts_per_combination + c] = count[f];
+            }
+
+            memset(count, 0, num_folds * sizeof(int));
+
+            for (int i = 0; i < info.num_unaffected; i += 16) {
+                // Aligned loading
+                snp_and = _mm_load_si128(rc_masks[0] + permutation[0] * info.num_samples_with_padding + info.num_affected_with_padding + i);
+
+                // Perform AND operation with all SNPs in the combination
+                for (int j = 1; j < order; j++) {
+                    snp_cmp = _mm_load_si128(rc_masks[j] + permutation[j] * info.num_samples_with_padding + info.num_affected_with_padding + i);
+                    snp_and = _mm_and_si128(snp_and, snp_cmp);
+                }
+
+                // Final AND with fold_masks
+                for (int f = 0; f < num_folds; f++) {
+                    snp_cmp = _mm_load_si128(fold_masks + f * info.num_samples_with_padding + info.num_affected_with_padding + i);
+                    snp_result = _mm_and_si128(snp_cmp, snp_and);
+
+                    count[f] += _mm_popcnt_u64(_mm_extract_epi64(snp_result, 0)) +
+                                _mm_popcnt_u64(_mm_extract_epi64(snp_result, 1));
+                }
+            }
+
+            // Assign to count in fold
+            for (int f = 0; f < num_folds; f++) {
+                LOG_DEBUG_F("%d) unaff comb idx (%d) = %d\n", f, c, count[f]);
+                counts_unaff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                           rc * info.num_cell_counts_per_combination + c] = count[f];
+            }
+        }
+    }
+}
+
+static void combination_counts_all_folds_bitplanes_sse42(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                                         uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                                         int *counts_aff, int *counts_unaff) {
+    int num_words = info.num_words_per_bitplane;
+    uint64_t snp_and[num_words];
+    int count_aff[num_folds], count_unaff[num_folds];
+    
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint64_t **rc_bitplanes = bitplanes + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            uint8_t *permutation = genotype_permutations[c];
+            
+            // AND of the bitplanes of all SNPs in the combination
+            memcpy(snp_and, rc_bitplanes[0] + permutation[0] * num_words, num_words * sizeof(uint64_t));
+            for (int j = 1; j < order; j++) {
+                uint64_t *plane = rc_bitplanes[j] + permutation[j] * num_words;
+                for (int w = 0; w < num_words; w++) {
+                    snp_and[w] &= plane[w];
+                }
+            }
+            
+            // Final AND with fold masks
+            for (int f = 0; f < num_folds; f++) {
+                uint64_t *bitmask = fold_bitmasks + f * num_words;
+                count_aff[f] = count_unaff[f] = 0;
+                for (int w = 0; w < info.num_words_affected; w++) {
+                    count_aff[f] += _mm_popcnt_u64(snp_and[w] & bitmask[w]);
+                }
+                for (int w = info.num_words_affected; w < num_words; w++) {
+                    count_unaff[f] += _mm_popcnt_u64(snp_and[w] & bitmask[w]);
+                }
+                
+                counts_aff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                           rc * info.num_cell_counts_per_combination + c] = count_aff[f];
+                counts_unaff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                             rc * info.num_cell_counts_per_combination + c] = count_unaff[f];
+            }
+        }
+    }
+}
+
+static void confusion_matrix_sse42(int order, int num_risky, uint8_t **risky_genotypes, uint8_t **genotypes,
+                                   uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2],
+                                   masks_info info, unsigned int *matrix) {
+    int num_samples = info.num_samples_with_padding;
+    // A model without risky genotypes still needs one (empty) mask to merge
+    int num_confusion_masks = (num_risky > 0) ? num_risky : 1;
+    uint8_t confusion_masks[num_confusion_masks * num_samples] __attribute__((aligned(16)));
+    memset(confusion_masks, 0, num_confusion_masks * num_samples * sizeof(uint8_t));
+
+    __m128i comb_genotypes;     // The genotype to compare for generating a mask (of the form {0 0 0 0 ... }, {1 1 1 1 ... })
+    __m128i input_genotypes;    // Genotypes from the input dataset
+    __m128i mask;               // Comparison between the reference genotype and input genotypes
+
+    // Check whether the input genotypes can be combined in any of the risky combinations
+    for (int i = 0; i < num_risky; i++) {
+        // First SNP in the combination
+        comb_genotypes = _mm_set1_epi8(risky_genotypes[i][0]);
+
+        for (int k = 0; k < num_samples; k += 16) {
+            input_genotypes = _mm_load_si128(genotypes[0] + k);
+            mask = _mm_cmpeq_epi8(input_genotypes, comb_genotypes);
+            _mm_store_si128(confusion_masks + i * num_samples + k, mask);
+        }
+
+        // Next SNPs in the combination
+        for (int j = 1; j < order; j++) {
+            comb_genotypes = _mm_set1_epi8(risky_genotypes[i][j]);
+
+            for (int k = 0; k < num_samples; k += 16) {
+                input_genotypes = _mm_load_si128(genotypes[j] + k);
+                mask = _mm_load_si128(confusion_masks + i * num_samples + k);
+                mask = _mm_and_si128(mask, _mm_cmpeq_epi8(input_genotypes, comb_genotypes));
+                _mm_store_si128(confusion_masks + i * num_samples + k, mask);
+            }
+        }
+
+        // Set to zero the positions in padding
+        memset(confusion_masks + i * num_samples + info.num_affected,
+                0, info.num_affected_with_padding - info.num_affected);
+        memset(confusion_masks + i * num_samples + info.num_affected_with_padding + info.num_unaffected,
+                0, info.num_unaffected_with_padding - info.num_unaffected);
+    }
+
+    uint8_t final_masks[num_samples] __attribute__((aligned(16)));
+    __m128i final_or, other_mask, xor_mask;
+    xor_mask = _mm_set1_epi8(1);
+
+    for (int k = 0; k < num_samples; k += 16) {
+        final_or = _mm_load_si128(confusion_masks + k); // First mask
+
+        // Merge all positives (1) and negatives (0)
+        for (int j = 1; j < num_risky; j++) {
+            other_mask = _mm_load_si128(confusion_masks + j * num_samples + k);
+            final_or = _mm_or_si128(final_or, other_mask);
+        }
+
+        // Filter samples only in training/testing folds
+        other_mask = _mm_load_si128(fold_masks + k);
+        if (subset == TRAINING) {
+            final_or = _mm_and_si128(other_mask, final_or);
+        } else {
+            // (not in fold mask) & final_or
+            other_mask = _mm_xor_si128(other_mask, xor_mask);
+            final_or = _mm_and_si128(other_mask, final_or);
+        }
+
+        _mm_store_si128(final_masks + k, final_or);
+    }
+
+    // Get the counts (popcount is the number of 1s -> popcount / 8 is the number of positives)
+    int popcount0 = 0, popcount1 = 0;
+    __m128i snp_and;
+
+    memset(final_masks + info.num_affected, 0, info.num_affected_with_padding - info.num_affected);
+    memset(final_masks + info.num_affected_with_padding + info.num_unaffected, 0, info.num_unaffected_with_padding - info.num_unaffected);
+
+    for (int k = 0; k < info.num_affected; k += 16) {
+        snp_and = _mm_load_si128(final_masks + k);
+        popcount0 += _mm_popcnt_u64(_mm_extract_epi64(snp_and, 0)) +
+                     _mm_popcnt_u64(_mm_extract_epi64(snp_and, 1));
+    }
+
+    for (int k = 0; k < info.num_unaffected; k += 16) {
+        snp_and = _mm_load_si128(final_masks + info.num_affected_with_padding + k);
+        popcount1 += _mm_popcnt_u64(_mm_extract_epi64(snp_and, 0)) +
+                     _mm_popcnt_u64(_mm_extract_epi64(snp_and, 1));
+    }
+
+    matrix[0] = popcount0; // TP
+    matrix[2] = popcount1; // FP
+    if (subset == TRAINING) {
+        matrix[1] = training_size[0] - popcount0; // Total affected - predicted
+        matrix[3] = training_size[1] - popcount1; // Total unaffected - predicted
+    } else if (subset == TESTING) {
+        matrix[1] = testing_size[0] - popcount0;
+        matrix[3] = testing_size[1] - popcount1;
+    }
+}
+
+
+/* **************************
+ *           AVX2           *
+ * **************************/
+
+/*
+ * Popcount of each byte using a nibble lookup table, then added in groups of 8 bytes,
+ * so the result contains 4 partial sums of 64 bits (Mula et al., 2016)
+ */
+static inline TARGET_AVX2 __m256i popcount_avx2(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+static inline TARGET_AVX2 int reduce_add_avx2(__m256i v) {
+    return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+           _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+
+/* Bytes whose position is less than 'remaining' are set to 0xFF, the rest to 0x00 */
+static inline TARGET_AVX2 __m256i valid_bytes_avx2(int remaining) {
+    const __m256i positions = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                               16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(remaining < 32 ? remaining : 32), positions);
+}
+
+static TARGET_AVX2 void set_genotypes_masks_avx2(int order, uint8_t **genotypes, int num_combinations, uint8_t *in_masks, masks_info info) {
+    __m256i reference_genotype, input_genotypes, mask;
+
+    for (int c = 0; c < num_combinations; c++) {
+        uint8_t *masks = in_masks + c * info.num_masks;
+        uint8_t **combination_genotypes = genotypes + c * order;
+
+        for (int j = 0; j < order; j++) {
+            for (int i = 0; i < NUM_GENOTYPES; i++) {
+                uint8_t *gt_masks = masks + j * NUM_GENOTYPES * info.num_samples_with_padding + i * info.num_samples_with_padding;
+                reference_genotype = _mm256_set1_epi8(i);
+
+                for (int k = 0; k < info.num_samples_with_padding; k += 32) {
+                    input_genotypes = _mm256_loadu_si256((__m256i*) (combination_genotypes[j] + k));
+                    mask = _mm256_cmpeq_epi8(input_genotypes, reference_genotype);
+                    _mm256_storeu_si256((__m256i*) (gt_masks + k), mask);
+                }
+
+                // Set padding with zeroes
+                memset(gt_masks + info.num_affected, 0, info.num_affected_with_padding - info.num_affected);
+                memset(gt_masks + info.num_affected_with_padding + info.num_unaffected, 0, info.num_unaffected_with_padding - info.num_unaffected);
+            }
+        }
+    }
+}
+
+static TARGET_AVX2 void combination_counts_all_folds_avx2(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                                          uint8_t **genotype_permutations, uint8_t **masks, masks_info info,
+                                                          int *counts_aff, int *counts_unaff) {
+    int group_sizes[2] = { info.num_affected, info.num_unaffected };
+    int group_offsets[2] = { 0, info.num_affected_with_padding };
+    int *group_counts[2] = { counts_aff, counts_unaff };
+    __m256i count[num_folds];
+    __m256i snp_and, snp_cmp;
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint8_t **rc_masks = masks + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            uint8_t *permutation = genotype_permutations[c];
+
+            // Affected samples first, then unaffected ones
+            for (int g = 0; g < 2; g++) {
+                for (int f = 0; f < num_folds; f++) {
+                    count[f] = _mm256_setzero_si256();
+                }
+
+                for (int i = group_offsets[g]; i < group_offsets[g] + group_sizes[g]; i += 32) {
+                    snp_and = _mm256_loadu_si256((__m256i*) (rc_masks[0] + permutation[0] * info.num_samples_with_padding + i));
+
+                    // Perform AND operation with all SNPs in the combination
+                    for (int j = 1; j < order; j++) {
+                        snp_cmp = _mm256_loadu_si256((__m256i*) (rc_masks[j] + permutation[j] * info.num_samples_with_padding + i));
+                        snp_and = _mm256_and_si256(snp_and, snp_cmp);
+                    }
+
+                    // Final AND with fold_masks
+                    for (int f = 0; f < num_folds; f++) {
+                        snp_cmp = _mm256_loadu_si256((__m256i*) (fold_masks + f * info.num_samples_with_padding + i));
+                        count[f] = _mm256_add_epi64(count[f], popcount_avx2(_mm256_and_si256(snp_and, snp_cmp)));
+                    }
+                }
+
+                for (int f = 0; f < num_folds; f++) {
+                    group_counts[g][f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                                    rc * info.num_cell_counts_per_combination + c] = reduce_add_avx2(count[f]);
+                }
+            }
+        }
+    }
+}
+
+static TARGET_AVX2 void combination_counts_all_folds_bitplanes_avx2(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                                                    uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                                                    int *counts_aff, int *counts_unaff) {
+    int num_words = info.num_words_per_bitplane;
+    int group_starts[3] = { 0, info.num_words_affected, num_words };
+    int *group_counts[2] = { counts_aff, counts_unaff };
+    uint64_t snp_and[num_words];
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint64_t **rc_bitplanes = bitplanes + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            uint8_t *permutation = genotype_permutations[c];
+
+            // AND of the bitplanes of all SNPs in the combination, 4 words at a time
+            memcpy(snp_and, rc_bitplanes[0] + permutation[0] * num_words, num_words * sizeof(uint64_t));
+            for (int j = 1; j < order; j++) {
+                uint64_t *plane = rc_bitplanes[j] + permutation[j] * num_words;
+                int w = 0;
+                for (; w + 4 <= num_words; w += 4) {
+                    __m256i snp_cmp = _mm256_loadu_si256((__m256i*) (plane + w));
+                    _mm256_storeu_si256((__m256i*) (snp_and + w), _mm256_and_si256(_mm256_loadu_si256((__m256i*) (snp_and + w)), snp_cmp));
+                }
+                for (; w < num_words; w++) {
+                    snp_and[w] &= plane[w];
+                }
+            }
+
+            // Final AND with fold masks, affected words first, then unaffected ones
+            for (int g = 0; g < 2; g++) {
+                for (int f = 0; f < num_folds; f++) {
+                    uint64_t *bitmask = fold_bitmasks + f * num_words;
+                    __m256i count = _mm256_setzero_si256();
+                    int tail_count = 0;
+                    int w = group_starts[g];
+                    for (; w + 4 <= group_starts[g + 1]; w += 4) {
+                        __m256i snp_result = _mm256_and_si256(_mm256_loadu_si256((__m256i*) (snp_and + w)), 
+                                                              _mm256_loadu_si256((__m256i*) (bitmask + w)));
+                        count = _mm256_add_epi64(count, popcount_avx2(snp_result));
+                    }
+                    for (; w < group_starts[g + 1]; w++) {
+                        tail_count += _mm_popcnt_u64(snp_and[w] & bitmask[w]);
+                    }
+
+                    group_counts[g][f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                                    rc * info.num_cell_counts_per_combination + c] = reduce_add_avx2(count) + tail_count;
+                }
+            }
+        }
+    }
+}
+
+static TARGET_AVX2 void confusion_matrix_avx2(int order, int num_risky, uint8_t **risky_genotypes, uint8_t **genotypes,
+                                              uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2],
+                                              masks_info info, unsigned int *matrix) {
+    int group_sizes[2] = { info.num_affected, info.num_unaffected };
+    int group_offsets[2] = { 0, info.num_affected_with_padding };
+    int popcounts[2];
+    // Testing samples are those out of the fold mask
+    __m256i xor_mask = _mm256_set1_epi8(subset == TRAINING ? 0 : 1);
+
+    for (int g = 0; g < 2; g++) {
+        __m256i count = _mm256_setzero_si256();
+
+        for (int k = 0; k < group_sizes[g]; k += 32) {
+            int offset = group_offsets[g] + k;
+            __m256i final_or = _mm256_setzero_si256();
+
+            // Merge the positives of all risky genotype combinations, without storing intermediate masks
+            for (int i = 0; i < num_risky; i++) {
+                __m256i mask = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) (genotypes[0] + offset)),
+                                                 _mm256_set1_epi8(risky_genotypes[i][0]));
+                for (int j = 1; j < order; j++) {
+                    mask = _mm256_and_si256(mask, _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) (genotypes[j] + offset)),
+                                                                    _mm256_set1_epi8(risky_genotypes[i][j])));
+                }
+                final_or = _mm256_or_si256(final_or, mask);
+            }
+
+            // Filter samples only in training/testing folds, and discard padding
+            __m256i fold = _mm256_xor_si256(_mm256_loadu_si256((__m256i*) (fold_masks + offset)), xor_mask);
+            final_or = _mm256_and_si256(final_or, _mm256_and_si256(fold, valid_bytes_avx2(group_sizes[g] - k)));
+            count = _mm256_add_epi64(count, popcount_avx2(final_or));
+        }
+
+        popcounts[g] = reduce_add_avx2(count);
+    }
+
+    matrix[0] = popcounts[0]; // TP
+    matrix[2] = popcounts[1]; // FP
+    if (subset == TRAINING) {
+        matrix[1] = training_size[0] - popcounts[0]; // Total affected - predicted
+        matrix[3] = training_size[1] - popcounts[1]; // Total unaffected - predicted
+    } else if (subset == TESTING) {
+        matrix[1] = testing_size[0] - popcounts[0];
+        matrix[3] = testing_size[1] - popcounts[1];
+    }
+}
+
+
+/* **************************
+ *          AVX-512         *
+ * **************************/
+
+static inline TARGET_AVX512 __mmask64 valid_bytes_avx512(int remaining) {
+    return remaining >= 64 ? ~((__mmask64) 0) : (((__mmask64) 1) << remaining) - 1;
+}
+
+/* Same as valid_bytes_avx512, but for 64-bit words */
+static inline TARGET_AVX512 __mmask8 valid_words_avx512(int remaining) {
+    return remaining >= 8 ? (__mmask8) 0xFF : (__mmask8) ((1 << remaining) - 1);
+}
+
+static TARGET_AVX512 void set_genotypes_masks_avx512(int order, uint8_t **genotypes, int num_combinations, uint8_t *in_masks, masks_info info) {
+    __m512i reference_genotype, input_genotypes;
+
+    for (int c = 0; c < num_combinations; c++) {
+        uint8_t *masks = in_masks + c * info.num_masks;
+        uint8_t **combination_genotypes = genotypes + c * order;
+
+        for (int j = 0; j < order; j++) {
+            for (int i = 0; i < NUM_GENOTYPES; i++) {
+                uint8_t *gt_masks = masks + j * NUM_GENOTYPES * info.num_samples_with_padding + i * info.num_samples_with_padding;
+                reference_genotype = _mm512_set1_epi8(i);
+
+                // Padding is cleared while comparing, using the valid bytes as write mask
+                for (int k = 0; k < info.num_affected_with_padding; k += 64) {
+                    input_genotypes = _mm512_loadu_si512(combination_genotypes[j] + k);
+                    __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(valid_bytes_avx512(info.num_affected - k), input_genotypes, reference_genotype);
+                    _mm512_storeu_si512(gt_masks + k, _mm512_movm_epi8(mask));
+                }
+                for (int k = 0; k < info.num_unaffected_with_padding; k += 64) {
+                    int offset = info.num_affected_with_padding + k;
+                    input_genotypes = _mm512_loadu_si512(combination_genotypes[j] + offset);
+                    __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(valid_bytes_avx512(info.num_unaffected - k), input_genotypes, reference_genotype);
+                    _mm512_storeu_si512(gt_masks + offset, _mm512_movm_epi8(mask));
+                }
+            }
+        }
+    }
+}
+
+static TARGET_AVX512 void combination_counts_all_folds_avx512(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                                              uint8_t **genotype_permutations, uint8_t **masks, masks_info info,
+                                                              int *counts_aff, int *counts_unaff) {
+    int group_sizes[2] = { info.num_affected, info.num_unaffected };
+    int group_offsets[2] = { 0, info.num_affected_with_padding };
+    int *group_counts[2] = { counts_aff, counts_unaff };
+    __m512i count[num_folds];
+    __m512i snp_and, snp_cmp;
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint8_t **rc_masks = masks + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            uint8_t *permutation = genotype_permutations[c];
+
+            // Affected samples first, then unaffected ones
+            for (int g = 0; g < 2; g++) {
+                for (int f = 0; f < num_folds; f++) {
+                    count[f] = _mm512_setzero_si512();
+                }
+
+                for (int i = group_offsets[g]; i < group_offsets[g] + group_sizes[g]; i += 64) {
+                    snp_and = _mm512_loadu_si512(rc_masks[0] + permutation[0] * info.num_samples_with_padding + i);
+
+                    // Perform AND operation with all SNPs in the combination
+                    for (int j = 1; j < order; j++) {
+                        snp_cmp = _mm512_loadu_si512(rc_masks[j] + permutation[j] * info.num_samples_with_padding + i);
+                        snp_and = _mm512_and_si512(snp_and, snp_cmp);
+                    }
+
+                    // Final AND with fold_masks
+                    for (int f = 0; f < num_folds; f++) {
+                        snp_cmp = _mm512_loadu_si512(fold_masks + f * info.num_samples_with_padding + i);
+                        count[f] = _mm512_add_epi64(count[f], _mm512_popcnt_epi64(_mm512_and_si512(snp_and, snp_cmp)));
+                    }
+                }
+
+                for (int f = 0; f < num_folds; f++) {
+                    group_counts[g][f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                                    rc * info.num_cell_counts_per_combination + c] = _mm512_reduce_add_epi64(count[f]);
+                }
+            }
+        }
+    }
+}
+
+static TARGET_AVX512 void combination_counts_all_folds_bitplanes_avx512(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                                                        uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                                                        int *counts_aff, int *counts_unaff) {
+    int num_words = info.num_words_per_bitplane;
+    int group_starts[3] = { 0, info.num_words_affected, num_words };
+    int *group_counts[2] = { counts_aff, counts_unaff };
+    uint64_t snp_and[num_words];
+
+    for (int rc = 0; rc < num_combinations; rc++) {
+        uint64_t **rc_bitplanes = bitplanes + rc * order;
+        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+            uint8_t *permutation = genotype_permutations[c];
+
+            // AND of the bitplanes of all SNPs in the combination, 8 words at a time (the last ones masked)
+            memcpy(snp_and, rc_bitplanes[0] + permutation[0] * num_words, num_words * sizeof(uint64_t));
+            for (int j = 1; j < order; j++) {
+                uint64_t *plane = rc_bitplanes[j] + permutation[j] * num_words;
+                for (int w = 0; w < num_words; w += 8) {
+                    __mmask8 valid = valid_words_avx512(num_words - w);
+                    __m512i snp_cmp = _mm512_maskz_loadu_epi64(valid, plane + w);
+                    _mm512_mask_storeu_epi64(snp_and + w, valid, _mm512_and_si512(_mm512_maskz_loadu_epi64(valid, snp_and + w), snp_cmp));
+                }
+            }
+
+            // Final AND with fold masks, affected words first, then unaffected ones
+            for (int g = 0; g < 2; g++) {
+                for (int f = 0; f < num_folds; f++) {
+                    uint64_t *bitmask = fold_bitmasks + f * num_words;
+                    __m512i count = _mm512_setzero_si512();
+                    for (int w = group_starts[g]; w < group_starts[g + 1]; w += 8) {
+                        __mmask8 valid = valid_words_avx512(group_starts[g + 1] - w);
+                        __m512i snp_result = _mm512_and_si512(_mm512_maskz_loadu_epi64(valid, snp_and + w), 
+                                                              _mm512_maskz_loadu_epi64(valid, bitmask + w));
+                        count = _mm512_add_epi64(count, _mm512_popcnt_epi64(snp_result));
+                    }
+
+                    group_counts[g][f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
+                                    rc * info.num_cell_counts_per_combination + c] = _mm512_reduce_add_epi64(count);
+                }
+            }
+        }
+    }
+}
+
+static TARGET_AVX512 void confusion_matrix_avx512(int order, int num_risky, uint8_t **risky_genotypes, uint8_t **genotypes,
+                                                  uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2],
+                                                  masks_info info, unsigned int *matrix) {
+    int group_sizes[2] = { info.num_affected, info.num_unaffected };
+    int group_offsets[2] = { 0, info.num_affected_with_padding };
+    int popcounts[2] = { 0, 0 };
+    const __m512i zero = _mm512_setzero_si512();
+
+    for (int g = 0; g < 2; g++) {
+        for (int k = 0; k < group_sizes[g]; k += 64) {
+            int offset = group_offsets[g] + k;
+            __mmask64 final_or = 0;
+
+            // Merge the positives of all risky genotype combinations, using bitmasks instead of byte masks
+            for (int i = 0; i < num_risky; i++) {
+                __mmask64 mask = valid_bytes_avx512(group_sizes[g] - k);
+                for (int j = 0; j < order; j++) {
+                    mask = _mm512_mask_cmpeq_epi8_mask(mask, _mm512_loadu_si512(genotypes[j] + offset),
+                                                       _mm512_set1_epi8(risky_genotypes[i][j]));
+                }
+                final_or |= mask;
+            }
+
+            // Filter samples only in training/testing folds
+            __mmask64 fold = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(fold_masks + offset), zero);
+            final_or &= (subset == TRAINING) ? fold : ~fold;
+            popcounts[g] += _mm_popcnt_u64(final_or);
+        }
+    }
+
+    matrix[0] = popcounts[0]; // TP
+    matrix[2] = popcounts[1]; // FP
+    if (subset == TRAINING) {
+        matrix[1] = training_size[0] - popcounts[0]; // Total affected - predicted
+        matrix[3] = training_size[1] - popcounts[1]; // Total unaffected - predicted
+    } else if (subset == TESTING) {
+        matrix[1] = testing_size[0] - popcounts[0];
+        matrix[3] = testing_size[1] - popcounts[1];
+    }
+}
+
+
+/* **************************
+ *      Kernel selection    *
+ * **************************/
+
+static const epistasis_kernels all_kernels[] = {
+    { KERNEL_SSE42, "SSE4.2", 16, set_genotypes_masks_sse42, combination_counts_all_folds_sse42, 
+      combination_counts_all_folds_bitplanes_sse42, confusion_matrix_sse42 },
+    { KERNEL_AVX2, "AVX2", 32, set_genotypes_masks_avx2, combination_counts_all_folds_avx2, 
+      combination_counts_all_folds_bitplanes_avx2, confusion_matrix_avx2 },
+    { KERNEL_AVX512, "AVX-512", 64, set_genotypes_masks_avx512, combination_counts_all_folds_avx512, 
+      combination_counts_all_folds_bitplanes_avx512, confusion_matrix_avx512 },
+};
+
+static const epistasis_kernels *selected_kernels = NULL;
+
+bool epistasis_kernels_supported(enum kernel_isa isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case KERNEL_SSE42:
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        case KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        case KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                   __builtin_cpu_supports("avx512vpopcntdq");
+        default:
+            return false;
+    }
+}
+
+const epistasis_kernels *epistasis_kernels_init(enum kernel_isa isa) {
+    if (isa != KERNEL_AUTO && !epistasis_kernels_supported(isa)) {
+        LOG_WARN_F("Kernels for %s not supported by this CPU, using the best available ones\n", all_kernels[isa].name);
+        isa = KERNEL_AUTO;
+    }
+
+    if (isa == KERNEL_AUTO) {
+        isa = KERNEL_SSE42;
+        for (int i = KERNEL_AVX512; i > KERNEL_SSE42; i--) {
+            if (epistasis_kernels_supported(i)) {
+                isa = i;
+                break;
+            }
+        }
+    }
+
+    selected_kernels = &all_kernels[isa];
+    return selected_kernels;
+}
+
+const epistasis_kernels *epistasis_kernels_get(void) {
+    if (!selected_kernels) {
+        epistasis_kernels_init(KERNEL_AUTO);
+    }
+    return selected_kernels;
+}
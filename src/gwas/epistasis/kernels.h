@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_KERNELS
+#define EPISTASIS_KERNELS
+
+/**
+ * @file kernels.h
+ * @brief SIMD implementations of the genotype counting functions
+ *
+ * The functions that scan the genotypes of all samples (masks generation, counts per
+ * genotype combination, from byte masks or bitplanes, and confusion matrices) are
+ * implemented once per instruction set.
+ * The widest one supported by the CPU is chosen at startup, so the same binary can run
+ * with SSE4.2, AVX2 or AVX-512 depending on the node.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <commons/log.h>
+
+#include "model.h"
+
+/**
+ * Widest vector (in bytes) any kernel may use. Buffers aligned to this value are valid for all of them.
+ */
+#define KERNEL_MAX_VECTOR_WIDTH     64
+
+enum kernel_isa { KERNEL_AUTO = -1, KERNEL_SSE42, KERNEL_AVX2, KERNEL_AVX512 };
+
+typedef struct {
+    enum kernel_isa isa;
+    const char *name;
+    int vector_width;       /**< Bytes processed per instruction, also the padding of each group of samples */
+
+    void (*set_genotypes_masks)(int order, uint8_t **genotypes, int num_combinations, uint8_t *masks, masks_info info);
+
+    void (*combination_counts_all_folds)(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                         uint8_t **genotype_permutations, uint8_t **masks, masks_info info,
+                                         int *counts_aff, int *counts_unaff);
+
+    void (*combination_counts_all_folds_bitplanes)(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                                   uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                                   int *counts_aff, int *counts_unaff);
+
+    void (*confusion_matrix)(int order, int num_risky, uint8_t **risky_genotypes, uint8_t **genotypes,
+                             uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2],
+                             masks_info info, unsigned int *matrix);
+} epistasis_kernels;
+
+
+/**
+ * @brief Selects the family of kernels used by the epistasis functions.
+ * @details Selects the family of kernels used by the epistasis functions. KERNEL_AUTO chooses the widest
+ * one supported by the CPU (as reported by CPUID). If the requested one is not supported, the best
+ * available is used instead. Must be called before any masks_info is initialized, because padding
+ * depends on the vector width.
+ *
+ * @param isa Requested instruction set
+ * @return The kernels that will be used
+ **/
+const epistasis_kernels *epistasis_kernels_init(enum kernel_isa isa);
+
+/**
+ * @brief Returns the kernels currently in use, selecting the best available ones if none was chosen yet.
+ **/
+const epistasis_kernels *epistasis_kernels_get(void);
+
+bool epistasis_kernels_supported(enum kernel_isa isa);
+
+#endif
@@ -35,7 +35,7 @@ int epistasis(int argc, char *argv[], const char *configuration_file) {
     if (argc == 1 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
         argtable = merge_epistasis_options(epistasis_options, shared_options, arg_end(epistasis_options->num_options + shared_options->num_options));
         show_usage("hpg-var-gwas epi", argtable);
-        arg_freetable(argtable, 12);
+        arg_freetable(argtable, 23);
         return 0;
     }
 
@@ -108,7 +108,7 @@ int epistasis(int argc, char *argv[], const char *configuration_file) {
     if (mpi_rank == 0) {
 #endif
 
-    arg_freetable(argtable, 12);
+    arg_freetable(argtable, 23);
     
 #ifdef _USE_MPI
     }
@@ -128,6 +128,22 @@ epistasis_options_t *new_epistasis_cli_options(void) {
     options->order = arg_int1(NULL, "order", NULL, "Number of SNPs to be combined at the same time");
     options->evaluation_subset = arg_str0(NULL, "eval-subset", NULL, "Whether to used training (default) or testing partitions when evaluating the best models");
     options->evaluation_mode = arg_str0(NULL, "eval-mode", NULL, "Whether to rank risky combinations by their CV-C or CV-A (values can be 'count' or 'accu')");
+    options->use_bitplanes = arg_lit0(NULL, "bitplanes", "Pack genotypes into bitplanes (1 bit per sample and genotype) instead of byte masks");
+    options->fuse_cv_repetitions = arg_lit0(NULL, "fuse-cv-runs", "Evaluate all cross-validation runs in a single sweep over the combinations (uses more memory)");
+    options->checkpoint_interval = arg_int0(NULL, "checkpoint-interval", NULL, "Seconds between checkpoints of the progress (0 disables them)");
+    options->resume = arg_lit0(NULL, "resume", "Resume the search from the last checkpoint in the output directory");
+    options->dynamic_blocks = arg_lit0(NULL, "dynamic-blocks", "Hand out blocks to MPI processes on request instead of splitting them up front");
+    options->evaluation_function = arg_str0(NULL, "eval-function", NULL, "Function the models are ranked by (ba, ca, wba, gamma, tau-b, chi-square or likelihood-ratio)");
+    options->num_permutations = arg_int0(NULL, "num-permutations", NULL, "Phenotype permutations for testing the significance of the best models (0 disables it)");
+    options->num_prefilter_snps = arg_int0(NULL, "prefilter-snps", NULL, "Restrict the search to the SNPs with the strongest marginal effect (0 searches all of them)");
+    options->auto_tune = arg_lit0(NULL, "auto-tune", "Choose the stride and the combinations processed at once that run fastest on this machine");
+    options->prune = arg_lit0(NULL, "prune", "Skip the folds of the combinations that can't be among the best models (training ba or ca only)");
+    options->beam_width = arg_int0(NULL, "beam-width", NULL, "Grow the models one SNP at a time, keeping this many of each order (heuristic, 0 searches all combinations)");
+    options->config_bitplanes = 0;
+    options->config_fuse_cv_repetitions = 0;
+    options->config_dynamic_blocks = 0;
+    options->config_auto_tune = 0;
+    options->config_prune = 0;
     return options;
 }
 
@@ -141,6 +157,19 @@ epistasis_options_data_t *new_epistasis_options_data(epistasis_options_t *option
     options_data->num_folds = *(options->num_folds->ival);
     options_data->order = *(options->order->ival);
     options_data->stride = *(options->stride->ival);
+    options_data->use_bitplanes = options->use_bitplanes->count || options->config_bitplanes;
+    options_data->fuse_cv_repetitions = options->fuse_cv_repetitions->count || options->config_fuse_cv_repetitions;
+    options_data->checkpoint_interval = *(options->checkpoint_interval->ival);
+    options_data->resume = options->resume->count;
+    options_data->dynamic_blocks = options->dynamic_blocks->count || options->config_dynamic_blocks;
+    // Balanced accuracy, as in the original MDR, unless other function is chosen
+    int eval_function = eval_function_from_name(*(options->evaluation_function->sval));
+    options_data->eval_function = (eval_function < 0) ? BA : eval_function;
+    options_data->num_permutations = *(options->num_permutations->ival);
+    options_data->num_prefilter_snps = *(options->num_prefilter_snps->ival);
+    options_data->auto_tune = options->auto_tune->count || options->config_auto_tune;
+    options_data->prune = options->prune->count || options->config_prune;
+    options_data->beam_width = *(options->beam_width->ival);
     return options_data;
 }
 
@@ -42,35 +42,45 @@ bool mdr_high_risk_combinations(unsigned int count_affected, unsigned int count_
 }
 
 
-int *mdr_high_risk_combinations2(int *counts_affected, int *counts_unaffected, int num_counts,
-                                 unsigned int num_affected, unsigned int num_unaffected,
-                                 void **aux_return_values) {
-    int max_num_high_risk = 16 * (int) ceil(((double) num_counts) / 16);
-    int *high_risk = _mm_malloc(max_num_high_risk * sizeof(int), 16);
-    memset(high_risk, 0, max_num_high_risk * sizeof(int));
+void mdr_high_risk_masks(int *counts_affected, int *counts_unaffected, int num_combinations, int num_counts_per_combination,
+                         unsigned int num_affected, unsigned int num_unaffected, uint64_t *risk_masks) {
+    // affected/unaffected >= num_affected/num_unaffected  <=>  affected * num_unaffected >= unaffected * num_affected
+    __m128i weight_affected = _mm_set1_epi32(num_unaffected);
+    __m128i weight_unaffected = _mm_set1_epi32(num_affected);
+    __m128i zero = _mm_setzero_si128();
+    int num_words = MDR_RISK_MASK_WORDS(num_counts_per_combination);
     
-    __m128 affected_unaffected_ratio = _mm_set1_ps((float) num_affected / num_unaffected);
-    __m128 counts_affected_sse, counts_unaffected_sse, total_in_cell;
-    __m128 proportional_unaffected, reduction_ratio;
-    __m128 normalized_affected, normalized_unaffected;
-    __m128i result;
-    
-    for (int i = 0; i < num_counts; i += 4) {
-        counts_affected_sse = _mm_set_ps(counts_affected[i+3], counts_affected[i+2], counts_affected[i+1], counts_affected[i]);
-        counts_unaffected_sse = _mm_set_ps(counts_unaffected[i+3], counts_unaffected[i+2], counts_unaffected[i+1], counts_unaffected[i]);
-        
-        total_in_cell = _mm_add_ps(counts_affected_sse, counts_unaffected_sse);
-        
-        proportional_unaffected = _mm_mul_ps(counts_unaffected_sse, affected_unaffected_ratio);
-        reduction_ratio = _mm_div_ps(total_in_cell, _mm_add_ps(proportional_unaffected, counts_affected_sse));
+    for (int c = 0; c < num_combinations; c++) {
+        int *affected = counts_affected + c * num_counts_per_combination;
+        int *unaffected = counts_unaffected + c * num_counts_per_combination;
+        uint64_t *mask = risk_masks + c * num_words;
+        memset(mask, 0, num_words * sizeof(uint64_t));
         
-        normalized_unaffected = _mm_mul_ps(proportional_unaffected, reduction_ratio);
-        normalized_affected = _mm_sub_ps(total_in_cell, normalized_unaffected);
+        int i = 0;
+        for (; i + 4 <= num_counts_per_combination; i += 4) {
+            __m128i aff = _mm_loadu_si128((__m128i*) (affected + i));
+            __m128i unaff = _mm_loadu_si128((__m128i*) (unaffected + i));
+            
+            // 32x32->64 bit products of the even lanes, then the odd ones
+            __m128i aff_even = _mm_mul_epu32(aff, weight_affected);
+            __m128i aff_odd = _mm_mul_epu32(_mm_srli_epi64(aff, 32), weight_affected);
+            __m128i unaff_even = _mm_mul_epu32(unaff, weight_unaffected);
+            __m128i unaff_odd = _mm_mul_epu32(_mm_srli_epi64(unaff, 32), weight_unaffected);
+            
+            int low_even = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(unaff_even, aff_even)));
+            int low_odd = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(unaff_odd, aff_odd)));
+            int low_risk = (low_even & 1) | ((low_odd & 1) << 1) | ((low_even & 2) << 1) | ((low_odd & 2) << 2);
+            int empty = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_add_epi32(aff, unaff), zero)));
+            
+            // Groups of 4 bits never cross a word boundary
+            mask[i / 64] |= (uint64_t) (~(low_risk | empty) & 0xF) << (i % 64);
+        }
         
-        result = _mm_cvtps_epi32(_mm_cmpge_ps(normalized_affected, normalized_unaffected));
-        _mm_store_si128(high_risk + i, result);
+        for (; i < num_counts_per_combination; i++) {
+            if (affected[i] + unaffected[i] > 0 && 
+                (uint64_t) affected[i] * num_unaffected >= (uint64_t) unaffected[i] * num_affected) {
+                mask[i / 64] |= (uint64_t) 1 << (i % 64);
+            }
+        }
     }
-    
-    return high_risk;
 }
-
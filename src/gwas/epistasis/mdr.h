@@ -24,17 +24,38 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <xmmintrin.h>
 #include <smmintrin.h>
+#include <nmmintrin.h>
 
 #include <commons/log.h>
 
 bool mdr_high_risk_combinations(unsigned int count_affected, unsigned int count_unaffected, 
                                 unsigned int samples_affected, unsigned int samples_unaffected, void **aux_return_values);
 
-int *mdr_high_risk_combinations2(int *counts_affected, int *counts_unaffected, int num_counts,
-                                 unsigned int num_affected, unsigned int num_unaffected,
-                                 void **aux_return_values);
+/**
+ * 64-bit words needed for the risk mask of a combination with the given number of genotype permutations.
+ */
+#define MDR_RISK_MASK_WORDS(num_counts)     (((num_counts) + 63) / 64)
+
+/**
+ * @brief Classifies the genotype permutations of several combinations as high or low risk.
+ * @details Classifies the genotype permutations of several combinations as high or low risk. A permutation is 
+ * high risk when its ratio of affected to unaffected samples is greater or equal than the one of the whole 
+ * dataset, which is the same rule mdr_high_risk_combinations applies after normalizing the counts. The ratios 
+ * are compared cross-multiplied in 64-bit integers, so no division is needed and the result is exact. Empty 
+ * cells are never high risk.
+ * 
+ * @param counts_affected Counts of affected samples, num_counts_per_combination per combination
+ * @param counts_unaffected Counts of unaffected samples, num_counts_per_combination per combination
+ * @param[out] risk_masks MDR_RISK_MASK_WORDS(num_counts_per_combination) words per combination, where bit i is 
+ * set if the i-th genotype permutation is high risk
+ **/
+void mdr_high_risk_masks(int *counts_affected, int *counts_unaffected, int num_combinations, int num_counts_per_combination,
+                         unsigned int num_affected, unsigned int num_unaffected, uint64_t *risk_masks);
+
 #endif
@@ -19,6 +19,7 @@
  */
 
 #include "model.h"
+#include "kernels.h"
 
 
 /* **************************
@@ -43,34 +44,7 @@ void set_genotypes_masks(int order, uint8_t **genotypes, int num_combinations, u
      * SNP(order-1) - Mask genotype 1 (all samples)
      * SNP(order-1) - Mask genotype 2 (all samples)
      */
-    __m128i reference_genotype; // The genotype to compare for generating a mask (of the form {0 0 0 0 ... }, {1 1 1 1 ... })
-    __m128i input_genotypes;    // Genotypes from the input dataset
-    __m128i mask;               // Comparison between the reference genotype and input genotypes
-    
-    for (int c = 0; c < num_combinations; c++) {
-        uint8_t *masks = in_masks + c * info.num_masks;
-        uint8_t **combination_genotypes = genotypes + c * order;
-
-        for (int j = 0; j < order; j++) {
-            for (int i = 0; i < NUM_GENOTYPES; i++) {
-                reference_genotype = _mm_set1_epi8(i);
-
-                // Set value of masks
-                for (int k = 0; k < info.num_samples_with_padding; k += 16) {
-                    input_genotypes = _mm_load_si128(combination_genotypes[j] + k);
-                    mask = _mm_cmpeq_epi8(input_genotypes, reference_genotype);
-                    _mm_store_si128(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) + k, mask);
-                }
-
-                // Set padding with zeroes
-                memset(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) + info.num_affected,
-                    0, info.num_affected_with_padding - info.num_affected);
-                memset(masks + j * NUM_GENOTYPES * (info.num_samples_with_padding) + i * (info.num_samples_with_padding) +
-                    info.num_affected_with_padding + info.num_unaffected,
-                    0, info.num_unaffected_with_padding - info.num_unaffected);
-            }
-        }
-    }
+    epistasis_kernels_get()->set_genotypes_masks(order, genotypes, num_combinations, in_masks, info);
 }
 
 void combination_counts(int order, uint8_t *masks, uint8_t **genotype_permutations, int num_genotype_permutations,
@@ -131,129 +105,214 @@ void combination_counts(int order, uint8_t *masks, uint8_t **genotype_permutatio
 void combination_counts_all_folds(int order, uint8_t *fold_masks, int num_folds,
                                   uint8_t **genotype_permutations, uint8_t *masks, masks_info info, 
                                   int *counts_aff, int *counts_unaff) {
-    uint8_t *permutation;
-    int count[num_folds];
-
-    __m128i snp_and, snp_cmp, snp_result;
-
-    for (int rc = 0; rc < info.num_combinations_in_a_row; rc++) {
-        uint8_t *rc_masks = masks + rc * order * NUM_GENOTYPES * info.num_samples_with_padding;
-        for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
-            permutation = genotype_permutations[c];
-            // print_gt_combination(permutation, c, order);
-            
-            memset(count, 0, num_folds * sizeof(int));
-
-            for (int i = 0; i < info.num_affected; i += 16) {
-                // Aligned loading
-                snp_and = _mm_load_si128(rc_masks + permutation[0] * info.num_samples_with_padding + i);
-
-                // Perform AND operation with all SNPs in the combination
-                for (int j = 1; j < order; j++) {
-                    snp_cmp = _mm_load_si128(rc_masks + j * NUM_GENOTYPES * info.num_samples_with_padding +
-                                             permutation[j] * info.num_samples_with_padding + i);
-                    snp_and = _mm_and_si128(snp_and, snp_cmp);
-                }
-
-                // Final AND with fold_masks
-                for (int f = 0; f < num_folds; f++) {
-                    snp_cmp = _mm_load_si128(fold_masks + f * info.num_samples_with_padding + i);
-                    snp_result = _mm_and_si128(snp_and, snp_cmp);
-                    
-                    count[f] += _mm_popcnt_u64(_mm_extract_epi64(snp_result, 0)) +
-                                _mm_popcnt_u64(_mm_extract_epi64(snp_result, 1));
-                }
-            }
-
-            // Assign to count in fold
-            for (int f = 0; f < num_folds; f++) {
-                LOG_DEBUG_F("%d) aff comb idx (%d) = %d\n", f, c, count[f]);
-                counts_aff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
-                           rc * info.num_cell_counts_per_combination + c] = count[f];
-            }
-
-            memset(count, 0, num_folds * sizeof(int));
-
-            for (int i = 0; i < info.num_unaffected; i += 16) {
-                // Aligned loading
-                snp_and = _mm_load_si128(rc_masks + permutation[0] * info.num_samples_with_padding + info.num_affected_with_padding + i);
-
-                // Perform AND operation with all SNPs in the combination
-                for (int j = 1; j < order; j++) {
-                    snp_cmp = _mm_load_si128(rc_masks + j * NUM_GENOTYPES * info.num_samples_with_padding +
-                                             permutation[j] * info.num_samples_with_padding + info.num_affected_with_padding + i);
-                    snp_and = _mm_and_si128(snp_and, snp_cmp);
-                }
-
-                // Final AND with fold_masks
-                for (int f = 0; f < num_folds; f++) {
-                    snp_cmp = _mm_load_si128(fold_masks + f * info.num_samples_with_padding + info.num_affected_with_padding + i);
-                    snp_result = _mm_and_si128(snp_cmp, snp_and);
-                    
-                    count[f] += _mm_popcnt_u64(_mm_extract_epi64(snp_result, 0)) +
-                                _mm_popcnt_u64(_mm_extract_epi64(snp_result, 1));
-                }
-            }
+    // Masks of each SNP in the row, as laid out by set_genotypes_masks
+    uint8_t *snp_masks[info.num_combinations_in_a_row * order];
+    for (int i = 0; i < info.num_combinations_in_a_row * order; i++) {
+        snp_masks[i] = masks + i * NUM_GENOTYPES * info.num_samples_with_padding;
+    }
+    epistasis_kernels_get()->combination_counts_all_folds(order, info.num_combinations_in_a_row, fold_masks, num_folds, 
+                                                          genotype_permutations, snp_masks, info, counts_aff, counts_unaff);
+}
 
-            // Assign to count in fold
-            for (int f = 0; f < num_folds; f++) {
-                LOG_DEBUG_F("%d) unaff comb idx (%d) = %d\n", f, c, count[f]);
-                counts_unaff[f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination +
-                           rc * info.num_cell_counts_per_combination + c] = count[f];
-            }
-        }
+void set_block_genotypes_masks(int num_variants, uint8_t *genotypes, masks_info info, uint8_t *masks) {
+    // Each SNP is processed as a combination of order 1, so its masks are placed right after the previous SNP ones
+    uint8_t *snp_genotypes[num_variants];
+    for (int i = 0; i < num_variants; i++) {
+        snp_genotypes[i] = genotypes + i * info.num_samples_with_padding;
     }
+    info.num_masks = NUM_GENOTYPES * info.num_samples_with_padding;
+    epistasis_kernels_get()->set_genotypes_masks(1, snp_genotypes, num_variants, masks, info);
+}
+
+void combination_counts_all_folds_cached(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                         uint8_t **genotype_permutations, uint8_t **snp_masks, masks_info info, 
+                                         int *counts_aff, int *counts_unaff) {
+    epistasis_kernels_get()->combination_counts_all_folds(order, num_combinations, fold_masks, num_folds, 
+                                                          genotype_permutations, snp_masks, info, counts_aff, counts_unaff);
 }
 
 void masks_info_init(int order, int num_combinations_in_a_row, int num_affected, int num_unaffected, masks_info *info) {
+    // Each group of samples is padded to the vector width of the kernels in use
+    int width = epistasis_kernels_get()->vector_width;
     info->num_affected = num_affected;
     info->num_unaffected = num_unaffected;
-    info->num_affected_with_padding = 16 * (int) ceil(((double) num_affected) / 16);
-    info->num_unaffected_with_padding = 16 * (int) ceil(((double) num_unaffected) / 16);
+    info->num_affected_with_padding = width * (int) ceil(((double) num_affected) / width);
+    info->num_unaffected_with_padding = width * (int) ceil(((double) num_unaffected) / width);
     info->num_combinations_in_a_row = num_combinations_in_a_row;
     info->num_cell_counts_per_combination = pow(NUM_GENOTYPES, order);
     info->num_samples_with_padding = info->num_affected_with_padding + info->num_unaffected_with_padding;
     info->num_masks = NUM_GENOTYPES * order * info->num_samples_with_padding;
+    // Bitplanes follow the same layout as in the datasets, so they can be used directly when available
+    info->num_words_affected = dataset_num_words(num_affected);
+    info->num_words_unaffected = dataset_num_words(num_unaffected);
+    info->num_words_per_bitplane = info->num_words_affected + info->num_words_unaffected;
+    info->num_words_per_snp = dataset_num_words_per_snp(num_affected, num_unaffected);
+    info->num_words_per_risk_mask = MDR_RISK_MASK_WORDS(info->num_cell_counts_per_combination);
     assert(info->num_affected_with_padding);
     assert(info->num_unaffected_with_padding);
 }
 
 
 /* **************************
- *         High risk        *
+ *         Bitplanes        *
  * **************************/
 
-int* choose_high_risk_combinations2(unsigned int* counts_aff, unsigned int* counts_unaff, 
-                                   unsigned int num_combinations, unsigned int num_counts_per_combination,
-                                   unsigned int num_affected, unsigned int num_unaffected, 
-                                   unsigned int *num_risky, void** aux_ret, 
-                                   int* (*test_func)(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, void **)) {
-    int num_counts = num_combinations * num_counts_per_combination;
+/**
+ * Sets bit i of 'words' when 'bytes[i]' equals 'value', for the first 'num_bytes' bytes. Reads up to the 
+ * next multiple of 16 bytes, which is always inside the padding of a group of samples.
+ */
+static void pack_bytes_equal_to(uint8_t *bytes, int num_bytes, uint8_t value, uint64_t *words) {
+    __m128i reference = _mm_set1_epi8(value);
+    int num_words = (num_bytes + 63) / 64;
+    memset(words, 0, num_words * sizeof(uint64_t));
     
-    void *test_return_values = NULL;
-    // Check high risk for all combinations
-    int *is_high_risk = test_func(counts_aff, counts_unaff, num_counts, num_affected, num_unaffected, &test_return_values);
-        
-    int *risky = malloc (num_counts * sizeof(int)); // Put all risky indexes together
+    for (int k = 0; k < num_bytes; k += 16) {
+        __m128i input = _mm_loadu_si128((__m128i*) (bytes + k));
+        uint64_t bits = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(input, reference));
+        words[k / 64] |= bits << (k % 64);
+    }
     
-    int total_risky = 0;
-    for (int i = 0; i < num_counts; i++) {
-        if (is_high_risk[i]) {
-            int c = i / num_counts_per_combination;
-            int idx = i % num_counts_per_combination;
-            
-            risky[total_risky] = idx;
-            num_risky[c]++;
-            total_risky++;
+    // Clear bits of samples out of range
+    if (num_bytes % 64) {
+        words[num_words - 1] &= (((uint64_t) 1) << (num_bytes % 64)) - 1;
+    }
+}
+
+void set_genotypes_bitplanes(int num_variants, uint8_t *genotypes, masks_info info, uint64_t *bitplanes) {
+    /*
+     * Structure: Bitplanes of a SNP in each 'row'
+     *
+     * SNP(0) - Genotype 0 (affected words, unaffected words)
+     * SNP(0) - Genotype 1 (affected words, unaffected words)
+     * SNP(0) - Genotype 2 (affected words, unaffected words)
+     * SNP(0) - Padding up to 64 bytes
+     *
+     * ...
+     */
+    for (int i = 0; i < num_variants; i++) {
+        uint8_t *snp_genotypes = genotypes + i * info.num_samples_with_padding;
+        uint64_t *snp_bitplanes = bitplanes + i * info.num_words_per_snp;
+        memset(snp_bitplanes + NUM_GENOTYPES * info.num_words_per_bitplane, 0, 
+               (info.num_words_per_snp - NUM_GENOTYPES * info.num_words_per_bitplane) * sizeof(uint64_t));
+        
+        for (int g = 0; g < NUM_GENOTYPES; g++) {
+            uint64_t *plane = snp_bitplanes + g * info.num_words_per_bitplane;
+            pack_bytes_equal_to(snp_genotypes, info.num_affected, g, plane);
+            pack_bytes_equal_to(snp_genotypes + info.num_affected_with_padding, info.num_unaffected, g, plane + info.num_words_affected);
         }
     }
+}
+
+void set_fold_bitmasks(int num_folds, uint8_t *fold_masks, masks_info info, uint64_t *fold_bitmasks) {
+    for (int f = 0; f < num_folds; f++) {
+        uint8_t *masks = fold_masks + f * info.num_samples_with_padding;
+        uint64_t *bitmask = fold_bitmasks + f * info.num_words_per_bitplane;
+        pack_bytes_equal_to(masks, info.num_affected, 1, bitmask);
+        pack_bytes_equal_to(masks + info.num_affected_with_padding, info.num_unaffected, 1, bitmask + info.num_words_affected);
+    }
+}
+
+uint8_t *add_all_samples_mask(int num_folds, uint8_t *fold_masks, masks_info info) {
+    uint8_t *masks = _mm_malloc((num_folds + 1) * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    memcpy(masks, fold_masks, num_folds * info.num_samples_with_padding * sizeof(uint8_t));
+    _mm_free(fold_masks);
     
-//    free(is_high_risk);
-    _mm_free(is_high_risk);
+    // Padding is not set, like in the masks of the folds
+    uint8_t *all_samples = masks + num_folds * info.num_samples_with_padding;
+    memset(all_samples, 0, info.num_samples_with_padding * sizeof(uint8_t));
+    memset(all_samples, 1, info.num_affected * sizeof(uint8_t));
+    memset(all_samples + info.num_affected_with_padding, 1, info.num_unaffected * sizeof(uint8_t));
     
-    return risky;
+    return masks;
+}
+
+void combination_counts_all_folds_bitplanes(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                            uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                            int *counts_aff, int *counts_unaff) {
+    epistasis_kernels_get()->combination_counts_all_folds_bitplanes(order, num_combinations, fold_bitmasks, num_folds, 
+                                                                    genotype_permutations, bitplanes, info, counts_aff, counts_unaff);
+}
+
+
+/* **************************
+ *       Prefix masks       *
+ * **************************/
+
+void prefix_masks_cache_init(int order, size_t plane_size, masks_info info, prefix_masks_cache *cache) {
+    cache->order = order;
+    cache->num_slots = info.num_combinations_in_a_row;
+    cache->num_prefix_permutations = pow(NUM_GENOTYPES, order - 1);
+    cache->plane_size = plane_size;
+    cache->last_slot = 0;
+    cache->slot_snps = calloc(cache->num_slots * (order - 1), sizeof(uint8_t*));
+    cache->planes = _mm_malloc(cache->num_slots * cache->num_prefix_permutations * plane_size, KERNEL_MAX_VECTOR_WIDTH);
+    
+    // Genotype permutations are sorted with the last SNP varying fastest, so permutation c is 
+    // the prefix permutation c / NUM_GENOTYPES combined with the genotype c % NUM_GENOTYPES
+    int num_permutations = info.num_cell_counts_per_combination;
+    cache->pair_permutations = malloc(num_permutations * sizeof(uint8_t*));
+    cache->pair_permutations[0] = malloc(2 * num_permutations * sizeof(uint8_t));
+    for (int c = 0; c < num_permutations; c++) {
+        cache->pair_permutations[c] = cache->pair_permutations[0] + 2 * c;
+        cache->pair_permutations[c][0] = c / NUM_GENOTYPES;
+        cache->pair_permutations[c][1] = c % NUM_GENOTYPES;
+    }
+}
+
+void prefix_masks_cache_free(prefix_masks_cache *cache) {
+    free(cache->pair_permutations[0]);
+    free(cache->pair_permutations);
+    _mm_free(cache->planes);
+    free(cache->slot_snps);
+}
+
+void prefix_masks_cache_reset(prefix_masks_cache *cache) {
+    // Buffers of masks are reused between blocks, so the same address may now contain another SNP
+    memset(cache->slot_snps, 0, cache->num_slots * (cache->order - 1) * sizeof(uint8_t*));
+}
+
+uint8_t *prefix_masks_cache_get(uint8_t **snp_planes, prefix_masks_cache *cache) {
+    int prefix_len = cache->order - 1;
+    size_t slot_size = cache->num_prefix_permutations * cache->plane_size;
+    
+    // Consecutive combinations usually share their first SNPs
+    if (!memcmp(cache->slot_snps + cache->last_slot * prefix_len, snp_planes, prefix_len * sizeof(uint8_t*))) {
+        return cache->planes + cache->last_slot * slot_size;
+    }
+    
+    // Combinations are sorted, so a prefix is never used again once replaced and 
+    // slots can be taken in turns, as long as there is one per combination in a row
+    cache->last_slot = (cache->last_slot + 1) % cache->num_slots;
+    memcpy(cache->slot_snps + cache->last_slot * prefix_len, snp_planes, prefix_len * sizeof(uint8_t*));
+    uint8_t *slot = cache->planes + cache->last_slot * slot_size;
+    
+    int num_words = cache->plane_size / sizeof(uint64_t);
+    for (int p = 0; p < cache->num_prefix_permutations; p++) {
+        uint64_t *prefix_and = (uint64_t*) (slot + p * cache->plane_size);
+        
+        // Genotypes of the permutation, the first SNP being the most significant digit
+        int genotypes[prefix_len];
+        for (int j = prefix_len - 1, remainder = p; j >= 0; j--, remainder /= NUM_GENOTYPES) {
+            genotypes[j] = remainder % NUM_GENOTYPES;
+        }
+        
+        memcpy(prefix_and, snp_planes[0] + genotypes[0] * cache->plane_size, cache->plane_size);
+        for (int j = 1; j < prefix_len; j++) {
+            uint64_t *plane = (uint64_t*) (snp_planes[j] + genotypes[j] * cache->plane_size);
+            for (int w = 0; w < num_words; w++) {
+                prefix_and[w] &= plane[w];
+            }
+        }
+    }
+    
+    return slot;
 }
 
+
+/* **************************
+ *         High risk        *
+ * **************************/
+
 int* choose_high_risk_combinations(unsigned int* counts_aff, unsigned int* counts_unaff, unsigned int num_counts, 
                                    unsigned int num_affected, unsigned int num_unaffected, 
                                    unsigned int *num_risky, void** aux_ret, 
@@ -275,44 +334,50 @@ int* choose_high_risk_combinations(unsigned int* counts_aff, unsigned int* count
     return risky;
 }
 
-risky_combination* risky_combination_new(int order, int comb[order], uint8_t** possible_genotypes_combinations, 
-                                         int num_risky, int* risky_idx, void *aux_info, masks_info info) {
-    risky_combination *risky = malloc(sizeof(risky_combination));
+int risk_mask_genotypes(uint64_t *risk_mask, uint8_t **genotype_permutations, masks_info info, uint8_t **risky_genotypes) {
+    int num_risky = 0;
+    for (int w = 0; w < info.num_words_per_risk_mask; w++) {
+        for (uint64_t bits = risk_mask[w]; bits; bits &= bits - 1) {
+            risky_genotypes[num_risky++] = genotype_permutations[w * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    return num_risky;
+}
+
+risky_combination* risky_combination_new(int order, int comb[order], uint8_t** genotype_permutations, 
+                                         uint64_t *risk_mask, void *aux_info, masks_info info) {
+    // The record, its combination and its genotypes are allocated in a single block
+    size_t combination_size = order * sizeof(int);
+    size_t genotypes_size = info.num_cell_counts_per_combination * order * sizeof(uint8_t); // Maximum possible
+    risky_combination *risky = malloc(sizeof(risky_combination) + combination_size + genotypes_size);
     risky->order = order;
-    risky->combination = malloc(order * sizeof(int));
+    risky->combination = (int*) (risky + 1);
     risky->cross_validation_count = 1;
-    risky->accuracy = 0.0f;
-    risky->genotypes = malloc(info.num_cell_counts_per_combination * order * sizeof(uint8_t)); // Maximum possible
-    risky->num_risky_genotypes = num_risky;
-    risky->auxiliary_info = aux_info; // TODO improvement: set this using a method-dependant (MDR, MB-MDR) function
-    
-    memcpy(risky->combination, comb, order * sizeof(int));
+    risky->genotypes = (uint8_t*) (risky->combination + order);
     
-    for (int i = 0; i < num_risky; i++) {
-        memcpy(risky->genotypes + (order * i), possible_genotypes_combinations[risky_idx[i]], order * sizeof(uint8_t));
-    }
-    
-    return risky;
+    return risky_combination_copy(order, comb, genotype_permutations, risk_mask, aux_info, info, risky);
 }
 
-risky_combination* risky_combination_copy(int order, int comb[order], uint8_t** possible_genotypes_combinations, 
-                                          int num_risky, int* risky_idx, void *aux_info, risky_combination* risky) {
+risky_combination* risky_combination_copy(int order, int comb[order], uint8_t** genotype_permutations, 
+                                          uint64_t *risk_mask, void *aux_info, masks_info info, risky_combination* risky) {
     assert(risky);
-    risky->num_risky_genotypes = num_risky;
+    risky->num_risky_genotypes = 0;
     risky->auxiliary_info = aux_info; // TODO improvement: set this using a method-dependant (MDR, MB-MDR) function
     risky->accuracy = 0.0f;
     
     memcpy(risky->combination, comb, order * sizeof(int));
-    for (int i = 0; i < num_risky; i++) {
-        memcpy(risky->genotypes + (order * i), possible_genotypes_combinations[risky_idx[i]], order * sizeof(uint8_t));
+    if (risk_mask) {
+        uint8_t *risky_genotypes[info.num_cell_counts_per_combination];
+        risky->num_risky_genotypes = risk_mask_genotypes(risk_mask, genotype_permutations, info, risky_genotypes);
+        for (int i = 0; i < risky->num_risky_genotypes; i++) {
+            memcpy(risky->genotypes + (order * i), risky_genotypes[i], order * sizeof(uint8_t));
+        }
     }
     
     return risky;
 }
 
 void risky_combination_free(risky_combination* combination) {
-    free(combination->combination);
-    free(combination->genotypes);
     free(combination);
 }
 
@@ -321,130 +386,73 @@ void risky_combination_free(risky_combination* combination) {
  *  Evaluation and ranking  *
  * **************************/
 
-double test_model(int order, risky_combination *risky_comb, uint8_t **genotypes, 
-                  uint8_t *fold_masks, enum evaluation_subset subset, int training_size[2], int testing_size[2], 
+double test_model(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint8_t **genotypes, 
+                  uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
                   masks_info info, unsigned int *conf_matrix) {
     // Get the matrix containing {FP,FN,TP,TN}
-    confusion_matrix(order, risky_comb, genotypes, fold_masks, subset, training_size, testing_size, info, conf_matrix);
+    confusion_matrix(order, risk_mask, genotype_permutations, genotypes, fold_masks, subset, training_size, testing_size, info, conf_matrix);
 
     // Evaluate the model, basing on the confusion matrix
-    double eval = evaluate_model(conf_matrix, BA);
-    risky_comb->accuracy = eval;
-
-    return eval;
+    return evaluate_model(conf_matrix, BA);
 }
 
-void confusion_matrix(int order, risky_combination *combination, uint8_t **genotypes, 
-                      uint8_t *fold_masks, enum evaluation_subset subset, int training_size[2], int testing_size[2], 
+void confusion_matrix(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint8_t **genotypes, 
+                      uint8_t *fold_masks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
                       masks_info info, unsigned int *matrix) {
-    int num_samples = info.num_samples_with_padding;
-    uint8_t confusion_masks[combination->num_risky_genotypes * num_samples];
-    memset(confusion_masks, 0, combination->num_risky_genotypes * num_samples * sizeof(uint8_t));
-    
-    __m128i comb_genotypes;     // The genotype to compare for generating a mask (of the form {0 0 0 0 ... }, {1 1 1 1 ... })
-    __m128i input_genotypes;    // Genotypes from the input dataset
-    __m128i mask;               // Comparison between the reference genotype and input genotypes
+    uint8_t *risky_genotypes[info.num_cell_counts_per_combination];
+    int num_risky = risk_mask_genotypes(risk_mask, genotype_permutations, info, risky_genotypes);
+    epistasis_kernels_get()->confusion_matrix(order, num_risky, risky_genotypes, genotypes, fold_masks, subset, 
+                                              training_size, testing_size, info, matrix);
     
-    // Check whether the input genotypes can be combined in any of the risky combinations
-    for (int i = 0; i < combination->num_risky_genotypes; i++) {
-        // First SNP in the combination
-        comb_genotypes = _mm_set1_epi8(combination->genotypes[i * order]);
-        
-        for (int k = 0; k < num_samples; k += 16) {
-            input_genotypes = _mm_load_si128(genotypes[0] + k);
-            mask = _mm_cmpeq_epi8(input_genotypes, comb_genotypes);
-            _mm_store_si128(confusion_masks + i * num_samples + k, mask);
-        }
-        
-        // Next SNPs in the combination
-        for (int j = 1; j < order; j++) {
-            comb_genotypes = _mm_set1_epi8(combination->genotypes[i * order + j]);
-            
-            for (int k = 0; k < num_samples; k += 16) {
-                input_genotypes = _mm_load_si128(genotypes[j] + k);
-                mask = _mm_load_si128(confusion_masks + i * num_samples + k);
-                mask = _mm_and_si128(mask, _mm_cmpeq_epi8(input_genotypes, comb_genotypes));
-                _mm_store_si128(confusion_masks + i * num_samples + k, mask);
-            }
-        }
-        
-        // Set to zero the positions in padding
-        memset(confusion_masks + i * num_samples + info.num_affected, 
-                0, info.num_affected_with_padding - info.num_affected);
-        memset(confusion_masks + i * num_samples + info.num_affected_with_padding + info.num_unaffected, 
-                0, info.num_unaffected_with_padding - info.num_unaffected);
+    if (subset == TRAINING) {
+        assert(matrix[0] + matrix[1] + matrix[2] + matrix[3] == training_size[0] + training_size[1]);
+    } else {
+        assert(matrix[0] + matrix[1] + matrix[2] + matrix[3] == testing_size[0] + testing_size[1]);
     }
+}
+
+double test_model_bitplanes(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint64_t **bitplanes, 
+                            uint64_t *fold_bitmasks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
+                            masks_info info, unsigned int *conf_matrix) {
+    // Get the matrix containing {FP,FN,TP,TN}
+    confusion_matrix_bitplanes(order, risk_mask, genotype_permutations, bitplanes, fold_bitmasks, subset, training_size, testing_size, info, conf_matrix);
+
+    // Evaluate the model, basing on the confusion matrix
+    return evaluate_model(conf_matrix, BA);
+}
+
+void confusion_matrix_bitplanes(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint64_t **bitplanes, 
+                                uint64_t *fold_bitmasks, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
+                                masks_info info, unsigned int *matrix) {
+    int num_words = info.num_words_per_bitplane;
+    int popcount0 = 0, popcount1 = 0;
+    uint8_t *risky_genotypes[info.num_cell_counts_per_combination];
+    int num_risky = risk_mask_genotypes(risk_mask, genotype_permutations, info, risky_genotypes);
     
-/*
-    printf("confusion masks sse = {\n");
-    for (int j = 0; j < combination->num_risky_genotypes; j++) {
-        printf(" comb %d = { ", j);
-        for (int k = 0; k < num_samples; k++) {
-            printf("%03d ", confusion_masks[j * num_samples + k]);
+    for (int w = 0; w < num_words; w++) {
+        // Merge the samples with any of the risky genotype combinations
+        uint64_t final_or = 0;
+        for (int i = 0; i < num_risky; i++) {
+            uint64_t mask = bitplanes[0][risky_genotypes[i][0] * num_words + w];
+            for (int j = 1; j < order; j++) {
+                mask &= bitplanes[j][risky_genotypes[i][j] * num_words + w];
+            }
+            final_or |= mask;
         }
-        printf("}\n");
-    }
-    printf("}\n");
-*/
-   
-    uint8_t final_masks[num_samples];
-    __m128i final_or, other_mask, xor_mask;
-    xor_mask = _mm_set1_epi8(1);
-    
-    for (int k = 0; k < num_samples; k += 16) {
-        final_or = _mm_load_si128(confusion_masks + k); // First mask
         
-        // Merge all positives (1) and negatives (0)
-        for (int j = 1; j < combination->num_risky_genotypes; j++) {
-            other_mask = _mm_load_si128(confusion_masks + j * num_samples + k);
-            final_or = _mm_or_si128(final_or, other_mask);
-        }
+        // Filter samples only in training/testing folds (bits out of range are always zero in the bitplanes)
+        final_or &= (subset == TRAINING) ? fold_bitmasks[w] : ~fold_bitmasks[w];
         
-        // Filter samples only in training/testing folds
-        other_mask = _mm_load_si128(fold_masks + k);
-        if (subset == TRAINING) {
-            final_or = _mm_and_si128(other_mask, final_or);
+        if (w < info.num_words_affected) {
+            popcount0 += _mm_popcnt_u64(final_or);
         } else {
-            // (not in fold mask) & final_or
-            other_mask = _mm_xor_si128(other_mask, xor_mask);
-            final_or = _mm_and_si128(other_mask, final_or);
-            //final_or = _mm_andnot_si128(other_mask, final_or);
+            popcount1 += _mm_popcnt_u64(final_or);
         }
-        
-        _mm_store_si128(final_masks + k, final_or);
-    }
-/*
-    printf("\n-------------------\n");
-    
-    printf("final masks sse = {\n");
-    for (int k = 0; k < num_samples; k++) {
-        printf("%d ", final_masks[k]);
-    }
-    printf("}\n");
-*/
-
-    // Get the counts (popcount is the number of 1s -> popcount / 8 is the number of positives)
-    int popcount0 = 0, popcount1 = 0;
-    __m128i snp_and;
-    
-    memset(final_masks + info.num_affected, 0, info.num_affected_with_padding - info.num_affected);
-    memset(final_masks + info.num_affected_with_padding + info.num_unaffected, 0, info.num_unaffected_with_padding - info.num_unaffected);
-    
-    for (int k = 0; k < info.num_affected; k += 16) {
-        snp_and = _mm_load_si128(final_masks + k);
-        popcount0 += _mm_popcnt_u64(_mm_extract_epi64(snp_and, 0)) + 
-                     _mm_popcnt_u64(_mm_extract_epi64(snp_and, 1));
-    }
-    
-    for (int k = 0; k < info.num_unaffected; k += 16) {
-        snp_and = _mm_load_si128(final_masks + info.num_affected_with_padding + k);
-        popcount1 += _mm_popcnt_u64(_mm_extract_epi64(snp_and, 0)) + 
-                     _mm_popcnt_u64(_mm_extract_epi64(snp_and, 1));
     }
     
     matrix[0] = popcount0; // TP
     matrix[2] = popcount1; // FP
-   if (subset == TRAINING) {
+    if (subset == TRAINING) {
         matrix[1] = training_size[0] - popcount0; // Total affected - predicted
         matrix[3] = training_size[1] - popcount1; // Total unaffected - predicted
     } else if (subset == TESTING) {
@@ -459,23 +467,161 @@ void confusion_matrix(int order, risky_combination *combination, uint8_t **genot
     }
 }
 
-double evaluate_model(unsigned int *confusion_matrix, enum eval_function function) {
-    double TP = confusion_matrix[0], FN = confusion_matrix[1], FP = confusion_matrix[2], TN = confusion_matrix[3];
+/**
+ * Weighted balanced accuracy of a model, where each cell is weighted by |affected/total_affected - 
+ * unaffected/total_unaffected| of the samples in the evaluated subset.
+ */
+static double weighted_balanced_accuracy(uint64_t *risk_mask, int *counts_aff, int *counts_unaff, int *all_counts_aff, int *all_counts_unaff,
+                                         enum evaluation_subset subset, unsigned int subset_size[2], masks_info info) {
+    double weighted_aff = 0, weighted_unaff = 0;            // All cells
+    double weighted_high_aff = 0, weighted_low_unaff = 0;   // Correctly classified samples
     
-    if (!function) {
-        function = BA;
+    for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+        double aff = (subset == TRAINING) ? counts_aff[c] : all_counts_aff[c] - counts_aff[c];
+        double unaff = (subset == TRAINING) ? counts_unaff[c] : all_counts_unaff[c] - counts_unaff[c];
+        double weight = fabs(aff / subset_size[0] - unaff / subset_size[1]);
+        
+        weighted_aff += weight * aff;
+        weighted_unaff += weight * unaff;
+        if ((risk_mask[c / 64] >> (c % 64)) & 1) {
+            weighted_high_aff += weight * aff;
+        } else {
+            weighted_low_unaff += weight * unaff;
+        }
     }
     
+    return (weighted_high_aff / weighted_aff + weighted_low_unaff / weighted_unaff) / 2;
+}
+
+double test_model_counts(uint64_t *risk_mask, int *counts_aff, int *counts_unaff, int *all_counts_aff, int *all_counts_unaff,
+                         enum eval_function function, enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
+                         masks_info info, unsigned int *conf_matrix) {
+    // Get the matrix containing {FP,FN,TP,TN}
+    confusion_matrix_counts(risk_mask, counts_aff, counts_unaff, all_counts_aff, all_counts_unaff, 
+                            subset, training_size, testing_size, info, conf_matrix);
+
+    // Evaluate the model, basing on the confusion matrix (or the counts, if the confusion matrix is not enough)
+    if (function == wBA) {
+        return weighted_balanced_accuracy(risk_mask, counts_aff, counts_unaff, all_counts_aff, all_counts_unaff, 
+                                          subset, (subset == TRAINING) ? training_size : testing_size, info);
+    }
+    return evaluate_model(conf_matrix, function);
+}
+
+void confusion_matrix_counts(uint64_t *risk_mask, int *counts_aff, int *counts_unaff, int *all_counts_aff, int *all_counts_unaff,
+                             enum evaluation_subset subset, unsigned int training_size[2], unsigned int testing_size[2], 
+                             masks_info info, unsigned int *matrix) {
+    int training_aff = 0, training_unaff = 0;
+    int all_aff = 0, all_unaff = 0;
+    
+    for (int w = 0; w < info.num_words_per_risk_mask; w++) {
+        for (uint64_t bits = risk_mask[w]; bits; bits &= bits - 1) {
+            int c = w * 64 + __builtin_ctzll(bits);
+            training_aff += counts_aff[c];
+            training_unaff += counts_unaff[c];
+            all_aff += all_counts_aff[c];
+            all_unaff += all_counts_unaff[c];
+        }
+    }
+    
+    if (subset == TRAINING) {
+        matrix[0] = training_aff; // TP
+        matrix[2] = training_unaff; // FP
+        matrix[1] = training_size[0] - training_aff; // Total affected - predicted
+        matrix[3] = training_size[1] - training_unaff; // Total unaffected - predicted
+    } else {
+        matrix[0] = all_aff - training_aff;
+        matrix[2] = all_unaff - training_unaff;
+        matrix[1] = testing_size[0] - matrix[0];
+        matrix[3] = testing_size[1] - matrix[2];
+    }
+}
+
+/**
+ * Terms of the likelihood ratio, where 0 * log(0) is 0.
+ */
+static inline double g_term(double observed, double expected) {
+    return observed > 0 ? observed * log(observed / expected) : 0;
+}
+
+bool model_upper_bound_available(enum eval_function function, enum evaluation_subset subset) {
+    return subset == TRAINING && (function == BA || function == CA);
+}
+
+double model_upper_bound(int *all_counts_aff, int *all_counts_unaff, enum eval_function function, unsigned int training_size[2], 
+                         masks_info info) {
+    // A fold can't contain more samples of a genotype permutation than all samples, nor than the fold itself
+    double bound_aff = 0, bound_unaff = 0;
+    for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+        int aff = MIN(all_counts_aff[c], (int) training_size[0]);
+        int unaff = MIN(all_counts_unaff[c], (int) training_size[1]);
+        
+        if (function == BA) {
+            // Whichever group weighs more in the balanced accuracy would be classified correctly
+            if ((double) aff * training_size[1] >= (double) unaff * training_size[0]) {
+                bound_aff += aff;
+            } else {
+                bound_unaff += unaff;
+            }
+        } else if (aff >= unaff) {
+            bound_aff += aff;
+        } else {
+            bound_unaff += unaff;
+        }
+    }
+    
+    bound_aff = MIN(bound_aff, training_size[0]);
+    bound_unaff = MIN(bound_unaff, training_size[1]);
+    if (function == BA) {
+        return (bound_aff / training_size[0] + bound_unaff / training_size[1]) / 2;
+    }
+    return (bound_aff + bound_unaff) / (training_size[0] + training_size[1]);
+}
+
+double evaluate_model(unsigned int *confusion_matrix, enum eval_function function) {
+    double TP = confusion_matrix[0], FN = confusion_matrix[1], FP = confusion_matrix[2], TN = confusion_matrix[3];
+    double N = TP + FN + FP + TN;
+    
     switch(function) {
         case CA:
-            return (TP + TN) / (TP + FN + TN + FP);
+            return (TP + TN) / N;
         case BA:
             return ((TP / (TP + FN)) + (TN / (TN + FP))) / 2;
         case GAMMA:
             return (TP * TN - FP * FN) / (TP * TN + FP * FN);
         case TAU_B:
             return (TP * TN - FP * FN) / sqrt((TP + FN) * (TN + FP) * (TP + FP) * (TN + FN));
+        case CHI_SQUARE:
+            // Both statistics grow as much when high risk predicts unaffected, which is not a better model than none
+            if (TP * TN < FP * FN) {
+                return 0;
+            }
+            return N * (TP * TN - FP * FN) * (TP * TN - FP * FN) / ((TP + FN) * (TN + FP) * (TP + FP) * (TN + FN));
+        case LIKELIHOOD_RATIO:
+            if (TP * TN < FP * FN) {
+                return 0;
+            }
+            // Expected counts are the product of the marginals of each cell
+            return 2 * (g_term(TP, (TP + FN) * (TP + FP) / N) + g_term(FN, (TP + FN) * (FN + TN) / N) + 
+                        g_term(FP, (FP + TN) * (TP + FP) / N) + g_term(TN, (FP + TN) * (FN + TN) / N));
+        default:
+            return NAN;
+    }
+}
+
+static const char *eval_function_names[NUM_EVAL_FUNCTIONS] = { "ca", "ba", "wba", "gamma", "tau-b", "chi-square", "likelihood-ratio" };
+
+const char *eval_function_name(enum eval_function function) {
+    return eval_function_names[function];
+}
+
+int eval_function_from_name(const char *name) {
+    for (int i = 0; name && i < NUM_EVAL_FUNCTIONS; i++) {
+        if (!strcmp(name, eval_function_names[i])) {
+            return i;
+        }
     }
+    return -1;
 }
 
 int add_to_model_ranking(risky_combination *risky_comb, int max_ranking_size, struct heap *ranking_risky,
@@ -521,6 +667,94 @@ int add_to_model_ranking(risky_combination *risky_comb, int max_ranking_size, st
 }
 
 
+/* **************************
+ *      Top-K rankings      *
+ * **************************/
+
+model_ranking *model_ranking_new(int capacity) {
+    model_ranking *ranking = malloc(sizeof(model_ranking));
+    ranking->capacity = capacity;
+    ranking->size = 0;
+    ranking->threshold = (capacity > 0) ? -INFINITY : INFINITY;
+    ranking->entries = malloc(capacity * sizeof(model_ranking_entry));
+    return ranking;
+}
+
+void model_ranking_free(model_ranking *ranking) {
+    for (int i = 0; i < ranking->size; i++) {
+        risky_combination_free(ranking->entries[i].model);
+    }
+    free(ranking->entries);
+    free(ranking);
+}
+
+static void model_ranking_sift_down(model_ranking *ranking, int i) {
+    model_ranking_entry *entries = ranking->entries;
+    model_ranking_entry moved = entries[i];
+    
+    while (2 * i + 1 < ranking->size) {
+        int child = 2 * i + 1;
+        if (child + 1 < ranking->size && entries[child + 1].accuracy < entries[child].accuracy) {
+            child++;
+        }
+        if (moved.accuracy <= entries[child].accuracy) {
+            break;
+        }
+        entries[i] = entries[child];
+        i = child;
+    }
+    entries[i] = moved;
+}
+
+static void model_ranking_sift_up(model_ranking *ranking, int i) {
+    model_ranking_entry *entries = ranking->entries;
+    model_ranking_entry moved = entries[i];
+    
+    while (i > 0 && moved.accuracy < entries[(i - 1) / 2].accuracy) {
+        entries[i] = entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    entries[i] = moved;
+}
+
+risky_combination *model_ranking_insert(model_ranking *ranking, risky_combination *model) {
+    // Same criteria as add_to_model_ranking: while not full any model enters, then only better ones
+    if (ranking->size < ranking->capacity) {
+        ranking->entries[ranking->size].accuracy = model->accuracy;
+        ranking->entries[ranking->size].model = model;
+        model_ranking_sift_up(ranking, ranking->size++);
+        if (ranking->size == ranking->capacity) {
+            ranking->threshold = ranking->entries[0].accuracy;
+        }
+        return NULL;
+    }
+    
+    if (!model_ranking_accepts(ranking, model->accuracy)) {
+        return model;
+    }
+    
+    // Replace the worst model
+    risky_combination *worst = ranking->entries[0].model;
+    ranking->entries[0].accuracy = model->accuracy;
+    ranking->entries[0].model = model;
+    model_ranking_sift_down(ranking, 0);
+    ranking->threshold = ranking->entries[0].accuracy;
+    return worst;
+}
+
+risky_combination *model_ranking_take(model_ranking *ranking) {
+    if (ranking->size == 0) {
+        return NULL;
+    }
+    
+    risky_combination *worst = ranking->entries[0].model;
+    ranking->entries[0] = ranking->entries[--ranking->size];
+    model_ranking_sift_down(ranking, 0);
+    ranking->threshold = (ranking->capacity > 0) ? -INFINITY : INFINITY;
+    return worst;
+}
+
+
 int compare_risky_heap_count_max(struct heap_node* a, struct heap_node* b) {
     risky_combination *r1 = (risky_combination*) a->value;
     risky_combination *r2 = (risky_combination*) b->value;
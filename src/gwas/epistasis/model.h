@@ -66,6 +66,11 @@ typedef struct {
     int num_masks;
     int num_combinations_in_a_row;
     int num_cell_counts_per_combination;
+    int num_words_affected;         /**< 64-bit words per bitplane needed to store the affected samples */
+    int num_words_unaffected;       /**< 64-bit words per bitplane needed to store the unaffected samples */
+    int num_words_per_bitplane;     /**< 64-bit words per bitplane (affected followed by unaffected) */
+    int num_words_per_snp;          /**< 64-bit words between the bitplanes of consecutive SNPs, multiple of 64 bytes */
+    int num_words_per_risk_mask;    /**< 64-bit words of the mask of high risk genotype permutations of a combination */
     uint8_t *masks;
 } masks_info;
 
@@ -77,11 +82,32 @@ enum evaluation_mode { CV_C, CV_A };
  * @details Functions available for evaluating the results of a MDR model. These are:
  * - CA: accuracy
  * - BA: balanced accuracy, used by the original MDR
- * - wBA: weighted balanced accuracy, Namkung et al. (2008) TODO
+ * - wBA: weighted balanced accuracy, Namkung et al. (2009), where each cell is weighted by the difference 
+ *   between its ratios of affected and unaffected samples. Needs the counts of each cell.
  * - Gamma: Goodman and Kruskal (1954)
  * - Tau-b: Kendall rank correlation coefficient
+ * - Chi-square: Pearson's chi-square of the high/low risk vs affected/unaffected table
+ * - Likelihood ratio: G statistic of the same table
+ * 
+ * Chi-square and likelihood ratio are 0 for inverted models, whose high risk cells have relatively more 
+ * unaffected samples than the low risk ones.
+ * 
+ * Greater values always mean better models.
  **/
-enum eval_function { CA, BA, wBA, GAMMA, TAU_B };
+enum eval_function { CA, BA, wBA, GAMMA, TAU_B, CHI_SQUARE, LIKELIHOOD_RATIO };
+
+#define NUM_EVAL_FUNCTIONS      7
+
+/**
+ * @brief Gets the name of an evaluation function, as used in the options of the tool.
+ **/
+const char *eval_function_name(enum eval_function function);
+
+/**
+ * @brief Gets an evaluation function from its name.
+ * @return The evaluation function, or -1 if the name does not correspond to any
+ **/
+int eval_function_from_name(const char *name);
 
 
 /* **************************
@@ -105,34 +131,170 @@ void set_genotypes_masks(int order, uint8_t **genotypes, int num_combinations, u
 void combination_counts(int order, uint8_t *masks, uint8_t **genotype_combinations, int num_genotype_combinations, 
                         int *counts_aff, int *counts_unaff, masks_info info);
 
+/**
+ * @brief Gets the counts of a row of combinations in the training partition of several folds.
+ * @details Gets the counts of a row of combinations in the training partition of several folds. The AND 
+ * of the genotype masks is calculated once per cell, and then combined with every fold mask, so the folds 
+ * of several cross-validation repetitions can be processed together for just an extra AND and popcount each.
+ **/
 void combination_counts_all_folds(int order, uint8_t *fold_masks, int num_folds,
                                   uint8_t **genotype_permutations, uint8_t *masks, masks_info info, 
                                   int *counts_aff, int *counts_unaff);
 
+/**
+ * @brief Generates the genotype masks of every SNP in a block.
+ * @details Generates the genotype masks of every SNP in a block, so they can be reused by all the combinations 
+ * the SNP takes part in. The NUM_GENOTYPES masks of SNP i start at masks + i * NUM_GENOTYPES * num_samples_with_padding.
+ * 
+ * @param num_variants Number of SNPs in the block
+ * @param genotypes Genotypes of the SNPs, with padding as described by info
+ * @param info Masks information
+ * @param[out] masks Buffer of num_variants * NUM_GENOTYPES * info.num_samples_with_padding bytes
+ **/
+void set_block_genotypes_masks(int num_variants, uint8_t *genotypes, masks_info info, uint8_t *masks);
+
+/**
+ * @brief Same as combination_counts_all_folds, but reading the masks of each SNP from a block masks cache.
+ * 
+ * @param num_combinations Number of combinations in the row (can be less than info.num_combinations_in_a_row)
+ * @param snp_masks Masks of each SNP in each combination of the row (num_combinations * order pointers), 
+ * as generated by set_block_genotypes_masks
+ **/
+void combination_counts_all_folds_cached(int order, int num_combinations, uint8_t *fold_masks, int num_folds,
+                                         uint8_t **genotype_permutations, uint8_t **snp_masks, masks_info info, 
+                                         int *counts_aff, int *counts_unaff);
+
 void masks_info_init(int order, int num_combinations_in_a_row, int num_affected, int num_unaffected, masks_info *info);
 
 
 /* **************************
- *         High risk        *
+ *         Bitplanes        *
  * **************************/
 
-int* choose_high_risk_combinations2(unsigned int* counts_aff, unsigned int* counts_unaff, 
-                                   unsigned int num_combinations, unsigned int num_counts_per_combination,
-                                   unsigned int num_affected, unsigned int num_unaffected, 
-                                   unsigned int *num_risky, void** aux_ret, 
-                                   int* (*test_func)(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, void **));
+/**
+ * @brief Packs the genotypes of a set of SNPs into bitplanes.
+ * @details Packs the genotypes of a set of SNPs into bitplanes. Each SNP is stored as NUM_GENOTYPES 
+ * bit-vectors (one per genotype), so bit i of bitplane g is set when sample i has genotype g. Affected 
+ * samples are packed first and unaffected ones start in a new word. Bits out of the samples range are zero.
+ * 
+ * @param num_variants Number of SNPs to pack
+ * @param genotypes Genotypes of the SNPs, with padding as described by info
+ * @param info Masks information
+ * @param[out] bitplanes Buffer of num_variants * info.num_words_per_snp words
+ **/
+void set_genotypes_bitplanes(int num_variants, uint8_t *genotypes, masks_info info, uint64_t *bitplanes);
+
+/**
+ * @brief Packs the masks of a set of folds into bit-vectors with the same layout as the genotype bitplanes.
+ **/
+void set_fold_bitmasks(int num_folds, uint8_t *fold_masks, masks_info info, uint64_t *fold_bitmasks);
+
+/**
+ * @brief Appends a mask of all samples to the masks of a set of folds.
+ * @details Appends a mask of all samples to the masks of a set of folds. When counting with the resulting masks, 
+ * the counts of all samples are obtained along with the ones of each fold, so the counts of the samples out of 
+ * a fold can be derived as the difference. The original masks are freed.
+ * 
+ * @return The num_folds + 1 masks
+ **/
+uint8_t *add_all_samples_mask(int num_folds, uint8_t *fold_masks, masks_info info);
+
+/**
+ * @brief Same as combination_counts_all_folds, but over bitplanes.
+ * @details Same as combination_counts_all_folds, but over bitplanes. Instead of byte masks, the counts 
+ * are obtained by AND and popcount of 64-bit words, so the memory traffic is 8 times lower.
+ * 
+ * @param num_combinations Number of combinations in the row (can be less than info.num_combinations_in_a_row)
+ * @param bitplanes Bitplanes of each SNP in each combination of the row (num_combinations * order pointers)
+ **/
+void combination_counts_all_folds_bitplanes(int order, int num_combinations, uint64_t *fold_bitmasks, int num_folds,
+                                            uint8_t **genotype_permutations, uint64_t **bitplanes, masks_info info,
+                                            int *counts_aff, int *counts_unaff);
+
+
+/* **************************
+ *       Prefix masks       *
+ * **************************/
+
+/**
+ * @brief Cache of the AND of the masks of the first order-1 SNPs of a combination.
+ * @details Cache of the AND of the masks of the first order-1 SNPs of a combination, one per genotype permutation 
+ * of those SNPs. Consecutive combinations in a block only differ in their last SNP, so storing these partial 
+ * results allows counting with a single AND per cell, as if the combination had order 2. The same cache works 
+ * for byte masks and bitplanes, since both store the NUM_GENOTYPES planes of a SNP consecutively.
+ */
+typedef struct {
+    int order;
+    int num_slots;                  /**< Prefixes stored at the same time, one per combination in a row */
+    int num_prefix_permutations;    /**< Genotype permutations of the first order-1 SNPs */
+    size_t plane_size;              /**< Bytes of each mask (or bitplane) */
+    int last_slot;                  /**< Slot of the last prefix requested */
+    uint8_t **slot_snps;            /**< Masks of the SNPs whose prefix is stored in each slot */
+    uint8_t *planes;                /**< num_prefix_permutations masks per slot */
+    uint8_t **pair_permutations;    /**< Each genotype permutation as (prefix permutation, genotype of the last SNP) */
+} prefix_masks_cache;
+
+/**
+ * @brief Initializes a cache of prefix masks.
+ * 
+ * @param order Number of SNPs combined, at least 3 for the cache to be useful
+ * @param plane_size Bytes of each mask: info.num_samples_with_padding for byte masks, or 
+ * info.num_words_per_bitplane * sizeof(uint64_t) for bitplanes
+ * @param info Masks information
+ * @param[out] cache Cache to initialize
+ **/
+void prefix_masks_cache_init(int order, size_t plane_size, masks_info info, prefix_masks_cache *cache);
+
+void prefix_masks_cache_free(prefix_masks_cache *cache);
+
+/**
+ * @brief Discards all prefixes in the cache, so it can be used with the masks of another block.
+ **/
+void prefix_masks_cache_reset(prefix_masks_cache *cache);
+
+/**
+ * @brief Gets the masks of the first order-1 SNPs of a combination, combined for each of their genotype permutations.
+ * @details Gets the masks of the first order-1 SNPs of a combination, combined for each of their genotype permutations. 
+ * They are generated only if the prefix is different from the one requested last. The result can be used as the 
+ * masks of the first SNP of an order 2 combination, along with cache->pair_permutations.
+ * 
+ * @param snp_planes Masks (or bitplanes) of the first order-1 SNPs
+ * @param cache Cache of prefixes
+ * @return The masks of the prefix, valid until num_slots different prefixes are requested
+ **/
+uint8_t *prefix_masks_cache_get(uint8_t **snp_planes, prefix_masks_cache *cache);
+
+
+/* **************************
+ *         High risk        *
+ * **************************/
 
 int* choose_high_risk_combinations(unsigned int* counts_aff, unsigned int* counts_unaff, unsigned int num_counts, 
                                    unsigned int num_affected, unsigned int num_unaffected, 
                                    unsigned int *num_risky, void** aux_ret, 
                                    bool (*test_func)(unsigned int, unsigned int, unsigned int, unsigned int, void **));
 
+/**
+ * @brief Gets the genotype permutations set in a risk mask.
+ * 
+ * @param risk_mask Mask of high risk genotype permutations, as returned by mdr_high_risk_masks
+ * @param genotype_permutations All possible genotype permutations, as returned by get_genotype_combinations
+ * @param[out] risky_genotypes Genotypes of each high risk permutation, info.num_cell_counts_per_combination at most
+ * @return Number of high risk permutations
+ **/
+int risk_mask_genotypes(uint64_t *risk_mask, uint8_t **genotype_permutations, masks_info info, uint8_t **risky_genotypes);
 
-risky_combination *risky_combination_new(int order, int comb[order], uint8_t **possible_genotypes_combinations, 
-                                         int num_risky, int *risky_idx, void *aux_info, masks_info info);
+/**
+ * @brief Creates the record of a model, whose risky genotypes are those set in risk_mask (none if it is NULL).
+ **/
+risky_combination *risky_combination_new(int order, int comb[order], uint8_t **genotype_permutations, 
+                                         uint64_t *risk_mask, void *aux_info, masks_info info);
 
-risky_combination* risky_combination_copy(int order, int comb[order], uint8_t** possible_genotypes_combinations, 
-                                          int num_risky, int* risky_idx, void *aux_info, risky_combination* risky);
+/**
+ * @brief Overwrites the record of a model, which must have been created by risky_combination_new.
+ **/
+risky_combination* risky_combination_copy(int order, int comb[order], uint8_t** genotype_permutations, 
+                                          uint64_t *risk_mask, void *aux_info, masks_info info, risky_combination* risky);
 
 void risky_combination_free(risky_combination *combination);
 
@@ -141,20 +303,140 @@ void risky_combination_free(risky_combination *combination);
  *  Evaluation and ranking  *
  * **************************/
 
-double test_model(int order, risky_combination *risky_comb, uint8_t **genotypes, 
-                  uint8_t *fold_masks, enum evaluation_subset mode, int training_size[2], int testing_size[2], 
+/**
+ * @brief Gets the balanced accuracy of a model over the training or testing samples of a fold.
+ * 
+ * @param risk_mask Mask of the high risk genotype permutations of the model
+ * @param genotype_permutations All possible genotype permutations, as returned by get_genotype_combinations
+ * @param genotypes Genotypes of the SNPs in the combination
+ * @param[out] conf_matrix Confusion matrix of the model, as {TP,FN,FP,TN}
+ * @return The balanced accuracy of the model
+ **/
+double test_model(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint8_t **genotypes, 
+                  uint8_t *fold_masks, enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
                   masks_info info, unsigned int *conf_matrix);
 
-void confusion_matrix(int order, risky_combination *combination, uint8_t **genotypes, 
-                      uint8_t *fold_masks, enum evaluation_subset mode, int training_size[2], int testing_size[2], 
+void confusion_matrix(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint8_t **genotypes, 
+                      uint8_t *fold_masks, enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
                       masks_info info, unsigned int *matrix);
 
+double test_model_bitplanes(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint64_t **bitplanes, 
+                            uint64_t *fold_bitmasks, enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
+                            masks_info info, unsigned int *conf_matrix);
+
+void confusion_matrix_bitplanes(int order, uint64_t *risk_mask, uint8_t **genotype_permutations, uint64_t **bitplanes, 
+                                uint64_t *fold_bitmasks, enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
+                                masks_info info, unsigned int *matrix);
+
+/**
+ * @brief Same as test_model, but from the counts of each genotype permutation instead of the genotypes.
+ * 
+ * @param counts_aff Counts of affected samples in the training partition, one per genotype permutation
+ * @param counts_unaff Counts of unaffected samples in the training partition, one per genotype permutation
+ * @param all_counts_aff Counts of all affected samples, one per genotype permutation
+ * @param all_counts_unaff Counts of all unaffected samples, one per genotype permutation
+ * @param function Function the model is evaluated with, any of them can be used
+ **/
+double test_model_counts(uint64_t *risk_mask, int *counts_aff, int *counts_unaff, int *all_counts_aff, int *all_counts_unaff,
+                         enum eval_function function, enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
+                         masks_info info, unsigned int *conf_matrix);
+
+/**
+ * @brief Same as confusion_matrix, but from the counts of each genotype permutation instead of the genotypes.
+ * @details Same as confusion_matrix, but from the counts of each genotype permutation instead of the genotypes. 
+ * The positives are the sum of the counts of the risky permutations, and the counts of the testing partition 
+ * are those of all samples minus the training ones, so no sample is scanned.
+ **/
+void confusion_matrix_counts(uint64_t *risk_mask, int *counts_aff, int *counts_unaff, int *all_counts_aff, int *all_counts_unaff,
+                             enum evaluation_subset mode, unsigned int training_size[2], unsigned int testing_size[2], 
+                             masks_info info, unsigned int *matrix);
+
+/**
+ * @brief Whether the evaluation of models can be bounded from their counts over all samples.
+ * @details Whether the evaluation of models can be bounded from their counts over all samples (see 
+ * model_upper_bound). Only the classification and balanced accuracies over the training samples can be.
+ **/
+bool model_upper_bound_available(enum eval_function function, enum evaluation_subset subset);
+
+/**
+ * @brief Gets an upper bound of the evaluation of a model over the training samples of a fold.
+ * @details Gets an upper bound of the evaluation of a model over the training samples of a fold, from the counts 
+ * of all samples alone, so no fold needs to be counted. Each genotype permutation contributes its group with more 
+ * weight in the evaluation, as if classified correctly and with all its samples in the fold (but never more than 
+ * the fold contains). Valid only when model_upper_bound_available.
+ *
+ * @param all_counts_aff Counts of all affected samples, one per genotype permutation
+ * @param all_counts_unaff Counts of all unaffected samples, one per genotype permutation
+ * @param training_size Affected and unaffected samples in the training partition of the fold
+ * @return An evaluation the model can't exceed in the fold
+ **/
+double model_upper_bound(int *all_counts_aff, int *all_counts_unaff, enum eval_function function, unsigned int training_size[2], 
+                         masks_info info);
+
+/**
+ * @brief Evaluates a model from its confusion matrix, as {TP,FN,FP,TN}.
+ * @details Evaluates a model from its confusion matrix, as {TP,FN,FP,TN}. The weighted balanced accuracy can't 
+ * be obtained from the confusion matrix alone (NaN is returned), use test_model_counts instead.
+ **/
 double evaluate_model(unsigned int *confusion_matrix, enum eval_function function);
 
 int add_to_model_ranking(risky_combination *risky_comb, int max_ranking_size, struct heap *ranking_risky,
                          compare_risky_heap_func priority_func);
 
 
+/* **************************
+ *      Top-K rankings      *
+ * **************************/
+
+typedef struct {
+    double accuracy;                /**< Copy of the accuracy of the model, so comparisons don't dereference it */
+    risky_combination *model;
+} model_ranking_entry;
+
+/**
+ * @brief Best models found in a fold, up to a fixed number of them.
+ * @details Best models found in a fold, up to a fixed number of them. Entries form a binary min-heap over a flat 
+ * array, keyed by accuracy, so the worst model is always the first one. Once the ranking is full, a model enters 
+ * only if it is better than the worst one, which can be checked with a single comparison against the threshold.
+ */
+typedef struct {
+    int capacity;
+    int size;
+    double threshold;               /**< Accuracy a model must exceed to enter the ranking, -INFINITY while not full */
+    model_ranking_entry *entries;
+} model_ranking;
+
+model_ranking *model_ranking_new(int capacity);
+
+/**
+ * @brief Frees a ranking and the models it contains.
+ **/
+void model_ranking_free(model_ranking *ranking);
+
+/**
+ * @brief Whether a model with the given accuracy would enter the ranking.
+ **/
+static inline bool model_ranking_accepts(model_ranking *ranking, double accuracy) {
+    return accuracy > ranking->threshold;
+}
+
+/**
+ * @brief Inserts a model in a ranking, if it is good enough.
+ * @details Inserts a model in a ranking, if it is good enough. When the ranking is full, the worst model is 
+ * taken out to make room for the new one.
+ *
+ * @return The model left out of the ranking (the worst one, or the new one if rejected), NULL if none
+ **/
+risky_combination *model_ranking_insert(model_ranking *ranking, risky_combination *model);
+
+/**
+ * @brief Takes the worst model out of a ranking.
+ *
+ * @return The worst model, NULL if the ranking is empty
+ **/
+risky_combination *model_ranking_take(model_ranking *ranking);
+
+
 int compare_risky_heap_count_max(struct heap_node* a, struct heap_node* b);
 
 int compare_risky_heap_count_min(struct heap_node* a, struct heap_node* b);
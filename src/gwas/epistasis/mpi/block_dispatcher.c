@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block_dispatcher.h"
+
+/**
+ * Takes the next chunk of blocks in the root process. Its size is a fraction of the pending blocks, so
+ * chunks shrink towards the end, but never less than one block per thread.
+ */
+static size_t take_chunk(block_dispatcher *dispatcher, size_t *first) {
+    omp_set_lock(&(dispatcher->root_lock));
+
+    size_t remaining = dispatcher->num_blocks - dispatcher->next_block;
+    size_t num_parts = 2 * dispatcher->num_mpi_ranks;
+    size_t count = (remaining + num_parts - 1) / num_parts;
+    if (count < dispatcher->num_threads) {
+        count = dispatcher->num_threads;
+    }
+    if (count > remaining) {
+        count = remaining;
+    }
+
+    *first = dispatcher->next_block;
+    dispatcher->next_block += count;
+
+    omp_unset_lock(&(dispatcher->root_lock));
+    return count;
+}
+
+static size_t request_chunk(block_dispatcher *dispatcher, size_t *first) {
+    if (dispatcher->mpi_rank == 0) {
+        return take_chunk(dispatcher, first);
+    }
+
+    int request = dispatcher->mpi_rank;
+    long chunk[2];
+    MPI_Send(&request, 1, MPI_INT, 0, TAG_BLOCK_REQUEST, dispatcher->comm);
+    MPI_Recv(chunk, 2, MPI_LONG, 0, TAG_BLOCK_CHUNK, dispatcher->comm, MPI_STATUS_IGNORE);
+
+    *first = (size_t) chunk[0];
+    return (size_t) chunk[1];
+}
+
+
+block_dispatcher *block_dispatcher_new(bool dynamic, int num_threads, int order, int *block_coords, size_t num_blocks,
+                                       int stride, size_t num_variants, MPI_Comm comm) {
+    block_dispatcher *dispatcher = calloc(1, sizeof(block_dispatcher));
+    dispatcher->dynamic = dynamic;
+    dispatcher->num_threads = num_threads;
+    dispatcher->num_blocks = num_blocks;
+    dispatcher->comm = comm;
+    MPI_Comm_rank(comm, &(dispatcher->mpi_rank));
+    MPI_Comm_size(comm, &(dispatcher->num_mpi_ranks));
+
+    if (dynamic) {
+        // Largest blocks first, so the smallest chunks at the end contain the smallest blocks
+        dispatcher->blocks = get_blocks_by_num_combinations(order, block_coords, num_blocks, stride, num_variants, NULL);
+        dispatcher->num_active_ranks = dispatcher->num_mpi_ranks - 1;
+    } else {
+        // All blocks of the process are available from the beginning
+        dispatcher->chunk_end = num_blocks;
+        dispatcher->finished = true;
+    }
+
+    omp_init_lock(&(dispatcher->root_lock));
+    omp_init_lock(&(dispatcher->lock));
+    return dispatcher;
+}
+
+bool block_dispatcher_needs_server(block_dispatcher *dispatcher) {
+    return dispatcher->dynamic && dispatcher->mpi_rank == 0 && dispatcher->num_active_ranks > 0;
+}
+
+void block_dispatcher_serve(block_dispatcher *dispatcher) {
+    while (dispatcher->num_active_ranks > 0) {
+        int pending;
+        MPI_Status stat;
+        MPI_Iprobe(MPI_ANY_SOURCE, TAG_BLOCK_REQUEST, dispatcher->comm, &pending, &stat);
+        if (!pending) {
+            usleep(DISPATCHER_POLL_USECS);
+            continue;
+        }
+
+        int request;
+        MPI_Recv(&request, 1, MPI_INT, stat.MPI_SOURCE, TAG_BLOCK_REQUEST, dispatcher->comm, MPI_STATUS_IGNORE);
+
+        size_t first;
+        size_t count = take_chunk(dispatcher, &first);
+        long chunk[2] = { (long) first, (long) count };
+        MPI_Send(chunk, 2, MPI_LONG, stat.MPI_SOURCE, TAG_BLOCK_CHUNK, dispatcher->comm);
+
+        // A process that receives an empty chunk won't request more
+        if (count == 0) {
+            dispatcher->num_active_ranks--;
+        }
+        LOG_DEBUG_F("Dispatcher: %zu blocks from %zu sent to P%d\n", count, first, stat.MPI_SOURCE);
+    }
+}
+
+bool block_dispatcher_next(block_dispatcher *dispatcher, size_t *block) {
+    omp_set_lock(&(dispatcher->lock));
+
+    // Only one thread waits for the next chunk, the rest of them wait for the lock
+    if (dispatcher->chunk_next == dispatcher->chunk_end && !dispatcher->finished) {
+        double start = omp_get_wtime();
+        size_t first;
+        size_t count = request_chunk(dispatcher, &first);
+        dispatcher->wait_time += omp_get_wtime() - start;
+
+        if (count > 0) {
+            dispatcher->chunk_next = first;
+            dispatcher->chunk_end = first + count;
+            dispatcher->num_chunks++;
+        } else {
+            dispatcher->finished = true;
+        }
+    }
+
+    bool has_block = dispatcher->chunk_next < dispatcher->chunk_end;
+    if (has_block) {
+        size_t position = dispatcher->chunk_next++;
+        *block = dispatcher->blocks ? dispatcher->blocks[position] : position;
+        dispatcher->num_blocks_taken++;
+    }
+
+    omp_unset_lock(&(dispatcher->lock));
+    return has_block;
+}
+
+void block_dispatcher_report(block_dispatcher *dispatcher) {
+    if (dispatcher->dynamic) {
+        LOG_INFO_F("P%d) %zu blocks in %zu chunks, %.3f s waiting for them\n", dispatcher->mpi_rank,
+                   dispatcher->num_blocks_taken, dispatcher->num_chunks, dispatcher->wait_time);
+    } else {
+        LOG_INFO_F("P%d) %zu blocks\n", dispatcher->mpi_rank, dispatcher->num_blocks_taken);
+    }
+}
+
+void block_dispatcher_free(block_dispatcher *dispatcher) {
+    omp_destroy_lock(&(dispatcher->root_lock));
+    omp_destroy_lock(&(dispatcher->lock));
+    free(dispatcher->blocks);
+    free(dispatcher);
+}
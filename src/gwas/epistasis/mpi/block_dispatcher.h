@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MPI_BLOCK_DISPATCHER_H
+#define MPI_BLOCK_DISPATCHER_H
+
+/**
+ * @file block_dispatcher.h
+ * @brief Distribution of blocks of combinations among the threads of the MPI processes
+ *
+ * In static mode, each process only knows its own blocks, which are taken by its threads one at a time.
+ *
+ * In dynamic mode, all processes know all blocks, sorted by their number of combinations (largest first).
+ * The root process hands them out in chunks, on request, so a process that is slower or got heavier blocks
+ * does not delay the rest. Chunks shrink as the pending work decreases (guided scheduling), so all processes
+ * finish at about the same time. A dedicated thread of the root process answers the requests of the others,
+ * while the threads of the root process take their chunks directly.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mpi.h>
+#include <omp.h>
+
+#include <commons/log.h>
+
+#include "../scheduler.h"
+#include "mpi_epistasis_helper.h"
+
+/**
+ * Microseconds the dispatcher thread sleeps when no requests are pending, so it doesn't compete with the
+ * threads processing blocks in the root process.
+ */
+#define DISPATCHER_POLL_USECS   200
+
+typedef struct {
+    bool dynamic;               /**< Whether blocks are requested to the root process */
+    int mpi_rank;
+    int num_mpi_ranks;
+    int num_threads;            /**< Threads processing blocks in each process */
+    MPI_Comm comm;
+
+    size_t num_blocks;
+    size_t *blocks;             /**< Blocks in the order they are handed out, NULL in static mode */
+
+    // State of the root process (dynamic mode only)
+    size_t next_block;          /**< First block not handed out yet */
+    int num_active_ranks;       /**< Processes that have not been told yet that no blocks are left */
+    omp_lock_t root_lock;
+
+    // Chunk of blocks being processed by the threads of this process
+    size_t chunk_next;
+    size_t chunk_end;
+    bool finished;              /**< Whether the root process has no more blocks to hand out */
+    omp_lock_t lock;
+
+    // Statistics
+    size_t num_chunks;
+    size_t num_blocks_taken;
+    double wait_time;           /**< Seconds spent waiting for a chunk from the root process */
+} block_dispatcher;
+
+
+/**
+ * @brief Creates a dispatcher for the blocks of a sweep over the combinations.
+ * @details Creates a dispatcher for the blocks of a sweep over the combinations. In dynamic mode, all
+ * processes must create it with the same blocks.
+ *
+ * @param dynamic Whether blocks are requested to the root process or were already split among processes
+ * @param num_threads Number of threads that process blocks in each process
+ * @param order Number of SNPs combined
+ * @param block_coords Coordinates of the blocks, order values per block
+ * @param num_blocks Number of blocks
+ * @param stride Number of SNPs per block
+ * @param num_variants Number of SNPs in the dataset
+ * @return A new dispatcher
+ **/
+block_dispatcher *block_dispatcher_new(bool dynamic, int num_threads, int order, int *block_coords, size_t num_blocks,
+                                       int stride, size_t num_variants, MPI_Comm comm);
+
+/**
+ * @brief Whether this process must run block_dispatcher_serve in a dedicated thread.
+ **/
+bool block_dispatcher_needs_server(block_dispatcher *dispatcher);
+
+/**
+ * @brief Answers the requests of chunks of blocks from other processes, until all of them are finished.
+ **/
+void block_dispatcher_serve(block_dispatcher *dispatcher);
+
+/**
+ * @brief Gets the next block a thread has to process.
+ * @details Gets the next block a thread has to process. If the chunk of the process is empty, a new one is
+ * requested to the root process, so the caller could block for a while.
+ *
+ * @param[out] block Index of the block to process
+ * @return Whether there was any block left
+ **/
+bool block_dispatcher_next(block_dispatcher *dispatcher, size_t *block);
+
+/**
+ * @brief Logs the blocks and chunks received by the process, and how long it waited for them.
+ **/
+void block_dispatcher_report(block_dispatcher *dispatcher);
+
+void block_dispatcher_free(block_dispatcher *dispatcher);
+
+#endif
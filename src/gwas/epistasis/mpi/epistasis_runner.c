@@ -21,6 +21,144 @@
 #include "../epistasis_runner.h"
 
 
+/**
+ * Merges the rankings of a sweep from all nodes in a tree fashion so none of them gets overloaded, then the root 
+ * node reports the best models of each repetition in the sweep. The rankings are freed.
+ * 
+ * @return Seconds spent
+ */
+static double reduce_and_report_sweep(int r, struct heap **ranking_risky, struct heap **best_models, 
+                                      int num_sweep_repetitions, int num_folds, int mpi_rank, int num_mpi_ranks, 
+                                      risky_combination_mpi_t risky_mpi_type, compare_risky_heap_func heap_min_func, 
+                                      compare_risky_heap_func heap_max_func, masks_info info, epistasis_checkpoint *checkpoint, 
+                                      permutation_test *permutations, epistasis_phenotypes *phenotypes, int *selected_snps, 
+                                      shared_options_data_t *shared_options_data, epistasis_options_data_t *options_data) {
+    double start = omp_get_wtime();
+    int order = options_data->order;
+    int num_sweep_folds = num_sweep_repetitions * num_folds;
+    int num_ranked_folds = (1 + (phenotypes ? phenotypes->num_phenotypes : 0)) * num_sweep_folds;
+    
+    if (mpi_rank == 0) {
+        LOG_DEBUG_F("Merging rankings in node for CV %d\n", r+1);
+    }
+ 
+    // Merge rankings from all nodes in a tree fashion so none of them gets overloaded.
+    // The rankings of all folds in the sweep travel together in a single message per step.
+    int numprocs_log2 = ceil(log((double) num_mpi_ranks) / log(2.0));
+
+    for (int i = 1; i <= numprocs_log2; i++) {
+        if (mpi_rank % (1 << i) == 0) {
+            int src = mpi_rank + (1 << (i - 1));
+            if (src < num_mpi_ranks) { // Take care when the number of ranks is not a power of 2
+                receive_rankings_mpi(order, num_ranked_folds, ranking_risky, options_data->max_ranking_size, 
+                                     heap_min_func, risky_mpi_type, info, src, MPI_COMM_WORLD);
+                LOG_DEBUG_F("IN, step %d -> Node %d receives from %d\n", i, mpi_rank, src);
+            } else {
+                LOG_DEBUG_F("--, step %d -> Node %d keeps its data\n", i, mpi_rank);
+            }
+        } else if (mpi_rank % (1 << (i - 1)) == 0) {
+            int dest = mpi_rank - (1 << (i - 1));
+            // Send best combinations of all folds to another node
+            send_rankings_mpi(num_ranked_folds, ranking_risky, heap_min_func, risky_mpi_type, dest, MPI_COMM_WORLD);
+            LOG_DEBUG_F("OUT, step %d <- Node %d sends to %d\n", i, mpi_rank, dest);
+        }
+    }
+
+    if (mpi_rank == 0) {
+        LOG_DEBUG_F("Rankings in node for CV %d merged!\n", r+1);
+    }
+    
+    // Root node merges all rankings in one and shows best models
+    if (mpi_rank == 0) {
+        for (int i = 0; i < num_sweep_repetitions; i++) {
+            best_models[r+i] = merge_rankings(num_folds, ranking_risky + i * num_folds, heap_min_func, heap_max_func);
+            
+            char *path, default_path[32];
+            sprintf(default_path, "hpg-variant.cv%d.epi", r+i+1);
+            FILE *fd = get_output_file(shared_options_data, default_path, &path);
+            epistasis_report(order, r+i, options_data->eval_mode, options_data->eval_subset, options_data->eval_function, 
+                             options_data->beam_width, best_models[r+i], options_data->max_ranking_size, heap_max_func, 
+                             permutations, selected_snps, fd);
+            fclose(fd);
+            free(path);
+            
+            if (phenotypes) {
+                epistasis_report_phenotypes(order, r+i, options_data->eval_mode, options_data->eval_subset, options_data->eval_function, 
+                                            phenotypes, num_folds, num_sweep_folds, ranking_risky + i * num_folds, 
+                                            options_data->max_ranking_size, heap_min_func, heap_max_func, selected_snps, 
+                                            shared_options_data);
+            }
+        }
+    }
+    
+    // The repetition is finished only when the root node has reported it
+    barrier_mpi(MPI_COMM_WORLD);
+    if (epistasis_checkpoint_end_sweep(checkpoint, r + num_sweep_repetitions)) {
+        LOG_WARN_F("P%d) The end of this repetition could not be saved, so it would be run again if resumed\n", mpi_rank);
+    }
+    
+    for (int i = 0; i < num_ranked_folds; i++) {
+        free(ranking_risky[i]);
+    }
+    free(ranking_risky);
+    
+    return omp_get_wtime() - start;
+}
+
+/**
+ * Grows the models one SNP at a time like epistasis_beam_search, but every node tests a share of the candidates 
+ * of each order, and their beams are gathered before extending them again. The candidates of the last order 
+ * are left in the rankings of the workspaces, to be merged and reduced like the ones of the blocks.
+ */
+static void beam_search_mpi(int order, int width, uint64_t *bitplanes, size_t num_variants, int num_folds, 
+                            uint64_t *fold_bitmasks, unsigned int *training_sizes, unsigned int *testing_sizes, bool prune, 
+                            enum eval_function function, enum evaluation_subset subset, masks_info info, 
+                            int mpi_rank, int num_mpi_ranks, int num_threads, epistasis_workspace **workspaces) {
+    // The search starts from a single combination without SNPs
+    epistasis_beam *beam = epistasis_beam_new(0, 1);
+    beam->size = 1;
+    
+    for (int k = 1; k < order; k++) {
+        epistasis_beam *local = epistasis_beam_new(k, width);
+        beam_search_extend(beam, bitplanes, num_variants, num_folds, fold_bitmasks, training_sizes, testing_sizes, prune,
+                           function, subset, info, mpi_rank, num_mpi_ranks, num_threads, workspaces, local);
+        epistasis_beam_free(beam);
+        
+        beam = epistasis_beam_new(k, width);
+        allgather_beam_mpi(local, beam, MPI_COMM_WORLD);
+        epistasis_beam_free(local);
+        
+        if (mpi_rank == 0 && beam->size > 0) {
+            LOG_INFO_F("Beam of order %d: %d combinations, the best one scores %.3f\n", k, beam->size, beam->scores[0]);
+        }
+    }
+    
+    beam_search_extend(beam, bitplanes, num_variants, num_folds, fold_bitmasks, training_sizes, testing_sizes, prune,
+                       function, subset, info, mpi_rank, num_mpi_ranks, num_threads, workspaces, NULL);
+    epistasis_beam_free(beam);
+}
+
+enum sweep_role { SWEEP_PROCESS_BLOCKS, SWEEP_SERVE_BLOCKS, SWEEP_REDUCE_RANKINGS };
+
+/**
+ * Role of the calling thread in the parallel region of a sweep. The server and the reduction are taken by the 
+ * last threads of the team, which can be smaller than requested (because of OMP_THREAD_LIMIT, for instance). 
+ * The server is always kept, or the rest of nodes would wait for their blocks forever, but the reduction is 
+ * only overlapped while another thread is left processing blocks.
+ */
+static enum sweep_role get_sweep_role(bool needs_server, bool pending_reduction) {
+    int team_size = omp_get_num_threads();
+    int thread = omp_get_thread_num();
+    bool overlapped = pending_reduction && team_size >= needs_server + 2;
+    
+    if (overlapped && thread == team_size - 1) {
+        return SWEEP_REDUCE_RANKINGS;
+    } else if (needs_server && thread == team_size - 1 - overlapped) {
+        return SWEEP_SERVE_BLOCKS;
+    }
+    return SWEEP_PROCESS_BLOCKS;
+}
+
 int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_data_t* options_data) {
     int ret_code = 0;
     
@@ -31,17 +169,35 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
     // Load binary input dataset
     int num_affected, num_unaffected;
     size_t num_variants, file_len;
-    size_t genotypes_offset = sizeof(size_t) + sizeof(uint32_t) + sizeof(uint32_t);
+    size_t genotypes_offset, bitplanes_offset;
     
-    MPI_File fd;
+    epistasis_dataset_mpi dataset;
     uint8_t *input_file = epistasis_dataset_load_mpi(options_data->dataset_filename, &num_affected, &num_unaffected, &num_variants, 
-                                                     &file_len, &genotypes_offset, &fd);
+                                                     &file_len, &genotypes_offset, &bitplanes_offset, &dataset);
     if (!input_file) {
         MPI_Finalize();
-        LOG_FATAL_F("File %s does not exist!\n", options_data->dataset_filename);
+        LOG_FATAL_F("File %s does not exist or is not a valid dataset!\n", options_data->dataset_filename);
     }
     
     uint8_t *genotypes = input_file + genotypes_offset;
+    
+    // Bitplanes stored in the dataset are always used, because they don't need to be packed again.
+    // The beam search combines any SNPs, so it always counts over bitplanes of the whole dataset.
+    uint64_t *dataset_bitplanes = bitplanes_offset ? (uint64_t*) (input_file + bitplanes_offset) : NULL;
+    int beam_width = options_data->beam_width;
+    int use_bitplanes = options_data->use_bitplanes || dataset_bitplanes || beam_width > 0;
+    if (beam_width > 0 && options_data->resume) {
+        MPI_Finalize();
+        LOG_FATAL("A heuristic search can't be resumed, because it does not save checkpoints\n");
+    }
+    
+    // Other phenotypes stored in the dataset are searched along with the main one
+    epistasis_phenotypes *phenotypes = epistasis_phenotypes_load(input_file, num_affected, num_unaffected);
+    if (phenotypes && beam_width > 0) {
+        if (mpi_rank == 0) { LOG_WARN("The heuristic search is only available for the main phenotype, the rest will be ignored\n"); }
+        epistasis_phenotypes_free(phenotypes);
+        phenotypes = NULL;
+    }
 
     // Try to create the directory where the output files will be stored
     ret_code = create_directory(shared_options_data->output_directory);
@@ -50,19 +206,98 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
         LOG_FATAL_F("Can't create output directory: %s\n", shared_options_data->output_directory);
     }
     
+    // Restrict the search to the SNPs with the strongest marginal effect, gathered into a smaller dataset.
+    // The root process scores them and the rest receive the selection, so all of them search the same SNPs.
+    int *selected_snps = NULL;
+    uint8_t *selected_genotypes = NULL;
+    uint64_t *selected_bitplanes = NULL;
+    if (options_data->num_prefilter_snps > 0 && options_data->num_prefilter_snps < num_variants) {
+        if (options_data->num_prefilter_snps < options_data->order) {
+            MPI_Finalize();
+            LOG_FATAL_F("At least %d SNPs must be selected for combinations of order %d\n", options_data->order, options_data->order);
+        }
+        
+        if (mpi_rank == 0) {
+            double *scores;
+            selected_snps = prefilter_snps(genotypes, dataset_bitplanes, num_variants, num_affected, num_unaffected, 
+                                           options_data->num_prefilter_snps, &scores);
+            LOG_INFO_F("Search restricted to the %d SNPs with the strongest marginal effect\n", options_data->num_prefilter_snps);
+            
+            char *path;
+            FILE *fd = get_output_file(shared_options_data, "hpg-variant.epi.snps", &path);
+            prefilter_report(selected_snps, scores, options_data->num_prefilter_snps, num_variants, fd);
+            fclose(fd);
+            free(path);
+            free(scores);
+        } else {
+            selected_snps = malloc(options_data->num_prefilter_snps * sizeof(int));
+        }
+        MPI_Bcast(selected_snps, options_data->num_prefilter_snps, MPI_INT, 0, MPI_COMM_WORLD);
+        
+        genotypes = selected_genotypes = prefilter_gather_genotypes(selected_snps, options_data->num_prefilter_snps, 
+                                                                    genotypes, num_affected + num_unaffected);
+        if (dataset_bitplanes) {
+            dataset_bitplanes = selected_bitplanes = prefilter_gather_bitplanes(selected_snps, options_data->num_prefilter_snps, 
+                                                                                dataset_bitplanes, num_affected, num_unaffected);
+        }
+        num_variants = options_data->num_prefilter_snps;
+    }
+    
     /************************** Variables global to the algorithm **************************/
     
     int order = options_data->order;
-    int stride = options_data->stride;
     int num_folds = options_data->num_folds;
     int num_samples = num_affected + num_unaffected;
+    
+    // When fusing cross-validation repetitions, the folds of all of them are evaluated in a single sweep
+    int num_sweep_repetitions = options_data->fuse_cv_repetitions ? options_data->num_cv_repetitions : 1;
+    int num_sweep_folds = num_sweep_repetitions * num_folds;
+    
+    // Each phenotype is ranked in the same folds, after the main one
+    int num_phenotypes = phenotypes ? phenotypes->num_phenotypes : 0;
+    int num_ranked_folds = (1 + num_phenotypes) * num_sweep_folds;
+    int num_count_masks = (1 + 2 * num_phenotypes) * (num_sweep_folds + 1);
+    
+    // Each node chooses the widest kernels its own CPU supports
+    const epistasis_kernels *kernels = epistasis_kernels_init(KERNEL_AUTO);
+    LOG_DEBUG_F("P%d) Using %s kernels\n", mpi_rank, kernels->name);
+    
+    // Stride and combinations per row, chosen by timing them in the root node if requested, as all nodes 
+    // must split the dataset in the same blocks (a resumed search keeps its stride)
+    int stride = options_data->stride;
+    int num_combinations_in_a_row = COMBINATIONS_ROW_SSE;
+    if (options_data->auto_tune && beam_width > 0) {
+        if (mpi_rank == 0) { LOG_WARN("Auto-tuning is only available for the exhaustive search, disabled\n"); }
+    } else if (options_data->auto_tune) {
+        if (mpi_rank == 0) {
+            int saved_stride = options_data->resume ? epistasis_checkpoint_saved_stride(shared_options_data->output_directory, 0) : 0;
+            epistasis_autotune(order, genotypes, dataset_bitplanes, num_variants, num_affected, num_unaffected, 
+                               num_sweep_repetitions, num_folds, options_data->max_ranking_size, use_bitplanes, 
+                               options_data->eval_function, options_data->eval_subset, shared_options_data->num_threads, 
+                               saved_stride, &stride, &num_combinations_in_a_row);
+        }
+        MPI_Bcast(&stride, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&num_combinations_in_a_row, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    
     size_t num_blocks_per_dim = ceil((double) num_variants / stride);
     size_t num_block_coords = 0;
-    size_t max_num_block_coords = (size_t) pow(num_blocks_per_dim, order);
     
     if (mpi_rank == 0) {
-        LOG_INFO_F("Combinations of order %d, %d variants per block\n", order, stride);
+        if (beam_width > 0) {
+            LOG_INFO_F("Combinations of order %d, grown from the best %d of each lower order (heuristic search)\n", order, beam_width);
+        } else {
+            LOG_INFO_F("Combinations of order %d, %d variants per block\n", order, stride);
+        }
         LOG_INFO_F("%d variants, %d blocks per dimension\n", num_variants, num_blocks_per_dim);
+        if (dataset_bitplanes) {
+            LOG_INFO("Using genotype bitplanes stored in the dataset\n");
+        } else if (use_bitplanes) {
+            LOG_INFO("Genotypes packed into bitplanes\n");
+        }
+        if (num_phenotypes > 0) {
+            LOG_INFO_F("Searching %d phenotypes besides the main one\n", num_phenotypes);
+        }
     }
     
     // Precalculate which genotype combinations can be tested for a given order (order 2 -> {(0,0), (0,1), ... , (2,1), (2,2)})
@@ -77,7 +312,7 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
     risky_combination_mpi_init(&risky_mpi_type);
 
     // Masks information (number (un)affected with padding, buffers, and so on)
-    masks_info info; masks_info_init(order, COMBINATIONS_ROW_SSE, num_affected, num_unaffected, &info);
+    masks_info info; masks_info_init(order, num_combinations_in_a_row, num_affected, num_unaffected, &info);
     
     compare_risky_heap_func heap_max_func = NULL;
     compare_risky_heap_func heap_min_func = NULL;
@@ -94,92 +329,150 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
         LOG_FATAL("Rank criteria not specified! Must be 'count' or 'accu'\n");
     }
     
-    /******************************* End of global variables *******************************/
+    // Combinations that can't be among the best models are discarded before counting them in each fold
+    bool prune = options_data->prune && model_upper_bound_available(options_data->eval_function, options_data->eval_subset) && !phenotypes;
+    if (mpi_rank == 0 && prune) {
+        LOG_INFO("Pruning combinations that can't be among the best models\n");
+    } else if (mpi_rank == 0 && options_data->prune && phenotypes) {
+        LOG_WARN("Pruning is only available when searching a single phenotype, disabled\n");
+    } else if (mpi_rank == 0 && options_data->prune) {
+        LOG_WARN("Pruning is only available for ba and ca over the training partitions, disabled\n");
+    }
     
+    // Significance of the best models, tested by the root node when reporting them
+    permutation_test *permutations = NULL;
+    if (mpi_rank == 0 && options_data->num_permutations > 0) {
+        LOG_INFO_F("Testing the best models with %d permutations\n", options_data->num_permutations);
+        permutations = permutation_test_new(order, genotypes, num_affected, num_unaffected, 
+                                            options_data->num_permutations, options_data->eval_function);
+    }
     
-    /****************************** MPI workload distribution ******************************/
-    int *block_coords, *node_block_coords;
-    int curr_idx, next_idx;
+    // Buffers and partial rankings of each thread, reused by all blocks and repetitions
+    epistasis_workspace *workspaces[shared_options_data->num_threads];
+    for (int t = 0; t < shared_options_data->num_threads; t++) {
+        workspaces[t] = epistasis_workspace_new(order, stride, num_sweep_folds, num_phenotypes, options_data->max_ranking_size, 
+                                                use_bitplanes, !dataset_bitplanes && beam_width == 0, info);
+    }
     
-    if (mpi_rank == 0) {
-        block_coords = calloc(max_num_block_coords * order, sizeof(int));
-        // printf("Blocks per dim = %zu\tMax block coords = %zu\n", num_blocks_per_dim, max_num_block_coords);
-        
-        // Calculate all blocks coordinates
-        do {
-            curr_idx = num_block_coords * order;
-            next_idx = curr_idx + order;
-            memcpy(block_coords + next_idx, block_coords + curr_idx, order * sizeof(int));
-            curr_idx = next_idx;
-            num_block_coords++;
-
-            // printf("(%d %d) ", block_coords[curr_idx], block_coords[curr_idx+1]);
-        } while (get_next_block(num_blocks_per_dim, order, block_coords + curr_idx));
+    // Bitplanes of the whole dataset for the beam search, packed once unless stored in the dataset
+    uint64_t *beam_bitplanes = NULL;
+    if (beam_width > 0) {
+        beam_bitplanes = dataset_bitplanes ? dataset_bitplanes : beam_search_bitplanes(genotypes, num_variants, info, 
+                                                                                       shared_options_data->num_threads);
     }
     
-    LOG_DEBUG_F("P%d) Broadcasting number of block coordinates...\n", mpi_rank);
-    // Send total number of blocks to all processes
-    MPI_Bcast(&num_block_coords, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    LOG_DEBUG_F("P%d) Number of block coordinates broadcasted!\n", mpi_rank);
+    /******************************* End of global variables *******************************/
     
-    // Prepare arguments for scatterv
-    int block_counts[num_mpi_ranks];
-    int block_offsets[num_mpi_ranks];
-
-    for (int p = 0; p < num_mpi_ranks; p++) {
-        if (p < num_block_coords % num_mpi_ranks) {
-            block_counts[p] = order * (num_block_coords / num_mpi_ranks + 1);
-        } else {
-            block_counts[p] = order * (num_block_coords / num_mpi_ranks);
-        }
-    }
-
-    block_offsets[0] = 0;
-    for (int p = 1; p < num_mpi_ranks; p++) {
-        block_offsets[p] = block_offsets[p-1] + block_counts[p-1];
-    }
     
-    node_block_coords = calloc(block_counts[mpi_rank] * order, sizeof(int));
+    /****************************** MPI workload distribution ******************************/
     
-/*
-    if (mpi_rank == 0) {
-        for (int p = 0; p < num_mpi_ranks; p++) {
-            printf("(%d, off %d) ", block_counts[p], block_offsets[p]);
+    // Handing out blocks on request needs another thread of the root process to communicate
+    bool dynamic_blocks = options_data->dynamic_blocks && num_mpi_ranks > 1 && beam_width == 0;
+    if (dynamic_blocks) {
+        int thread_support;
+        MPI_Query_thread(&thread_support);
+        if (thread_support < MPI_THREAD_SERIALIZED) {
+            if (mpi_rank == 0) { LOG_WARN("The MPI library does not support threads, blocks will be split up front\n"); }
+            dynamic_blocks = false;
+        } else if (mpi_rank == 0) {
+            LOG_INFO("Blocks handed out to processes on request\n");
         }
-        printf("\n");
     }
-*/
-   
-    LOG_DEBUG_F("P%d) Scattering block coordinates...\n", mpi_rank);
-    // MPI_Scatterv sends block coordinates to all processes
-    MPI_Scatterv(block_coords, block_counts, block_offsets, MPI_INT, 
-                 node_block_coords, block_counts[mpi_rank], MPI_INT,
-                 0, MPI_COMM_WORLD);
-    LOG_DEBUG_F("P%d) Block coordinates scattered!\n", mpi_rank);
-
+    
+    // The candidates of the beam search are split among processes as they are generated, so there are no blocks
+    int *node_block_coords = distribute_blocks_mpi(order, num_variants, stride, dynamic_blocks, beam_width > 0, 
+                                                   &num_block_coords, 0, MPI_COMM_WORLD);
+    
     char processor_name[MPI_MAX_PROCESSOR_NAME];
     int processor_len;
     MPI_Get_processor_name(processor_name, &processor_len);
 
     LOG_INFO_F("P%d) Assigned to node %.*s\n", mpi_rank, processor_len, processor_name);
-
-    if (mpi_rank == 0) {
-        free(block_coords);
-    }
-    
-    num_block_coords = block_counts[mpi_rank] / order;
     
     /************************** End of MPI workload distribution ***************************/
     
     
+    // Checkpoints of the progress of each node, and resume from the last one if requested
+    epistasis_checkpoint *checkpoint = epistasis_checkpoint_new(shared_options_data->output_directory, mpi_rank, shared_options_data->num_threads, 
+                                                                (beam_width > 0) ? 0 : options_data->checkpoint_interval, order, stride, num_variants, 
+                                                                num_sweep_folds, num_phenotypes, options_data->eval_function, options_data->eval_subset, 
+                                                                options_data->eval_mode, options_data->max_ranking_size, num_block_coords, info);
+    int first_repetition = 0;
+    uint8_t *resumed_fold_masks = NULL;
+    unsigned int *resumed_testing_sizes = NULL;
+    if (options_data->resume) {
+        if (epistasis_checkpoint_load(checkpoint, workspaces, info, &first_repetition, &resumed_fold_masks, &resumed_testing_sizes)) {
+            LOG_FATAL_F("P%d) Can't resume from the checkpoint in %s\n", mpi_rank, shared_options_data->output_directory);
+        }
+        
+        // All nodes must resume the same repetition, or their rankings could not be merged, and either all 
+        // of them or none must have its folds, as the root node broadcasts new ones to the rest
+        int min_first_repetition, resumed_folds = (resumed_fold_masks != NULL), resumed_folds_range[2];
+        int local_range[2] = { resumed_folds, -resumed_folds };
+        MPI_Allreduce(&first_repetition, &min_first_repetition, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        MPI_Allreduce(local_range, resumed_folds_range, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        if (min_first_repetition != first_repetition || resumed_folds_range[0] != -resumed_folds_range[1]) {
+            LOG_FATAL_F("P%d) Checkpoints of the nodes are not consistent, the search must be started again\n", mpi_rank);
+        }
+        
+        // In dynamic mode, any process could have finished a block, so all of them must skip it
+        if (dynamic_blocks) {
+            MPI_Allreduce(MPI_IN_PLACE, checkpoint->completed, num_block_coords, MPI_C_BOOL, MPI_LOR, MPI_COMM_WORLD);
+        }
+    }
+    
+    // Repetitions finished before the checkpoint were already reported
+    for (int r = 0; r < first_repetition && r < options_data->num_cv_repetitions; r++) {
+        best_models[r] = malloc(sizeof(struct heap));
+        heap_init(best_models[r]);
+    }
+    
+    // Reducing the rankings of a sweep while the next one is processed needs another thread to communicate,
+    // at the same time as the threads requesting blocks, if any
+    int thread_support;
+    MPI_Query_thread(&thread_support);
+    bool overlap_reduction = thread_support >= (dynamic_blocks ? MPI_THREAD_MULTIPLE : MPI_THREAD_SERIALIZED);
+    if (!overlap_reduction && mpi_rank == 0) {
+        LOG_WARN("The MPI library does not support enough threads, rankings will be merged after each repetition\n");
+    }
+    
+    // Rankings of the previous sweep, merged while the current one is processed
+    struct heap **pending_rankings = NULL;
+    int pending_repetition = 0;
+    double computation_time = 0, communication_time = 0, overlapped_communication_time = 0;
     
-    for (int r = 0; r < options_data->num_cv_repetitions; r++) {
-        LOG_INFO_F("P%d) Running cross-validation #%d...\n", mpi_rank, r+1);
+    for (int r = first_repetition; r < options_data->num_cv_repetitions; r += num_sweep_repetitions) {
+        if (num_sweep_repetitions > 1) {
+            LOG_INFO_F("P%d) Running cross-validations #%d to #%d...\n", mpi_rank, r+1, r+num_sweep_repetitions);
+        } else {
+            LOG_INFO_F("P%d) Running cross-validation #%d...\n", mpi_rank, r+1);
+        }
         
         // Initialize folds, first block coordinates, genotype combinations and rankings for each repetition
+        // Fold f of the repetition r+i is stored at position i * num_folds + f
         unsigned int *testing_sizes, *training_sizes;
-        int **folds = get_k_folds(num_affected, num_unaffected, num_folds, &testing_sizes);
-        uint8_t *fold_masks = get_k_folds_masks(num_affected, num_unaffected, num_folds, folds, testing_sizes);
+        uint8_t *fold_masks;
+        if (resumed_fold_masks) {
+            fold_masks = resumed_fold_masks;
+            testing_sizes = resumed_testing_sizes;
+            resumed_fold_masks = NULL;
+        } else {
+            // The root node draws the folds for all nodes, which build their masks with the padding of their own kernels
+            int *fold_assignment = (mpi_rank == 0) ? 
+                                   get_k_folds_assignment_repetitions(num_sweep_repetitions, num_affected, num_unaffected, num_folds, NULL) : 
+                                   malloc(num_sweep_repetitions * num_samples * sizeof(int));
+            MPI_Bcast(fold_assignment, num_sweep_repetitions * num_samples, MPI_INT, 0, MPI_COMM_WORLD);
+            fold_masks = get_k_folds_masks_from_assignment(num_sweep_repetitions, num_affected, num_unaffected, num_folds, 
+                                                           fold_assignment, &testing_sizes);
+            free(fold_assignment);
+        }
+        
+        // The counts of all samples are obtained along with the ones of each fold
+        fold_masks = add_all_samples_mask(num_sweep_folds, fold_masks, info);
+        
+        if (epistasis_checkpoint_begin_sweep(checkpoint, r, fold_masks, testing_sizes, workspaces, pending_rankings != NULL)) {
+            LOG_WARN_F("P%d) The folds of this repetition could not be saved, so it won't be possible to resume it\n", mpi_rank);
+        }
         
 /*
         printf("fold_masks = {\n");
@@ -193,69 +486,83 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
 */
         
         // Calculate size of training datasets
-        training_sizes = calloc(3 * num_folds, sizeof(unsigned int));
-        for (int i = 0; i < num_folds; i++) {
+        training_sizes = calloc(3 * num_ranked_folds, sizeof(unsigned int));
+        for (int i = 0; i < num_sweep_folds; i++) {
             training_sizes[3 * i] = num_samples - testing_sizes[3 * i];
             training_sizes[3 * i + 1] = num_affected - testing_sizes[3 * i + 1];
             training_sizes[3 * i + 2] = num_unaffected - testing_sizes[3 * i + 2];
         }
         
+        // Folds restricted to the cases and controls of each phenotype, whose sizes follow the ones of the main phenotype
+        uint8_t *count_masks = fold_masks;
+        unsigned int *ranked_testing_sizes = testing_sizes;
+        if (phenotypes) {
+            ranked_testing_sizes = malloc(3 * num_ranked_folds * sizeof(unsigned int));
+            memcpy(ranked_testing_sizes, testing_sizes, 3 * num_sweep_folds * sizeof(unsigned int));
+            count_masks = get_phenotype_masks(num_sweep_folds, fold_masks, phenotypes, info, 
+                                              training_sizes + 3 * num_sweep_folds, ranked_testing_sizes + 3 * num_sweep_folds);
+        }
+        
+        // Fold masks packed into bits, only used when genotypes are packed into bitplanes
+        uint64_t *fold_bitmasks = NULL;
+        if (use_bitplanes) {
+            fold_bitmasks = _mm_malloc(num_count_masks * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+            set_fold_bitmasks(num_count_masks, count_masks, info, fold_bitmasks);
+        }
+        
         // Initialize rankings for each repetition
-        struct heap **ranking_risky = malloc(num_folds * sizeof(struct heap*));
-        for (int i = 0; i < num_folds; i++) {
+        struct heap **ranking_risky = malloc(num_ranked_folds * sizeof(struct heap*));
+        for (int i = 0; i < num_ranked_folds; i++) {
             ranking_risky[i] = malloc(sizeof(struct heap));
             heap_init(ranking_risky[i]);
         }
         
-        // Masks information (number (un)affected with padding, buffers, and so on)
-#pragma omp parallel for num_threads(shared_options_data->num_threads) schedule(dynamic)
-        for (int i = 0; i < num_block_coords; i++) {
+        // Skip the blocks finished before the last checkpoint
+        int *pending_coords = malloc(num_block_coords * order * sizeof(int));
+        size_t *pending_blocks = malloc(num_block_coords * sizeof(size_t));
+        size_t num_pending = epistasis_checkpoint_pending_blocks(checkpoint, order, node_block_coords, num_block_coords, 
+                                                                 pending_coords, pending_blocks);
+        
+        block_dispatcher *dispatcher = block_dispatcher_new(dynamic_blocks, shared_options_data->num_threads, order, pending_coords, 
+                                                            num_pending, stride, num_variants, MPI_COMM_WORLD);
+        
+        // The root process needs an additional thread to answer the requests of blocks from the rest,
+        // and another one merges the rankings of the previous sweep, if pending
+        bool needs_server = block_dispatcher_needs_server(dispatcher);
+        bool pending_reduced = false;
+        double sweep_start = omp_get_wtime();
+        
+#pragma omp parallel num_threads(shared_options_data->num_threads + needs_server + (pending_rankings != NULL))
+        if (get_sweep_role(needs_server, pending_rankings != NULL) == SWEEP_REDUCE_RANKINGS) {
+            overlapped_communication_time += reduce_and_report_sweep(pending_repetition, pending_rankings, best_models, num_sweep_repetitions,
+                                                                     num_folds, mpi_rank, num_mpi_ranks, risky_mpi_type, heap_min_func, 
+                                                                     heap_max_func, info, checkpoint, permutations, phenotypes, selected_snps, 
+                                                                     shared_options_data, options_data);
+            pending_reduced = true;
+        } else if (get_sweep_role(needs_server, pending_rankings != NULL) == SWEEP_SERVE_BLOCKS) {
+            block_dispatcher_serve(dispatcher);
+        } else for (size_t i = 0; block_dispatcher_next(dispatcher, &i); ) {
             // Coordinates of the block being tested
             int task_block_coords[order];
-            
-            // Initialize rankings for each repetition
-            struct heap **ranking_risky_local = malloc(num_folds * sizeof(struct heap*));
-            for (int i = 0; i < num_folds; i++) {
-                ranking_risky_local[i] = malloc(sizeof(struct heap));
-                heap_init(ranking_risky_local[i]);
-            }
-        
-            memcpy(task_block_coords, node_block_coords + i * order, order * sizeof(int));
+            memcpy(task_block_coords, pending_coords + i * order, order * sizeof(int));
                 
 //            printf("%d) cv %d, block %d %d\n", omp_get_thread_num(), r, my_block_coords[0], my_block_coords[1]);
 
             // ******************* Variables private to each task (block) *******************
 
-            // Buffer for genotypes masks
-            uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), 16);
-
-            // Scratchpad for block genotypes
-            uint8_t *scratchpad[order];
-            for (int s = 0; s < order; s++) {
-                scratchpad[s] = _mm_malloc(stride * info.num_samples_with_padding * sizeof(uint8_t), 16);
-            }
-            // Genotypes for the current block
-            uint8_t *block_genotypes[order];
+            // Buffers of the thread, allocated once for the whole run
+            epistasis_workspace *workspace = workspaces[omp_get_thread_num()];
+            
+            // Masks for the current block (only when not using bitplanes)
+            uint8_t *block_masks[order];
+            
 
-            // Counts per genotype combination
-            // Grouped by fold, then combination, then permutation, so there is spatial locality when getting confusion matrix
-            int max_num_counts = 16 * (int) ceil(((double) info.num_cell_counts_per_combination * info.num_combinations_in_a_row * num_folds) / 16);
-            int *counts_aff = _mm_malloc(max_num_counts * sizeof(int), 16);
-            int *counts_unaff = _mm_malloc(max_num_counts * sizeof(int), 16);
+            // Bitplanes for the current block (only when packing into bitplanes)
+            uint64_t *bitplanes_buffer[order];
+            uint64_t **block_bitplanes = use_bitplanes ? bitplanes_buffer : NULL;
 
             // Confusion matrix
             unsigned int conf_matrix[4];
-
-            // Functions for ranking combinations
-            compare_risky_heap_func heap_max_func_local = NULL;
-            compare_risky_heap_func heap_min_func_local = NULL;
-            if (options_data->eval_mode == CV_A) {
-                heap_max_func_local = compare_risky_heap_accuracy_max;
-                heap_min_func_local = compare_risky_heap_accuracy_min;
-            } else {
-                heap_max_func_local = compare_risky_heap_count_max;
-                heap_min_func_local = compare_risky_heap_count_min;
-            }
     
             // **************** Variables private to each task (block) (end) ****************
 
@@ -263,54 +570,15 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
 
             // -------------------- Get genotypes of block --------------------
 
-            uint8_t *block_starts[order];
-            for (int s = 0; s < order; s++) {
-                block_starts[s] = genotypes + task_block_coords[s] * stride * num_samples;
-            }
-
-            // Initialize first coordinate (only if it's different from the previous)
-            block_genotypes[0] = get_genotypes_of_block_coord(num_variants, num_samples, info, stride,
-                                                              task_block_coords[0], block_starts[0], scratchpad[0]);
-
-            // Initialize the rest of coordinates
-            for (int m = 1; m < order; m++) {
-                bool already_present = false;
-                // If any coordinate is the same as a previous one, don't copy, but reference directly
-                for (int n = 0; n < m; n++) {
-                    if (task_block_coords[m] == task_block_coords[n]) {
-//                             printf("taking %d -> %d\n", n, m);
-                        block_genotypes[m] = block_genotypes[n];
-                        already_present = true;
-                        break;
-                    }
-                }
-
-                if (!already_present) {
-                    // If not equals to a previous one, retrieve data
-                    block_genotypes[m] = get_genotypes_of_block_coord(num_variants, num_samples, info, stride,
-                                                                      task_block_coords[m], block_starts[m], scratchpad[m]);
-                }
+            // Only the coordinates not shared with the last blocks of the thread are loaded
+            int num_loaded = get_planes_of_block(order, task_block_coords, genotypes, dataset_bitplanes, num_variants, stride, info, 
+                                                 workspace, block_masks, block_bitplanes);
+            
+            // Masks of the first order-1 SNPs cached by the previous block are not valid if their masks were replaced
+            if (workspace->prefix_cache && num_loaded > 0) {
+                prefix_masks_cache_reset(workspace->prefix_cache);
             }
 
-
-//            printf("padded block (%d*%d) = {\n", stride, info.num_samples_with_padding);
-//            for (int m = 0; m < MIN(stride, num_variants); m++) {
-//                for (int n = 0; n < info.num_samples_with_padding; n++) {
-//                    printf("%d ", block_genotypes[0][m * info.num_samples_with_padding + n]);
-//                }
-//                printf("\n");
-//            }
-//            printf("}\n");
-//
-//            printf("padded block (%d*%d) = {\n", stride, info.num_samples_with_padding);
-//            for (int m = 0; m < MIN(stride, num_variants); m++) {
-//                for (int n = 0; n < info.num_samples_with_padding; n++) {
-//                    printf("%d ", block_genotypes[1][m * info.num_samples_with_padding + n]);
-//                }
-//                printf("\n");
-//            }
-//            printf("}\n-------------------------\n");
-
             // -------------------- Get genotypes of block (end) --------------------
 
             // Combination of variants being tested
@@ -330,53 +598,24 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
                     continue; // Nothing to do until we have an amount (COMBINATIONS_ROW_SSE) of combinations ready
                 }
                 
-                process_set_of_combinations(info.num_combinations_in_a_row, combs, order, stride, num_folds, fold_masks,
-                                            training_sizes, testing_sizes,  block_genotypes, genotype_permutations,
-                                            masks, options_data->eval_subset, info, 
-                                            heap_min_func_local, counts_aff, counts_unaff, conf_matrix, 
-                                            options_data->max_ranking_size, ranking_risky_local);
+                process_set_of_combinations(info.num_combinations_in_a_row, combs, order, stride, num_sweep_folds, count_masks,
+                                            training_sizes, ranked_testing_sizes, phenotypes, block_bitplanes, fold_bitmasks, genotype_permutations,
+                                            block_masks, workspace->prefix_cache, prune, options_data->eval_function, options_data->eval_subset, info, 
+                                            workspace->counts_aff, workspace->counts_unaff, workspace->risk_masks, conf_matrix, 
+                                            workspace->rankings, &(workspace->risky_scratch));
                 
                 cur_comb_idx = 0;
             } while (get_next_combination_in_block(order, comb, task_block_coords, stride, num_variants));
 
             
             // Process combinations out of a full set
-            process_set_of_combinations(cur_comb_idx, combs, order, stride, num_folds, fold_masks,
-                                        training_sizes, testing_sizes, block_genotypes, genotype_permutations,
-                                        masks, options_data->eval_subset, info, 
-                                        heap_min_func_local, counts_aff, counts_unaff, conf_matrix, 
-                                        options_data->max_ranking_size, ranking_risky_local);
+            process_set_of_combinations(cur_comb_idx, combs, order, stride, num_sweep_folds, count_masks,
+                                        training_sizes, ranked_testing_sizes, phenotypes, block_bitplanes, fold_bitmasks, genotype_permutations,
+                                        block_masks, workspace->prefix_cache, prune, options_data->eval_function, options_data->eval_subset, info, 
+                                        workspace->counts_aff, workspace->counts_unaff, workspace->risk_masks, conf_matrix, 
+                                        workspace->rankings, &(workspace->risky_scratch));
 
             
-            // Insert best models of this block in the global ranking (critical section)
-            for (int i = 0; i < num_folds; i++) {
-                while (!heap_empty(ranking_risky_local[i])) {
-                    struct heap_node *hn = heap_take(heap_min_func_local, ranking_risky_local[i]);
-                    risky_combination *risky_comb = (risky_combination*) hn->value;
-                    
-                    int position = -1;
-                    
-#pragma omp critical
-                    {
-                        position = add_to_model_ranking(risky_comb, options_data->max_ranking_size, ranking_risky[i], heap_min_func_local);
-                    }
-                    
-                    if (position < 0) {
-                        risky_combination_free(risky_comb);
-                    }
-                    free(hn);
-                }
-                free(ranking_risky_local[i]);
-            }
-            free(ranking_risky_local);
-            
-            _mm_free(masks);
-            for (int s = 0; s < order; s++) {
-                _mm_free(scratchpad[s]);
-            }
-            _mm_free(counts_aff);
-            _mm_free(counts_unaff);
-            
             // Notify a block has been processed
             char end_block_msg[256]; memset(end_block_msg, 0, 256 * sizeof(char));
             sprintf(end_block_msg, "[%d,%d] Block finished: (", mpi_rank, omp_get_thread_num());
@@ -388,7 +627,40 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
             end_block_msg[end_block_msg_len] = '\n';
             
             LOG_INFO(end_block_msg);
+            
+            epistasis_checkpoint_block_finished(checkpoint, omp_get_thread_num(), pending_blocks[i], workspace);
         }
+        
+        // Without threads enough for overlapping it, the rankings of the previous sweep are reduced now, and as the
+        // start of this sweep was deferred until then, none of its blocks has been saved by the checkpoints
+        if (pending_rankings && !pending_reduced) {
+            double reduction_time = reduce_and_report_sweep(pending_repetition, pending_rankings, best_models, num_sweep_repetitions,
+                                                            num_folds, mpi_rank, num_mpi_ranks, risky_mpi_type, heap_min_func, 
+                                                            heap_max_func, info, checkpoint, permutations, phenotypes, selected_snps, 
+                                                            shared_options_data, options_data);
+            communication_time += reduction_time;
+            sweep_start += reduction_time;
+        }
+        
+        // Models grown one SNP at a time from the best ones of the previous order, once the rankings of the 
+        // previous sweep have been reduced, as both communicate from the main thread
+        if (beam_width > 0) {
+            beam_search_mpi(order, beam_width, beam_bitplanes, num_variants, num_sweep_folds, fold_bitmasks, 
+                            training_sizes, testing_sizes, prune, options_data->eval_function, options_data->eval_subset, 
+                            info, mpi_rank, num_mpi_ranks, shared_options_data->num_threads, workspaces);
+        }
+        
+        computation_time += omp_get_wtime() - sweep_start;
+        pending_rankings = NULL;
+        
+        block_dispatcher_report(dispatcher);
+        block_dispatcher_free(dispatcher);
+        free(pending_coords);
+        free(pending_blocks);
+        
+        // Insert the best models found by each thread in the ranking of the node
+        merge_workspace_rankings(shared_options_data->num_threads, workspaces, options_data->max_ranking_size, 
+                                 heap_min_func, ranking_risky);
 
 /*
         for (int f = 0; f < num_folds; f++) {
@@ -403,88 +675,50 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
             printf("\n\n");
         }
 */
-        if (mpi_rank == 0) {
-            LOG_DEBUG_F("Merging rankings in node for CV %d\n", r+1);
-        }
- 
-        // Merge rankings from all nodes in a tree fashion so none of them gets overloaded
-        int numprocs_log2 = ceil(log((double) num_mpi_ranks) / log(2.0));
-        MPI_Status stat;
-
-        for (int f = 0; f < num_folds; f++) {
-            for (int i = 1; i <= numprocs_log2; i++) {
-                if (mpi_rank % (1 << i) == 0) {
-                    int src = mpi_rank + (1 << (i - 1));
-                    if (src < num_mpi_ranks) { // Take care when the number of ranks is not a power of 2
-                        size_t ranking_size = receive_ranking_risky_size_mpi(src, MPI_COMM_WORLD, stat);
-                        for (int c = 0; c < ranking_size; c++) {
-                            risky_combination *risky_comb = receive_risky_combination_mpi(order, risky_mpi_type, info, src, MPI_COMM_WORLD, stat);
-                            int position = add_to_model_ranking(risky_comb, options_data->max_ranking_size, ranking_risky[f], heap_min_func);
-                            if (position < 0) {
-                                risky_combination_free(risky_comb);
-                            }
-                        }
-                        
-                        LOG_DEBUG_F("IN, step %d -> Node %d receives from %d\n", i, mpi_rank, src);
-                    } else {
-                        LOG_DEBUG_F("--, step %d -> Node %d keeps its data\n", i, mpi_rank);
-                    }
-                } else if (mpi_rank % (1 << (i - 1)) == 0) {
-                    int dest = mpi_rank - (1 << (i - 1));
-                    // Send size of this ranking
-                    send_ranking_risky_size_mpi(ranking_risky[f], dest, MPI_COMM_WORLD);
-
-                    // Send best combinations to another node
-                    struct heap_node *hn;
-                    risky_combination *risky = NULL;
-
-                    while (!heap_empty(ranking_risky[f])) {
-                        hn = heap_take(heap_min_func, ranking_risky[f]);
-                        risky = (risky_combination*) hn->value;
-                        send_risky_combination_mpi(risky, risky_mpi_type, dest, MPI_COMM_WORLD);
-                        risky_combination_free(risky);
-                        free(hn);
-                    }
-                
-                    LOG_DEBUG_F("OUT, step %d <- Node %d sends to %d\n", i, mpi_rank, mpi_rank - (1 << (i - 1)));
-                }
-            }
-        }
-
-	MPI_Barrier(MPI_COMM_WORLD);
-        if (mpi_rank == 0) {
-            LOG_DEBUG_F("Rankings in node for CV %d merged!\n", r+1);
-        }        
-        
-        // Root node merges all rankings in one and shows best models
-        if (mpi_rank == 0) {
-            best_models[r] = merge_rankings(num_folds, ranking_risky, heap_min_func, heap_max_func);
-            
-            char *path, default_path[32];
-            sprintf(default_path, "hpg-variant.cv%d.epi", r+1);
-            FILE *fd = get_output_file(shared_options_data, default_path, &path);
-            epistasis_report(order, r, options_data->eval_mode, options_data->eval_subset, best_models[r], options_data->max_ranking_size, heap_max_func, fd);
-            fclose(fd);
-        }
-        
-        // Free data por this repetition
-        for (int i = 0; i < num_folds; i++) {
-            free(folds[i]);
-            free(ranking_risky[i]);
-        }
-        free(ranking_risky);
-        free(folds);
+        // Folds are not needed anymore once all blocks have been processed
         free(testing_sizes);
         free(training_sizes);
         _mm_free(fold_masks);
+        if (phenotypes) {
+            free(ranked_testing_sizes);
+            _mm_free(count_masks);
+        }
+        if (fold_bitmasks) {
+            _mm_free(fold_bitmasks);
+        }
         
+        // The rankings are reduced while the next sweep is processed, unless this is the last one
+        if (overlap_reduction && r + num_sweep_repetitions < options_data->num_cv_repetitions) {
+            pending_rankings = ranking_risky;
+            pending_repetition = r;
+        } else {
+            communication_time += reduce_and_report_sweep(r, ranking_risky, best_models, num_sweep_repetitions, num_folds,
+                                                          mpi_rank, num_mpi_ranks, risky_mpi_type, heap_min_func, heap_max_func, 
+                                                          info, checkpoint, permutations, phenotypes, selected_snps, 
+                                                          shared_options_data, options_data);
+        }
     }
+    
+    communication_time += overlapped_communication_time;
+    LOG_INFO_F("P%d) %.3f s processing blocks, %.3f s merging rankings (%.3f s of them while processing blocks)\n", 
+               mpi_rank, computation_time, communication_time, overlapped_communication_time);
    
+    // The search has finished, so it won't need to be resumed
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_checkpoint_free(checkpoint);
+    free(node_block_coords);
+    
     // Free data for the whole epistasis check
     for (int i = 0; i < num_genotype_permutations; i++) {
         free(genotype_permutations[i]);
     }
     free(genotype_permutations);
+    for (int t = 0; t < shared_options_data->num_threads; t++) {
+        epistasis_workspace_free(workspaces[t]);
+    }
+    if (beam_bitplanes && beam_bitplanes != dataset_bitplanes) {
+        _mm_free(beam_bitplanes);
+    }
     
     // Free best models rankings in root node
     if (mpi_rank == 0) {
@@ -498,9 +732,23 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
         }
     }
     
+    if (permutations) {
+        permutation_test_free(permutations);
+    }
+    if (phenotypes) {
+        epistasis_phenotypes_free(phenotypes);
+    }
+    if (selected_snps) {
+        free(selected_snps);
+        free(selected_genotypes);
+        if (selected_bitplanes) {
+            _mm_free(selected_bitplanes);
+        }
+    }
+    
     // TODO MPI_ERR_Type? Invalid datatype argument. May be an uncommitted MPI_Datatype (see MPI_Type_commit).
     risky_combination_mpi_free(&risky_mpi_type);
-    epistasis_dataset_close_mpi(input_file, fd);
+    epistasis_dataset_close_mpi(input_file, dataset);
     
     MPI_Barrier(MPI_COMM_WORLD);
     return ret_code;
@@ -38,7 +38,7 @@ void bcast_shared_options_data_mpi(shared_options_data_t *options_data, int root
 void bcast_epistasis_options_data_mpi(epistasis_options_data_t *options_data, int root, MPI_Comm comm) {
     MPI_Datatype mpi_epistasis_options_type;
     // Length of the struct members
-    int lengths[] = { 7 };
+    int lengths[] = { 18 };
     // Datatype of the struct members
     MPI_Datatype types[] = { MPI_INT };
     // Offset of the struct members
@@ -70,6 +70,26 @@ void bcast_epistasis_options_data_mpi(epistasis_options_data_t *options_data, in
 }
 
 
+void wait_request_mpi(MPI_Request *request) {
+    int done;
+    MPI_Test(request, &done, MPI_STATUS_IGNORE);
+    while (!done) {
+        usleep(MPI_POLL_USECS);
+        MPI_Test(request, &done, MPI_STATUS_IGNORE);
+    }
+}
+
+void barrier_mpi(MPI_Comm comm) {
+#if MPI_VERSION >= 3
+    MPI_Request request;
+    MPI_Ibarrier(comm, &request);
+    wait_request_mpi(&request);
+#else
+    MPI_Barrier(comm);
+#endif
+}
+
+
 void risky_combination_mpi_init(risky_combination_mpi_t *type) {
     // Length of each block of struct members
     type->lengths[0] = 1;
@@ -93,36 +113,184 @@ void risky_combination_mpi_free(risky_combination_mpi_t *type) {
     MPI_Type_free(&(type->datatype));
 }
 
-void send_ranking_risky_size_mpi(struct heap *ranking, int dest, MPI_Comm comm) {
-    long size_cast_for_mpi = (long) ranking->size;
-    MPI_Send(&size_cast_for_mpi, 1, MPI_LONG, dest, TAG_RANKING_RISKY_SIZE, comm);
+void send_rankings_mpi(int num_rankings, struct heap **rankings, compare_risky_heap_func priority_func, 
+                       risky_combination_mpi_t type, int dest, MPI_Comm comm) {
+    // Take the combinations out of the rankings, which can't be iterated otherwise
+    size_t ranking_sizes[num_rankings];
+    struct heap_node **nodes[num_rankings];
+    
+    for (int f = 0; f < num_rankings; f++) {
+        ranking_sizes[f] = rankings[f]->size;
+        nodes[f] = malloc(ranking_sizes[f] * sizeof(struct heap_node*));
+        for (size_t i = 0; i < ranking_sizes[f]; i++) {
+            nodes[f][i] = heap_take(priority_func, rankings[f]);
+        }
+    }
+    
+    // Get the size of the message: size of each ranking, then the members of each combination
+    int buffer_size, member_size;
+    MPI_Pack_size(num_rankings, MPI_LONG, comm, &buffer_size);
+    
+    for (int f = 0; f < num_rankings; f++) {
+        for (size_t i = 0; i < ranking_sizes[f]; i++) {
+            risky_combination *risky = (risky_combination*) nodes[f][i]->value;
+            MPI_Pack_size(1, type.datatype, comm, &member_size);
+            buffer_size += member_size;
+            MPI_Pack_size(risky->order, MPI_INT, comm, &member_size);
+            buffer_size += member_size;
+            MPI_Pack_size(risky->num_risky_genotypes * risky->order, MPI_BYTE, comm, &member_size);
+            buffer_size += member_size;
+        }
+    }
+    
+    // Pack all rankings, freeing their combinations
+    char *buffer = malloc(buffer_size);
+    int position = 0;
+    
+    for (int f = 0; f < num_rankings; f++) {
+        long size_cast_for_mpi = (long) ranking_sizes[f];
+        MPI_Pack(&size_cast_for_mpi, 1, MPI_LONG, buffer, buffer_size, &position, comm);
+        
+        for (size_t i = 0; i < ranking_sizes[f]; i++) {
+            risky_combination *risky = (risky_combination*) nodes[f][i]->value;
+            // Members of built-in types, combination (int pointer) and genotypes (uint8_t pointer)
+            MPI_Pack(risky, 1, type.datatype, buffer, buffer_size, &position, comm);
+            MPI_Pack(risky->combination, risky->order, MPI_INT, buffer, buffer_size, &position, comm);
+            MPI_Pack(risky->genotypes, risky->num_risky_genotypes * risky->order, MPI_BYTE, buffer, buffer_size, &position, comm);
+            risky_combination_free(risky);
+            free(nodes[f][i]);
+        }
+        free(nodes[f]);
+    }
+    
+    MPI_Request request;
+    MPI_Isend(buffer, position, MPI_PACKED, dest, TAG_RANKINGS, comm, &request);
+    wait_request_mpi(&request);
+    free(buffer);
 }
 
-size_t receive_ranking_risky_size_mpi(int src, MPI_Comm comm, MPI_Status stat) {
-    long received_size;
-    MPI_Recv(&received_size, 1, MPI_LONG, src, TAG_RANKING_RISKY_SIZE, comm, &stat);
-    return (size_t) received_size;
+void receive_rankings_mpi(int order, int num_rankings, struct heap **rankings, int max_ranking_size, 
+                          compare_risky_heap_func priority_func, risky_combination_mpi_t type, masks_info info, 
+                          int src, MPI_Comm comm) {
+    // The size of the message is not known in advance
+    MPI_Status stat;
+    int buffer_size, arrived;
+    MPI_Iprobe(src, TAG_RANKINGS, comm, &arrived, &stat);
+    while (!arrived) {
+        usleep(MPI_POLL_USECS);
+        MPI_Iprobe(src, TAG_RANKINGS, comm, &arrived, &stat);
+    }
+    MPI_Get_count(&stat, MPI_PACKED, &buffer_size);
+    
+    char *buffer = malloc(buffer_size);
+    int position = 0;
+    MPI_Request request;
+    MPI_Irecv(buffer, buffer_size, MPI_PACKED, src, TAG_RANKINGS, comm, &request);
+    wait_request_mpi(&request);
+    
+    int comb[order]; memset(comb, 0, order * sizeof(int));
+    
+    for (int f = 0; f < num_rankings; f++) {
+        long ranking_size;
+        MPI_Unpack(buffer, buffer_size, &position, &ranking_size, 1, MPI_LONG, comm);
+        
+        for (long c = 0; c < ranking_size; c++) {
+            risky_combination *received = risky_combination_new(order, comb, NULL, NULL, NULL, info);
+            MPI_Unpack(buffer, buffer_size, &position, received, 1, type.datatype, comm);
+            MPI_Unpack(buffer, buffer_size, &position, received->combination, received->order, MPI_INT, comm);
+            MPI_Unpack(buffer, buffer_size, &position, received->genotypes, received->num_risky_genotypes * received->order, MPI_BYTE, comm);
+            
+            if (add_to_model_ranking(received, max_ranking_size, rankings[f], priority_func) < 0) {
+                risky_combination_free(received);
+            }
+        }
+    }
+    
+    free(buffer);
 }
 
-void send_risky_combination_mpi(risky_combination *risky, risky_combination_mpi_t type, int dest, MPI_Comm comm) {
-    // Send members of built-in types
-    MPI_Send(risky, 1, type.datatype, dest, TAG_RANKING_RISKY_ELEM, comm);
-    // Send combination (int pointer)
-    MPI_Send(risky->combination, risky->order, MPI_INT, dest, TAG_RANKING_RISKY_ELEM, comm);
-    // Send genotypes (uint8_t pointer)
-    MPI_Send(risky->genotypes, risky->num_risky_genotypes * risky->order, MPI_BYTE, dest, TAG_RANKING_RISKY_ELEM, comm);
+void allgather_beam_mpi(epistasis_beam *beam, epistasis_beam *merged, MPI_Comm comm) {
+    int num_ranks, order = beam->order;
+    MPI_Comm_size(comm, &num_ranks);
+    
+    int sizes[num_ranks], counts[num_ranks], offsets[num_ranks];
+    MPI_Allgather(&beam->size, 1, MPI_INT, sizes, 1, MPI_INT, comm);
+    
+    int total_size = 0;
+    for (int p = 0; p < num_ranks; p++) {
+        offsets[p] = total_size;
+        total_size += sizes[p];
+    }
+    
+    // Beams of all processes, received one after another
+    epistasis_beam *received = epistasis_beam_new(order, total_size > 0 ? total_size : 1);
+    MPI_Allgatherv(beam->scores, beam->size, MPI_DOUBLE, received->scores, sizes, offsets, MPI_DOUBLE, comm);
+    for (int p = 0; p < num_ranks; p++) {
+        counts[p] = sizes[p] * order;
+        offsets[p] *= order;
+    }
+    MPI_Allgatherv(beam->combinations, beam->size * order, MPI_INT, received->combinations, counts, offsets, MPI_INT, comm);
+    received->size = total_size;
+    
+    epistasis_beam_merge(1, &received, merged);
+    epistasis_beam_free(received);
 }
 
-risky_combination* receive_risky_combination_mpi(int order, risky_combination_mpi_t type, masks_info info, int src, MPI_Comm comm, MPI_Status stat) {
-    int comb[order]; memset(comb, 0, order * sizeof(int));
-    risky_combination *received = risky_combination_new(order, comb, NULL, 0, NULL, NULL, info);
+int *distribute_blocks_mpi(int order, size_t num_variants, int stride, bool dynamic, bool heuristic, 
+                           size_t *num_blocks, int root, MPI_Comm comm) {
+    *num_blocks = 0;
+    if (heuristic) {
+        return NULL;
+    }
+    
+    int mpi_rank, num_mpi_ranks;
+    MPI_Comm_rank(comm, &mpi_rank);
+    MPI_Comm_size(comm, &num_mpi_ranks);
+    
+    // In dynamic mode every process calculates all the blocks, so only their indices are sent later
+    int *block_coords = NULL;
+    size_t num_block_coords = 0;
+    if (mpi_rank == root || dynamic) {
+        size_t num_blocks_per_dim = ceil((double) num_variants / stride);
+        size_t max_num_block_coords = (size_t) pow(num_blocks_per_dim, order);
+        block_coords = calloc((max_num_block_coords + 1) * order, sizeof(int));
+        
+        int curr_idx = 0;
+        do {
+            int next_idx = curr_idx + order;
+            memcpy(block_coords + next_idx, block_coords + curr_idx, order * sizeof(int));
+            curr_idx = next_idx;
+            num_block_coords++;
+        } while (get_next_block(num_blocks_per_dim, order, block_coords + curr_idx));
+    }
+    
+    if (dynamic) {
+        *num_blocks = num_block_coords;
+        return block_coords;
+    }
+    
+    // Send total number of blocks to all processes, then a share of their coordinates to each one
+    MPI_Bcast(&num_block_coords, 1, MPI_UNSIGNED_LONG, root, comm);
+    
+    int block_counts[num_mpi_ranks];
+    int block_offsets[num_mpi_ranks];
+    for (int p = 0; p < num_mpi_ranks; p++) {
+        if (p < num_block_coords % num_mpi_ranks) {
+            block_counts[p] = order * (num_block_coords / num_mpi_ranks + 1);
+        } else {
+            block_counts[p] = order * (num_block_coords / num_mpi_ranks);
+        }
+    }
+    block_offsets[0] = 0;
+    for (int p = 1; p < num_mpi_ranks; p++) {
+        block_offsets[p] = block_offsets[p-1] + block_counts[p-1];
+    }
     
-    // Receive members of built-in types
-    MPI_Recv(received, 1, type.datatype, src, TAG_RANKING_RISKY_ELEM, comm, &stat);
-    // Receive combination (int pointer)
-    MPI_Recv(received->combination, received->order, MPI_INT, src, TAG_RANKING_RISKY_ELEM, comm, &stat);
-    // Receive genotypes (uint8_t pointer)
-    MPI_Recv(received->genotypes, received->num_risky_genotypes * received->order, MPI_BYTE, src, TAG_RANKING_RISKY_ELEM, comm, &stat);
+    int *node_block_coords = calloc(block_counts[mpi_rank] + 1, sizeof(int));
+    MPI_Scatterv(block_coords, block_counts, block_offsets, MPI_INT, 
+                 node_block_coords, block_counts[mpi_rank], MPI_INT, root, comm);
+    free(block_coords);
     
-    return received;
+    *num_blocks = block_counts[mpi_rank] / order;
+    return node_block_coords;
 }
@@ -22,15 +22,25 @@
 #define	MPI_EPISTASIS_HELPER_H
 
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <mpi.h>
 
+#include "../beam_search.h"
+#include "../dataset.h"
 #include "../epistasis.h"
 #include "../model.h"
 #include "shared_options.h"
 
-#define TAG_RANKING_RISKY_SIZE  0
-#define TAG_RANKING_RISKY_ELEM  1
+#define TAG_RANKINGS            0
+#define TAG_BLOCK_REQUEST       1
+#define TAG_BLOCK_CHUNK         2
+
+/**
+ * Microseconds between checks of a pending communication. Blocking calls of most MPI libraries keep a core 
+ * busy, which would be taken from the threads processing blocks when communicating at the same time.
+ */
+#define MPI_POLL_USECS          200
 
 typedef struct {
     int lengths[2];
@@ -43,17 +53,72 @@ void bcast_shared_options_data_mpi(shared_options_data_t *options_data, int root
 
 void bcast_epistasis_options_data_mpi(epistasis_options_data_t *options_data, int root, MPI_Comm comm);
 
-void risky_combination_mpi_init(risky_combination_mpi_t *type);
-
-void risky_combination_mpi_free(risky_combination_mpi_t *type);
-
-void send_ranking_risky_size_mpi(struct heap *ranking, int dest, MPI_Comm comm);
+/**
+ * @brief Waits for a non-blocking communication to complete, sleeping between checks.
+ **/
+void wait_request_mpi(MPI_Request *request);
 
-size_t receive_ranking_risky_size_mpi(int src, MPI_Comm comm, MPI_Status stat);
+/**
+ * @brief Same as MPI_Barrier, but sleeping while other processes arrive (with MPI-3 or later).
+ **/
+void barrier_mpi(MPI_Comm comm);
 
-void send_risky_combination_mpi(risky_combination *risky, risky_combination_mpi_t type, int dest, MPI_Comm comm);
+void risky_combination_mpi_init(risky_combination_mpi_t *type);
 
-risky_combination* receive_risky_combination_mpi(int order, risky_combination_mpi_t type, masks_info info, int src, MPI_Comm comm, MPI_Status stat);
+void risky_combination_mpi_free(risky_combination_mpi_t *type);
 
+/**
+ * @brief Sends the rankings of several folds to another process in a single message.
+ * @details Sends the rankings of several folds to another process in a single message. For each ranking, 
+ * its size is packed followed by its combinations. The rankings are emptied and their combinations freed.
+ *
+ * @param num_rankings Number of rankings to send
+ * @param rankings Rankings to send
+ * @param priority_func Function for taking elements out of the rankings
+ * @param type MPI datatype of the members of built-in types of a combination
+ **/
+void send_rankings_mpi(int num_rankings, struct heap **rankings, compare_risky_heap_func priority_func, 
+                       risky_combination_mpi_t type, int dest, MPI_Comm comm);
+
+/**
+ * @brief Receives the rankings of several folds from another process and merges them with the local ones.
+ * @details Receives the rankings of several folds from another process, as sent by send_rankings_mpi, 
+ * and inserts their combinations into the rankings of this process.
+ *
+ * @param order Number of SNPs combined
+ * @param num_rankings Number of rankings to receive
+ * @param rankings Rankings where the received combinations are inserted
+ * @param max_ranking_size Maximum number of combinations in each ranking
+ * @param priority_func Function for inserting elements into the rankings
+ * @param type MPI datatype of the members of built-in types of a combination
+ * @param info Masks information, needed to allocate the combinations
+ **/
+void receive_rankings_mpi(int order, int num_rankings, struct heap **rankings, int max_ranking_size, 
+                          compare_risky_heap_func priority_func, risky_combination_mpi_t type, masks_info info, 
+                          int src, MPI_Comm comm);
+
+/**
+ * @brief Gathers the beams found by all processes and merges them, so all of them get the same one.
+ * @details Gathers the beams found by all processes, each one with the best candidates it tested, and merges 
+ * them keeping the best combinations. The merged beam is the same in all processes.
+ *
+ * @param beam Best candidates tested by this process
+ * @param[out] merged Best candidates tested by all processes
+ **/
+void allgather_beam_mpi(epistasis_beam *beam, epistasis_beam *merged, MPI_Comm comm);
+
+/**
+ * @brief Gets the coordinates of the blocks each process of the exhaustive search must test.
+ * @details Gets the coordinates of the blocks each process of the exhaustive search must test. In dynamic 
+ * mode all processes get all blocks, and their indices are dispatched later. Otherwise the root process 
+ * enumerates them and scatters a share to each process. The beam search tests no blocks, so NULL is returned 
+ * and num_blocks is set to 0, without communicating.
+ *
+ * @param heuristic Whether the combinations are grown by the beam search
+ * @param[out] num_blocks Number of blocks of this process
+ * @return Coordinates of the blocks of this process, order per block
+ **/
+int *distribute_blocks_mpi(int order, size_t num_variants, int stride, bool dynamic, bool heuristic, 
+                           size_t *num_blocks, int root, MPI_Comm comm);
 
 #endif
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "permutation.h"
+
+
+permutation_test *permutation_test_new(int order, uint8_t *genotypes, int num_affected, int num_unaffected,
+                                       int num_permutations, enum eval_function function) {
+    permutation_test *test = malloc(sizeof(permutation_test));
+    test->order = order;
+    test->num_permutations = num_permutations;
+    test->function = function;
+    test->genotypes = genotypes;
+    masks_info_init(order, 1, num_affected, num_unaffected, &(test->info));
+
+    int num_genotype_permutations;
+    test->genotype_permutations = get_genotype_combinations(order, &num_genotype_permutations);
+
+    // Masks of the affected samples of each permutation (the last one is all samples), packed into bits
+    int num_samples = num_affected + num_unaffected;
+    int num_masks = num_permutations + 1;
+    uint8_t *labels = _mm_malloc(test->info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    int *samples = malloc(num_samples * sizeof(int));
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = i;
+    }
+    
+    // The permutations are drawn from a state of their own, so they don't change the folds drawn from rand afterwards
+    unsigned int seed = PERMUTATION_SEED;
+
+    test->label_bitmasks = _mm_malloc(num_masks * test->info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    for (int p = 0; p < num_masks; p++) {
+        memset(labels, 0, test->info.num_samples_with_padding * sizeof(uint8_t));
+        if (p < num_permutations) {
+            // The first num_affected samples after shuffling are labelled as affected
+            shuffle_samples(samples, num_samples, &seed);
+            for (int i = 0; i < num_affected; i++) {
+                int s = samples[i];
+                labels[(s < num_affected) ? s : test->info.num_affected_with_padding + s - num_affected] = 1;
+            }
+        } else {
+            memset(labels, 1, num_affected * sizeof(uint8_t));
+            memset(labels + test->info.num_affected_with_padding, 1, num_unaffected * sizeof(uint8_t));
+        }
+        set_fold_bitmasks(1, labels, test->info, test->label_bitmasks + p * test->info.num_words_per_bitplane);
+    }
+    _mm_free(labels);
+    free(samples);
+
+    int num_counts = num_masks * test->info.num_cell_counts_per_combination;
+    test->padded_genotypes = _mm_malloc(test->info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    test->bitplanes = _mm_malloc(order * test->info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    test->counts_aff = malloc(num_counts * sizeof(int));
+    test->counts_unaff = malloc(num_counts * sizeof(int));
+    test->cases = malloc(num_counts * sizeof(int));
+    test->controls = malloc(num_counts * sizeof(int));
+    test->risk_masks = malloc(num_masks * test->info.num_words_per_risk_mask * sizeof(uint64_t));
+
+    return test;
+}
+
+double permutation_test_pvalue(int *combination, permutation_test *test, double *statistic) {
+    masks_info info = test->info;
+    int num_samples = info.num_affected + info.num_unaffected;
+    int num_cells = info.num_cell_counts_per_combination;
+    int num_permutations = test->num_permutations;
+
+    // Bitplanes of the SNPs of the model
+    uint64_t *snp_bitplanes[test->order];
+    for (int j = 0; j < test->order; j++) {
+        uint8_t *snp_genotypes = test->genotypes + (size_t) combination[j] * num_samples;
+        memset(test->padded_genotypes, 0, info.num_samples_with_padding * sizeof(uint8_t));
+        memcpy(test->padded_genotypes, snp_genotypes, info.num_affected * sizeof(uint8_t));
+        memcpy(test->padded_genotypes + info.num_affected_with_padding, snp_genotypes + info.num_affected, info.num_unaffected * sizeof(uint8_t));
+
+        snp_bitplanes[j] = test->bitplanes + j * info.num_words_per_snp;
+        set_genotypes_bitplanes(1, test->padded_genotypes, info, snp_bitplanes[j]);
+    }
+
+    // Counts of all permutations at once
+    combination_counts_all_folds_bitplanes(test->order, 1, test->label_bitmasks, num_permutations + 1, test->genotype_permutations,
+                                           snp_bitplanes, info, test->counts_aff, test->counts_unaff);
+
+    // Samples labelled as affected in a cell are counted in either group, the rest of the cell is unaffected.
+    // The original phenotypes are placed after the permutations.
+    int *all_aff = test->counts_aff + num_permutations * num_cells;
+    int *all_unaff = test->counts_unaff + num_permutations * num_cells;
+    for (int p = 0; p < num_permutations; p++) {
+        for (int c = 0; c < num_cells; c++) {
+            int cases = test->counts_aff[p * num_cells + c] + test->counts_unaff[p * num_cells + c];
+            test->cases[p * num_cells + c] = cases;
+            test->controls[p * num_cells + c] = all_aff[c] + all_unaff[c] - cases;
+        }
+    }
+    memcpy(test->cases + num_permutations * num_cells, all_aff, num_cells * sizeof(int));
+    memcpy(test->controls + num_permutations * num_cells, all_unaff, num_cells * sizeof(int));
+
+    // Fit and evaluate the model with each set of phenotypes, using all samples
+    mdr_high_risk_masks(test->cases, test->controls, num_permutations + 1, num_cells,
+                        info.num_affected, info.num_unaffected, test->risk_masks);
+
+    unsigned int sizes[2] = { info.num_affected, info.num_unaffected };
+    double evaluations[num_permutations + 1];
+    for (int p = 0; p <= num_permutations; p++) {
+        unsigned int conf_matrix[4];
+        int *cases = test->cases + p * num_cells;
+        int *controls = test->controls + p * num_cells;
+        evaluations[p] = test_model_counts(test->risk_masks + p * info.num_words_per_risk_mask, cases, controls, cases, controls,
+                                           test->function, TRAINING, sizes, sizes, info, conf_matrix);
+    }
+
+    *statistic = evaluations[num_permutations];
+    int num_as_good = 1;
+    for (int p = 0; p < num_permutations; p++) {
+        if (evaluations[p] >= *statistic) {
+            num_as_good++;
+        }
+    }
+
+    return (double) num_as_good / (num_permutations + 1);
+}
+
+void permutation_test_free(permutation_test *test) {
+    for (int i = 0; i < test->info.num_cell_counts_per_combination; i++) {
+        free(test->genotype_permutations[i]);
+    }
+    free(test->genotype_permutations);
+    _mm_free(test->label_bitmasks);
+    _mm_free(test->padded_genotypes);
+    _mm_free(test->bitplanes);
+    free(test->counts_aff);
+    free(test->counts_unaff);
+    free(test->cases);
+    free(test->controls);
+    free(test->risk_masks);
+    free(test);
+}
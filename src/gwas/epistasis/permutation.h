@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_PERMUTATION_H
+#define EPISTASIS_PERMUTATION_H
+
+/**
+ * @file permutation.h
+ * @brief Permutation tests of the significance of the best models
+ *
+ * The phenotypes of the samples are permuted a number of times, and the model is fitted and evaluated again
+ * with each permutation. The samples labelled as affected in each permutation are stored as a mask, with the
+ * same layout as the masks of the folds, so the counts of all permutations are obtained in a single call to
+ * the counting kernel. A mask of all samples is appended, so the unaffected samples of each permutation are
+ * derived as the difference, and the counts with the original phenotypes are obtained along with the rest.
+ *
+ * The p-value is computed for each model on its own, so it does not account for the rest of combinations
+ * tested in the search.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <commons/log.h>
+#include <math/data/array_utils.h>
+
+#include "cross_validation.h"
+#include "kernels.h"
+#include "mdr.h"
+#include "model.h"
+
+#define PERMUTATION_SEED                1       /**< Initial state of the generator of the permutations */
+
+typedef struct {
+    int order;
+    int num_permutations;
+    enum eval_function function;
+    masks_info info;                    /**< Layout of the samples, with a single combination per row */
+    uint8_t *genotypes;                 /**< Genotypes of the dataset, num_samples per SNP */
+    uint8_t **genotype_permutations;
+    uint64_t *label_bitmasks;           /**< Samples labelled as affected in each permutation, then all samples */
+    uint8_t *padded_genotypes;          /**< Genotypes of a SNP, with the padding of info */
+    uint64_t *bitplanes;                /**< Bitplanes of the SNPs of the model being tested */
+    int *counts_aff;                    /**< Counts of the samples in each mask, per genotype permutation */
+    int *counts_unaff;
+    int *cases;                         /**< Affected samples of each phenotype permutation, per genotype permutation */
+    int *controls;
+    uint64_t *risk_masks;
+} permutation_test;
+
+
+/**
+ * @brief Generates the permutations of the phenotypes used for testing the models of a search.
+ *
+ * @param genotypes Genotypes of the dataset, affected samples first
+ * @param num_permutations Number of permutations of the phenotypes
+ * @param function Function the models are evaluated with
+ * @return A new permutation test
+ **/
+permutation_test *permutation_test_new(int order, uint8_t *genotypes, int num_affected, int num_unaffected,
+                                       int num_permutations, enum eval_function function);
+
+/**
+ * @brief Gets the p-value of a model, as the proportion of permutations that evaluate at least as well.
+ * @details Gets the p-value of a model, as the proportion of permutations that evaluate at least as well. The
+ * model is fitted again with all samples and each permutation of the phenotypes, and the original phenotypes
+ * count as one more permutation, so the p-value is never zero.
+ *
+ * @param combination SNPs of the model
+ * @param[out] statistic Evaluation of the model fitted with all samples and the original phenotypes
+ * @return The p-value of the model
+ **/
+double permutation_test_pvalue(int *combination, permutation_test *test, double *statistic);
+
+void permutation_test_free(permutation_test *test);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "phenotype.h"
+
+
+epistasis_phenotypes *epistasis_phenotypes_load(uint8_t *contents, int num_affected, int num_unaffected) {
+    // Legacy datasets and the ones without the section only contain the main phenotype
+    epistasis_dataset_header *header = (epistasis_dataset_header*) contents;
+    if (memcmp(contents, EPISTASIS_DATASET_MAGIC, EPISTASIS_DATASET_MAGIC_LEN) ||
+        !(header->layout_flags & EPISTASIS_DATASET_PHENOTYPES) || header->num_phenotypes == 0) {
+        return NULL;
+    }
+
+    int num_samples = num_affected + num_unaffected;
+    epistasis_phenotypes *phenotypes = malloc(sizeof(epistasis_phenotypes));
+    phenotypes->num_phenotypes = header->num_phenotypes;
+    phenotypes->names = malloc(phenotypes->num_phenotypes * sizeof(char*));
+    phenotypes->labels = malloc(phenotypes->num_phenotypes * sizeof(uint8_t*));
+    phenotypes->num_affected = calloc(phenotypes->num_phenotypes, sizeof(int));
+    phenotypes->num_unaffected = calloc(phenotypes->num_phenotypes, sizeof(int));
+
+    uint8_t *record = contents + sizeof(epistasis_dataset_header);
+    for (int p = 0; p < phenotypes->num_phenotypes; p++) {
+        phenotypes->names[p] = strndup((char*) record, EPISTASIS_DATASET_PHENOTYPE_NAME_LEN);
+        phenotypes->labels[p] = record + EPISTASIS_DATASET_PHENOTYPE_NAME_LEN;
+        for (int i = 0; i < num_samples; i++) {
+            if (phenotypes->labels[p][i] == 1) {
+                phenotypes->num_affected[p]++;
+            } else if (phenotypes->labels[p][i] == 0) {
+                phenotypes->num_unaffected[p]++;
+            }
+        }
+
+        LOG_DEBUG_F("Phenotype %s: %d affected, %d unaffected\n", phenotypes->names[p],
+                    phenotypes->num_affected[p], phenotypes->num_unaffected[p]);
+        record += EPISTASIS_DATASET_PHENOTYPE_NAME_LEN + num_samples;
+    }
+
+    return phenotypes;
+}
+
+void epistasis_phenotypes_free(epistasis_phenotypes *phenotypes) {
+    for (int p = 0; p < phenotypes->num_phenotypes; p++) {
+        free(phenotypes->names[p]);
+    }
+    free(phenotypes->names);
+    free(phenotypes->labels);
+    free(phenotypes->num_affected);
+    free(phenotypes->num_unaffected);
+    free(phenotypes);
+}
+
+uint8_t *get_phenotype_masks(int num_folds, uint8_t *fold_masks, epistasis_phenotypes *phenotypes, masks_info info,
+                             unsigned int *training_sizes, unsigned int *testing_sizes) {
+    int num_masks = num_folds + 1;
+    size_t group_len = num_masks * info.num_samples_with_padding;
+    uint8_t *masks = _mm_malloc((1 + 2 * phenotypes->num_phenotypes) * group_len * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    memcpy(masks, fold_masks, group_len * sizeof(uint8_t));
+
+    for (int p = 0; p < phenotypes->num_phenotypes; p++) {
+        uint8_t *cases = masks + (1 + 2 * p) * group_len;
+        uint8_t *controls = cases + group_len;
+        memset(cases, 0, 2 * group_len * sizeof(uint8_t));
+
+        for (int m = 0; m < num_masks; m++) {
+            uint8_t *fold_mask = fold_masks + m * info.num_samples_with_padding;
+            uint8_t *case_mask = cases + m * info.num_samples_with_padding;
+            uint8_t *control_mask = controls + m * info.num_samples_with_padding;
+            int training_affected = 0, training_unaffected = 0;
+
+            // Samples keep their position in the layout of the main phenotype, and padding is not set
+            for (int i = 0; i < info.num_affected + info.num_unaffected; i++) {
+                int position = (i < info.num_affected) ? i : info.num_affected_with_padding + i - info.num_affected;
+                uint8_t label = phenotypes->labels[p][i];
+                case_mask[position] = fold_mask[position] && label == 1;
+                control_mask[position] = fold_mask[position] && label == 0;
+                training_affected += case_mask[position];
+                training_unaffected += control_mask[position];
+            }
+
+            // The mask of all samples has no partitions
+            if (m == num_folds) {
+                continue;
+            }
+
+            unsigned int *training = training_sizes + 3 * (p * num_folds + m);
+            unsigned int *testing = testing_sizes + 3 * (p * num_folds + m);
+            training[0] = training_affected + training_unaffected;
+            training[1] = training_affected;
+            training[2] = training_unaffected;
+            testing[1] = phenotypes->num_affected[p] - training_affected;
+            testing[2] = phenotypes->num_unaffected[p] - training_unaffected;
+            testing[0] = testing[1] + testing[2];
+        }
+    }
+
+    return masks;
+}
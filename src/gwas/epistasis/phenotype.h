@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_PHENOTYPE_H
+#define EPISTASIS_PHENOTYPE_H
+
+/**
+ * @file phenotype.h
+ * @brief Phenotypes searched along with the one the samples of a dataset are grouped by
+ *
+ * The samples of a dataset are split into affected and unaffected by its main phenotype, and the rest of
+ * phenotypes are stored as labels of each sample (see dataset_format.h). The cases (and the controls) of
+ * each phenotype are stored as masks with the same layout as the masks of the folds, like the permutations
+ * of a permutation test, so they are counted in the same call to the kernels as the folds. The AND of the
+ * bitplanes (or masks) of the SNPs is shared by all phenotypes, and only the final AND with each mask and
+ * its popcount are repeated.
+ *
+ * Every phenotype is evaluated with the folds of the main one, so its folds are not stratified.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <commons/log.h>
+
+#include "dataset_format.h"
+#include "kernels.h"
+#include "model.h"
+
+typedef struct {
+    int num_phenotypes;
+    char **names;                   /**< Name of each phenotype, NUL-terminated */
+    uint8_t **labels;               /**< Label of each sample, in the order of the dataset (see dataset_format.h) */
+    int *num_affected;              /**< Samples affected by each phenotype */
+    int *num_unaffected;            /**< Samples unaffected by each phenotype (unknown samples are neither) */
+} epistasis_phenotypes;
+
+
+/**
+ * @brief Gets the phenotypes stored in a dataset besides its main one.
+ *
+ * @param contents Contents of the dataset, as loaded by epistasis_dataset_load
+ * @return The phenotypes of the dataset, or NULL if it does not store any
+ **/
+epistasis_phenotypes *epistasis_phenotypes_load(uint8_t *contents, int num_affected, int num_unaffected);
+
+void epistasis_phenotypes_free(epistasis_phenotypes *phenotypes);
+
+/**
+ * @brief Gets the masks counted for evaluating all phenotypes at once.
+ * @details Gets the masks counted for evaluating all phenotypes at once. The masks of the folds (followed by
+ * the mask of all samples) are copied first, and then, for each phenotype, the same masks restricted to its
+ * cases and to its controls. The sizes of the training and testing partitions of each phenotype in each fold
+ * (total, affected, unaffected) are calculated too.
+ *
+ * @param fold_masks Masks of the folds, followed by the mask of all samples (see add_all_samples_mask)
+ * @param[out] training_sizes 3 * num_folds values per phenotype
+ * @param[out] testing_sizes 3 * num_folds values per phenotype
+ * @return (1 + 2 * num_phenotypes) groups of num_folds + 1 masks
+ **/
+uint8_t *get_phenotype_masks(int num_folds, uint8_t *fold_masks, epistasis_phenotypes *phenotypes, masks_info info,
+                             unsigned int *training_sizes, unsigned int *testing_sizes);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefilter.h"
+
+typedef struct {
+    double score;
+    int snp;
+} scored_snp;
+
+static int compare_scored_snps(const void *snp_1, const void *snp_2);
+static int compare_scored_snps_position(const void *snp_1, const void *snp_2);
+
+/** Chi-square of the genotype x phenotype table of a SNP, leaving genotypes absent from all samples out. */
+static double marginal_chi_square(int *counts_aff, int *counts_unaff) {
+    int total_aff = 0, total_unaff = 0;
+    for (int g = 0; g < NUM_DATASET_GENOTYPES; g++) {
+        total_aff += counts_aff[g];
+        total_unaff += counts_unaff[g];
+    }
+    
+    double total = total_aff + total_unaff, chi_square = 0;
+    for (int g = 0; g < NUM_DATASET_GENOTYPES; g++) {
+        double num_samples = counts_aff[g] + counts_unaff[g];
+        if (num_samples == 0) {
+            continue;
+        }
+        double expected_aff = num_samples * total_aff / total;
+        double expected_unaff = num_samples * total_unaff / total;
+        if (expected_aff > 0) {
+            chi_square += (counts_aff[g] - expected_aff) * (counts_aff[g] - expected_aff) / expected_aff;
+        }
+        if (expected_unaff > 0) {
+            chi_square += (counts_unaff[g] - expected_unaff) * (counts_unaff[g] - expected_unaff) / expected_unaff;
+        }
+    }
+    
+    return chi_square;
+}
+
+int *prefilter_snps(uint8_t *genotypes, uint64_t *bitplanes, size_t num_variants, int num_affected, int num_unaffected, 
+                    int num_selected, double **scores) {
+    int num_samples = num_affected + num_unaffected;
+    int num_words_affected = dataset_num_words(num_affected);
+    int num_words_per_bitplane = num_words_affected + dataset_num_words(num_unaffected);
+    int num_words_per_snp = dataset_num_words_per_snp(num_affected, num_unaffected);
+    
+    scored_snp *snps = malloc(num_variants * sizeof(scored_snp));
+    
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < num_variants; i++) {
+        int counts_aff[NUM_DATASET_GENOTYPES] = { 0 }, counts_unaff[NUM_DATASET_GENOTYPES] = { 0 };
+        
+        if (bitplanes) {
+            uint64_t *snp_bitplanes = bitplanes + i * num_words_per_snp;
+            for (int g = 0; g < NUM_DATASET_GENOTYPES; g++) {
+                uint64_t *plane = snp_bitplanes + g * num_words_per_bitplane;
+                for (int w = 0; w < num_words_affected; w++) {
+                    counts_aff[g] += _mm_popcnt_u64(plane[w]);
+                }
+                for (int w = num_words_affected; w < num_words_per_bitplane; w++) {
+                    counts_unaff[g] += _mm_popcnt_u64(plane[w]);
+                }
+            }
+        } else {
+            // Missing genotypes are not counted
+            uint8_t *snp_genotypes = genotypes + i * num_samples;
+            for (int j = 0; j < num_affected; j++) {
+                if (snp_genotypes[j] < NUM_DATASET_GENOTYPES) {
+                    counts_aff[snp_genotypes[j]]++;
+                }
+            }
+            for (int j = num_affected; j < num_samples; j++) {
+                if (snp_genotypes[j] < NUM_DATASET_GENOTYPES) {
+                    counts_unaff[snp_genotypes[j]]++;
+                }
+            }
+        }
+        
+        snps[i].score = marginal_chi_square(counts_aff, counts_unaff);
+        snps[i].snp = i;
+    }
+    
+    // Best SNPs first, then the selected ones back to their order in the dataset
+    qsort(snps, num_variants, sizeof(scored_snp), compare_scored_snps);
+    qsort(snps, num_selected, sizeof(scored_snp), compare_scored_snps_position);
+    
+    int *selected = malloc(num_selected * sizeof(int));
+    *scores = malloc(num_selected * sizeof(double));
+    for (int i = 0; i < num_selected; i++) {
+        selected[i] = snps[i].snp;
+        (*scores)[i] = snps[i].score;
+    }
+    
+    free(snps);
+    return selected;
+}
+
+uint8_t *prefilter_gather_genotypes(int *selected, int num_selected, uint8_t *genotypes, int num_samples) {
+    uint8_t *selected_genotypes = malloc((size_t) num_selected * num_samples * sizeof(uint8_t));
+    for (int i = 0; i < num_selected; i++) {
+        memcpy(selected_genotypes + (size_t) i * num_samples, genotypes + (size_t) selected[i] * num_samples, 
+               num_samples * sizeof(uint8_t));
+    }
+    return selected_genotypes;
+}
+
+uint64_t *prefilter_gather_bitplanes(int *selected, int num_selected, uint64_t *bitplanes, int num_affected, int num_unaffected) {
+    int num_words_per_snp = dataset_num_words_per_snp(num_affected, num_unaffected);
+    uint64_t *selected_bitplanes = _mm_malloc((size_t) num_selected * num_words_per_snp * sizeof(uint64_t), EPISTASIS_DATASET_ALIGNMENT);
+    for (int i = 0; i < num_selected; i++) {
+        memcpy(selected_bitplanes + (size_t) i * num_words_per_snp, bitplanes + (size_t) selected[i] * num_words_per_snp, 
+               num_words_per_snp * sizeof(uint64_t));
+    }
+    return selected_bitplanes;
+}
+
+void prefilter_report(int *selected, double *scores, int num_selected, size_t num_variants, FILE *fd) {
+    fprintf(fd, "#SNPs SELECTED BY MARGINAL CHI-SQUARE: %d of %zu\n", num_selected, num_variants);
+    fprintf(fd, "#INDEX\tSNP\tCHI-SQUARE\n");
+    for (int i = 0; i < num_selected; i++) {
+        fprintf(fd, "%d\t%d\t%.3f\n", i, selected[i], scores[i]);
+    }
+}
+
+
+/* **********************************************
+ *                  Comparators                 *
+ * **********************************************/
+
+static int compare_scored_snps(const void *snp_1, const void *snp_2) {
+    const scored_snp *s1 = snp_1, *s2 = snp_2;
+    if (s1->score != s2->score) {
+        return (s1->score > s2->score) ? -1 : 1;
+    }
+    return s1->snp - s2->snp;
+}
+
+static int compare_scored_snps_position(const void *snp_1, const void *snp_2) {
+    return ((const scored_snp*) snp_1)->snp - ((const scored_snp*) snp_2)->snp;
+}
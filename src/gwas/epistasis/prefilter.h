@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_PREFILTER_H
+#define EPISTASIS_PREFILTER_H
+
+/**
+ * @file prefilter.h
+ * @brief Selection of the SNPs an epistasis search is restricted to, by their marginal effect
+ *
+ * Each SNP is scored by the chi-square statistic of its genotype x phenotype table (2 degrees of freedom),
+ * and only the best ones are combined in the exhaustive search. The genotypes (and bitplanes, if the dataset 
+ * stores them) of the selected SNPs are gathered into a smaller dataset, so the rest of the search does not 
+ * change. SNPs are numbered in this smaller dataset, and mapped back to their position in the original one 
+ * when the best models are reported.
+ *
+ * Interactions without marginal effects are missed, so this trades completeness for bounded running times.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nmmintrin.h>
+#include <omp.h>
+
+#include <commons/log.h>
+
+#include "dataset_format.h"
+
+/**
+ * @brief Selects the SNPs with the strongest marginal effect.
+ * @details Selects the SNPs with the strongest marginal effect. If the dataset stores bitplanes, the genotypes of 
+ * each phenotype are counted by popcount over them, otherwise over the genotypes matrix. Ties are broken by the 
+ * position of the SNPs, so all processes select the same ones.
+ *
+ * @param genotypes Genotypes of the dataset, affected samples first
+ * @param bitplanes Bitplanes stored in the dataset, NULL if not present
+ * @param num_selected Number of SNPs to select
+ * @param[out] scores Score of each selected SNP
+ * @return Position of the selected SNPs in the dataset, in increasing order
+ **/
+int *prefilter_snps(uint8_t *genotypes, uint64_t *bitplanes, size_t num_variants, int num_affected, int num_unaffected, 
+                    int num_selected, double **scores);
+
+/**
+ * @brief Copies the genotypes of the selected SNPs into a new matrix, with the same layout as in the dataset.
+ **/
+uint8_t *prefilter_gather_genotypes(int *selected, int num_selected, uint8_t *genotypes, int num_samples);
+
+/**
+ * @brief Copies the bitplanes of the selected SNPs into a new buffer, with the same layout as in the dataset.
+ **/
+uint64_t *prefilter_gather_bitplanes(int *selected, int num_selected, uint64_t *bitplanes, int num_affected, int num_unaffected);
+
+/**
+ * @brief Writes the position in the dataset of each selected SNP, and its score.
+ **/
+void prefilter_report(int *selected, double *scores, int num_selected, size_t num_variants, FILE *fd);
+
+#endif
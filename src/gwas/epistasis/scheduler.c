@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+
+typedef struct {
+    size_t cost;
+    size_t index;
+} block_cost;
+
+static int compare_block_cost_desc(const void *a, const void *b) {
+    const block_cost *b1 = a, *b2 = b;
+    if (b1->cost != b2->cost) {
+        return (b1->cost < b2->cost) ? 1 : -1;
+    }
+    // Keep the generation order for blocks with the same cost
+    return (b1->index > b2->index) - (b1->index < b2->index);
+}
+
+static size_t num_subsets(size_t n, int k) {
+    if (k > n) {
+        return 0;
+    }
+    size_t result = 1;
+    for (int i = 1; i <= k; i++) {
+        result = result * (n - k + i) / i;
+    }
+    return result;
+}
+
+
+size_t get_block_num_combinations(int order, int *block_coords, int stride, size_t num_variants) {
+    size_t num_combinations = 1;
+
+    for (int i = 0; i < order; ) {
+        // Repeated coordinates are contiguous
+        int repetitions = 1;
+        while (i + repetitions < order && block_coords[i + repetitions] == block_coords[i]) {
+            repetitions++;
+        }
+
+        // The last block can contain less than 'stride' SNPs
+        size_t first_snp = (size_t) block_coords[i] * stride;
+        size_t num_snps = (first_snp < num_variants) ? num_variants - first_snp : 0;
+        if (num_snps > stride) {
+            num_snps = stride;
+        }
+
+        num_combinations *= num_subsets(num_snps, repetitions);
+        i += repetitions;
+    }
+
+    return num_combinations;
+}
+
+size_t *get_blocks_by_num_combinations(int order, int *block_coords, size_t num_blocks, int stride, size_t num_variants,
+                                       size_t *costs) {
+    block_cost *sorted = malloc(num_blocks * sizeof(block_cost));
+    for (size_t i = 0; i < num_blocks; i++) {
+        sorted[i].cost = get_block_num_combinations(order, block_coords + i * order, stride, num_variants);
+        sorted[i].index = i;
+        if (costs) {
+            costs[i] = sorted[i].cost;
+        }
+    }
+    qsort(sorted, num_blocks, sizeof(block_cost), compare_block_cost_desc);
+
+    size_t *blocks = malloc(num_blocks * sizeof(size_t));
+    for (size_t i = 0; i < num_blocks; i++) {
+        blocks[i] = sorted[i].index;
+    }
+
+    free(sorted);
+    return blocks;
+}
+
+block_scheduler *block_scheduler_new(int num_threads, int order, int *block_coords, size_t num_blocks,
+                                     int stride, size_t num_variants) {
+    block_scheduler *scheduler = malloc(sizeof(block_scheduler));
+    scheduler->num_threads = num_threads;
+    scheduler->num_blocks = num_blocks;
+    scheduler->costs = malloc(num_blocks * sizeof(size_t));
+    scheduler->queues = calloc(num_threads, sizeof(block_queue));
+    scheduler->stats = calloc(num_threads, sizeof(block_thread_stats));
+
+    // Sort blocks by number of combinations, largest first
+    size_t *sorted = get_blocks_by_num_combinations(order, block_coords, num_blocks, stride, num_variants, scheduler->costs);
+
+    // Split the sorted blocks in consecutive runs with a similar amount of work, so all queues are sorted and 
+    // blocks with the same number of combinations keep their generation order. Consecutive blocks of a thread 
+    // then share all coordinates but the last one, and their masks can be reused.
+    size_t total_cost = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        total_cost += scheduler->costs[i];
+    }
+    int *owners = malloc(num_blocks * sizeof(int));
+    size_t *queue_sizes = calloc(num_threads, sizeof(size_t));
+    size_t cumulative_cost = 0;
+    for (size_t i = 0, t = 0; i < num_blocks; i++) {
+        while (t < num_threads - 1 && cumulative_cost * num_threads >= total_cost * (t + 1)) {
+            t++;
+        }
+        owners[i] = t;
+        queue_sizes[t]++;
+        cumulative_cost += scheduler->costs[sorted[i]];
+    }
+    
+    for (int t = 0; t < num_threads; t++) {
+        scheduler->queues[t].blocks = malloc((queue_sizes[t] + 1) * sizeof(size_t));
+        omp_init_lock(&(scheduler->queues[t].lock));
+    }
+    for (size_t i = 0; i < num_blocks; i++) {
+        block_queue *queue = scheduler->queues + owners[i];
+        queue->blocks[queue->tail++] = sorted[i];
+        queue->pending_cost += scheduler->costs[sorted[i]];
+    }
+
+    free(owners);
+    free(queue_sizes);
+    free(sorted);
+    return scheduler;
+}
+
+bool block_scheduler_next(int thread, block_scheduler *scheduler, size_t *block) {
+    block_thread_stats *stats = scheduler->stats + thread;
+    double start = omp_get_wtime();
+
+    // The previous block (if any) has just been finished
+    if (stats->has_block) {
+        stats->busy_time += start - stats->last_time;
+        stats->num_combinations += stats->current_cost;
+        stats->num_blocks++;
+        stats->has_block = false;
+    }
+
+    // Take the largest block in the own queue
+    block_queue *own = scheduler->queues + thread;
+    omp_set_lock(&(own->lock));
+    if (own->head < own->tail) {
+        *block = own->blocks[own->head++];
+        own->pending_cost -= scheduler->costs[*block];
+        stats->has_block = true;
+    }
+    omp_unset_lock(&(own->lock));
+
+    // If empty, steal the smallest block of the thread with most pending work
+    while (!stats->has_block) {
+        int victim = -1;
+        size_t victim_cost = 0;
+        for (int t = 0; t < scheduler->num_threads; t++) {
+            block_queue *queue = scheduler->queues + t;
+            omp_set_lock(&(queue->lock));
+            if (queue->head < queue->tail && (victim < 0 || queue->pending_cost > victim_cost)) {
+                victim = t;
+                victim_cost = queue->pending_cost;
+            }
+            omp_unset_lock(&(queue->lock));
+        }
+
+        if (victim < 0) {
+            break; // No work left in any queue
+        }
+
+        // Another thread could have emptied the queue meanwhile, so check again
+        block_queue *queue = scheduler->queues + victim;
+        omp_set_lock(&(queue->lock));
+        if (queue->head < queue->tail) {
+            *block = queue->blocks[--queue->tail];
+            queue->pending_cost -= scheduler->costs[*block];
+            stats->has_block = true;
+            stats->num_stolen++;
+        }
+        omp_unset_lock(&(queue->lock));
+    }
+
+    stats->last_time = omp_get_wtime();
+    stats->idle_time += stats->last_time - start;
+    if (stats->has_block) {
+        stats->current_cost = scheduler->costs[*block];
+    }
+
+    return stats->has_block;
+}
+
+void block_scheduler_report(block_scheduler *scheduler) {
+    // Threads that finished earlier waited for the last one
+    double end_time = 0;
+    for (int t = 0; t < scheduler->num_threads; t++) {
+        if (scheduler->stats[t].last_time > end_time) {
+            end_time = scheduler->stats[t].last_time;
+        }
+    }
+
+    double total_busy = 0, total_idle = 0;
+    for (int t = 0; t < scheduler->num_threads; t++) {
+        block_thread_stats *stats = scheduler->stats + t;
+        if (stats->last_time > 0) {
+            stats->idle_time += end_time - stats->last_time;
+        }
+        total_busy += stats->busy_time;
+        total_idle += stats->idle_time;
+
+        LOG_INFO_F("Thread %d: %zu blocks (%zu stolen), %zu combinations, busy %.3f s, idle %.3f s\n",
+                   t, stats->num_blocks, stats->num_stolen, stats->num_combinations, stats->busy_time, stats->idle_time);
+    }
+
+    if (total_busy + total_idle > 0) {
+        LOG_INFO_F("Threads were busy %.2f%% of the time\n", 100 * total_busy / (total_busy + total_idle));
+    }
+}
+
+void block_scheduler_free(block_scheduler *scheduler) {
+    for (int t = 0; t < scheduler->num_threads; t++) {
+        omp_destroy_lock(&(scheduler->queues[t].lock));
+        free(scheduler->queues[t].blocks);
+    }
+    free(scheduler->queues);
+    free(scheduler->stats);
+    free(scheduler->costs);
+    free(scheduler);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2013 Cristina Yenyxe Gonzalez Garcia (ICM-CIPF)
+ * Copyright (c) 2013 Ignacio Medina (ICM-CIPF)
+ *
+ * This file is part of hpg-variant.
+ *
+ * hpg-variant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * hpg-variant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hpg-variant. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPISTASIS_SCHEDULER
+#define EPISTASIS_SCHEDULER
+
+/**
+ * @file scheduler.h
+ * @brief Distribution of blocks of combinations among threads
+ *
+ * Blocks with repeated coordinates and blocks at the end of the dataset contain fewer combinations
+ * than the rest, so a static distribution leaves threads idle at the end of each repetition. Blocks
+ * are sorted by their number of combinations and split in consecutive runs with a similar amount of
+ * work, one per thread, so consecutive blocks of a thread share most of their coordinates. Each
+ * thread takes blocks from the front of its own queue and, once empty, steals from the back of the
+ * queue with most pending work.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <omp.h>
+
+#include <commons/log.h>
+
+typedef struct {
+    size_t *blocks;         /**< Indices of the blocks assigned to the thread, largest first */
+    size_t head;            /**< Next block to take by the owner */
+    size_t tail;            /**< One past the next block to steal */
+    size_t pending_cost;    /**< Combinations in the blocks still in the queue */
+    omp_lock_t lock;
+} block_queue;
+
+typedef struct {
+    double busy_time;       /**< Seconds spent processing blocks */
+    double idle_time;       /**< Seconds spent looking for work or waiting for other threads */
+    size_t num_blocks;
+    size_t num_stolen;
+    size_t num_combinations;
+    double last_time;       /**< Time of the last call to block_scheduler_next */
+    bool has_block;
+    size_t current_cost;
+} block_thread_stats;
+
+typedef struct {
+    int num_threads;
+    size_t num_blocks;
+    size_t *costs;          /**< Combinations in each block */
+    block_queue *queues;
+    block_thread_stats *stats;
+} block_scheduler;
+
+
+/**
+ * @brief Gets the number of combinations of SNPs contained in a block.
+ * @details Gets the number of combinations of SNPs contained in a block. Coordinates must be sorted in
+ * ascending order, as generated by get_next_block. A coordinate repeated k times contributes with
+ * C(n,k) combinations, n being the number of SNPs in that block.
+ **/
+size_t get_block_num_combinations(int order, int *block_coords, int stride, size_t num_variants);
+
+/**
+ * @brief Sorts a set of blocks by their number of combinations, largest first.
+ * @details Sorts a set of blocks by their number of combinations, largest first. Blocks with the same
+ * number of combinations keep their generation order, so all processes get the same result.
+ *
+ * @param[out] costs Combinations in each block, unless NULL
+ * @return Indices of the blocks, sorted
+ **/
+size_t *get_blocks_by_num_combinations(int order, int *block_coords, size_t num_blocks, int stride, size_t num_variants,
+                                       size_t *costs);
+
+/**
+ * @brief Creates a scheduler for a set of blocks.
+ *
+ * @param num_threads Number of threads that will request blocks
+ * @param order Number of SNPs combined
+ * @param block_coords Coordinates of all blocks, order values per block
+ * @param num_blocks Number of blocks
+ * @param stride Number of SNPs per block
+ * @param num_variants Number of SNPs in the dataset
+ * @return A new scheduler
+ **/
+block_scheduler *block_scheduler_new(int num_threads, int order, int *block_coords, size_t num_blocks,
+                                     int stride, size_t num_variants);
+
+/**
+ * @brief Gets the next block a thread has to process.
+ * @details Gets the next block a thread has to process, from its own queue or stolen from another thread.
+ * Calling this function also marks the previous block of the thread as finished, for the statistics.
+ *
+ * @param thread Number of the calling thread
+ * @param[out] block Index of the block to process
+ * @return Whether there was any block left
+ **/
+bool block_scheduler_next(int thread, block_scheduler *scheduler, size_t *block);
+
+/**
+ * @brief Logs the time each thread was busy and idle, along with the blocks it processed.
+ **/
+void block_scheduler_report(block_scheduler *scheduler);
+
+void block_scheduler_free(block_scheduler *scheduler);
+
+#endif
@@ -26,32 +26,117 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
     
     // Load binary input dataset
     int num_affected, num_unaffected;
-    size_t num_variants, file_len, genotypes_offset;
+    size_t num_variants, file_len, genotypes_offset, bitplanes_offset;
     
-    uint8_t *input_file = epistasis_dataset_load(&num_affected, &num_unaffected, &num_variants, &file_len, &genotypes_offset, options_data->dataset_filename);
+    uint8_t *input_file = epistasis_dataset_load(&num_affected, &num_unaffected, &num_variants, &file_len, 
+                                                 &genotypes_offset, &bitplanes_offset, options_data->dataset_filename);
     if (!input_file) {
-        LOG_FATAL_F("File %s does not exist!\n", options_data->dataset_filename);
+        LOG_FATAL_F("File %s does not exist or is not a valid dataset!\n", options_data->dataset_filename);
     }
     
     uint8_t *genotypes = input_file + genotypes_offset;
     
+    // Bitplanes stored in the dataset are always used, because they don't need to be packed again.
+    // The beam search combines any SNPs, so it always counts over bitplanes of the whole dataset.
+    uint64_t *dataset_bitplanes = bitplanes_offset ? (uint64_t*) (input_file + bitplanes_offset) : NULL;
+    int beam_width = options_data->beam_width;
+    int use_bitplanes = options_data->use_bitplanes || dataset_bitplanes || beam_width > 0;
+    if (beam_width > 0 && options_data->resume) {
+        LOG_FATAL("A heuristic search can't be resumed, because it does not save checkpoints\n");
+    }
+    
+    // Other phenotypes stored in the dataset are searched along with the main one
+    epistasis_phenotypes *phenotypes = epistasis_phenotypes_load(input_file, num_affected, num_unaffected);
+    if (phenotypes && beam_width > 0) {
+        LOG_WARN("The heuristic search is only available for the main phenotype, the rest will be ignored\n");
+        epistasis_phenotypes_free(phenotypes);
+        phenotypes = NULL;
+    }
+    
     // Try to create the directory where the output files will be stored
     ret_code = create_directory(shared_options_data->output_directory);
     if (ret_code != 0 && errno != EEXIST) {
         LOG_FATAL_F("Can't create output directory: %s\n", shared_options_data->output_directory);
     }
     
+    // Restrict the search to the SNPs with the strongest marginal effect, gathered into a smaller dataset
+    int *selected_snps = NULL;
+    uint8_t *selected_genotypes = NULL;
+    uint64_t *selected_bitplanes = NULL;
+    if (options_data->num_prefilter_snps > 0 && options_data->num_prefilter_snps < num_variants) {
+        if (options_data->num_prefilter_snps < options_data->order) {
+            LOG_FATAL_F("At least %d SNPs must be selected for combinations of order %d\n", options_data->order, options_data->order);
+        }
+        
+        double *scores;
+        selected_snps = prefilter_snps(genotypes, dataset_bitplanes, num_variants, num_affected, num_unaffected, 
+                                       options_data->num_prefilter_snps, &scores);
+        genotypes = selected_genotypes = prefilter_gather_genotypes(selected_snps, options_data->num_prefilter_snps, 
+                                                                    genotypes, num_affected + num_unaffected);
+        if (dataset_bitplanes) {
+            dataset_bitplanes = selected_bitplanes = prefilter_gather_bitplanes(selected_snps, options_data->num_prefilter_snps, 
+                                                                                dataset_bitplanes, num_affected, num_unaffected);
+        }
+        LOG_INFO_F("Search restricted to the %d SNPs with the strongest marginal effect\n", options_data->num_prefilter_snps);
+        
+        char *path;
+        FILE *fd = get_output_file(shared_options_data, "hpg-variant.epi.snps", &path);
+        prefilter_report(selected_snps, scores, options_data->num_prefilter_snps, num_variants, fd);
+        fclose(fd);
+        free(path);
+        free(scores);
+        
+        num_variants = options_data->num_prefilter_snps;
+    }
+    
     /*************** Precalculate the rest of variables the algorithm needs  ***************/
     
     int order = options_data->order;
-    int stride = options_data->stride;
     int num_folds = options_data->num_folds;
     int num_samples = num_affected + num_unaffected;
+    
+    // When fusing cross-validation repetitions, the folds of all of them are evaluated in a single sweep
+    int num_sweep_repetitions = options_data->fuse_cv_repetitions ? options_data->num_cv_repetitions : 1;
+    int num_sweep_folds = num_sweep_repetitions * num_folds;
+    
+    // Each phenotype is ranked in the same folds, after the main one
+    int num_phenotypes = phenotypes ? phenotypes->num_phenotypes : 0;
+    int num_ranked_folds = (1 + num_phenotypes) * num_sweep_folds;
+    int num_count_masks = (1 + 2 * num_phenotypes) * (num_sweep_folds + 1);
+    
+    LOG_INFO_F("Using %s kernels\n", epistasis_kernels_init(KERNEL_AUTO)->name);
+    
+    // Stride and combinations per row, chosen by timing them if requested (a resumed search keeps its stride)
+    int stride = options_data->stride;
+    int num_combinations_in_a_row = COMBINATIONS_ROW_SSE;
+    if (options_data->auto_tune && beam_width > 0) {
+        LOG_WARN("Auto-tuning is only available for the exhaustive search, disabled\n");
+    } else if (options_data->auto_tune) {
+        int saved_stride = options_data->resume ? epistasis_checkpoint_saved_stride(shared_options_data->output_directory, 0) : 0;
+        epistasis_autotune(order, genotypes, dataset_bitplanes, num_variants, num_affected, num_unaffected, 
+                           num_sweep_repetitions, num_folds, options_data->max_ranking_size, use_bitplanes, 
+                           options_data->eval_function, options_data->eval_subset, shared_options_data->num_threads, 
+                           saved_stride, &stride, &num_combinations_in_a_row);
+    }
+    
+    // No blocks are enumerated by the beam search, which would not fit in memory for high orders
     int num_blocks_per_dim = ceil((double) num_variants / stride);
-    size_t max_num_block_coords = (size_t) pow(num_blocks_per_dim, order);
+    size_t max_num_block_coords = (beam_width > 0) ? 1 : (size_t) pow(num_blocks_per_dim, order);
     
-    LOG_INFO_F("Combinations of order %d, %d variants per block\n", order, stride);
+    if (beam_width > 0) {
+        LOG_INFO_F("Combinations of order %d, grown from the best %d of each lower order (heuristic search)\n", order, beam_width);
+    } else {
+        LOG_INFO_F("Combinations of order %d, %d variants per block\n", order, stride);
+    }
     LOG_INFO_F("%d variants, %d blocks per dimension\n", num_variants, num_blocks_per_dim);
+    if (dataset_bitplanes) {
+        LOG_INFO("Using genotype bitplanes stored in the dataset\n");
+    } else if (use_bitplanes) {
+        LOG_INFO("Genotypes packed into bitplanes\n");
+    }
+    if (num_phenotypes > 0) {
+        LOG_INFO_F("Searching %d phenotypes besides the main one\n", num_phenotypes);
+    }
     
     // Precalculate which genotype combinations can be tested for a given order (order 2 -> {(0,0), (0,1), ... , (2,1), (2,2)})
     int num_genotype_permutations;
@@ -74,16 +159,103 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
         LOG_FATAL("Rank criteria not specified! Must be 'count' or 'accu'\n");
     }
     
+    // Combinations that can't be among the best models are discarded before counting them in each fold
+    bool prune = options_data->prune && model_upper_bound_available(options_data->eval_function, options_data->eval_subset) && !phenotypes;
+    if (prune) {
+        LOG_INFO("Pruning combinations that can't be among the best models\n");
+    } else if (options_data->prune && phenotypes) {
+        LOG_WARN("Pruning is only available when searching a single phenotype, disabled\n");
+    } else if (options_data->prune) {
+        LOG_WARN("Pruning is only available for ba and ca over the training partitions, disabled\n");
+    }
+    
+    // Masks information (number (un)affected with padding, buffers, and so on)
+    masks_info info; masks_info_init(order, num_combinations_in_a_row, num_affected, num_unaffected, &info);
+    
+    // Significance of the best models, tested when reporting them
+    permutation_test *permutations = NULL;
+    if (options_data->num_permutations > 0) {
+        LOG_INFO_F("Testing the best models with %d permutations\n", options_data->num_permutations);
+        permutations = permutation_test_new(order, genotypes, num_affected, num_unaffected, 
+                                            options_data->num_permutations, options_data->eval_function);
+    }
+    
+    // Buffers and partial rankings of each thread, reused by all blocks and repetitions
+    epistasis_workspace *workspaces[shared_options_data->num_threads];
+    for (int t = 0; t < shared_options_data->num_threads; t++) {
+        workspaces[t] = epistasis_workspace_new(order, stride, num_sweep_folds, num_phenotypes, options_data->max_ranking_size, 
+                                                use_bitplanes, !dataset_bitplanes && beam_width == 0, info);
+    }
+    
+    // Bitplanes of the whole dataset for the beam search, packed once unless stored in the dataset
+    uint64_t *beam_bitplanes = NULL;
+    if (beam_width > 0) {
+        beam_bitplanes = dataset_bitplanes ? dataset_bitplanes : beam_search_bitplanes(genotypes, num_variants, info, 
+                                                                                       shared_options_data->num_threads);
+    }
+    
+    // Calculate all blocks coordinates, which are the same in every repetition (there are none in a beam search)
+    int *block_coords = calloc(max_num_block_coords * order, sizeof(int));
+    int curr_idx = 0, next_idx = 0;
+    size_t num_block_coords = 0;
+    if (beam_width == 0) {
+        do {
+            curr_idx = num_block_coords * order;
+            next_idx = curr_idx + order;
+            memcpy(block_coords + next_idx, block_coords + curr_idx, order * sizeof(int));
+            curr_idx = next_idx;
+            num_block_coords++;
+        } while (get_next_block(num_blocks_per_dim, order, block_coords + curr_idx));
+    }
+    
+    // Checkpoints of the progress, and resume from the last one if requested
+    epistasis_checkpoint *checkpoint = epistasis_checkpoint_new(shared_options_data->output_directory, 0, shared_options_data->num_threads, 
+                                                                (beam_width > 0) ? 0 : options_data->checkpoint_interval, order, stride, num_variants, 
+                                                                num_sweep_folds, num_phenotypes, options_data->eval_function, options_data->eval_subset, 
+                                                                options_data->eval_mode, options_data->max_ranking_size, num_block_coords, info);
+    int first_repetition = 0;
+    uint8_t *resumed_fold_masks = NULL;
+    unsigned int *resumed_testing_sizes = NULL;
+    if (options_data->resume) {
+        if (epistasis_checkpoint_load(checkpoint, workspaces, info, &first_repetition, &resumed_fold_masks, &resumed_testing_sizes)) {
+            LOG_FATAL_F("Can't resume from the checkpoint in %s\n", shared_options_data->output_directory);
+        }
+    }
+    
+    // Repetitions finished before the checkpoint were already reported
+    for (int r = 0; r < first_repetition && r < options_data->num_cv_repetitions; r++) {
+        best_models[r] = malloc(sizeof(struct heap));
+        heap_init(best_models[r]);
+    }
+    
     /**************************** End of variables precalculus  ****************************/
     
     
-    for (int r = 0; r < options_data->num_cv_repetitions; r++) {
-        LOG_INFO_F("Running cross-validation #%d...\n", r+1);
+    for (int r = first_repetition; r < options_data->num_cv_repetitions; r += num_sweep_repetitions) {
+        if (num_sweep_repetitions > 1) {
+            LOG_INFO_F("Running cross-validations #%d to #%d...\n", r+1, r+num_sweep_repetitions);
+        } else {
+            LOG_INFO_F("Running cross-validation #%d...\n", r+1);
+        }
         
         // Initialize folds, first block coordinates, genotype combinations and rankings for each repetition
+        // Fold f of the repetition r+i is stored at position i * num_folds + f
         unsigned int *testing_sizes, *training_sizes;
-        int **folds = get_k_folds(num_affected, num_unaffected, num_folds, &testing_sizes);
-        uint8_t *fold_masks = get_k_folds_masks(num_affected, num_unaffected, num_folds, folds, testing_sizes);
+        uint8_t *fold_masks;
+        if (resumed_fold_masks) {
+            fold_masks = resumed_fold_masks;
+            testing_sizes = resumed_testing_sizes;
+            resumed_fold_masks = NULL;
+        } else {
+            fold_masks = get_k_folds_masks_repetitions(num_sweep_repetitions, num_affected, num_unaffected, num_folds, &testing_sizes);
+        }
+        
+        // The counts of all samples are obtained along with the ones of each fold
+        fold_masks = add_all_samples_mask(num_sweep_folds, fold_masks, info);
+        
+        if (epistasis_checkpoint_begin_sweep(checkpoint, r, fold_masks, testing_sizes, workspaces, false)) {
+            LOG_WARN("The folds of this repetition could not be saved, so it won't be possible to resume it\n");
+        }
         
 /*
         printf("fold_masks = {\n");
@@ -97,215 +269,150 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
 */
         
         // Calculate size of training datasets
-        training_sizes = calloc(3 * num_folds, sizeof(unsigned int));
-        for (int f = 0; f < num_folds; f++) {
+        training_sizes = calloc(3 * num_ranked_folds, sizeof(unsigned int));
+        for (int f = 0; f < num_sweep_folds; f++) {
             training_sizes[3 * f] = num_samples - testing_sizes[3 * f];
             training_sizes[3 * f + 1] = num_affected - testing_sizes[3 * f + 1];
             training_sizes[3 * f + 2] = num_unaffected - testing_sizes[3 * f + 2];
         }
         
+        // Folds restricted to the cases and controls of each phenotype, whose sizes follow the ones of the main phenotype
+        uint8_t *count_masks = fold_masks;
+        unsigned int *ranked_testing_sizes = testing_sizes;
+        if (phenotypes) {
+            ranked_testing_sizes = malloc(3 * num_ranked_folds * sizeof(unsigned int));
+            memcpy(ranked_testing_sizes, testing_sizes, 3 * num_sweep_folds * sizeof(unsigned int));
+            count_masks = get_phenotype_masks(num_sweep_folds, fold_masks, phenotypes, info, 
+                                              training_sizes + 3 * num_sweep_folds, ranked_testing_sizes + 3 * num_sweep_folds);
+        }
+        
+        // Fold masks packed into bits, only used when genotypes are packed into bitplanes
+        uint64_t *fold_bitmasks = NULL;
+        if (use_bitplanes) {
+            fold_bitmasks = _mm_malloc(num_count_masks * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+            set_fold_bitmasks(num_count_masks, count_masks, info, fold_bitmasks);
+        }
+        
         // Initialize rankings for each repetition
-        struct heap **ranking_risky = malloc(num_folds * sizeof(struct heap*));
-        for (int i = 0; i < num_folds; i++) {
+        struct heap **ranking_risky = malloc(num_ranked_folds * sizeof(struct heap*));
+        for (int i = 0; i < num_ranked_folds; i++) {
             ranking_risky[i] = malloc(sizeof(struct heap));
             heap_init(ranking_risky[i]);
         }
         
-        int *block_coords = calloc(max_num_block_coords * order, sizeof(int));
-        
-        // Calculate all blocks coordinates
-        int curr_idx = 0, next_idx = 0;
-        size_t num_block_coords = 0;
-        do {
-            curr_idx = num_block_coords * order;
-            next_idx = curr_idx + order;
-            memcpy(block_coords + next_idx, block_coords + curr_idx, order * sizeof(int));
-            curr_idx = next_idx;
-            num_block_coords++;
-        } while (get_next_block(num_blocks_per_dim, order, block_coords + curr_idx));
-        
+        if (beam_width > 0) {
+            // Models grown one SNP at a time from the best ones of the previous order
+            epistasis_beam_search(order, beam_width, beam_bitplanes, num_variants, num_sweep_folds, fold_bitmasks, 
+                                  training_sizes, testing_sizes, prune, options_data->eval_function, options_data->eval_subset, 
+                                  info, shared_options_data->num_threads, workspaces);
+        } else {
+            // Skip the blocks finished before the last checkpoint
+            int *pending_coords = malloc(num_block_coords * order * sizeof(int));
+            size_t *pending_blocks = malloc(num_block_coords * sizeof(size_t));
+            size_t num_pending = epistasis_checkpoint_pending_blocks(checkpoint, order, block_coords, num_block_coords, 
+                                                                     pending_coords, pending_blocks);
         
-        #pragma omp parallel for num_threads(shared_options_data->num_threads)
-        for (int i = 0; i < num_block_coords; i++) {
-            int my_block_coords[order];
-            
-            // Initialize rankings for each repetition
-            struct heap **ranking_risky_local = malloc(num_folds * sizeof(struct heap*));
-            for (int i = 0; i < num_folds; i++) {
-                ranking_risky_local[i] = malloc(sizeof(struct heap));
-                heap_init(ranking_risky_local[i]);
-            }
+            // Blocks are processed largest-first, and threads that run out of them steal from the rest
+            block_scheduler *scheduler = block_scheduler_new(shared_options_data->num_threads, order, pending_coords, num_pending, 
+                                                             stride, num_variants);
         
-            memcpy(my_block_coords, block_coords + i * order, order * sizeof(int));
-            // printf("%d) cv %d, block %d %d\n", omp_get_thread_num(), r, my_block_coords[0], my_block_coords[1]);
-
-            // ***************** Variables private to each task (block) *****************
+            #pragma omp parallel num_threads(shared_options_data->num_threads)
+            for (size_t i = 0; block_scheduler_next(omp_get_thread_num(), scheduler, &i); ) {
+                int my_block_coords[order];
+                memcpy(my_block_coords, pending_coords + i * order, order * sizeof(int));
+                // printf("%d) cv %d, block %d %d\n", omp_get_thread_num(), r, my_block_coords[0], my_block_coords[1]);
 
-            // Masks information (number (un)affected with padding, buffers, and so on)
-            masks_info info; masks_info_init(order, COMBINATIONS_ROW_SSE, num_affected, num_unaffected, &info);
+                // ***************** Variables private to each task (block) *****************
 
-            // Scratchpad for block genotypes
-            uint8_t *scratchpad[order];
-            for (int s = 0; s < order; s++) {
-                scratchpad[s] = _mm_malloc(stride * info.num_samples_with_padding * sizeof(uint8_t), 16);
-            }
-            // Genotypes for the current block
-            uint8_t *block_genotypes[order];
-
-            // Counts per genotype combination
-            // Grouped by fold, then combination, then permutation, so there is spatial locality when getting confusion matrix
-            int max_num_counts = 16 * (int) ceil(((double) info.num_cell_counts_per_combination * info.num_combinations_in_a_row * num_folds) / 16);
-            int *counts_aff = _mm_malloc(max_num_counts * sizeof(int), 16);
-            int *counts_unaff = _mm_malloc(max_num_counts * sizeof(int), 16);
-
-            // Confusion matrix
-            unsigned int conf_matrix[4];
+                // Buffers of the thread, allocated once for the whole run
+                epistasis_workspace *workspace = workspaces[omp_get_thread_num()];
+            
+                // Bitplanes for the current block (only when packing into bitplanes)
+                uint64_t *bitplanes_buffer[order];
+                uint64_t **block_bitplanes = use_bitplanes ? bitplanes_buffer : NULL;
 
-            // Buffer for genotypes masks
-            uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), 16);
+                // Confusion matrix
+                unsigned int conf_matrix[4];
 
-            // Functions for ranking combinations
-            compare_risky_heap_func heap_max_func_local = NULL;
-            compare_risky_heap_func heap_min_func_local = NULL;
-            if (options_data->eval_mode == CV_A) {
-                heap_max_func_local = compare_risky_heap_accuracy_max;
-                heap_min_func_local = compare_risky_heap_accuracy_min;
-            } else {
-                heap_max_func_local = compare_risky_heap_count_max;
-                heap_min_func_local = compare_risky_heap_count_min;
-            }
+                // Masks for the current block (only when not using bitplanes)
+                uint8_t *block_masks[order];
     
-            // *************** Variables private to each task (block) (end) ***************
-
-
+                // *************** Variables private to each task (block) (end) ***************
 
-            // -------------------- Get genotypes of block --------------------
 
-            uint8_t *block_starts[order];
-            for (int s = 0; s < order; s++) {
-                block_starts[s] = genotypes + my_block_coords[s] * stride * num_samples;
-            }
-
-            // Initialize first coordinate (only if it's different from the previous)
-            block_genotypes[0] = get_genotypes_of_block_coord(num_variants, num_samples, info, stride,
-                                                              my_block_coords[0], block_starts[0], scratchpad[0]);
 
-            // Initialize the rest of coordinates
-            for (int m = 1; m < order; m++) {
-                bool already_present = false;
-                // If any coordinate is the same as a previous one, don't copy, but reference directly
-                for (int n = 0; n < m; n++) {
-                    if (my_block_coords[m] == my_block_coords[n]) {
-//                             printf("taking %d -> %d\n", n, m);
-                        block_genotypes[m] = block_genotypes[n];
-                        already_present = true;
-                        break;
-                    }
-                }
+                // -------------------- Get genotypes of block --------------------
 
-                if (!already_present) {
-                    // If not equals to a previous one, retrieve data
-                    block_genotypes[m] = get_genotypes_of_block_coord(num_variants, num_samples, info, stride,
-                                                                      my_block_coords[m], block_starts[m], scratchpad[m]);
+                // Only the coordinates not shared with the last blocks of the thread are loaded
+                int num_loaded = get_planes_of_block(order, my_block_coords, genotypes, dataset_bitplanes, num_variants, stride, info, 
+                                                     workspace, block_masks, block_bitplanes);
+            
+                // Masks of the first order-1 SNPs cached by the previous block are not valid if their masks were replaced
+                if (workspace->prefix_cache && num_loaded > 0) {
+                    prefix_masks_cache_reset(workspace->prefix_cache);
                 }
-            }
-
 
-//            printf("padded block (%d*%d) = {\n", stride, info.num_samples_with_padding);
-//            for (int m = 0; m < MIN(stride, num_variants); m++) {
-//                for (int n = 0; n < info.num_samples_with_padding; n++) {
-//                    printf("%d ", block_genotypes[0][m * info.num_samples_with_padding + n]);
-//                }
-//                printf("\n");
-//            }
-//            printf("}\n");
-//
-//            printf("padded block (%d*%d) = {\n", stride, info.num_samples_with_padding);
-//            for (int m = 0; m < MIN(stride, num_variants); m++) {
-//                for (int n = 0; n < info.num_samples_with_padding; n++) {
-//                    printf("%d ", block_genotypes[1][m * info.num_samples_with_padding + n]);
-//                }
-//                printf("\n");
-//            }
-//            printf("}\n-------------------------\n");
+                // -------------------- Get genotypes of block (end) --------------------
 
-            // -------------------- Get genotypes of block (end) --------------------
+                // Combination of variants being tested
+                int comb[order];
+                // Array of combinations to process in a row
+                int combs[info.num_combinations_in_a_row * order];
+                int cur_comb_idx = 0;
 
-            // Combination of variants being tested
-            int comb[order];
-            // Array of combinations to process in a row
-            int combs[info.num_combinations_in_a_row * order];
-            int cur_comb_idx = 0;
+                // Test first combination in the block
+                get_first_combination_in_block(order, comb, my_block_coords, stride);
 
-            // Test first combination in the block
-            get_first_combination_in_block(order, comb, my_block_coords, stride);
+                do {
+                    memcpy(combs + cur_comb_idx * order, comb, order * sizeof(int));
+                    cur_comb_idx++;
 
-            do {
-                memcpy(combs + cur_comb_idx * order, comb, order * sizeof(int));
-                cur_comb_idx++;
-
-                if (cur_comb_idx < info.num_combinations_in_a_row) {
-                    continue; // Nothing to do until we have an amount (COMBINATIONS_ROW_SSE) of combinations ready
-                }
+                    if (cur_comb_idx < info.num_combinations_in_a_row) {
+                        continue; // Nothing to do until we have an amount (COMBINATIONS_ROW_SSE) of combinations ready
+                    }
 
-                process_set_of_combinations(info.num_combinations_in_a_row, combs, order, stride, num_folds, fold_masks,
-                                            training_sizes, testing_sizes,  block_genotypes, genotype_permutations,
-                                            masks, options_data->eval_subset, info, 
-                                            heap_min_func_local, counts_aff, counts_unaff, conf_matrix, 
-                                            options_data->max_ranking_size, ranking_risky_local);
+                    process_set_of_combinations(info.num_combinations_in_a_row, combs, order, stride, num_sweep_folds, count_masks,
+                                                training_sizes, ranked_testing_sizes, phenotypes, block_bitplanes, fold_bitmasks, genotype_permutations,
+                                                block_masks, workspace->prefix_cache, prune, options_data->eval_function, options_data->eval_subset, info, 
+                                                workspace->counts_aff, workspace->counts_unaff, workspace->risk_masks, conf_matrix, 
+                                                workspace->rankings, &(workspace->risky_scratch));
                 
-                cur_comb_idx = 0;
-            } while (get_next_combination_in_block(order, comb, my_block_coords, stride, num_variants));
+                    cur_comb_idx = 0;
+                } while (get_next_combination_in_block(order, comb, my_block_coords, stride, num_variants));
 
             
-            // Process combinations out of a full set
-            process_set_of_combinations(cur_comb_idx, combs, order, stride, num_folds, fold_masks,
-                                        training_sizes, testing_sizes, block_genotypes, genotype_permutations,
-                                        masks, options_data->eval_subset, info, 
-                                        heap_min_func_local, counts_aff, counts_unaff, conf_matrix, 
-                                        options_data->max_ranking_size, ranking_risky_local);
+                // Process combinations out of a full set
+                process_set_of_combinations(cur_comb_idx, combs, order, stride, num_sweep_folds, count_masks,
+                                            training_sizes, ranked_testing_sizes, phenotypes, block_bitplanes, fold_bitmasks, genotype_permutations,
+                                            block_masks, workspace->prefix_cache, prune, options_data->eval_function, options_data->eval_subset, info, 
+                                            workspace->counts_aff, workspace->counts_unaff, workspace->risk_masks, conf_matrix, 
+                                            workspace->rankings, &(workspace->risky_scratch));
 
-            // Insert best model of this block in the global ranking (critical section)
-            for (int i = 0; i < num_folds; i++) {
-                while (!heap_empty(ranking_risky_local[i])) {
-                    struct heap_node *hn = heap_take(heap_min_func_local, ranking_risky_local[i]);
-                    risky_combination *risky_comb = (risky_combination*) hn->value;
-                    
-                    int position = -1;
-                    
-#pragma omp critical
-                    {
-                        position = add_to_model_ranking(risky_comb, options_data->max_ranking_size, ranking_risky[i], heap_min_func_local);
-                    }
-                    if (position < 0) {
-                        risky_combination_free(risky_comb);
-                    }
-                    free(hn);
+                // Notify a block has been processed
+                char end_block_msg[256]; memset(end_block_msg, 0, 256 * sizeof(char));
+                strcat(end_block_msg, "Block finished: (");
+                for (int s = 0; s < order; s++) {
+                    sprintf(end_block_msg + strlen(end_block_msg), "%d,", my_block_coords[s] + 1);
                 }
-                free(ranking_risky_local[i]);
-            }
-            free(ranking_risky_local);
+                size_t end_block_msg_len = strlen(end_block_msg);
+                end_block_msg[end_block_msg_len - 1] = ')';
+                end_block_msg[end_block_msg_len] = '\n';
             
-            _mm_free(masks);
-            for (int s = 0; s < order; s++) {
-                _mm_free(scratchpad[s]);
-            }
-            _mm_free(counts_aff);
-            _mm_free(counts_unaff);
-
-            // Notify a block has been processed
-            char end_block_msg[256]; memset(end_block_msg, 0, 256 * sizeof(char));
-            strcat(end_block_msg, "Block finished: (");
-            for (int s = 0; s < order; s++) {
-                sprintf(end_block_msg + strlen(end_block_msg), "%d,", my_block_coords[s] + 1);
-            }
-            size_t end_block_msg_len = strlen(end_block_msg);
-            end_block_msg[end_block_msg_len - 1] = ')';
-            end_block_msg[end_block_msg_len] = '\n';
+                LOG_INFO(end_block_msg);
             
-            LOG_INFO(end_block_msg);
+                epistasis_checkpoint_block_finished(checkpoint, omp_get_thread_num(), pending_blocks[i], workspace);
+            }
+        
+            block_scheduler_report(scheduler);
+            block_scheduler_free(scheduler);
+            free(pending_coords);
+            free(pending_blocks);
         }
         
+        // Insert the best models found by each thread in the global ranking
+        merge_workspace_rankings(shared_options_data->num_threads, workspaces, options_data->max_ranking_size, 
+                                 heap_min_func, ranking_risky);
+        
 /*
         for (int f = 0; f < num_folds; f++) {
             printf("Ranking fold %d = {\n", f);
@@ -320,33 +427,78 @@ int run_epistasis(shared_options_data_t* shared_options_data, epistasis_options_
         }
 */
         
-        // Merge all rankings in one
-        best_models[r] = merge_rankings(num_folds, ranking_risky, heap_min_func, heap_max_func);
+        for (int i = 0; i < num_sweep_repetitions; i++) {
+            // Merge all rankings of a repetition in one
+            best_models[r+i] = merge_rankings(num_folds, ranking_risky + i * num_folds, heap_min_func, heap_max_func);
+            
+            // Show the best model of this repetition
+            char *path, default_path[32];
+            sprintf(default_path, "hpg-variant.cv%d.epi", r+i+1);
+            FILE *fd = get_output_file(shared_options_data, default_path, &path);
+            epistasis_report(order, r+i, options_data->eval_mode, options_data->eval_subset, options_data->eval_function, 
+                             options_data->beam_width, best_models[r+i], options_data->max_ranking_size, heap_max_func, 
+                             permutations, selected_snps, fd);
+            fclose(fd);
+            free(path);
+            
+            if (phenotypes) {
+                epistasis_report_phenotypes(order, r+i, options_data->eval_mode, options_data->eval_subset, options_data->eval_function, 
+                                            phenotypes, num_folds, num_sweep_folds, ranking_risky + i * num_folds, 
+                                            options_data->max_ranking_size, heap_min_func, heap_max_func, selected_snps, 
+                                            shared_options_data);
+            }
+        }
         
-        // Show the best model of this repetition
-        char *path, default_path[32];
-        sprintf(default_path, "hpg-variant.cv%d.epi", r+1);
-        FILE *fd = get_output_file(shared_options_data, default_path, &path);
-        epistasis_report(order, r, options_data->eval_mode, options_data->eval_subset, best_models[r], options_data->max_ranking_size, heap_max_func, fd);
-        fclose(fd);
+        if (epistasis_checkpoint_end_sweep(checkpoint, r + num_sweep_repetitions)) {
+            LOG_WARN("The end of this repetition could not be saved, so it would be run again if resumed\n");
+        }
         
         // Free data por this repetition
-        for (int i = 0; i < num_folds; i++) {
-            free(folds[i]);
+        for (int i = 0; i < num_ranked_folds; i++) {
             free(ranking_risky[i]);
         }
         free(ranking_risky);
-        free(folds);
         free(testing_sizes);
         free(training_sizes);
         _mm_free(fold_masks);
+        if (phenotypes) {
+            free(ranked_testing_sizes);
+            _mm_free(count_masks);
+        }
+        if (fold_bitmasks) {
+            _mm_free(fold_bitmasks);
+        }
     }
     
+    // The search has finished, so it won't need to be resumed
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_checkpoint_free(checkpoint);
+    free(block_coords);
+    
     // Free data for the whole epistasis check
     for (int i = 0; i < num_genotype_permutations; i++) {
         free(genotype_permutations[i]);
     }
     free(genotype_permutations);
+    for (int t = 0; t < shared_options_data->num_threads; t++) {
+        epistasis_workspace_free(workspaces[t]);
+    }
+    if (beam_bitplanes && beam_bitplanes != dataset_bitplanes) {
+        _mm_free(beam_bitplanes);
+    }
+    if (permutations) {
+        permutation_test_free(permutations);
+    }
+    if (phenotypes) {
+        epistasis_phenotypes_free(phenotypes);
+    }
+    if (selected_snps) {
+        free(selected_snps);
+        free(selected_genotypes);
+        if (selected_bitplanes) {
+            _mm_free(selected_bitplanes);
+        }
+    }
     for (int r = 0; r < options_data->num_cv_repetitions; r++) {
         struct heap_node *hn;
         risky_combination *element = NULL;
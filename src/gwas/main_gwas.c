@@ -36,8 +36,9 @@ int main(int argc, char *argv[]) {
     int config_len;
 
 #ifdef _USE_MPI
-    int mpi_rank;
-    MPI_Init(&argc, &argv);
+    int mpi_rank, mpi_thread_support;
+    // Threads other than the main one may communicate, even at the same time
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_support);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
 
     if (mpi_rank == 0) {
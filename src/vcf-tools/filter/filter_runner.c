@@ -213,15 +213,15 @@ int run_filter(shared_options_data_t *shared_options_data, filter_options_data_t
                 // Write records that passed and failed to 2 new separated files
                 if (output->passed_records != NULL && output->passed_records->size > 0) {
                     LOG_DEBUG_F("[batch %d] %zu passed records\n", i, output->passed_records->size);
-                    for (int r = 0; r < output->passed_records->size; r++) {
-                        write_vcf_record(output->passed_records->items[r], passed_file);
+                    if (write_filtered_records(output->passed_records, output->batch, passed_file)) {
+                        LOG_ERROR_F("[batch %d] %zu passed records could not be written!\n", i, output->passed_records->size);
                     }
                 }
 
                 if (options_data->save_rejected && output->failed_records != NULL && output->failed_records->size > 0) {
                     LOG_DEBUG_F("[batch %d] %zu failed records\n", i, output->failed_records->size);
-                    for (int r = 0; r < output->failed_records->size; r++) {
-                        write_vcf_record(output->failed_records->items[r], failed_file);
+                    if (write_filtered_records(output->failed_records, output->batch, failed_file)) {
+                        LOG_ERROR_F("[batch %d] %zu failed records could not be written!\n", i, output->failed_records->size);
                     }
                 }
 
@@ -269,3 +269,75 @@ void filter_temp_output_free(filter_temp_output_t *temp) {
     array_list_free(temp->failed_records, NULL);
     vcf_batch_free(temp->batch);
 }
+
+int write_filtered_records(array_list_t *records, vcf_batch_t *batch, FILE *file) {
+    char *text = batch->text;
+    char *text_end = text ? text + strlen(text) : NULL;
+    char *span = NULL;
+    size_t span_len = 0;
+
+    for (int r = 0; r < records->size; r++) {
+        vcf_record_t *record = records->items[r];
+        size_t line_len = 0;
+        char *line = get_vcf_record_line(record, text, text_end, &line_len);
+        int complete_line = line && line[line_len - 1] == '\n';
+
+        // Lines of records that follow each other in the input are written at once
+        if (complete_line && span && line == span + span_len) {
+            span_len += line_len;
+            continue;
+        }
+        if (span && fwrite(span, sizeof(char), span_len, file) != span_len) {
+            return 1;
+        }
+        span = complete_line ? line : NULL;
+        span_len = complete_line ? line_len : 0;
+
+        if (!line) {
+            write_vcf_record(record, file);
+        } else if (!complete_line) {
+            // Last line of a file not ended by a newline
+            if (fwrite(line, sizeof(char), line_len, file) != line_len || fputc('\n', file) == EOF) {
+                return 1;
+            }
+        }
+    }
+
+    if (span && fwrite(span, sizeof(char), span_len, file) != span_len) {
+        return 1;
+    }
+    return 0;
+}
+
+char *get_vcf_record_line(vcf_record_t *record, char *text, char *text_end, size_t *line_len) {
+    if (!text || record->chromosome < text || record->chromosome >= text_end) {
+        return NULL;
+    }
+
+    // The text columns of a record point to its line while they are not modified, so they must be
+    // found one after the other. Position, quality and samples are never modified by the filters.
+    char *line = record->chromosome;
+    if (record->id <= line + record->chromosome_len ||
+        record->reference != record->id + record->id_len + 1 ||
+        record->alternate != record->reference + record->reference_len + 1 ||
+        record->filter <= record->alternate + record->alternate_len ||
+        record->info != record->filter + record->filter_len + 1) {
+        return NULL;
+    }
+
+    char *last = record->info + record->info_len;
+    if (record->format_len > 0) {
+        if (record->format != last + 1) {
+            return NULL;
+        }
+        last = record->format + record->format_len;
+    }
+    if (last > text_end) {
+        return NULL;
+    }
+
+    char *newline = memchr(last, '\n', text_end - last);
+    char *end = newline ? newline + 1 : text_end;
+    *line_len = end - line;
+    return line;
+}
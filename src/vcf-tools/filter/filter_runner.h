@@ -47,4 +47,16 @@ filter_temp_output_t *filter_temp_output_new(vcf_batch_t *batch, array_list_t *p
 
 void filter_temp_output_free(filter_temp_output_t *temp);
 
+/**
+ * Writes the records of a batch that passed (or failed) the filters. The original line of each record is
+ * copied from the text of the batch, and records modified after being read are written field by field.
+ * Returns 0 if all lines were copied, 1 otherwise.
+ */
+int write_filtered_records(array_list_t *records, vcf_batch_t *batch, FILE *file);
+
+/**
+ * Gets the line a record was read from, including its newline, or NULL if the record was modified.
+ */
+char *get_vcf_record_line(vcf_record_t *record, char *text, char *text_end, size_t *line_len);
+
 #endif
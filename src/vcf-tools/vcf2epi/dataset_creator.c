@@ -1,7 +1,7 @@
 #include "dataset_creator.h"
 
 
-int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
+int create_dataset_from_vcf(shared_options_data_t* shared_options_data, vcf2epi_options_data_t *options_data) {
     list_t *output_list = (list_t*) malloc (sizeof(list_t));
     list_init("output", shared_options_data->num_threads, INT_MAX, output_list);
 
@@ -35,9 +35,13 @@ int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
     int *destination, num_affected, num_unaffected;
     uint8_t *phenotypes;
     
+    // Other phenotypes, stored as a label per sample in the order of the dataset
+    int num_other_phenotypes = 0;
+    uint8_t *other_phenotypes = NULL;
+    
     LOG_INFO("About to create epistasis dataset...\n");
 
-#pragma omp parallel sections private(ret_code, start, stop, total) shared(destination,num_affected, num_unaffected)
+#pragma omp parallel sections private(ret_code, start, stop, total) shared(destination,num_affected, num_unaffected, num_other_phenotypes, other_phenotypes)
     {
 #pragma omp section
         {
@@ -97,6 +101,11 @@ int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
                     phenotypes = get_individual_phenotypes(vcf_file, ped_file, &num_affected, &num_unaffected);
                     destination = group_individuals_by_phenotype(phenotypes, num_affected, num_unaffected);
                     
+                    if (options_data->phenotypes_filename) {
+                        other_phenotypes = read_other_phenotypes(options_data->phenotypes_filename, sample_ids, destination, 
+                                                                 get_num_vcf_samples(vcf_file), &num_other_phenotypes);
+                    }
+                    
 //                     assert(destination);
 //                     
 //                     printf("destination = { ");
@@ -177,24 +186,41 @@ int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
             char *filename;
             FILE *fp = get_output_file(shared_options_data, "epistasis_dataset.bin", &filename);
             
+            // Bitplanes are written to a temporary file, and appended to the dataset when the number of variants is known
+            char *bitplanes_filename = malloc ((strlen(filename) + 16) * sizeof(char));
+            sprintf(bitplanes_filename, "%s.bitplanes", filename);
+            FILE *bitplanes_fp = fopen(bitplanes_filename, "w+b");
+            if (!bitplanes_fp) {
+                LOG_FATAL_F("Can't create temporary file: %s\n", bitplanes_filename);
+            }
+            
             double start = omp_get_wtime();
             
             // Write binary file with dataset
             
             size_t num_samples;
+            epistasis_dataset_header header;
             bool header_written = false;
             list_item_t* item = NULL;
             while (item = list_remove_item(output_list)) {
                 uint8_t *genotypes = item->data_p;
                 
-                // First make room for the number of variants, then write the number of samples and phenotypes
+                // First make room for the header, whose number of variants and offsets are known at the end,
+                // followed by the other phenotypes, if any
                 if (!header_written) {
                     num_samples = get_num_vcf_samples(vcf_file);
-                    if (!fwrite(&num_variants, sizeof(uint32_t), 1, fp) ||
-                        !fwrite(&num_affected, sizeof(uint32_t), 1, fp) ||
-                        !fwrite(&num_unaffected, sizeof(uint32_t), 1, fp)) {
+                    size_t phenotypes_len = dataset_phenotypes_len(num_other_phenotypes, num_samples);
+                    epistasis_dataset_header_init(num_affected, num_unaffected, 
+                                                  EPISTASIS_DATASET_GENOTYPES | EPISTASIS_DATASET_BITPLANES | 
+                                                  (num_other_phenotypes ? EPISTASIS_DATASET_PHENOTYPES : 0), &header);
+                    header.num_phenotypes = num_other_phenotypes;
+                    header.genotypes_offset = sizeof(epistasis_dataset_header) + phenotypes_len;
+                    if (!fwrite(&header, sizeof(epistasis_dataset_header), 1, fp)) {
                         LOG_ERROR("The header of the dataset could not be written!");
                     }
+                    if (phenotypes_len && !fwrite(other_phenotypes, sizeof(uint8_t), phenotypes_len, fp)) {
+                        LOG_ERROR("The phenotypes of the dataset could not be written!");
+                    }
                     header_written = true;
                 }
                 
@@ -202,18 +228,26 @@ int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
                 if (!fwrite(genotypes, sizeof(uint8_t), item->type * num_samples, fp)) {
                     LOG_ERROR_F("%d variants could not be written!\n", item->type);
                 }
+                if (epistasis_dataset_write_bitplanes(genotypes, item->type, &header, bitplanes_fp)) {
+                    LOG_ERROR_F("Bitplanes of %d variants could not be written!\n", item->type);
+                }
                 
                 free(genotypes);
                 list_item_free(item);
             }
             
-            // Finally, write the real number of variants
-            fseek(fp, 0, SEEK_SET);
-            if (!fwrite(&num_variants, sizeof(uint32_t), 1, fp)) {
-                LOG_ERROR("The number of variants in the dataset could not be written!");
+            // Finally, append the bitplanes and write the real number of variants
+            if (header_written) {
+                header.num_variants = num_variants;
+                if (epistasis_dataset_finish(&header, fp, bitplanes_fp)) {
+                    LOG_ERROR("The bitplanes or the header of the dataset could not be written!");
+                }
             }
             
             fclose(fp);
+            fclose(bitplanes_fp);
+            remove(bitplanes_filename);
+            free(bitplanes_filename);
     
             double stop = omp_get_wtime();
 
@@ -224,6 +258,9 @@ int create_dataset_from_vcf(shared_options_data_t* shared_options_data) {
     }
     
     free(phenotypes);
+    if (other_phenotypes) {
+        free(other_phenotypes);
+    }
     free(output_list);
     vcf_close(vcf_file);
     // TODO delete conflicts among frees
@@ -272,6 +309,57 @@ uint8_t *epistasis_dataset_process_records(vcf_record_t **variants, size_t num_v
 }
 
 
+/* *******************
+ *  Dataset writing  *
+ * *******************/
+
+int epistasis_dataset_write_bitplanes(uint8_t *genotypes, size_t num_variants, epistasis_dataset_header *header, FILE *fp) {
+    int num_samples = header->num_affected + header->num_unaffected;
+    uint64_t bitplanes[header->num_words_per_snp];
+    
+    for (size_t i = 0; i < num_variants; i++) {
+        epistasis_dataset_pack_bitplanes(genotypes + i * num_samples, header, bitplanes);
+        if (fwrite(bitplanes, sizeof(uint64_t), header->num_words_per_snp, fp) != header->num_words_per_snp) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int epistasis_dataset_finish(epistasis_dataset_header *header, FILE *fp, FILE *bitplanes_fp) {
+    // Bitplanes start at the first aligned position after the genotypes
+    size_t genotypes_end = header->genotypes_offset + header->num_variants * (header->num_affected + header->num_unaffected);
+    header->bitplanes_offset = dataset_aligned_offset(genotypes_end);
+    
+    uint8_t padding[EPISTASIS_DATASET_ALIGNMENT];
+    memset(padding, 0, EPISTASIS_DATASET_ALIGNMENT * sizeof(uint8_t));
+    fseek(fp, genotypes_end, SEEK_SET);
+    if (header->bitplanes_offset > genotypes_end && 
+        !fwrite(padding, sizeof(uint8_t), header->bitplanes_offset - genotypes_end, fp)) {
+        return 1;
+    }
+    
+    // Copy the bitplanes from the temporary file
+    uint8_t buffer[16384];
+    size_t bytes_read;
+    rewind(bitplanes_fp);
+    while ((bytes_read = fread(buffer, sizeof(uint8_t), 16384, bitplanes_fp)) > 0) {
+        if (fwrite(buffer, sizeof(uint8_t), bytes_read, fp) != bytes_read) {
+            return 2;
+        }
+    }
+    
+    // Overwrite the header with the final number of variants and offsets
+    fseek(fp, 0, SEEK_SET);
+    if (!fwrite(header, sizeof(epistasis_dataset_header), 1, fp)) {
+        return 3;
+    }
+    
+    return 0;
+}
+
+
 /* *******************
  *       Sorting     *
  * *******************/
@@ -319,4 +407,79 @@ int *group_individuals_by_phenotype(uint8_t *phenotypes, int num_affected, int n
     return destination;
 }
 
-
+/**
+ * Reads a file with other phenotypes of the samples, whose header contains the family and individual IDs 
+ * followed by the name of each phenotype, like the alternate phenotype files of PLINK. Each phenotype is 
+ * returned as a record of the dataset (see dataset_format.h), with its labels in the order of the dataset.
+ */
+uint8_t *read_other_phenotypes(char *filename, khash_t(ids) *sample_ids, int *destination, int num_samples, 
+                               int *num_phenotypes) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        LOG_FATAL_F("Phenotypes file %s does not exist!\n", filename);
+    }
+    
+    char *line = NULL, *saveptr;
+    size_t line_len = 0;
+    if (getline(&line, &line_len, fp) < 0) {
+        LOG_FATAL_F("Phenotypes file %s is empty!\n", filename);
+    }
+    
+    // Names of the phenotypes, after the family and individual IDs
+    char *delimiters = " \t\r\n";
+    strtok_r(line, delimiters, &saveptr);
+    strtok_r(NULL, delimiters, &saveptr);
+    uint8_t *records = NULL;
+    *num_phenotypes = 0;
+    for (char *name = strtok_r(NULL, delimiters, &saveptr); name; name = strtok_r(NULL, delimiters, &saveptr)) {
+        if (strlen(name) > EPISTASIS_DATASET_PHENOTYPE_NAME_LEN) {
+            LOG_WARN_F("The name of phenotype %s is too long, it will be truncated\n", name);
+        }
+        records = realloc(records, dataset_phenotypes_len(*num_phenotypes + 1, num_samples));
+        uint8_t *record = records + dataset_phenotypes_len(*num_phenotypes, num_samples);
+        memset(record, 0, EPISTASIS_DATASET_PHENOTYPE_NAME_LEN);
+        strncpy((char*) record, name, EPISTASIS_DATASET_PHENOTYPE_NAME_LEN);
+        // Samples not found in the file are unknown
+        memset(record + EPISTASIS_DATASET_PHENOTYPE_NAME_LEN, EPISTASIS_DATASET_PHENOTYPE_MISSING, num_samples);
+        (*num_phenotypes)++;
+    }
+    
+    if (*num_phenotypes == 0) {
+        LOG_WARN_F("Phenotypes file %s does not contain any phenotype\n", filename);
+    }
+    
+    // Each line contains the values of a sample: 2 if affected, 1 if unaffected, anything else if unknown
+    while (getline(&line, &line_len, fp) >= 0) {
+        char *family_id = strtok_r(line, delimiters, &saveptr);
+        char *sample_id = strtok_r(NULL, delimiters, &saveptr);
+        if (!family_id || !sample_id) {
+            continue;
+        }
+        
+        khiter_t iter = kh_get(ids, sample_ids, sample_id);
+        if (iter == kh_end(sample_ids)) {
+            LOG_WARN_F("Sample %s is not in the VCF file, its phenotypes will be ignored\n", sample_id);
+            continue;
+        }
+        int position = destination[kh_value(sample_ids, iter)];
+        
+        for (int p = 0; p < *num_phenotypes; p++) {
+            char *value = strtok_r(NULL, delimiters, &saveptr);
+            if (!value) {
+                break;
+            }
+            uint8_t *labels = records + dataset_phenotypes_len(p, num_samples) + EPISTASIS_DATASET_PHENOTYPE_NAME_LEN;
+            if (!strcmp(value, "2")) {
+                labels[position] = 1;
+            } else if (!strcmp(value, "1")) {
+                labels[position] = 0;
+            }
+        }
+    }
+    
+    free(line);
+    fclose(fp);
+    
+    LOG_INFO_F("%d other phenotypes read from %s\n", *num_phenotypes, filename);
+    return records;
+}
@@ -14,19 +14,45 @@
 #include <commons/file_utils.h>
 #include <containers/list.h>
 
+#include "gwas/epistasis/dataset_format.h"
 #include "hpg_variant_utils.h"
 #include "shared_options.h"
+#include "vcf2epi.h"
 
-int create_dataset_from_vcf(shared_options_data_t* shared_options_data);
+int create_dataset_from_vcf(shared_options_data_t* shared_options_data, vcf2epi_options_data_t *options_data);
 
 
 uint8_t *epistasis_dataset_process_records(vcf_record_t** variants, size_t num_variants, int* destination, 
                                            int num_samples, int num_threads);
 
+/**
+ * @brief Packs the genotypes of a set of variants into bitplanes and writes them to a file.
+ * @details Packs the genotypes of a set of variants into bitplanes and writes them to a file. Each variant 
+ * takes header->num_words_per_snp words, as described in dataset_format.h.
+ * 
+ * @return Zero if the bitplanes were successfully written, non-zero otherwise
+ **/
+int epistasis_dataset_write_bitplanes(uint8_t *genotypes, size_t num_variants, epistasis_dataset_header *header, FILE *fp);
+
+/**
+ * @brief Appends the bitplanes to a dataset whose genotypes have already been written, and writes the final header.
+ * @details Appends the bitplanes to a dataset whose genotypes have already been written, and writes the final 
+ * header. The bitplanes section starts at a 64-byte boundary.
+ * 
+ * @param header Header of the dataset, with the final number of variants. Its bitplanes offset is updated.
+ * @param fp Dataset file
+ * @param bitplanes_fp File the bitplanes were written to with epistasis_dataset_write_bitplanes
+ * @return Zero if the dataset was successfully completed, non-zero otherwise
+ **/
+int epistasis_dataset_finish(epistasis_dataset_header *header, FILE *fp, FILE *bitplanes_fp);
+
 
 
 static uint8_t *get_individual_phenotypes(vcf_file_t* vcf, ped_file_t* ped, int* num_affected, int* num_unaffected);
 
 static int *group_individuals_by_phenotype(uint8_t *phenotypes, int num_affected, int num_unaffected);
 
+static uint8_t *read_other_phenotypes(char *filename, khash_t(ids) *sample_ids, int *destination, int num_samples, 
+                                      int *num_phenotypes);
+
 #endif
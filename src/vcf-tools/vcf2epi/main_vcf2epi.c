@@ -69,7 +69,7 @@ int vcf_tool_vcf2epi(int argc, char *argv[], const char *configuration_file) {
     vcf2epi_options_data_t *vcf2epi_options_data = new_vcf2epi_options_data(vcf2epi_options);
 
     // Step 5: Execute request and manage its response (as CURL request callback function)
-    int result = create_dataset_from_vcf(shared_options_data);
+    int result = create_dataset_from_vcf(shared_options_data, vcf2epi_options_data);
     
     free_vcf2epi_options_data(vcf2epi_options_data);
     free_shared_options_data(shared_options_data);
@@ -81,14 +81,22 @@ int vcf_tool_vcf2epi(int argc, char *argv[], const char *configuration_file) {
 vcf2epi_options_t *new_vcf2epi_cli_options(void) {
     vcf2epi_options_t *options = (vcf2epi_options_t*) malloc (sizeof(vcf2epi_options_t));
     options->num_options = NUM_EPISTASIS_OPTIONS;
+    options->phenotypes_filename = arg_file0(NULL, "phenotypes", NULL, 
+            "File with other phenotypes of the samples (FID, IID and a column per phenotype, 2 = affected, 1 = unaffected)");
     return options;
 }
 
 vcf2epi_options_data_t *new_vcf2epi_options_data(vcf2epi_options_t *options) {
-    vcf2epi_options_data_t *options_data = (vcf2epi_options_data_t*) malloc (sizeof(vcf2epi_options_data_t));
+    vcf2epi_options_data_t *options_data = (vcf2epi_options_data_t*) calloc (1, sizeof(vcf2epi_options_data_t));
+    if (options->phenotypes_filename->count > 0) {
+        options_data->phenotypes_filename = strdup(*(options->phenotypes_filename->filename));
+    }
     return options_data;
 }
 
 void free_vcf2epi_options_data(vcf2epi_options_data_t *options_data) {
+    if (options_data->phenotypes_filename) {
+        free(options_data->phenotypes_filename);
+    }
     free(options_data);
 }
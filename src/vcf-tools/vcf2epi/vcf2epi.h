@@ -42,10 +42,12 @@
 /**
  * Number of options applicable to the vcf2epi tool.
  */
-#define NUM_EPISTASIS_OPTIONS  28
+#define NUM_EPISTASIS_OPTIONS  29
 
 typedef struct vcf2epi_options {
     int num_options;
+    
+    struct arg_file *phenotypes_filename;   /**< File with other phenotypes of the samples. */
 } vcf2epi_options_t;
 
 /**
@@ -55,6 +57,7 @@ typedef struct vcf2epi_options {
  * order of the SNP combinations or the maximum number of cross-validation runs.
  */
 typedef struct vcf2epi_options_data {
+    char *phenotypes_filename;  /**< File with other phenotypes of the samples, NULL if not provided. */
 } vcf2epi_options_data_t;
 
 
@@ -78,7 +78,7 @@ void **parse_vcf2epi_options(int argc, char *argv[], vcf2epi_options_t *vcf2epi_
 }
 
 void **merge_vcf2epi_options(vcf2epi_options_t *vcf2epi_options, shared_options_t *shared_options, struct arg_end *arg_end) {
-    void **tool_options = malloc (NUM_EPISTASIS_OPTIONS * sizeof(void*));
+    void **tool_options = malloc (vcf2epi_options->num_options * sizeof(void*));
     // Input/output files
     tool_options[0] = shared_options->vcf_filename;
     tool_options[1] = shared_options->ped_filename;
@@ -116,7 +116,10 @@ void **merge_vcf2epi_options(vcf2epi_options_t *vcf2epi_options, shared_options_
     tool_options[25] = shared_options->mmap_vcf_files;
     tool_options[26] = shared_options->compression;
     
-    tool_options[27] = arg_end;
+    // Other phenotypes
+    tool_options[27] = vcf2epi_options->phenotypes_filename;
+    
+    tool_options[28] = arg_end;
     
     return tool_options;
 }
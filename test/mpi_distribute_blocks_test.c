@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "gwas/epistasis/mpi/mpi_epistasis_helper.h"
+
+/**
+ * Checks the blocks every process gets in each kind of search. The blocks split up front must be all the
+ * blocks of the dataset, each one in a single process. The beam search must get no blocks and communicate
+ * nothing, as the rest of processes won't take part in the distribution.
+ */
+int main(int argc, char *argv[]) {
+    int order = 2, stride = 10, num_failed = 0;
+    size_t num_variants = 95;
+    int num_mpi_ranks, mpi_rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_mpi_ranks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+    // 10 blocks per dimension, of which 55 have non-decreasing coordinates
+    size_t expected_blocks = 55;
+
+    // Beam search, run by the root process only, as the rest would be waiting for it if it communicated
+    size_t num_blocks = 1;
+    if (mpi_rank == 0) {
+        int *blocks = distribute_blocks_mpi(order, num_variants, stride, false, true, &num_blocks, 0, MPI_COMM_WORLD);
+        if (blocks || num_blocks) {
+            printf("P%d) The beam search should get no blocks, not %zu\n", mpi_rank, num_blocks);
+            num_failed++;
+        }
+        free(blocks);
+    }
+
+    // Dynamic mode, where all processes get all blocks
+    int *blocks = distribute_blocks_mpi(order, num_variants, stride, true, false, &num_blocks, 0, MPI_COMM_WORLD);
+    if (num_blocks != expected_blocks) {
+        printf("P%d) All %zu blocks should be available in dynamic mode, not %zu\n", mpi_rank, expected_blocks, num_blocks);
+        num_failed++;
+    }
+    free(blocks);
+
+    // Static mode, where each block belongs to a single process
+    blocks = distribute_blocks_mpi(order, num_variants, stride, false, false, &num_blocks, 0, MPI_COMM_WORLD);
+    unsigned long total_blocks = num_blocks, coords_sum = 0, total_coords_sum;
+    for (size_t i = 0; i < num_blocks * order; i++) {
+        coords_sum += blocks[i];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &total_blocks, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&coords_sum, &total_coords_sum, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+    // Each coordinate c in [0,10) appears in 11 blocks of order 2, so their sum is 11 * 45
+    if (total_blocks != expected_blocks || total_coords_sum != 11 * 45) {
+        printf("P%d) The blocks split up front should be %zu, not %lu (sum of coordinates %lu)\n",
+               mpi_rank, expected_blocks, total_blocks, total_coords_sum);
+        num_failed++;
+    }
+    free(blocks);
+
+    MPI_Allreduce(MPI_IN_PLACE, &num_failed, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+        printf("%s\n", num_failed ? "FAILED" : "PASSED");
+    }
+
+    MPI_Finalize();
+
+    return num_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -8,13 +8,14 @@
 #include <containers/array_list.h>
 
 #include "gwas/epistasis/cross_validation.h"
+#include "gwas/epistasis/kernels.h"
 #include "gwas/epistasis/mdr.h"
 #include "gwas/epistasis/model.h"
 
 
 Suite *create_test_suite(void);
 
-void check_fold_masks(int num_affected, int num_unaffected, int **folds, int i, int *sizes, uint8_t *masks);
+void check_fold_masks(int num_affected, int num_unaffected, int **folds, int i, unsigned int *sizes, uint8_t *masks);
 
 void check_copied_genotypes_fold_0(uint8_t **genotypes, uint8_t *block_starts[2], int snp_offset[2], int num_samples);
 
@@ -287,6 +288,106 @@ START_TEST (test_get_k_folds) {
 END_TEST
 
 
+START_TEST (test_get_k_folds_masks_repetitions) {
+    unsigned int k = 5, num_repetitions = 3;
+    int num_affected = 50, num_unaffected = 75;
+    int num_samples_with_padding = 16 * (int) ceil(((double) num_affected) / 16) + 16 * (int) ceil(((double) num_unaffected) / 16);
+    
+    srand(1234);
+    unsigned int *sizes;
+    uint8_t *masks = get_k_folds_masks_repetitions(num_repetitions, num_affected, num_unaffected, k, &sizes);
+    
+    // Each repetition must be the same as if it was generated on its own
+    srand(1234);
+    for (int r = 0; r < num_repetitions; r++) {
+        unsigned int *repetition_sizes;
+        int **folds = get_k_folds(num_affected, num_unaffected, k, &repetition_sizes);
+        uint8_t *repetition_masks = get_k_folds_masks(num_affected, num_unaffected, k, folds, repetition_sizes);
+        
+        fail_if(memcmp(sizes + r * 3 * k, repetition_sizes, 3 * k * sizeof(unsigned int)), 
+                "Fold sizes of a repetition must be stored after the previous ones");
+        fail_if(memcmp(masks + r * k * num_samples_with_padding, repetition_masks, k * num_samples_with_padding), 
+                "Fold masks of a repetition must be stored after the previous ones");
+        
+        // Each sample must be left out of the training partition in exactly one fold
+        int num_affected_with_padding = 16 * (int) ceil(((double) num_affected) / 16);
+        for (int j = 0; j < num_affected + num_unaffected; j++) {
+            int position = (j < num_affected) ? j : num_affected_with_padding + j - num_affected;
+            int num_testing = 0;
+            for (int i = 0; i < k; i++) {
+                num_testing += !masks[(r * k + i) * num_samples_with_padding + position];
+            }
+            fail_unless(num_testing == 1, "A sample must be in the testing partition of only one fold per repetition");
+        }
+        
+        for (int i = 0; i < k; i++) {
+            free(folds[i]);
+        }
+        free(folds);
+        free(repetition_sizes);
+        _mm_free(repetition_masks);
+    }
+    
+    free(sizes);
+    _mm_free(masks);
+}
+END_TEST
+
+START_TEST (test_get_k_folds_assignment_repetitions) {
+    unsigned int k = 4, num_repetitions = 2;
+    int num_affected = 21, num_unaffected = 30, num_samples = num_affected + num_unaffected;
+    
+    // Folds drawn with a seed are the same for any caller, and leave the sequence of rand untouched
+    srand(1234);
+    int next_random = rand();
+    srand(1234);
+    unsigned int seed = 42, same_seed = 42;
+    int *assignment = get_k_folds_assignment_repetitions(num_repetitions, num_affected, num_unaffected, k, &seed);
+    int *same_assignment = get_k_folds_assignment_repetitions(num_repetitions, num_affected, num_unaffected, k, &same_seed);
+    fail_if(memcmp(assignment, same_assignment, num_repetitions * num_samples * sizeof(int)), 
+            "Folds drawn with the same seed must be the same");
+    fail_if(rand() != next_random, "Folds drawn with a seed must not draw from rand");
+    
+    // The masks of any kernels test each sample in the fold it was assigned to, and the padding in none
+    enum kernel_isa isas[] = { KERNEL_SSE42, KERNEL_AVX2, KERNEL_AVX512 };
+    for (int n = 0; n < 3; n++) {
+        if (!epistasis_kernels_supported(isas[n])) {
+            continue;
+        }
+        int width = epistasis_kernels_init(isas[n])->vector_width;
+        int num_affected_with_padding = width * (int) ceil(((double) num_affected) / width);
+        int num_samples_with_padding = num_affected_with_padding + width * (int) ceil(((double) num_unaffected) / width);
+        
+        unsigned int *sizes;
+        uint8_t *masks = get_k_folds_masks_from_assignment(num_repetitions, num_affected, num_unaffected, k, assignment, &sizes);
+        for (int f = 0; f < num_repetitions * k; f++) {
+            int r = f / k, num_testing[3] = { 0, 0, 0 };
+            for (int j = 0; j < num_samples_with_padding; j++) {
+                int s = (j < num_affected) ? j : j - num_affected_with_padding + num_affected;
+                int is_sample = j < num_affected || (j >= num_affected_with_padding && s < num_samples);
+                if (!is_sample) {
+                    fail_if(masks[f * num_samples_with_padding + j], "Padding must not be in the training partition");
+                    continue;
+                }
+                int is_testing = assignment[r * num_samples + s] == f % k;
+                fail_if(masks[f * num_samples_with_padding + j] == is_testing, 
+                        "Sample %d must only be left out of the training partition of its fold", s);
+                num_testing[0] += is_testing;
+                num_testing[(s < num_affected) ? 1 : 2] += is_testing;
+            }
+            fail_if(memcmp(sizes + 3 * f, num_testing, 3 * sizeof(int)), "Sizes of fold %d must match its samples", f);
+        }
+        
+        free(sizes);
+        _mm_free(masks);
+    }
+    epistasis_kernels_init(KERNEL_SSE42);
+    
+    free(assignment);
+    free(same_assignment);
+}
+END_TEST
+
 START_TEST (test_get_genotypes_for_block) {
     int order = 2, num_folds = 3, stride = 3, num_blocks = 3;
     unsigned int *sizes;
@@ -615,6 +716,9 @@ END_TEST
  * ******************************/
 
 int main (int argc, char *argv) {
+    // Expected values below assume the padding of the SSE4.2 kernels
+    epistasis_kernels_init(KERNEL_SSE42);
+    
     Suite *fs = create_test_suite();
     SRunner *fs_runner = srunner_create(fs);
     srunner_run_all(fs_runner, CK_NORMAL);
@@ -628,6 +732,8 @@ int main (int argc, char *argv) {
 Suite *create_test_suite(void) {
     TCase *tc_k_fold = tcase_create("k-fold creation");
     tcase_add_test(tc_k_fold, test_get_k_folds);
+    tcase_add_test(tc_k_fold, test_get_k_folds_masks_repetitions);
+    tcase_add_test(tc_k_fold, test_get_k_folds_assignment_repetitions);
     
     TCase *tc_genotypes = tcase_create("Genotype and fold association");
     tcase_add_test(tc_genotypes, test_get_genotypes_for_block);
@@ -647,7 +753,7 @@ Suite *create_test_suite(void) {
  *          Auxiliary           *
  * *****************************/
 
-void check_fold_masks(int num_affected, int num_unaffected, int **folds, int i, int *sizes, uint8_t *masks) {
+void check_fold_masks(int num_affected, int num_unaffected, int **folds, int i, unsigned int *sizes, uint8_t *masks) {
     int idx_in_fold = 0, num_toggled = 0;
     int num_affected_with_padding = 16 * (int) ceil(((double) num_affected) / 16);
     int num_unaffected_with_padding = 16 * (int) ceil(((double) num_unaffected) / 16);
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "error.h"
+#include "gwas/epistasis/checkpoint.h"
+#include "gwas/epistasis/epistasis.h"
+#include "gwas/epistasis/kernels.h"
+#include "gwas/epistasis/model.h"
+
+
+Suite *create_test_suite(void);
+
+int order = 2, stride = 10, num_folds = 3, num_phenotypes = 1, max_ranking_size = 5;
+int num_affected = 40, num_unaffected = 30;
+size_t num_variants = 100, num_blocks = 55;
+
+char output_directory[] = "/tmp/hpg-variant.checkpoint.XXXXXX";
+masks_info info;
+
+
+/* ******************************
+ *      Unchecked fixtures      *
+ * ******************************/
+
+void setup_directory(void) {
+    epistasis_kernels_init(KERNEL_SSE42);
+    masks_info_init(order, 1, num_affected, num_unaffected, &info);
+    fail_if(!mkdtemp(output_directory), "Can't create a directory for the checkpoints");
+}
+
+void teardown_directory(void) {
+    rmdir(output_directory);
+}
+
+static epistasis_checkpoint *new_checkpoint(int num_threads, enum eval_function function, int ranking_size) {
+    return epistasis_checkpoint_new(output_directory, 0, num_threads, 600, order, stride, num_variants, num_folds, num_phenotypes,
+                                    function, TESTING, CV_A, ranking_size, num_blocks, info);
+}
+
+/**
+ * Saves a sweep starting at the third repetition in which a single thread finished the blocks 3 and 7, and
+ * found a model in each fold of both phenotypes. The folds of the sweep are stored in fold_masks and testing_sizes.
+ */
+static void save_sweep(enum eval_function function, int ranking_size, uint8_t *fold_masks, unsigned int *testing_sizes) {
+    epistasis_checkpoint *checkpoint = new_checkpoint(1, function, ranking_size);
+    epistasis_workspace *workspace = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, ranking_size, 0, 0, info);
+
+    for (int i = 0; i < num_folds * info.num_samples_with_padding; i++) {
+        fold_masks[i] = (i % 3 != 0);
+    }
+    for (int i = 0; i < 3 * num_folds; i++) {
+        testing_sizes[i] = 10 + i;
+    }
+    for (int f = 0; f < (1 + num_phenotypes) * num_folds; f++) {
+        int comb[2] = { f, f + 10 };
+        risky_combination *risky = risky_combination_new(order, comb, NULL, NULL, NULL, info);
+        risky->accuracy = 0.5 + 0.01 * f;
+        risky->num_risky_genotypes = 2;
+        risky->genotypes[0] = 0; risky->genotypes[1] = 1;
+        risky->genotypes[2] = 2; risky->genotypes[3] = 1;
+        model_ranking_insert(workspace->rankings[f], risky);
+    }
+
+    fail_if(epistasis_checkpoint_begin_sweep(checkpoint, 2, fold_masks, testing_sizes, &workspace, false),
+            "The start of the sweep should be saved");
+    epistasis_checkpoint_block_finished(checkpoint, 0, 3, workspace);
+
+    // Pretend the interval has elapsed, so the progress of the thread is saved along with the second block
+    checkpoint->threads[0].last_save_time -= checkpoint->interval;
+    epistasis_checkpoint_block_finished(checkpoint, 0, 7, workspace);
+
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+}
+
+/**
+ * Loads the checkpoint saved by a single thread, as when the search is resumed, and returns the number of 
+ * blocks already finished in the sweep to resume.
+ */
+static size_t load_sweep(int *first_repetition) {
+    epistasis_checkpoint *checkpoint = new_checkpoint(1, BA, max_ranking_size);
+    epistasis_workspace *workspace = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, max_ranking_size, 0, 0, info);
+    uint8_t *loaded_fold_masks;
+    unsigned int *loaded_testing_sizes;
+    fail_if(epistasis_checkpoint_load(checkpoint, &workspace, info, first_repetition, &loaded_fold_masks, &loaded_testing_sizes),
+            "The checkpoint should be loaded");
+
+    size_t num_completed = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        num_completed += checkpoint->completed[i];
+    }
+
+    free(loaded_testing_sizes);
+    _mm_free(loaded_fold_masks);
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+    return num_completed;
+}
+
+
+/* ******************************
+ *          Unit tests          *
+ * ******************************/
+
+START_TEST (test_checkpoint_save_load) {
+    uint8_t fold_masks[num_folds * info.num_samples_with_padding];
+    unsigned int testing_sizes[3 * num_folds];
+    save_sweep(BA, max_ranking_size, fold_masks, testing_sizes);
+
+    // The sweep is resumed by two threads, the first one takes the progress saved by the only thread before
+    epistasis_checkpoint *checkpoint = new_checkpoint(2, BA, max_ranking_size);
+    epistasis_workspace *workspaces[2];
+    for (int t = 0; t < 2; t++) {
+        workspaces[t] = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, max_ranking_size, 0, 0, info);
+    }
+
+    int first_repetition;
+    uint8_t *loaded_fold_masks;
+    unsigned int *loaded_testing_sizes;
+    fail_if(epistasis_checkpoint_load(checkpoint, workspaces, info, &first_repetition, &loaded_fold_masks, &loaded_testing_sizes),
+            "The checkpoint should be loaded");
+
+    fail_if(first_repetition != 2, "The sweep should be resumed from the third repetition, not %d", first_repetition + 1);
+    fail_if(!loaded_fold_masks || memcmp(loaded_fold_masks, fold_masks, num_folds * info.num_samples_with_padding),
+            "The fold masks of the sweep should be loaded");
+    fail_if(!loaded_testing_sizes || memcmp(loaded_testing_sizes, testing_sizes, 3 * num_folds * sizeof(unsigned int)),
+            "The sizes of the testing partitions should be loaded");
+
+    for (size_t i = 0; i < num_blocks; i++) {
+        fail_if(checkpoint->completed[i] != (i == 3 || i == 7), "Only the blocks 3 and 7 should be finished");
+    }
+
+    for (int f = 0; f < (1 + num_phenotypes) * num_folds; f++) {
+        model_ranking *ranking = workspaces[0]->rankings[f];
+        fail_if(ranking->size != 1, "Ranking %d should contain the saved model", f);
+        risky_combination *risky = ranking->entries[0].model;
+        fail_if(fabs(risky->accuracy - (0.5 + 0.01 * f)) > 1e-9, "Accuracy of the model in ranking %d should be kept", f);
+        fail_if(risky->combination[0] != f || risky->combination[1] != f + 10, "SNPs of the model in ranking %d should be kept", f);
+        fail_if(risky->num_risky_genotypes != 2 || risky->genotypes[2] != 2 || risky->genotypes[3] != 1,
+                "Risky genotypes of the model in ranking %d should be kept", f);
+        fail_if(workspaces[1]->rankings[f]->size != 0, "The second thread should not take any model");
+    }
+
+    epistasis_checkpoint_remove(checkpoint);
+    free(loaded_testing_sizes);
+    _mm_free(loaded_fold_masks);
+    for (int t = 0; t < 2; t++) {
+        epistasis_workspace_free(workspaces[t]);
+    }
+    epistasis_checkpoint_free(checkpoint);
+}
+END_TEST
+
+START_TEST (test_checkpoint_header_mismatch) {
+    uint8_t fold_masks[num_folds * info.num_samples_with_padding];
+    unsigned int testing_sizes[3 * num_folds];
+    int first_repetition;
+    uint8_t *loaded_fold_masks;
+    unsigned int *loaded_testing_sizes;
+
+    // Models ranked by another function
+    save_sweep(CA, max_ranking_size, fold_masks, testing_sizes);
+    epistasis_checkpoint *checkpoint = new_checkpoint(1, BA, max_ranking_size);
+    epistasis_workspace *workspace = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, max_ranking_size, 0, 0, info);
+    fail_unless(epistasis_checkpoint_load(checkpoint, &workspace, info, &first_repetition, &loaded_fold_masks, &loaded_testing_sizes) ==
+                EPISTASIS_CHECKPOINT_NOT_VALID, "A checkpoint of another evaluation function should be rejected");
+    fail_if(loaded_fold_masks || loaded_testing_sizes, "No folds should be loaded from a rejected checkpoint");
+    fail_if(workspace->rankings[0]->size != 0, "No models should be loaded from a rejected checkpoint");
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+
+    // Rankings of another size
+    save_sweep(BA, max_ranking_size + 1, fold_masks, testing_sizes);
+    checkpoint = new_checkpoint(1, BA, max_ranking_size);
+    workspace = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, max_ranking_size, 0, 0, info);
+    fail_unless(epistasis_checkpoint_load(checkpoint, &workspace, info, &first_repetition, &loaded_fold_masks, &loaded_testing_sizes) ==
+                EPISTASIS_CHECKPOINT_NOT_VALID, "A checkpoint with rankings of another size should be rejected");
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+
+    // Another number of phenotypes, which changes the number of rankings saved by each thread
+    save_sweep(BA, max_ranking_size, fold_masks, testing_sizes);
+    checkpoint = epistasis_checkpoint_new(output_directory, 0, 1, 600, order, stride, num_variants, num_folds, 0,
+                                          BA, TESTING, CV_A, max_ranking_size, num_blocks, info);
+    workspace = epistasis_workspace_new(order, stride, num_folds, 0, max_ranking_size, 0, 0, info);
+    fail_unless(epistasis_checkpoint_load(checkpoint, &workspace, info, &first_repetition, &loaded_fold_masks, &loaded_testing_sizes) ==
+                EPISTASIS_CHECKPOINT_NOT_VALID, "A checkpoint with another number of phenotypes should be rejected");
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+}
+END_TEST
+
+START_TEST (test_checkpoint_deferred_sweep) {
+    uint8_t fold_masks[num_folds * info.num_samples_with_padding];
+    unsigned int testing_sizes[3 * num_folds];
+    memset(fold_masks, 1, num_folds * info.num_samples_with_padding);
+    for (int i = 0; i < 3 * num_folds; i++) {
+        testing_sizes[i] = 10 + i;
+    }
+
+    epistasis_checkpoint *checkpoint = new_checkpoint(1, BA, max_ranking_size);
+    epistasis_workspace *workspace = epistasis_workspace_new(order, stride, num_folds, num_phenotypes, max_ranking_size, 0, 0, info);
+    int first_repetition;
+
+    // The second sweep starts while the first one, whose blocks are all finished, is still being reported
+    fail_if(epistasis_checkpoint_begin_sweep(checkpoint, 0, fold_masks, testing_sizes, &workspace, false),
+            "The start of the first sweep should be saved");
+    fail_if(epistasis_checkpoint_begin_sweep(checkpoint, 2, fold_masks, testing_sizes, &workspace, true),
+            "The start of the second sweep should be deferred");
+
+    // No progress is saved until the first sweep is reported, so a failure resumes it
+    checkpoint->threads[0].last_save_time -= checkpoint->interval;
+    epistasis_checkpoint_block_finished(checkpoint, 0, 3, workspace);
+    fail_if(load_sweep(&first_repetition) != 0 || first_repetition != 0,
+            "The first sweep should be resumed from the beginning, not cross-validation #%d", first_repetition + 1);
+
+    // Once reported, the second sweep is resumed, but the block finished before is processed again
+    fail_if(epistasis_checkpoint_end_sweep(checkpoint, 2), "The end of the first sweep should be saved");
+    fail_if(load_sweep(&first_repetition) != 0 || first_repetition != 2,
+            "The second sweep should be resumed from the beginning, not cross-validation #%d", first_repetition + 1);
+
+    // From then on, threads save their progress, including the blocks finished while the start was deferred
+    checkpoint->threads[0].last_save_time -= checkpoint->interval;
+    epistasis_checkpoint_block_finished(checkpoint, 0, 7, workspace);
+    fail_if(load_sweep(&first_repetition) != 2 || first_repetition != 2, "The blocks 3 and 7 of the second sweep should be finished");
+
+    epistasis_checkpoint_remove(checkpoint);
+    epistasis_workspace_free(workspace);
+    epistasis_checkpoint_free(checkpoint);
+}
+END_TEST
+
+
+/* ******************************
+ *      Main entry point        *
+ * ******************************/
+
+int main (int argc, char *argv) {
+    Suite *fs = create_test_suite();
+    SRunner *fs_runner = srunner_create(fs);
+    srunner_run_all(fs_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed (fs_runner);
+    srunner_free (fs_runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+Suite *create_test_suite(void) {
+    TCase *tc_checkpoint = tcase_create("Checkpoint files");
+    tcase_add_unchecked_fixture(tc_checkpoint, setup_directory, teardown_directory);
+    tcase_add_test(tc_checkpoint, test_checkpoint_save_load);
+    tcase_add_test(tc_checkpoint, test_checkpoint_header_mismatch);
+    tcase_add_test(tc_checkpoint, test_checkpoint_deferred_sweep);
+
+    // Add test cases to a test suite
+    Suite *fs = suite_create("Epistasis checkpoints");
+    suite_add_tcase(fs, tc_checkpoint);
+
+    return fs;
+}
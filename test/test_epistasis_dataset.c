@@ -8,6 +8,8 @@
 #include <bioformats/vcf/vcf_file_structure.h>
 
 #include "gwas/epistasis/dataset.h"
+#include "gwas/epistasis/prefilter.h"
+#include "gwas/epistasis/scheduler.h"
 #include "vcf-tools/vcf2epi/dataset_creator.c"
 
 
@@ -156,7 +158,7 @@ END_TEST
 
 START_TEST (test_dataset_load) {
     int num_variants, num_affected, num_unaffected;
-    size_t file_len, genotypes_offset;
+    size_t file_len, genotypes_offset, bitplanes_offset;
     char *filename = "epistasis_dataset.bin";
     
     uint8_t expected[] = { 
@@ -177,7 +179,7 @@ START_TEST (test_dataset_load) {
         1, 1, 2, 2, 2, 2, 1, 2, 2, 0, 2, 0, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 1, 2, 2, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 
         1, 1, 2, 255, 2, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2 };
     
-    uint8_t *contents = epistasis_dataset_load(&num_affected, &num_unaffected, &num_variants, &file_len, &genotypes_offset, filename);
+    uint8_t *contents = epistasis_dataset_load(&num_affected, &num_unaffected, &num_variants, &file_len, &genotypes_offset, &bitplanes_offset, filename);
     
     fail_unless(num_variants == 4, "There must be 4 variants");
     fail_unless(num_affected == 49, "There must be 49 affected samples");
@@ -193,6 +195,119 @@ START_TEST (test_dataset_load) {
 }
 END_TEST
 
+START_TEST (test_dataset_write_load_bitplanes) {
+    char *filename = "epistasis_dataset_bitplanes.bin";
+    int *destination = group_individuals_by_phenotype(phenotypes, num_affected, num_unaffected);
+    uint8_t *genotypes = epistasis_dataset_process_records(records, num_records, destination, num_samples, 4);
+    
+    // Write a dataset the same way hpg-var-vcf epi does
+    epistasis_dataset_header header;
+    epistasis_dataset_header_init(num_affected, num_unaffected, EPISTASIS_DATASET_GENOTYPES | EPISTASIS_DATASET_BITPLANES, &header);
+    header.genotypes_offset = sizeof(epistasis_dataset_header);
+    header.num_variants = num_records;
+    
+    FILE *fp = fopen(filename, "w+b");
+    FILE *bitplanes_fp = tmpfile();
+    fail_unless(fwrite(&header, sizeof(epistasis_dataset_header), 1, fp) == 1, "The header could not be written");
+    fail_unless(fwrite(genotypes, sizeof(uint8_t), num_records * num_samples, fp) == num_records * num_samples, 
+                "The genotypes could not be written");
+    fail_unless(epistasis_dataset_write_bitplanes(genotypes, num_records, &header, bitplanes_fp) == 0, 
+                "The bitplanes could not be written");
+    fail_unless(epistasis_dataset_finish(&header, fp, bitplanes_fp) == 0, "The dataset could not be completed");
+    fclose(bitplanes_fp);
+    fclose(fp);
+    
+    // Load it back
+    int loaded_affected, loaded_unaffected;
+    size_t loaded_variants, file_len, genotypes_offset, bitplanes_offset;
+    uint8_t *contents = epistasis_dataset_load(&loaded_affected, &loaded_unaffected, &loaded_variants, &file_len, 
+                                               &genotypes_offset, &bitplanes_offset, filename);
+    
+    fail_if(contents == NULL, "The dataset must be loaded");
+    fail_unless(loaded_variants == num_records, "There must be 3 variants");
+    fail_unless(loaded_affected == num_affected, "There must be 10 affected samples");
+    fail_unless(loaded_unaffected == num_unaffected, "There must be 10 unaffected samples");
+    fail_unless(genotypes_offset == sizeof(epistasis_dataset_header), "Genotypes must start after the header");
+    fail_unless(bitplanes_offset > 0 && bitplanes_offset % EPISTASIS_DATASET_ALIGNMENT == 0, 
+                "Bitplanes must start at a 64-byte boundary");
+    fail_unless(file_len == bitplanes_offset + num_records * header.num_words_per_snp * sizeof(uint64_t), 
+                "Bitplanes must be the last section in the file");
+    
+    for (int i = 0; i < num_records * num_samples; i++) {
+        fail_unless(contents[genotypes_offset + i] == genotypes[i], "Genotypes must be the same that were written");
+    }
+    
+    // Each sample must be set in the bitplane of its genotype only, and missing genotypes in none
+    uint64_t *bitplanes = (uint64_t*) (contents + bitplanes_offset);
+    int num_words_per_bitplane = header.num_words_affected + header.num_words_unaffected;
+    for (int v = 0; v < num_records; v++) {
+        uint64_t *snp_bitplanes = bitplanes + v * header.num_words_per_snp;
+        for (int i = 0; i < num_samples; i++) {
+            int bit = (i < num_affected) ? i : (header.num_words_affected * 64 + i - num_affected);
+            for (int g = 0; g < NUM_DATASET_GENOTYPES; g++) {
+                int is_set = (snp_bitplanes[g * num_words_per_bitplane + bit / 64] >> (bit % 64)) & 1;
+                fail_unless(is_set == (genotypes[v * num_samples + i] == g), "Bitplanes must match genotypes");
+            }
+        }
+    }
+    
+    epistasis_dataset_close(contents, file_len);
+    remove(filename);
+    free(genotypes);
+    free(destination);
+}
+END_TEST
+
+
+START_TEST (test_prefilter_snps) {
+    int num_aff = 8, num_unaff = 8, num_snps = 5;
+    uint8_t genotypes[5][16] = { { 0, 1, 2, 0, 1, 2, 0, 1,   0, 1, 2, 0, 1, 2, 0, 1 },      // No effect
+                                 { 2, 2, 2, 2, 2, 2, 2, 2,   0, 0, 0, 0, 0, 0, 0, 0 },      // Perfect association
+                                 { 0, 0, 0, 0, 1, 1, 1, 1,   0, 0, 1, 1, 1, 1, 1, 1 },      // Weak association
+                                 { 1, 1, 1, 1, 1, 1, 1, 1,   0, 0, 0, 0, 0, 0, 0, 0 },      // Perfect association
+                                 { 0, 1, 0, 1, 0, 1, 0, 1,   1, 0, 1, 0, 1, 0, 1, 0 } };    // No effect
+    
+    // The same SNPs must be selected from the genotypes and from the bitplanes
+    epistasis_dataset_header header;
+    epistasis_dataset_header_init(num_aff, num_unaff, EPISTASIS_DATASET_GENOTYPES | EPISTASIS_DATASET_BITPLANES, &header);
+    uint64_t *bitplanes = _mm_malloc(num_snps * header.num_words_per_snp * sizeof(uint64_t), EPISTASIS_DATASET_ALIGNMENT);
+    for (int v = 0; v < num_snps; v++) {
+        epistasis_dataset_pack_bitplanes(genotypes[v], &header, bitplanes + v * header.num_words_per_snp);
+    }
+    
+    for (int source = 0; source < 2; source++) {
+        double *scores;
+        int *selected = prefilter_snps((uint8_t*) genotypes, source ? bitplanes : NULL, num_snps, num_aff, num_unaff, 3, &scores);
+        fail_if(selected[0] != 1 || selected[1] != 2 || selected[2] != 3, 
+                "SNPs 1, 2 and 3 must be selected in order (%d, %d, %d)", selected[0], selected[1], selected[2]);
+        fail_if(fabs(scores[0] - 16) > 1e-6 || fabs(scores[2] - 16) > 1e-6, "Perfect associations must score N = 16");
+        fail_if(fabs(scores[1] - 1.06666666) > 1e-6, "SNP 2 must score 1.0666...");
+        free(selected);
+        free(scores);
+        
+        // Ties are broken by the position of the SNPs
+        selected = prefilter_snps((uint8_t*) genotypes, source ? bitplanes : NULL, num_snps, num_aff, num_unaff, 1, &scores);
+        fail_if(selected[0] != 1, "SNP 1 must be selected before SNP 3");
+        free(selected);
+        free(scores);
+    }
+    
+    // The selected SNPs are gathered with the same layout
+    int selected[] = { 1, 3 };
+    uint8_t *selected_genotypes = prefilter_gather_genotypes(selected, 2, (uint8_t*) genotypes, num_aff + num_unaff);
+    uint64_t *selected_bitplanes = prefilter_gather_bitplanes(selected, 2, bitplanes, num_aff, num_unaff);
+    for (int i = 0; i < 2; i++) {
+        fail_if(memcmp(selected_genotypes + i * 16, genotypes[selected[i]], 16), "Genotypes of SNP %d must be copied", selected[i]);
+        fail_if(memcmp(selected_bitplanes + i * header.num_words_per_snp, bitplanes + selected[i] * header.num_words_per_snp, 
+                       header.num_words_per_snp * sizeof(uint64_t)), "Bitplanes of SNP %d must be copied", selected[i]);
+    }
+    
+    free(selected_genotypes);
+    _mm_free(selected_bitplanes);
+    _mm_free(bitplanes);
+}
+END_TEST
+
 
 
 START_TEST (test_get_block_stride) {
@@ -330,7 +445,101 @@ START_TEST (test_get_first_combination_in_block) {
 END_TEST
 
 START_TEST (test_get_next_combination_in_block) {
-    // TODO!
+    int stride = 10, num_variants = 25, num_blocks = 3;
+    
+    // Every combination of the dataset must be generated exactly once, in the block its positions belong to
+    for (int order = 2; order <= 4; order++) {
+        int block_coords[4] = { 0 }, comb[4];
+        static int times_generated[25][25][25][25];
+        memset(times_generated, 0, sizeof(times_generated));
+        size_t total = 0;
+        
+        do {
+            size_t num_combinations = 0;
+            get_first_combination_in_block(order, comb, block_coords, stride);
+            if (comb[order-1] >= num_variants) { continue; }
+            
+            do {
+                for (int i = 0; i < order; i++) {
+                    fail_if(comb[i] / stride != block_coords[i], "Position %d must belong to block %d", i, block_coords[i]);
+                    fail_if(i > 0 && comb[i] <= comb[i-1], "Combination must be in increasing order");
+                }
+                times_generated[comb[0]][comb[1]][order > 2 ? comb[2] : 0][order > 3 ? comb[3] : 0]++;
+                num_combinations++;
+            } while (get_next_combination_in_block(order, comb, block_coords, stride, num_variants));
+            
+            fail_if(num_combinations != get_block_num_combinations(order, block_coords, stride, num_variants), 
+                    "Order %d: the combinations generated must match the size of the block", order);
+            total += num_combinations;
+        } while (get_next_block(num_blocks, order, block_coords));
+        
+        size_t expected = (order == 2) ? 300 : (order == 3) ? 2300 : 12650;
+        fail_if(total != expected, "Order %d: C(25,%d) combinations must be generated, not %zu", order, order, total);
+        for (int a = 0; a < num_variants; a++) {
+            for (int b = 0; b < num_variants; b++) {
+                for (int c = 0; c < num_variants; c++) {
+                    for (int d = 0; d < num_variants; d++) {
+                        fail_if(times_generated[a][b][c][d] > 1, "Combination generated more than once");
+                    }
+                }
+            }
+        }
+    }
+}
+END_TEST
+
+START_TEST (test_get_block_num_combinations) {
+    int stride = 10, num_variants = 25;
+    
+    fail_if(get_block_num_combinations(2, (int[2]) { 0, 0 }, stride, num_variants) != 45, "B(0,0) -> C(10,2) = 45");
+    fail_if(get_block_num_combinations(2, (int[2]) { 0, 1 }, stride, num_variants) != 100, "B(0,1) -> 10 * 10 = 100");
+    fail_if(get_block_num_combinations(2, (int[2]) { 0, 2 }, stride, num_variants) != 50, "B(0,2) -> 10 * 5 = 50");
+    fail_if(get_block_num_combinations(2, (int[2]) { 2, 2 }, stride, num_variants) != 10, "B(2,2) -> C(5,2) = 10");
+    
+    fail_if(get_block_num_combinations(3, (int[3]) { 0, 0, 0 }, stride, num_variants) != 120, "B(0,0,0) -> C(10,3) = 120");
+    fail_if(get_block_num_combinations(3, (int[3]) { 1, 1, 2 }, stride, num_variants) != 225, "B(1,1,2) -> C(10,2) * 5 = 225");
+    fail_if(get_block_num_combinations(3, (int[3]) { 0, 1, 2 }, stride, num_variants) != 500, "B(0,1,2) -> 10 * 10 * 5 = 500");
+}
+END_TEST
+
+START_TEST (test_block_scheduler) {
+    int stride = 10, num_variants = 35, order = 2;
+    
+    // 4 blocks per dimension, the last one with only 5 SNPs
+    int block_coords[10 * order], current_coords[] = { 0, 0 };
+    size_t num_blocks = 0;
+    do {
+        memcpy(block_coords + num_blocks * order, current_coords, order * sizeof(int));
+        num_blocks++;
+    } while (get_next_block(4, order, current_coords));
+    fail_if(num_blocks != 10, "4 blocks, order 2 -> 10 blocks");
+    
+    // Only the first thread asks for blocks, so it must steal the ones assigned to the second
+    block_scheduler *scheduler = block_scheduler_new(2, order, block_coords, num_blocks, stride, num_variants);
+    int times_processed[10] = { 0 };
+    size_t block, previous_cost = 1000, num_processed = 0;
+    
+    // The first thread gets the largest blocks in generation order, so they share their first coordinate
+    fail_if(!block_scheduler_next(0, scheduler, &block), "There must be blocks to process");
+    fail_if(get_block_num_combinations(order, block_coords + block * order, stride, num_variants) != 100, 
+            "The first block must be one of the largest");
+    fail_if(scheduler->queues[0].tail != 3, "The first thread must get the 3 largest blocks");
+    fail_if(block != 1 || scheduler->queues[0].blocks[1] != 2 || scheduler->queues[0].blocks[2] != 5, 
+            "The blocks of the first thread must be (0,1), (0,2) and (1,2)");
+    do {
+        times_processed[block]++;
+        num_processed++;
+    } while (block_scheduler_next(0, scheduler, &block));
+    
+    fail_if(num_processed != num_blocks, "All blocks must be processed");
+    for (int i = 0; i < num_blocks; i++) {
+        fail_if(times_processed[i] != 1, "Block %d must be processed once", i);
+    }
+    fail_if(scheduler->stats[0].num_stolen != 7, "7 blocks must be stolen from the second thread");
+    fail_if(scheduler->stats[0].num_combinations != 45 * 3 + 10 + 100 * 3 + 50 * 3, 
+            "All combinations must have been processed by the first thread");
+    
+    block_scheduler_free(scheduler);
 }
 END_TEST
  
@@ -356,11 +565,16 @@ Suite *create_test_suite(void) {
     tcase_add_test(tc_creation, test_destination);
     tcase_add_test(tc_creation, test_process_records);
     tcase_add_test(tc_creation, test_dataset_load);
+    tcase_add_test(tc_creation, test_dataset_write_load_bitplanes);
+    tcase_add_test(tc_creation, test_prefilter_snps);
     
     TCase *tc_balancing = tcase_create("Work distribution and load balancing");
     tcase_add_test(tc_balancing, test_get_block_stride);
     tcase_add_test(tc_balancing, test_get_next_block);
+    tcase_add_test(tc_balancing, test_get_next_combination_in_block);
     tcase_add_test(tc_balancing, test_get_first_combination_in_block);
+    tcase_add_test(tc_balancing, test_get_block_num_combinations);
+    tcase_add_test(tc_balancing, test_block_scheduler);
     
     
     // Add test cases to a test suite
@@ -9,7 +9,10 @@
 
 #include <containers/array_list.h>
 
+#include "gwas/epistasis/kernels.h"
 #include "gwas/epistasis/model.h"
+#include "gwas/epistasis/permutation.h"
+#include "gwas/epistasis/phenotype.h"
 
 
 Suite *create_test_suite(void);
@@ -27,6 +30,39 @@ uint8_t genotypes[4][8] = { { 0, 0, 1, 0, 2, 1, 0, 2 },
  *      Unchecked fixtures      *
  * ******************************/
 
+/**
+ * Fills a block of num_snps SNPs with random genotypes, laid out like the blocks of a search (affected, padding, 
+ * unaffected, padding), and leaves each sample out of the training partition of a random fold. The sizes of the 
+ * partitions of each fold (affected, unaffected) are counted unless training_size and testing_size are NULL.
+ */
+static void make_random_block(masks_info info, int num_snps, int num_folds, unsigned int seed, uint8_t **block, 
+                              uint8_t **fold_masks, unsigned int *training_size, unsigned int *testing_size) {
+    srand(seed);
+    *block = _mm_malloc(num_snps * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    *fold_masks = _mm_malloc(num_folds * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    memset(*block, 0, num_snps * info.num_samples_with_padding * sizeof(uint8_t));
+    memset(*fold_masks, 0, num_folds * info.num_samples_with_padding * sizeof(uint8_t));
+    if (training_size && testing_size) {
+        memset(training_size, 0, 2 * num_folds * sizeof(int));
+        memset(testing_size, 0, 2 * num_folds * sizeof(int));
+    }
+    
+    for (int i = 0; i < info.num_affected + info.num_unaffected; i++) {
+        int group = (i < info.num_affected) ? 0 : 1;
+        int offset = group ? info.num_affected_with_padding + i - info.num_affected : i;
+        int fold = rand() % num_folds;
+        for (int j = 0; j < num_snps; j++) {
+            (*block)[j * info.num_samples_with_padding + offset] = rand() % NUM_GENOTYPES;
+        }
+        for (int f = 0; f < num_folds; f++) {
+            (*fold_masks)[f * info.num_samples_with_padding + offset] = (fold != f);
+            if (training_size && testing_size) {
+                if (fold != f) { training_size[2 * f + group]++; } else { testing_size[2 * f + group]++; }
+            }
+        }
+    }
+}
+
 
 
 /* ******************************
@@ -363,18 +399,57 @@ START_TEST(test_get_counts_all_folds_order_3) {
 END_TEST
 
 
+START_TEST(test_high_risk_masks) {
+    // 30 affected and 20 unaffected samples: high risk if affected/unaffected >= 1.5
+    int num_affected = 30, num_unaffected = 20;
+    
+    // Ties (3/2, 6/4) are high risk, empty cells are not
+    int counts_aff[] = { 3, 2, 0, 6, 0, 1, 5, 3, 0 };
+    int counts_unaff[] = { 2, 2, 1, 4, 0, 0, 4, 1, 0 };
+    uint64_t mask[1];
+    mdr_high_risk_masks(counts_aff, counts_unaff, 1, 9, num_affected, num_unaffected, mask);
+    fail_if(mask[0] != ((1 << 0) | (1 << 3) | (1 << 5) | (1 << 7)), "High risk cells should be 0, 3, 5 and 7 (mask = %lx)", mask[0]);
+    
+    // Random counts of several combinations of orders 2 to 5, checked against the scalar rule
+    srand(2014);
+    for (int order = 2; order <= 5; order++) {
+        int num_combinations = 5;
+        int num_counts = pow(NUM_GENOTYPES, order);
+        int num_words = MDR_RISK_MASK_WORDS(num_counts);
+        int aff[num_combinations * num_counts], unaff[num_combinations * num_counts];
+        uint64_t masks[num_combinations * num_words];
+        for (int i = 0; i < num_combinations * num_counts; i++) {
+            aff[i] = rand() % 4;
+            unaff[i] = rand() % 4;
+        }
+        
+        mdr_high_risk_masks(aff, unaff, num_combinations, num_counts, num_affected, num_unaffected, masks);
+        
+        for (int c = 0; c < num_combinations; c++) {
+            for (int i = 0; i < num_counts; i++) {
+                int a = aff[c * num_counts + i], u = unaff[c * num_counts + i];
+                bool expected = (a + u > 0) && (a * num_unaffected >= u * num_affected);
+                bool is_set = (masks[c * num_words + i / 64] >> (i % 64)) & 1;
+                fail_if(is_set != expected, "Order %d, combination %d, cell %d (%d/%d) should be %s risk", 
+                        order, c, i, a, u, expected ? "high" : "low");
+            }
+        }
+    }
+}
+END_TEST
+
 START_TEST(test_get_confusion_matrix) {
     int order = 2;
     int num_combinations;
     masks_info info;
-    int matrix[4];
+    unsigned int matrix[4];
     
     // ---------- order 2 ------------
     
     uint8_t **possible_2d = get_genotype_combinations(order, &num_combinations);
     // Risky combinations: (1,0), (2,1), (2,2)
     masks_info_init(order, 1, 7, 5, &info);
-    risky_combination *combination_2d = risky_combination_new(order, (int[2]){ 0, 1 }, possible_2d, 3, (int[3]){ 3, 7, 8 }, NULL, info);
+    uint64_t risk_2d[] = { (1 << 3) | (1 << 7) | (1 << 8) };
     
     // 7 affected, 5 unaffected
     uint8_t gt2_0a[] = { 1, 1, 0, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
@@ -382,7 +457,7 @@ START_TEST(test_get_confusion_matrix) {
     uint8_t *genotypes_2da[2] = { gt2_0a, gt2_1a };
     uint8_t fold_masks_2da[] = { 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     
-    confusion_matrix(order, combination_2d, genotypes_2da, fold_masks_2da, TRAINING, (int[2]) { 7, 5 }, (int[2]) { 0, 0 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2da, fold_masks_2da, TRAINING, (unsigned int[2]) { 7, 5 }, (unsigned int[2]) { 0, 0 }, info, matrix);
     
     // printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 6, "(7 aff,5 unaff) TP = 6");
@@ -397,7 +472,7 @@ START_TEST(test_get_confusion_matrix) {
     uint8_t *genotypes_2db[2] = { gt2_0b, gt2_1b };
     uint8_t fold_masks_2db[] = { 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
     
-    confusion_matrix(order, combination_2d, genotypes_2db, fold_masks_2db, TRAINING, (int[2]) { 4, 8 }, (int[2]) { 0, 0 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2db, fold_masks_2db, TRAINING, (unsigned int[2]) { 4, 8 }, (unsigned int[2]) { 0, 0 }, info, matrix);
     
     // printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 3, "(4 aff,8 unaff) TP = 3");
@@ -405,7 +480,6 @@ START_TEST(test_get_confusion_matrix) {
     fail_if(matrix[2] != 4, "(4 aff,8 unaff) FP = 4");
     fail_if(matrix[3] != 4, "(4 aff,8 unaff) TN = 4");
     
-    risky_combination_free(combination_2d);
     
     // ---------- order 3 ------------
     order = 3;
@@ -418,10 +492,10 @@ START_TEST(test_get_confusion_matrix) {
     uint8_t **possible_3d = get_genotype_combinations(order, &num_combinations);
     // Risky combinations: (1,0,1), (2,1,0), (2,2,1)
     masks_info_init(order, 1, 6, 6, &info);
-    risky_combination *combination_3d = risky_combination_new(order, (int[3]){ 0, 1, 2 }, possible_3d, 4, (int[4]){ 4, 10, 21, 25 }, NULL, info);
+    uint64_t risk_3d[] = { (1 << 4) | (1 << 10) | (1 << 21) | (1 << 25) };
     
     // 6 affected, 6 unaffected
-    confusion_matrix(order, combination_3d, genotypes_3d, fold_masks_3d, TRAINING, (int[2]) { 6, 6 }, (int[2]) { 0, 0 }, info, matrix);
+    confusion_matrix(order, risk_3d, possible_3d, genotypes_3d, fold_masks_3d, TRAINING, (unsigned int[2]) { 6, 6 }, (unsigned int[2]) { 0, 0 }, info, matrix);
     
     // printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 6, "(6 aff,6 unaff) TP = 6");
@@ -429,7 +503,6 @@ START_TEST(test_get_confusion_matrix) {
     fail_if(matrix[2] != 3, "(6 aff,6 unaff) FP = 3");
     fail_if(matrix[3] != 3, "(6 aff,6 unaff) TN = 3");
     
-    risky_combination_free(combination_3d);
 }
 END_TEST
 
@@ -438,14 +511,14 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     int order = 2;
     int num_combinations;
     masks_info info;
-    int matrix[4];
+    unsigned int matrix[4];
     
     // ---------- order 2 ------------
     
     uint8_t **possible_2d = get_genotype_combinations(order, &num_combinations);
     // Risky combinations: (1,0), (2,1), (2,2)
     masks_info_init(order, 1, 7, 5, &info);
-    risky_combination *combination_2d = risky_combination_new(order, (int[2]){ 0, 1 }, possible_2d, 3, (int[3]){ 3, 7, 8 }, NULL, info);
+    uint64_t risk_2d[] = { (1 << 3) | (1 << 7) | (1 << 8) };
     
     // 7 affected, 5 unaffected
     uint8_t gt2_0a[] = { 1, 1, 0, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
@@ -453,7 +526,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     uint8_t *genotypes_2d[2] = { gt2_0a, gt2_1a };
     uint8_t fold_masks_2da[] = { 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2da, TRAINING, (int[2]) { 4, 3 }, (int[2]) { 3, 2 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2da, TRAINING, (unsigned int[2]) { 4, 3 }, (unsigned int[2]) { 3, 2 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 3, "(7 aff,5 unaff) TP = 3");
@@ -461,7 +534,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     fail_if(matrix[2] != 0, "(7 aff,5 unaff) FP = 0");
     fail_if(matrix[3] != 3, "(7 aff,5 unaff) TN = 3");
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2da, TESTING, (int[2]) { 4, 3 }, (int[2]) { 3, 2 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2da, TESTING, (unsigned int[2]) { 4, 3 }, (unsigned int[2]) { 3, 2 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 3, "(7 aff,5 unaff) TP = 3");
@@ -471,7 +544,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     
     uint8_t fold_masks_2db[] = { 1, 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2db, TRAINING, (int[2]) { 4, 2 }, (int[2]) { 3, 3 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2db, TRAINING, (unsigned int[2]) { 4, 2 }, (unsigned int[2]) { 3, 3 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 3, "(7 aff,5 unaff) TP = 3");
@@ -479,7 +552,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     fail_if(matrix[2] != 0, "(7 aff,5 unaff) FP = 0");
     fail_if(matrix[3] != 2, "(7 aff,5 unaff) TN = 2");
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2db, TESTING, (int[2]) { 4, 2 }, (int[2]) { 3, 3 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2db, TESTING, (unsigned int[2]) { 4, 2 }, (unsigned int[2]) { 3, 3 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 3, "(7 aff,5 unaff) TP = 3");
@@ -489,7 +562,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     
     uint8_t fold_masks_2dc[] = { 1, 1, 0, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2dc, TRAINING, (int[2]) { 6, 4 }, (int[2]) { 1, 1 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2dc, TRAINING, (unsigned int[2]) { 6, 4 }, (unsigned int[2]) { 1, 1 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 6, "(7 aff,5 unaff) TP = 6");
@@ -497,7 +570,7 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     fail_if(matrix[2] != 0, "(7 aff,5 unaff) FP = 0");
     fail_if(matrix[3] != 4, "(7 aff,5 unaff) TN = 4");
     
-    confusion_matrix(order, combination_2d, genotypes_2d, fold_masks_2dc, TESTING, (int[2]) { 6, 4 }, (int[2]) { 1, 1 }, info, matrix);
+    confusion_matrix(order, risk_2d, possible_2d, genotypes_2d, fold_masks_2dc, TESTING, (unsigned int[2]) { 6, 4 }, (unsigned int[2]) { 1, 1 }, info, matrix);
     
     printf("matrix = { %d, %d, %d, %d }\n", matrix[0], matrix[1], matrix[2], matrix[3]);
     fail_if(matrix[0] != 0, "(7 aff,5 unaff) TP = 0");
@@ -505,11 +578,75 @@ START_TEST(test_get_confusion_matrix_excluding_samples) {
     fail_if(matrix[2] != 1, "(7 aff,5 unaff) FP = 1");
     fail_if(matrix[3] != 0, "(7 aff,5 unaff) TN = 0");
     
-    risky_combination_free(combination_2d);
 }
 END_TEST
 
 
+START_TEST(test_confusion_matrix_from_counts) {
+    int order = 2, num_folds = 3, num_snps = 3;
+    int num_affected = 41, num_unaffected = 29;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    // All pairs of 3 SNPs in a row: (0,1), (0,2), (1,2)
+    int combs[] = { 0, 1, 0, 2, 1, 2 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+    
+    uint8_t *block, *fold_masks;
+    unsigned int training_size[2 * num_folds], testing_size[2 * num_folds];
+    make_random_block(info, num_snps, num_folds, 1492, &block, &fold_masks, training_size, testing_size);
+    
+    // The last mask selects all samples, and nothing in the padding
+    fold_masks = add_all_samples_mask(num_folds, fold_masks, info);
+    uint8_t *all_samples = fold_masks + num_folds * info.num_samples_with_padding;
+    for (int i = 0; i < info.num_samples_with_padding; i++) {
+        bool is_sample = i < num_affected || (i >= info.num_affected_with_padding && i < info.num_affected_with_padding + num_unaffected);
+        fail_if(all_samples[i] != is_sample, "Position %d of the mask of all samples should be %d", i, is_sample);
+    }
+    
+    uint8_t *genotypes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        genotypes[c] = block + combs[c] * info.num_samples_with_padding;
+    }
+    
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination;
+    int counts_aff[num_counts * (num_folds + 1)], counts_unaff[num_counts * (num_folds + 1)];
+    uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_masks(order, genotypes, 3, masks, info);
+    combination_counts_all_folds(order, fold_masks, num_folds + 1, permutations, masks, info, counts_aff, counts_unaff);
+    
+    uint64_t risk_masks[3 * num_folds * info.num_words_per_risk_mask];
+    mdr_high_risk_masks(counts_aff, counts_unaff, 3 * num_folds, info.num_cell_counts_per_combination, 
+                        num_affected, num_unaffected, risk_masks);
+    
+    for (int f = 0; f < num_folds; f++) {
+        for (int rc = 0; rc < 3; rc++) {
+            uint64_t *risk_mask = risk_masks + (f * 3 + rc) * info.num_words_per_risk_mask;
+            int *fold_aff = counts_aff + f * num_counts + rc * info.num_cell_counts_per_combination;
+            int *fold_unaff = counts_unaff + f * num_counts + rc * info.num_cell_counts_per_combination;
+            int *all_aff = counts_aff + num_folds * num_counts + rc * info.num_cell_counts_per_combination;
+            int *all_unaff = counts_unaff + num_folds * num_counts + rc * info.num_cell_counts_per_combination;
+            
+            for (enum evaluation_subset subset = TESTING; subset <= TRAINING; subset++) {
+                unsigned int genotypes_matrix[4], counts_matrix[4];
+                confusion_matrix(order, risk_mask, permutations, genotypes + rc * order, fold_masks + f * info.num_samples_with_padding, 
+                                 subset, training_size + 2 * f, testing_size + 2 * f, info, genotypes_matrix);
+                confusion_matrix_counts(risk_mask, fold_aff, fold_unaff, all_aff, all_unaff, 
+                                        subset, training_size + 2 * f, testing_size + 2 * f, info, counts_matrix);
+                fail_if(memcmp(genotypes_matrix, counts_matrix, 4 * sizeof(unsigned int)),
+                        "Confusion matrix of combination %d in fold %d should be { %d, %d, %d, %d }", rc, f, 
+                        genotypes_matrix[0], genotypes_matrix[1], genotypes_matrix[2], genotypes_matrix[3]);
+            }
+        }
+    }
+    
+    _mm_free(masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
+}
+END_TEST
+
 START_TEST(test_model_evaluation_formulas) {
     unsigned int confusion_matrix_1[] = { 40, 2, 4, 10 };
     unsigned int confusion_matrix_2[] = { 20, 10, 10, 20 };
@@ -530,6 +667,647 @@ START_TEST(test_model_evaluation_formulas) {
     fail_if(evaluate_model(confusion_matrix_1, TAU_B) - 0.70352647 > 1e-6, "TAU_B(1) = 0.70352647");
     fail_if(evaluate_model(confusion_matrix_2, TAU_B) - 0.33333333 > 1e-6, "TAU_B(2) = 0.3333...");
     
+    // Chi-square
+    fail_if(fabs(evaluate_model(confusion_matrix_1, CHI_SQUARE) - 27.71717171) > 1e-6, "CHI_SQUARE(1) = 27.71717171");
+    fail_if(fabs(evaluate_model(confusion_matrix_2, CHI_SQUARE) - 6.66666666) > 1e-6, "CHI_SQUARE(2) = 6.6666...");
+    
+    // Likelihood ratio (G)
+    fail_if(fabs(evaluate_model(confusion_matrix_1, LIKELIHOOD_RATIO) - 25.36009061) > 1e-6, "LIKELIHOOD_RATIO(1) = 25.36009061");
+    fail_if(fabs(evaluate_model(confusion_matrix_2, LIKELIHOOD_RATIO) - 6.79596147) > 1e-6, "LIKELIHOOD_RATIO(2) = 6.79596147");
+    
+    // Both statistics are symmetric, but models that classify the samples the other way round are not associations
+    unsigned int inverted_matrix[] = { 2, 40, 10, 4 };
+    fail_if(evaluate_model(inverted_matrix, CHI_SQUARE) != 0, "CHI_SQUARE(inverted) = 0");
+    fail_if(evaluate_model(inverted_matrix, LIKELIHOOD_RATIO) != 0, "LIKELIHOOD_RATIO(inverted) = 0");
+    
+    // Weighted balanced accuracy, which needs the counts of each genotype
+    masks_info info; masks_info_init(1, 1, 10, 10, &info);
+    int counts_aff[] = { 8, 2, 0 }, counts_unaff[] = { 2, 6, 2 };
+    unsigned int sizes[] = { 10, 10 };
+    uint64_t risk_mask = 1;
+    unsigned int matrix[4];
+    double wba = test_model_counts(&risk_mask, counts_aff, counts_unaff, counts_aff, counts_unaff, wBA, TRAINING, sizes, sizes, info, matrix);
+    fail_if(fabs(wba - 0.77857142) > 1e-6, "wBA = 0.77857142");
+    
+    // Names of the functions
+    for (int i = 0; i < NUM_EVAL_FUNCTIONS; i++) {
+        fail_unless(eval_function_from_name(eval_function_name(i)) == i, "Function %d should be found by its name", i);
+    }
+    fail_unless(eval_function_from_name("accuracy") == -1, "Unknown functions should not be found");
+}
+END_TEST
+
+START_TEST(test_model_upper_bound) {
+    int order = 2, num_folds = 4, num_snps = 3;
+    int num_affected = 53, num_unaffected = 38;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    int combs[] = { 0, 1, 0, 2, 1, 2 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+    
+    uint8_t *block, *fold_masks;
+    unsigned int training_size[2 * num_folds], testing_size[2 * num_folds];
+    make_random_block(info, num_snps, num_folds, 2013, &block, &fold_masks, training_size, testing_size);
+    fold_masks = add_all_samples_mask(num_folds, fold_masks, info);
+    
+    uint8_t *genotypes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        genotypes[c] = block + combs[c] * info.num_samples_with_padding;
+    }
+    
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination;
+    int counts_aff[num_counts * (num_folds + 1)], counts_unaff[num_counts * (num_folds + 1)];
+    uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_masks(order, genotypes, 3, masks, info);
+    combination_counts_all_folds(order, fold_masks, num_folds + 1, permutations, masks, info, counts_aff, counts_unaff);
+    
+    uint64_t risk_masks[3 * num_folds * info.num_words_per_risk_mask];
+    mdr_high_risk_masks(counts_aff, counts_unaff, 3 * num_folds, info.num_cell_counts_per_combination, 
+                        num_affected, num_unaffected, risk_masks);
+    
+    fail_unless(model_upper_bound_available(BA, TRAINING) && model_upper_bound_available(CA, TRAINING), 
+                "BA and CA in training should be bounded");
+    fail_if(model_upper_bound_available(BA, TESTING) || model_upper_bound_available(GAMMA, TRAINING), 
+            "Only BA and CA in training should be bounded");
+    
+    // The bound from the counts of all samples can't be lower than the evaluation in any fold
+    enum eval_function functions[] = { BA, CA };
+    for (int i = 0; i < 2; i++) {
+        for (int f = 0; f < num_folds; f++) {
+            for (int rc = 0; rc < 3; rc++) {
+                uint64_t *risk_mask = risk_masks + (f * 3 + rc) * info.num_words_per_risk_mask;
+                int *fold_aff = counts_aff + f * num_counts + rc * info.num_cell_counts_per_combination;
+                int *fold_unaff = counts_unaff + f * num_counts + rc * info.num_cell_counts_per_combination;
+                int *all_aff = counts_aff + num_folds * num_counts + rc * info.num_cell_counts_per_combination;
+                int *all_unaff = counts_unaff + num_folds * num_counts + rc * info.num_cell_counts_per_combination;
+                
+                unsigned int matrix[4];
+                double accuracy = test_model_counts(risk_mask, fold_aff, fold_unaff, all_aff, all_unaff, functions[i], TRAINING, 
+                                                    training_size + 2 * f, testing_size + 2 * f, info, matrix);
+                double bound = model_upper_bound(all_aff, all_unaff, functions[i], training_size + 2 * f, info);
+                fail_if(bound < accuracy - 1e-9 || bound > 1 + 1e-9, 
+                        "Bound %.3f of combination %d in fold %d should be in [%.3f, 1]", bound, rc, f, accuracy);
+            }
+        }
+    }
+    
+    _mm_free(masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
+}
+END_TEST
+
+START_TEST(test_permutation_pvalue) {
+    int order = 2, num_snps = 4, num_aff = 32, num_unaff = 32, num_permutations = 99;
+    int num_total = num_aff + num_unaff;
+    
+    // SNPs 0 and 1 classify all samples perfectly, SNPs 2 and 3 are random
+    srand(1);
+    uint8_t dataset[num_snps * num_total];
+    for (int i = 0; i < num_total; i++) {
+        dataset[i] = i % 3;
+        dataset[num_total + i] = (i < num_aff) ? i % 3 : (i + 1) % 3;
+        dataset[2 * num_total + i] = rand() % 3;
+        dataset[3 * num_total + i] = rand() % 3;
+    }
+    
+    permutation_test *test = permutation_test_new(order, dataset, num_aff, num_unaff, num_permutations, BA);
+    
+    double statistic;
+    int associated[2] = { 0, 1 }, random[2] = { 2, 3 };
+    double pvalue = permutation_test_pvalue(associated, test, &statistic);
+    fail_if(fabs(statistic - 1) > 1e-6, "The associated SNPs should classify all samples (BA = %.3f)", statistic);
+    fail_if(fabs(pvalue - 0.01) > 1e-6, "No permutation should be as good as the associated SNPs (p = %.3f)", pvalue);
+    
+    pvalue = permutation_test_pvalue(random, test, &statistic);
+    fail_if(pvalue < 0.01 - 1e-6 || pvalue > 1, "The p-value should be in [1/(P+1), 1] (p = %.3f)", pvalue);
+    
+    permutation_test_free(test);
+}
+END_TEST
+
+
+START_TEST(test_model_ranking_top_k) {
+    int order = 2, capacity = 5, num_models = 20;
+    masks_info info; masks_info_init(order, COMBINATIONS_ROW_SSE, num_affected, num_unaffected, &info);
+    
+    // Accuracies in no particular order, the best 5 are 0.95, 0.9, 0.85, 0.8 and 0.75
+    double accuracies[] = { 0.5, 0.9, 0.1, 0.75, 0.3, 0.95, 0.2, 0.6, 0.8, 0.4, 
+                            0.65, 0.05, 0.85, 0.15, 0.55, 0.7, 0.25, 0.45, 0.35, 0.6 };
+    model_ranking *ranking = model_ranking_new(capacity);
+    fail_if(!model_ranking_accepts(ranking, 0.0), "An empty ranking should accept any model");
+    
+    int num_left_out = 0;
+    for (int i = 0; i < num_models; i++) {
+        int comb[2] = { i, i + 1 };
+        risky_combination *risky = risky_combination_new(order, comb, NULL, NULL, NULL, info);
+        risky->accuracy = accuracies[i];
+        
+        risky_combination *left_out = model_ranking_insert(ranking, risky);
+        if (left_out) {
+            num_left_out++;
+            risky_combination_free(left_out);
+        }
+        fail_if(ranking->size != (i < capacity ? i + 1 : capacity), "The ranking should not exceed its capacity");
+    }
+    fail_if(num_left_out != num_models - capacity, "Every model out of the ranking should be returned once");
+    
+    fail_unless(fabs(ranking->threshold - 0.75) < 1e-9, "The threshold of a full ranking should be its worst accuracy");
+    fail_if(model_ranking_accepts(ranking, 0.75), "A model as good as the worst one should be rejected");
+    fail_unless(model_ranking_accepts(ranking, 0.76), "A model better than the worst one should be accepted");
+    
+    // Models are taken from the worst to the best
+    double expected[] = { 0.75, 0.8, 0.85, 0.9, 0.95 };
+    for (int i = 0; i < capacity; i++) {
+        risky_combination *risky = model_ranking_take(ranking);
+        fail_if(!risky, "The ranking should contain %d models", capacity);
+        fail_unless(fabs(risky->accuracy - expected[i]) < 1e-9, "Model %d taken should have accuracy %.2f", i, expected[i]);
+        risky_combination_free(risky);
+    }
+    fail_if(model_ranking_take(ranking), "The ranking should be empty");
+    fail_if(!model_ranking_accepts(ranking, 0.0), "An emptied ranking should accept any model");
+    
+    model_ranking_free(ranking);
+}
+END_TEST
+
+
+START_TEST(test_kernels_equivalence) {
+    int order = 2, num_folds = 3;
+    int num_affected = 37, num_unaffected = 91;
+    int num_combinations;
+    uint8_t **combinations = get_genotype_combinations(order, &num_combinations);
+    
+    // Counts and confusion matrices obtained with the SSE4.2 kernels are the reference
+    int num_counts = num_combinations * num_folds;
+    int reference_aff[num_counts], reference_unaff[num_counts];
+    unsigned int reference_matrix[2][4];
+    
+    srand(2013);
+    uint8_t genotypes[order][num_affected + num_unaffected], folds[num_affected + num_unaffected];
+    for (int s = 0; s < num_affected + num_unaffected; s++) {
+        for (int j = 0; j < order; j++) {
+            genotypes[j][s] = rand() % NUM_GENOTYPES;
+        }
+        folds[s] = rand() % num_folds;
+    }
+    
+    for (enum kernel_isa isa = KERNEL_SSE42; isa <= KERNEL_AVX512; isa++) {
+        if (!epistasis_kernels_supported(isa)) {
+            continue;
+        }
+        epistasis_kernels_init(isa);
+        
+        masks_info info; masks_info_init(order, 1, num_affected, num_unaffected, &info);
+        
+        // Copy samples to the padded buffers of this kernel, affected first
+        uint8_t *padded_genotypes[order];
+        for (int j = 0; j < order; j++) {
+            padded_genotypes[j] = _mm_malloc(info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+            memset(padded_genotypes[j], 0, info.num_samples_with_padding * sizeof(uint8_t));
+            memcpy(padded_genotypes[j], genotypes[j], num_affected * sizeof(uint8_t));
+            memcpy(padded_genotypes[j] + info.num_affected_with_padding, genotypes[j] + num_affected, num_unaffected * sizeof(uint8_t));
+        }
+        
+        uint8_t *fold_masks = _mm_malloc(num_folds * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+        memset(fold_masks, 0, num_folds * info.num_samples_with_padding * sizeof(uint8_t));
+        unsigned int training_size[2] = { 0, 0 }, testing_size[2] = { 0, 0 };
+        for (int f = 0; f < num_folds; f++) {
+            for (int s = 0; s < num_affected; s++) {
+                fold_masks[f * info.num_samples_with_padding + s] = (folds[s] != f);
+            }
+            for (int s = 0; s < num_unaffected; s++) {
+                fold_masks[f * info.num_samples_with_padding + info.num_affected_with_padding + s] = (folds[num_affected + s] != f);
+            }
+        }
+        for (int s = 0; s < num_affected + num_unaffected; s++) {
+            int group = (s < num_affected) ? 0 : 1;
+            if (folds[s]) { training_size[group]++; } else { testing_size[group]++; }
+        }
+        
+        uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+        set_genotypes_masks(order, padded_genotypes, 1, masks, info);
+        
+        int counts_aff[num_counts], counts_unaff[num_counts];
+        combination_counts_all_folds(order, fold_masks, num_folds, combinations, masks, info, counts_aff, counts_unaff);
+        
+        // Risky combinations: (0,1), (1,1), (2,0)
+        unsigned int matrix[2][4];
+        uint64_t risk_mask[] = { (1 << 1) | (1 << 4) | (1 << 6) };
+        confusion_matrix(order, risk_mask, combinations, padded_genotypes, fold_masks, TRAINING, training_size, testing_size, info, matrix[0]);
+        confusion_matrix(order, risk_mask, combinations, padded_genotypes, fold_masks, TESTING, training_size, testing_size, info, matrix[1]);
+        
+        if (isa == KERNEL_SSE42) {
+            memcpy(reference_aff, counts_aff, num_counts * sizeof(int));
+            memcpy(reference_unaff, counts_unaff, num_counts * sizeof(int));
+            memcpy(reference_matrix, matrix, 2 * 4 * sizeof(unsigned int));
+        } else {
+            for (int c = 0; c < num_counts; c++) {
+                fail_if(counts_aff[c] != reference_aff[c] || counts_unaff[c] != reference_unaff[c],
+                        "%s counts of cell %d should be %d,%d", epistasis_kernels_get()->name, c, reference_aff[c], reference_unaff[c]);
+            }
+            fail_if(memcmp(matrix, reference_matrix, 2 * 4 * sizeof(unsigned int)),
+                    "%s confusion matrices should match the SSE4.2 ones", epistasis_kernels_get()->name);
+        }
+        
+        _mm_free(masks);
+        _mm_free(fold_masks);
+        for (int j = 0; j < order; j++) {
+            _mm_free(padded_genotypes[j]);
+        }
+    }
+    
+    epistasis_kernels_init(KERNEL_SSE42);
+    free(combinations);
+}
+END_TEST
+
+
+START_TEST(test_bitplanes_equivalence) {
+    int order = 2, num_folds = 4, num_snps = 3;
+    int num_affected = 70, num_unaffected = 45;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    // All pairs of 3 SNPs in a row: (0,1), (0,2), (1,2)
+    int combs[] = { 0, 1, 0, 2, 1, 2 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+    
+    fail_if(info.num_words_affected != 2, "70 affected samples need 2 words");
+    fail_if(info.num_words_unaffected != 1, "45 unaffected samples need 1 word");
+    
+    // Genotypes and folds with the layout of a block (affected, padding, unaffected, padding)
+    uint8_t *block, *fold_masks;
+    unsigned int training_size[2 * num_folds], testing_size[2 * num_folds];
+    make_random_block(info, num_snps, num_folds, 1987, &block, &fold_masks, training_size, testing_size);
+    
+    uint8_t *genotypes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        genotypes[c] = block + combs[c] * info.num_samples_with_padding;
+    }
+    
+    // Counts using byte masks
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination * num_folds;
+    int masks_aff[num_counts], masks_unaff[num_counts];
+    uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_masks(order, genotypes, 3, masks, info);
+    combination_counts_all_folds(order, fold_masks, num_folds, permutations, masks, info, masks_aff, masks_unaff);
+    
+    // Counts using bitplanes
+    int bitplanes_aff[num_counts], bitplanes_unaff[num_counts];
+    uint64_t *block_bitplanes = _mm_malloc(num_snps * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    uint64_t *fold_bitmasks = _mm_malloc(num_folds * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_bitplanes(num_snps, block, info, block_bitplanes);
+    set_fold_bitmasks(num_folds, fold_masks, info, fold_bitmasks);
+    
+    uint64_t *bitplanes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        bitplanes[c] = block_bitplanes + combs[c] * info.num_words_per_snp;
+    }
+    combination_counts_all_folds_bitplanes(order, 3, fold_bitmasks, num_folds, permutations, bitplanes, info, bitplanes_aff, bitplanes_unaff);
+    
+    for (int c = 0; c < num_counts; c++) {
+        fail_if(masks_aff[c] != bitplanes_aff[c] || masks_unaff[c] != bitplanes_unaff[c],
+                "Counts of cell %d should be %d,%d", c, masks_aff[c], masks_unaff[c]);
+    }
+    
+    // Confusion matrices of the second combination, risky genotypes (0,0), (1,2), (2,1)
+    uint64_t risk_mask[] = { (1 << 0) | (1 << 5) | (1 << 7) };
+    for (int f = 0; f < num_folds; f++) {
+        for (enum evaluation_subset subset = TESTING; subset <= TRAINING; subset++) {
+            unsigned int masks_matrix[4], bitplanes_matrix[4];
+            confusion_matrix(order, risk_mask, permutations, genotypes + order, fold_masks + f * info.num_samples_with_padding, subset, 
+                             training_size + 2 * f, testing_size + 2 * f, info, masks_matrix);
+            confusion_matrix_bitplanes(order, risk_mask, permutations, bitplanes + order, fold_bitmasks + f * info.num_words_per_bitplane, subset, 
+                                       training_size + 2 * f, testing_size + 2 * f, info, bitplanes_matrix);
+            fail_if(memcmp(masks_matrix, bitplanes_matrix, 4 * sizeof(unsigned int)),
+                    "Confusion matrix of fold %d should be { %d, %d, %d, %d }", f, 
+                    masks_matrix[0], masks_matrix[1], masks_matrix[2], masks_matrix[3]);
+        }
+    }
+    
+    _mm_free(fold_bitmasks);
+    _mm_free(block_bitplanes);
+    _mm_free(masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
+}
+END_TEST
+
+START_TEST(test_bitplane_kernels_equivalence) {
+    int order = 3, num_folds = 5, num_snps = 4;
+    int num_affected = 600, num_unaffected = 275;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+
+    // Rows of 3 combinations: (0,1,2), (0,1,3), (1,2,3)
+    int combs[] = { 0, 1, 2, 0, 1, 3, 1, 2, 3 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+
+    // 10 affected and 5 unaffected words, so the widest kernels process full vectors and a remainder
+    fail_if(info.num_words_affected != 10, "600 affected samples need 10 words");
+    fail_if(info.num_words_unaffected != 5, "275 unaffected samples need 5 words");
+
+    // Bitplanes and fold bitmasks don't depend on the padding of the kernels, so they are filled only once
+    srand(1789);
+    uint64_t *block_bitplanes = _mm_malloc(num_snps * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    uint64_t *fold_bitmasks = _mm_malloc(num_folds * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    memset(block_bitplanes, 0, num_snps * info.num_words_per_snp * sizeof(uint64_t));
+    memset(fold_bitmasks, 0, num_folds * info.num_words_per_bitplane * sizeof(uint64_t));
+
+    for (int i = 0; i < num_affected + num_unaffected; i++) {
+        int word = (i < num_affected) ? i / 64 : info.num_words_affected + (i - num_affected) / 64;
+        uint64_t bit = ((uint64_t) 1) << ((i < num_affected) ? i % 64 : (i - num_affected) % 64);
+        for (int j = 0; j < num_snps; j++) {
+            block_bitplanes[j * info.num_words_per_snp + (rand() % NUM_GENOTYPES) * info.num_words_per_bitplane + word] |= bit;
+        }
+        int fold = rand() % num_folds;
+        for (int f = 0; f < num_folds; f++) {
+            if (fold != f) { fold_bitmasks[f * info.num_words_per_bitplane + word] |= bit; }
+        }
+    }
+
+    uint64_t *bitplanes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        bitplanes[c] = block_bitplanes + combs[c] * info.num_words_per_snp;
+    }
+
+    // Counts obtained with the SSE4.2 kernels are the reference
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination * num_folds;
+    int reference_aff[num_counts], reference_unaff[num_counts];
+
+    for (enum kernel_isa isa = KERNEL_SSE42; isa <= KERNEL_AVX512; isa++) {
+        if (!epistasis_kernels_supported(isa)) {
+            continue;
+        }
+        epistasis_kernels_init(isa);
+
+        int counts_aff[num_counts], counts_unaff[num_counts];
+        combination_counts_all_folds_bitplanes(order, 3, fold_bitmasks, num_folds, permutations, bitplanes, info, counts_aff, counts_unaff);
+
+        if (isa == KERNEL_SSE42) {
+            memcpy(reference_aff, counts_aff, num_counts * sizeof(int));
+            memcpy(reference_unaff, counts_unaff, num_counts * sizeof(int));
+        } else {
+            for (int c = 0; c < num_counts; c++) {
+                fail_if(counts_aff[c] != reference_aff[c] || counts_unaff[c] != reference_unaff[c],
+                        "%s bitplane counts of cell %d should be %d,%d", epistasis_kernels_get()->name, c, reference_aff[c], reference_unaff[c]);
+            }
+        }
+    }
+
+    // Every sample is counted once per fold it is trained in, in the cell of its genotypes
+    for (int rc = 0; rc < 3; rc++) {
+        for (int f = 0; f < num_folds; f++) {
+            int total = 0;
+            for (int c = 0; c < info.num_cell_counts_per_combination; c++) {
+                int idx = f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination + rc * info.num_cell_counts_per_combination + c;
+                total += reference_aff[idx] + reference_unaff[idx];
+            }
+            int expected = 0;
+            for (int w = 0; w < info.num_words_per_bitplane; w++) {
+                expected += __builtin_popcountll(fold_bitmasks[f * info.num_words_per_bitplane + w]);
+            }
+            fail_if(total != expected, "Combination %d should count the %d samples trained in fold %d", rc, expected, f);
+        }
+    }
+
+    epistasis_kernels_init(KERNEL_SSE42);
+    _mm_free(fold_bitmasks);
+    _mm_free(block_bitplanes);
+    for (int i = 0; i < num_combinations; i++) {
+        free(permutations[i]);
+    }
+    free(permutations);
+}
+END_TEST
+
+
+START_TEST(test_phenotype_masks) {
+    int order = 2, num_folds = 4, num_snps = 3;
+    int num_affected = 70, num_unaffected = 45;
+    int num_samples = num_affected + num_unaffected;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    // All pairs of 3 SNPs in a row: (0,1), (0,2), (1,2)
+    int combs[] = { 0, 1, 0, 2, 1, 2 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+    
+    // Genotypes and folds with the layout of a block (affected, padding, unaffected, padding)
+    uint8_t *block, *fold_masks;
+    unsigned int training_size[2 * num_folds], testing_size[2 * num_folds], swapped_training_size[2 * num_folds];
+    make_random_block(info, num_snps, num_folds, 1987, &block, &fold_masks, training_size, testing_size);
+    memset(swapped_training_size, 0, 2 * num_folds * sizeof(int));
+    
+    // The first phenotype is the main one, the second one swaps cases and controls and misses some samples
+    uint8_t labels_same[num_samples], labels_swapped[num_samples];
+    int num_missing = 0;
+    for (int i = 0; i < num_samples; i++) {
+        int group = (i < num_affected) ? 0 : 1;
+        int offset = group ? info.num_affected_with_padding + i - num_affected : i;
+        for (int f = 0; f < num_folds; f++) {
+            if (fold_masks[f * info.num_samples_with_padding + offset] && i % 7) { swapped_training_size[2 * f + !group]++; }
+        }
+        labels_same[i] = !group;
+        labels_swapped[i] = (i % 7) ? group : EPISTASIS_DATASET_PHENOTYPE_MISSING;
+        num_missing += !(i % 7);
+    }
+    fold_masks = add_all_samples_mask(num_folds, fold_masks, info);
+    
+    char *names[] = { "same", "swapped" };
+    uint8_t *labels[] = { labels_same, labels_swapped };
+    int phenotype_affected[] = { num_affected, num_unaffected - 7 };
+    int phenotype_unaffected[] = { num_unaffected, num_affected - 10 };
+    epistasis_phenotypes phenotypes = { 2, names, labels, phenotype_affected, phenotype_unaffected };
+    fail_if(num_missing != 17, "17 samples should be missing, 10 affected and 7 unaffected");
+    
+    unsigned int training_sizes[3 * 2 * num_folds], testing_sizes[3 * 2 * num_folds];
+    uint8_t *count_masks = get_phenotype_masks(num_folds, fold_masks, &phenotypes, info, training_sizes, testing_sizes);
+    int num_count_masks = 5 * (num_folds + 1);
+    
+    for (int f = 0; f < num_folds; f++) {
+        fail_if(training_sizes[3 * f + 1] != training_size[2 * f] || training_sizes[3 * f + 2] != training_size[2 * f + 1], 
+                "Training sizes of fold %d should be the ones of the main phenotype", f);
+        fail_if(testing_sizes[3 * f + 1] != num_affected - training_size[2 * f] || 
+                testing_sizes[3 * f + 2] != num_unaffected - training_size[2 * f + 1], 
+                "Testing sizes of fold %d should be the ones of the main phenotype", f);
+        
+        unsigned int *swapped_training = training_sizes + 3 * (num_folds + f);
+        fail_if(swapped_training[1] != swapped_training_size[2 * f] || swapped_training[2] != swapped_training_size[2 * f + 1], 
+                "Training sizes of fold %d should not include the missing samples", f);
+    }
+    
+    // Counts of all masks at once
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination * num_count_masks;
+    int counts_aff[num_counts], counts_unaff[num_counts];
+    uint64_t *block_bitplanes = _mm_malloc(num_snps * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    uint64_t *count_bitmasks = _mm_malloc(num_count_masks * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_bitplanes(num_snps, block, info, block_bitplanes);
+    set_fold_bitmasks(num_count_masks, count_masks, info, count_bitmasks);
+    
+    uint64_t *bitplanes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        bitplanes[c] = block_bitplanes + combs[c] * info.num_words_per_snp;
+    }
+    combination_counts_all_folds_bitplanes(order, 3, count_bitmasks, num_count_masks, permutations, bitplanes, info, counts_aff, counts_unaff);
+    
+    // The cases and controls of a phenotype equal to the main one are its affected and unaffected samples
+    int group_len = num_counts / 5;
+    int *cases_aff = counts_aff + group_len, *cases_unaff = counts_unaff + group_len;
+    int *controls_aff = cases_aff + group_len, *controls_unaff = cases_unaff + group_len;
+    for (int c = 0; c < group_len; c++) {
+        fail_if(cases_aff[c] + cases_unaff[c] != counts_aff[c] || controls_aff[c] + controls_unaff[c] != counts_unaff[c],
+                "Counts of cell %d should be %d,%d", c, counts_aff[c], counts_unaff[c]);
+    }
+    
+    // The cases of the swapped phenotype are only found among the unaffected samples, and its controls among the affected ones
+    int *swapped_cases_aff = controls_aff + group_len, *swapped_cases_unaff = controls_unaff + group_len;
+    int *swapped_controls_aff = swapped_cases_aff + group_len, *swapped_controls_unaff = swapped_cases_unaff + group_len;
+    for (int c = 0; c < group_len; c++) {
+        fail_if(swapped_cases_aff[c] != 0 || swapped_controls_unaff[c] != 0, "Cell %d should be empty", c);
+        fail_if(swapped_cases_unaff[c] > counts_unaff[c] || swapped_controls_aff[c] > counts_aff[c], 
+                "Cell %d should not count the missing samples", c);
+    }
+    
+    _mm_free(count_bitmasks);
+    _mm_free(block_bitplanes);
+    _mm_free(count_masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
+}
+END_TEST
+
+
+START_TEST(test_block_masks_equivalence) {
+    int order = 3, num_folds = 3, num_snps = 4;
+    int num_affected = 37, num_unaffected = 52;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    // Combinations of 4 SNPs in a row: (0,1,2), (0,1,3), (1,2,3)
+    int combs[] = { 0, 1, 2, 0, 1, 3, 1, 2, 3 };
+    masks_info info; masks_info_init(order, 3, num_affected, num_unaffected, &info);
+    
+    uint8_t *block, *fold_masks;
+    make_random_block(info, num_snps, num_folds, 2013, &block, &fold_masks, NULL, NULL);
+    
+    // Counts using masks generated for each combination
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination * num_folds;
+    int row_aff[num_counts], row_unaff[num_counts];
+    uint8_t *genotypes[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        genotypes[c] = block + combs[c] * info.num_samples_with_padding;
+    }
+    uint8_t *masks = _mm_malloc(info.num_combinations_in_a_row * info.num_masks * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_genotypes_masks(order, genotypes, 3, masks, info);
+    combination_counts_all_folds(order, fold_masks, num_folds, permutations, masks, info, row_aff, row_unaff);
+    
+    // Counts using the masks of the whole block, generated once per SNP
+    int cached_aff[num_counts], cached_unaff[num_counts];
+    uint8_t *block_masks = _mm_malloc(num_snps * NUM_GENOTYPES * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_block_genotypes_masks(num_snps, block, info, block_masks);
+    uint8_t *snp_masks[3 * order];
+    for (int c = 0; c < 3 * order; c++) {
+        snp_masks[c] = block_masks + combs[c] * NUM_GENOTYPES * info.num_samples_with_padding;
+    }
+    combination_counts_all_folds_cached(order, 3, fold_masks, num_folds, permutations, snp_masks, info, cached_aff, cached_unaff);
+    
+    for (int c = 0; c < num_counts; c++) {
+        fail_if(row_aff[c] != cached_aff[c] || row_unaff[c] != cached_unaff[c],
+                "Counts of cell %d should be %d,%d", c, row_aff[c], row_unaff[c]);
+    }
+    
+    _mm_free(block_masks);
+    _mm_free(masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
+}
+END_TEST
+
+
+START_TEST(test_prefix_masks_equivalence) {
+    int order = 3, num_folds = 2, num_snps = 5, row_size = 4;
+    int num_affected = 29, num_unaffected = 66;
+    int num_combinations;
+    uint8_t **permutations = get_genotype_combinations(order, &num_combinations);
+    
+    // All triples of 5 SNPs in the order they are generated, processed in rows of 4 so prefixes are split between rows
+    int combs[] = { 0, 1, 2,  0, 1, 3,  0, 1, 4,  0, 2, 3,    0, 2, 4,  0, 3, 4,  1, 2, 3,  1, 2, 4,    1, 3, 4,  2, 3, 4 };
+    int num_combs = 10;
+    masks_info info; masks_info_init(order, row_size, num_affected, num_unaffected, &info);
+    
+    uint8_t *block, *fold_masks;
+    make_random_block(info, num_snps, num_folds, 3, &block, &fold_masks, NULL, NULL);
+    
+    uint8_t *block_masks = _mm_malloc(num_snps * NUM_GENOTYPES * info.num_samples_with_padding * sizeof(uint8_t), KERNEL_MAX_VECTOR_WIDTH);
+    uint64_t *block_bitplanes = _mm_malloc(num_snps * info.num_words_per_snp * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    uint64_t *fold_bitmasks = _mm_malloc(num_folds * info.num_words_per_bitplane * sizeof(uint64_t), KERNEL_MAX_VECTOR_WIDTH);
+    set_block_genotypes_masks(num_snps, block, info, block_masks);
+    set_genotypes_bitplanes(num_snps, block, info, block_bitplanes);
+    set_fold_bitmasks(num_folds, fold_masks, info, fold_bitmasks);
+    
+    prefix_masks_cache masks_cache, bitplanes_cache;
+    prefix_masks_cache_init(order, info.num_samples_with_padding, info, &masks_cache);
+    prefix_masks_cache_init(order, info.num_words_per_bitplane * sizeof(uint64_t), info, &bitplanes_cache);
+    
+    int num_counts = info.num_combinations_in_a_row * info.num_cell_counts_per_combination * num_folds;
+    for (int first = 0; first < num_combs; first += row_size) {
+        int num_in_row = MIN(row_size, num_combs - first);
+        int *row = combs + first * order;
+        
+        // Counts combining the masks of all SNPs
+        int expected_aff[num_counts], expected_unaff[num_counts];
+        uint8_t *snp_masks[row_size * order];
+        for (int c = 0; c < num_in_row * order; c++) {
+            snp_masks[c] = block_masks + row[c] * NUM_GENOTYPES * info.num_samples_with_padding;
+        }
+        combination_counts_all_folds_cached(order, num_in_row, fold_masks, num_folds, permutations, snp_masks, info, 
+                                            expected_aff, expected_unaff);
+        
+        // Counts combining the cached prefix with the last SNP, using masks and bitplanes
+        int masks_aff[num_counts], masks_unaff[num_counts], bitplanes_aff[num_counts], bitplanes_unaff[num_counts];
+        uint8_t *masks_pairs[row_size * 2];
+        uint64_t *bitplanes_pairs[row_size * 2];
+        for (int c = 0; c < num_in_row; c++) {
+            uint8_t *snp_bitplanes[order];
+            for (int j = 0; j < order; j++) {
+                snp_bitplanes[j] = (uint8_t*) (block_bitplanes + row[c * order + j] * info.num_words_per_snp);
+            }
+            masks_pairs[c * 2] = prefix_masks_cache_get(snp_masks + c * order, &masks_cache);
+            masks_pairs[c * 2 + 1] = snp_masks[c * order + order - 1];
+            bitplanes_pairs[c * 2] = (uint64_t*) prefix_masks_cache_get(snp_bitplanes, &bitplanes_cache);
+            bitplanes_pairs[c * 2 + 1] = (uint64_t*) snp_bitplanes[order - 1];
+        }
+        combination_counts_all_folds_cached(2, num_in_row, fold_masks, num_folds, masks_cache.pair_permutations, masks_pairs, info, 
+                                            masks_aff, masks_unaff);
+        combination_counts_all_folds_bitplanes(2, num_in_row, fold_bitmasks, num_folds, bitplanes_cache.pair_permutations, 
+                                               bitplanes_pairs, info, bitplanes_aff, bitplanes_unaff);
+        
+        for (int f = 0; f < num_folds; f++) {
+            for (int c = 0; c < num_in_row * info.num_cell_counts_per_combination; c++) {
+                int idx = f * info.num_combinations_in_a_row * info.num_cell_counts_per_combination + c;
+                fail_if(masks_aff[idx] != expected_aff[idx] || masks_unaff[idx] != expected_unaff[idx],
+                        "Counts of cell %d in fold %d using prefix masks should be %d,%d", c, f, expected_aff[idx], expected_unaff[idx]);
+                fail_if(bitplanes_aff[idx] != expected_aff[idx] || bitplanes_unaff[idx] != expected_unaff[idx],
+                        "Counts of cell %d in fold %d using prefix bitplanes should be %d,%d", c, f, expected_aff[idx], expected_unaff[idx]);
+            }
+        }
+    }
+    
+    prefix_masks_cache_free(&bitplanes_cache);
+    prefix_masks_cache_free(&masks_cache);
+    _mm_free(fold_bitmasks);
+    _mm_free(block_bitplanes);
+    _mm_free(block_masks);
+    _mm_free(fold_masks);
+    _mm_free(block);
+    free(permutations);
 }
 END_TEST
 
@@ -539,6 +1317,9 @@ END_TEST
  * ******************************/
 
 int main (int argc, char *argv) {
+    // Expected values below assume the padding of the SSE4.2 kernels
+    epistasis_kernels_init(KERNEL_SSE42);
+    
     Suite *fs = create_test_suite();
     SRunner *fs_runner = srunner_create(fs);
     srunner_run_all(fs_runner, CK_NORMAL);
@@ -555,11 +1336,22 @@ Suite *create_test_suite(void) {
     tcase_add_test(tc_counts, test_get_counts);
     tcase_add_test(tc_counts, test_get_counts_all_folds_order_2);
     tcase_add_test(tc_counts, test_get_counts_all_folds_order_3);
+    tcase_add_test(tc_counts, test_kernels_equivalence);
+    tcase_add_test(tc_counts, test_bitplanes_equivalence);
+    tcase_add_test(tc_counts, test_bitplane_kernels_equivalence);
+    tcase_add_test(tc_counts, test_block_masks_equivalence);
+    tcase_add_test(tc_counts, test_prefix_masks_equivalence);
+    tcase_add_test(tc_counts, test_phenotype_masks);
     
     TCase *tc_ranking = tcase_create("Evaluation and ranking");
+    tcase_add_test(tc_ranking, test_high_risk_masks);
     tcase_add_test(tc_ranking, test_get_confusion_matrix);
     tcase_add_test(tc_ranking, test_get_confusion_matrix_excluding_samples);
+    tcase_add_test(tc_ranking, test_confusion_matrix_from_counts);
     tcase_add_test(tc_ranking, test_model_evaluation_formulas);
+    tcase_add_test(tc_ranking, test_model_ranking_top_k);
+    tcase_add_test(tc_ranking, test_model_upper_bound);
+    tcase_add_test(tc_ranking, test_permutation_pvalue);
     
     // Add test cases to a test suite
     Suite *fs = suite_create("Epistasis model");
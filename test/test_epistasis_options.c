@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "gwas/epistasis/epistasis.h"
+
+
+Suite *create_test_suite(void);
+
+void write_configuration(const char *text);
+
+
+char config_filename[] = "/tmp/hpg-variant.epistasis.XXXXXX";
+
+shared_options_t *shared_options;
+epistasis_options_t *epistasis_options;
+void **argtable;
+
+
+/* ******************************
+ *      Unchecked fixtures      *
+ * ******************************/
+
+void setup_options(void) {
+    shared_options = new_shared_cli_options(0);
+
+    // Same options as the epistasis tool, which are created in its entry point
+    epistasis_options = calloc(1, sizeof(epistasis_options_t));
+    epistasis_options->num_options = NUM_EPISTASIS_OPTIONS;
+    epistasis_options->dataset_filename = arg_file1("d", "dataset", NULL, "Binary dataset used as input");
+    epistasis_options->max_ranking_size = arg_int0(NULL, "rank-size", NULL, "Number of best models saved");
+    epistasis_options->num_cv_repetitions = arg_int0(NULL, "num-cv-runs", NULL, "Number of times the k-fold cross-validation process is run");
+    epistasis_options->num_folds = arg_int0(NULL, "num-folds", NULL, "Number of folds in a k-fold cross-validation");
+    epistasis_options->stride = arg_int0(NULL, "stride", NULL, "Number of SNPs per block partition of the dataset");
+    epistasis_options->order = arg_int1(NULL, "order", NULL, "Number of SNPs to be combined at the same time");
+    epistasis_options->evaluation_subset = arg_str0(NULL, "eval-subset", NULL, "Partition for evaluating the best models");
+    epistasis_options->evaluation_mode = arg_str0(NULL, "eval-mode", NULL, "Whether to rank risky combinations by their CV-C or CV-A");
+    epistasis_options->use_bitplanes = arg_lit0(NULL, "bitplanes", "Pack genotypes into bitplanes");
+    epistasis_options->fuse_cv_repetitions = arg_lit0(NULL, "fuse-cv-runs", "Evaluate all cross-validation runs in a single sweep");
+    epistasis_options->checkpoint_interval = arg_int0(NULL, "checkpoint-interval", NULL, "Seconds between checkpoints of the progress");
+    epistasis_options->resume = arg_lit0(NULL, "resume", "Resume the search from the last checkpoint");
+    epistasis_options->dynamic_blocks = arg_lit0(NULL, "dynamic-blocks", "Hand out blocks to MPI processes on request");
+    epistasis_options->evaluation_function = arg_str0(NULL, "eval-function", NULL, "Function the models are ranked by");
+    epistasis_options->num_permutations = arg_int0(NULL, "num-permutations", NULL, "Phenotype permutations for the p-values");
+    epistasis_options->num_prefilter_snps = arg_int0(NULL, "prefilter-snps", NULL, "SNPs with the strongest marginal effect");
+    epistasis_options->auto_tune = arg_lit0(NULL, "auto-tune", "Choose the stride and combinations per row at runtime");
+    epistasis_options->prune = arg_lit0(NULL, "prune", "Skip the combinations that can't be among the best models");
+    epistasis_options->beam_width = arg_int0(NULL, "beam-width", NULL, "Combinations of each order kept by the heuristic search");
+
+    int fd = mkstemp(config_filename);
+    fail_if(fd < 0, "Can't create a configuration file");
+    close(fd);
+}
+
+void teardown_options(void) {
+    arg_freetable(argtable, 23);
+    free(argtable);
+    free(epistasis_options);
+    free(shared_options);
+    unlink(config_filename);
+    strcpy(config_filename, "/tmp/hpg-variant.epistasis.XXXXXX");
+}
+
+
+/* ******************************
+ *          Unit tests          *
+ * ******************************/
+
+START_TEST (test_config_flag_survives_parsing) {
+    write_configuration("gwas = { epistasis = { prune = true; bitplanes = false; }; };\n");
+    fail_if(read_epistasis_configuration(config_filename, epistasis_options, shared_options),
+            "The configuration file should be read");
+
+    // The flag is not in the command-line, so parsing it must not discard the value from the file
+    char *argv[] = { "epi", "--order", "2", "-d", "dataset.bin" };
+    argtable = parse_epistasis_options(5, argv, epistasis_options, shared_options);
+
+    fail_unless(epistasis_options->config_prune, "The prune flag from the configuration file should be kept");
+    fail_if(epistasis_options->config_bitplanes, "The bitplanes flag is disabled in the configuration file");
+    fail_if(epistasis_options->config_auto_tune, "The auto-tune flag is not in the configuration file");
+    fail_if(epistasis_options->prune->count, "The prune flag is not in the command-line");
+}
+END_TEST
+
+START_TEST (test_cli_flag_without_config) {
+    write_configuration("gwas = { epistasis = { prune = false; }; };\n");
+    fail_if(read_epistasis_configuration(config_filename, epistasis_options, shared_options),
+            "The configuration file should be read");
+
+    char *argv[] = { "epi", "--order", "2", "-d", "dataset.bin", "--prune" };
+    argtable = parse_epistasis_options(6, argv, epistasis_options, shared_options);
+
+    fail_if(epistasis_options->config_prune, "The prune flag is disabled in the configuration file");
+    fail_unless(epistasis_options->prune->count == 1, "The prune flag from the command-line should be set");
+}
+END_TEST
+
+
+/* ******************************
+ *      Main entry point        *
+ * ******************************/
+
+int main (int argc, char *argv) {
+    Suite *fs = create_test_suite();
+    SRunner *fs_runner = srunner_create(fs);
+    srunner_run_all(fs_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed (fs_runner);
+    srunner_free (fs_runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+Suite *create_test_suite(void) {
+    TCase *tc_config = tcase_create("Configuration file");
+    tcase_add_checked_fixture(tc_config, setup_options, teardown_options);
+    tcase_add_test(tc_config, test_config_flag_survives_parsing);
+    tcase_add_test(tc_config, test_cli_flag_without_config);
+
+    // Add test cases to a test suite
+    Suite *fs = suite_create("Epistasis options");
+    suite_add_tcase(fs, tc_config);
+
+    return fs;
+}
+
+
+/* ******************************
+ *          Auxiliary           *
+ * *****************************/
+
+void write_configuration(const char *text) {
+    FILE *file = fopen(config_filename, "w");
+    fail_if(!file, "Can't write the configuration file");
+    fputs(text, file);
+    fclose(file);
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <bioformats/vcf/vcf_file_structure.h>
+#include <containers/array_list.h>
+
+#include "vcf-tools/filter/filter_runner.h"
+
+
+Suite *create_test_suite(void);
+
+vcf_record_t *record_from_line(char *line);
+
+char *read_output(FILE *file);
+
+
+// The last line is not ended by a newline, as in a file truncated after its last record
+char *lines[] = { "1\t100\trs1\tA\tT\t50\tPASS\tDP=10\tGT\t0/1\n",
+                  "1\t200\trs2\tG\tC\t30.5\tPASS\tDP=5\tGT\t1/1\n",
+                  "1\t300\trs3\tC\tG\t40\tPASS\tDP=7\tGT\t0/0" };
+
+vcf_batch_t batch;
+vcf_record_t *records[3];
+
+
+/* ******************************
+ *      Unchecked fixtures      *
+ * ******************************/
+
+void setup_batch(void) {
+    // The records point to the text of the batch, as when they are read from a file
+    size_t text_len = strlen(lines[0]) + strlen(lines[1]) + strlen(lines[2]);
+    batch.text = calloc(text_len + 1, sizeof(char));
+    batch.records = array_list_new(3, 1.1, COLLECTION_MODE_ASYNCHRONIZED);
+
+    char *line = batch.text;
+    for (int i = 0; i < 3; i++) {
+        strcat(batch.text, lines[i]);
+        records[i] = record_from_line(line);
+        array_list_insert(records[i], batch.records);
+        line += strlen(lines[i]);
+    }
+}
+
+void teardown_batch(void) {
+    for (int i = 0; i < 3; i++) {
+        vcf_record_free(records[i]);
+    }
+    array_list_free(batch.records, NULL);
+    free(batch.text);
+}
+
+
+/* ******************************
+ *          Unit tests          *
+ * ******************************/
+
+START_TEST (test_write_unmodified_records) {
+    FILE *file = tmpfile();
+    fail_if(write_filtered_records(batch.records, &batch, file), "All records should be written");
+
+    // Lines are copied byte for byte, and the last one is ended by a newline
+    char *output = read_output(file);
+    char expected[1024];
+    sprintf(expected, "%s%s%s\n", lines[0], lines[1], lines[2]);
+    fail_if(strcmp(output, expected), "The lines of the records should be copied as they are:\n%s", output);
+
+    free(output);
+    fclose(file);
+}
+END_TEST
+
+START_TEST (test_write_non_contiguous_records) {
+    array_list_t *passed = array_list_new(2, 1.1, COLLECTION_MODE_ASYNCHRONIZED);
+    array_list_insert(records[0], passed);
+    array_list_insert(records[2], passed);
+
+    FILE *file = tmpfile();
+    fail_if(write_filtered_records(passed, &batch, file), "All records should be written");
+
+    char *output = read_output(file);
+    char expected[1024];
+    sprintf(expected, "%s%s\n", lines[0], lines[2]);
+    fail_if(strcmp(output, expected), "Only the lines of the records written should be copied:\n%s", output);
+
+    free(output);
+    fclose(file);
+    array_list_free(passed, NULL);
+}
+END_TEST
+
+START_TEST (test_write_modified_record) {
+    // FILTER no longer points to the line of the record
+    set_vcf_record_filter("q10", 3, records[1]);
+
+    FILE *file = tmpfile();
+    fail_if(write_filtered_records(batch.records, &batch, file), "All records should be written");
+
+    char *output = read_output(file);
+    char *first_end = strchr(output, '\n');
+    fail_if(!first_end || strncmp(output, lines[0], strlen(lines[0])), "The line of the first record should be copied:\n%s", output);
+
+    // The modified record is written field by field, whatever the format of its quality
+    char *second = first_end + 1;
+    char *second_end = strchr(second, '\n');
+    fail_if(!second_end, "The modified record should be written in a line of its own:\n%s", output);
+    fail_if(strncmp(second, "1\t200\trs2\tG\tC\t", 14), "The modified record should keep its first columns:\n%s", output);
+    char *filter = strchr(second + 14, '\t');
+    fail_if(!filter || strncmp(filter, "\tq10\tDP=5\tGT\t", 13), "The modified record should have the new FILTER:\n%s", output);
+
+    char expected[1024];
+    sprintf(expected, "%s\n", lines[2]);
+    fail_if(strcmp(second_end + 1, expected), "The line of the last record should be copied:\n%s", output);
+
+    free(output);
+    fclose(file);
+}
+END_TEST
+
+
+/* ******************************
+ *      Main entry point        *
+ * ******************************/
+
+int main (int argc, char *argv) {
+    Suite *fs = create_test_suite();
+    SRunner *fs_runner = srunner_create(fs);
+    srunner_run_all(fs_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed (fs_runner);
+    srunner_free (fs_runner);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+Suite *create_test_suite(void) {
+    TCase *tc_output = tcase_create("Output of filtered records");
+    tcase_add_checked_fixture(tc_output, setup_batch, teardown_batch);
+    tcase_add_test(tc_output, test_write_unmodified_records);
+    tcase_add_test(tc_output, test_write_non_contiguous_records);
+    tcase_add_test(tc_output, test_write_modified_record);
+
+    // Add test cases to a test suite
+    Suite *fs = suite_create("Filter tool");
+    suite_add_tcase(fs, tc_output);
+
+    return fs;
+}
+
+
+/* ******************************
+ *          Auxiliary           *
+ * *****************************/
+
+vcf_record_t *record_from_line(char *line) {
+    char *fields[10];
+    int lengths[10];
+    char *start = line;
+    for (int i = 0; i < 10; i++) {
+        lengths[i] = strcspn(start, "\t\n");
+        fields[i] = start;
+        start += lengths[i] + 1;
+    }
+
+    vcf_record_t *record = vcf_record_new();
+    set_vcf_record_chromosome(fields[0], lengths[0], record);
+    set_vcf_record_position(atol(fields[1]), record);
+    set_vcf_record_id(fields[2], lengths[2], record);
+    set_vcf_record_reference(fields[3], lengths[3], record);
+    set_vcf_record_alternate(fields[4], lengths[4], record);
+    set_vcf_record_quality(atof(fields[5]), record);
+    set_vcf_record_filter(fields[6], lengths[6], record);
+    set_vcf_record_info(fields[7], lengths[7], record);
+    set_vcf_record_format(fields[8], lengths[8], record);
+    add_vcf_record_sample(fields[9], lengths[9], record);
+    return record;
+}
+
+char *read_output(FILE *file) {
+    long size = ftell(file);
+    char *output = calloc(size + 1, sizeof(char));
+    rewind(file);
+    fread(output, sizeof(char), size, file);
+    return output;
+}